@@ -3,6 +3,9 @@
 #include "time.h"
 #include "connect4_app.h"
 
+// Shipped policy: 42 observations, 128 hidden, 7 columns, one board at a time
+PUFFERNET_FIXED_LINEARLSTM(connect4, 1, 42, 128, 7)
+
 const unsigned char NOOP_ACTION = 8;
 
 static Weights* weights = NULL;
@@ -41,10 +44,23 @@ void InitConnect4(int mode) {
     aiTurnPending = false;
     aiDelayTimer = 0.0f;
 
-    // Load weights from resources directory (handled by SearchAndSetResourceDir in main.c)
+    // Load weights from resources directory (handled by SearchAndSetResourceDir in main.c).
+    // Accepts the raw file or a .pufw container made with tools/pufw_convert
     weights = load_weights("connect4_weights.bin", 138632);
-    int logit_sizes[] = {7};
-    net = make_linearlstm(weights, 1, 42, logit_sizes, 1);
+    if (weights != NULL) {
+        int logit_sizes[] = {7};
+        net = make_linearlstm(weights, 1, 42, logit_sizes, 1, NULL);
+        multidiscrete_seed(net->multidiscrete, (uint64_t)time(NULL));
+    } else {
+        fprintf(stderr, "Connect4 policy unavailable, AI vs AI mode is disabled\n");
+    }
+
+    // The AI moves inside a frame: deepen for SEARCH_UI_BUDGET per move, so
+    // it plays as strong as the machine allows without dropping frames
+    connect4_search.depth = SEARCH_MAX_DEPTH;
+    connect4_search.budget = SEARCH_UI_BUDGET;
+    // Made with tools/book_gen. Without it the AI searches every move
+    connect4_book = load_book(BOOK_FILE);
 
     allocate_cconnect4(&env);
     c_reset(&env);
@@ -154,12 +170,12 @@ void UpdateConnect4() {
     if (playerAction != -1) {
         env.actions[0] = playerAction;
         playerMoved = true;
-    } else if (gameMode == 0 && tick % 30 == 0) {
+    } else if (gameMode == 0 && tick % 30 == 0 && net != NULL) {
         // AI vs AI logic (every 30 ticks ~ 0.5s)
         for (int i = 0; i < 42; i++) {
             observations[i] = env.observations[i];
         }
-        forward_linearlstm(net, (float*)&observations, (int*)&actions);
+        forward_linearlstm_connect4(net, (float*)&observations, (int*)&actions);
         env.actions[0] = actions[0];
     }
 
@@ -327,9 +343,13 @@ void UnloadConnect4() {
         net = NULL;
     }
     if (weights) {
-        free(weights);
+        free_weights(weights);
         weights = NULL;
     }
+    free_book(connect4_book);
+    connect4_book = NULL;
+    free_transposition_table(connect4_search.table);
+    connect4_search.table = NULL;
     if (env.client) {
         close_client(env.client);
         env.client = NULL;
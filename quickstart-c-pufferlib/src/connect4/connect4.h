@@ -2,7 +2,12 @@
 #include <math.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <stdbool.h>
+
+// Define CONNECT4_HEADLESS to use the environment without raylib (tools)
+#ifndef CONNECT4_HEADLESS
 #include "raylib.h"
+#endif
 
 #define WIN_CONDITION 4
 const int PLAYER_WIN = 1.0;
@@ -67,9 +72,6 @@ void free_allocated_cconnect4(CConnect4* env) {
     free(env->rewards);
 }
 
-void c_close(CConnect4* env) {
-}
-
 void add_log(CConnect4* env) {
     env->log.perf += (float)(env->rewards[0] == PLAYER_WIN);
     env->log.score += env->rewards[0];
@@ -107,9 +109,13 @@ uint64_t play(int column, uint64_t mask,  uint64_t other_pieces) {
     return other_pieces ^ mask;
 }
 
-// A full board has this specifc value
+// The bottom cell of every column, and every cell without the sentinel row
+#define BOTTOM_ROW UINT64_C(0x40810204081)
+#define BOARD_MASK (BOTTOM_ROW*((UINT64_C(1) << ROWS) - 1))
+
+// A full board
 bool draw(uint64_t mask) {
-    return mask == 4432406249472;
+    return mask == BOARD_MASK;
 }
 
 // Determine if 'pieces' contains at least one line of connected pieces.
@@ -141,84 +147,32 @@ bool won(uint64_t pieces) {
     return false;
 }
 
-// https://en.wikipedia.org/wiki/Negamax#Negamax_variant_with_no_color_parameter
-float negamax(uint64_t pieces, uint64_t other_pieces, int depth) {
-    uint64_t piece_mask = pieces | other_pieces;
-    if (won(other_pieces)) {
-        return pow(10, depth);
-    }
-    if (won(pieces)) {
-        return 0;
-    }
-
-    if (depth == 0 || draw(piece_mask)) {
-        return 0;
-    }
-
-    float value = 0;
-    for (uint64_t column = 0; column < 7; column ++) {
-        if (invalid_move(column, piece_mask)) {
-            continue;
-        }
-        uint64_t child_pieces = play(column, piece_mask, other_pieces);
-        value -= negamax(other_pieces, child_pieces, depth - 1);
-    }
-    return value;
-}
+// Alpha-beta search for the env's moves, on the helpers above, and the
+// opening book of solved positions
+#include "connect4_search.h"
+#include "connect4_book.h"
 
 int compute_env_move(CConnect4* env) {
     uint64_t piece_mask = env->player_pieces | env->env_pieces;
-    uint64_t hash = env->player_pieces + piece_mask + c_bottom();
-
-    // Hard coded opening book to handle some early game traps
-    // TODO: Add more opening book moves
-    switch (hash) {
-        case 4398050705408:
-            // Respond to _ _ _ o _ _ _
-            // with       _ _ x o _ _ _
-            return 2;
-        case 4398583382016:
-            // Respond to _ _ _ _ o _ _
-            // with       _ _ _ x o _ _
-            return 3;
+    // Solved early positions cost a binary search instead of a search
+    int column;
+    if (connect4_book != NULL && book_probe(connect4_book, env->env_pieces, piece_mask,
+            &column, NULL)) {
+        return column;
     }
 
-    float best_value = 9999;
-    float values[7];
-    for (int i = 0; i < 7; i++) {
-        values[i] = 9999;
+    if (connect4_search.table == NULL) {
+        // Searches without a table if this fails
+        connect4_search.table = make_transposition_table(SEARCH_TABLE_BYTES);
     }
-    for (uint64_t column = 0; column < 7; column ++) {
-        if (invalid_move(column, piece_mask)) {
-            continue;
-        }
-        uint64_t child_env_pieces = play(column, piece_mask, env->player_pieces);
-        if (won(child_env_pieces)) {
-            return column;
-        }
-        float val = -negamax(env->player_pieces, child_env_pieces, 3);
-        values[column] = val;
-        if (val < best_value) {
-            best_value = val;
-        }
-    }
-    int num_ties = 0;
-    for (uint64_t column = 0; column < 7; column ++) {
-        if (values[column] == best_value) {
-            num_ties++;
-        }
-    }
-    //printf("Values: %f, %f, %f, %f, %f, %f, %f\n", values[0], values[1], values[2], values[3], values[4], values[5], values[6]);
-    int best_tie = rand() % num_ties;
-    for (uint64_t column = 0; column < 7; column ++) {
-        if (values[column] == best_value) {
-            if (best_tie == 0) {
-                return column;
-            }
-            best_tie--;
-        }
-    }
-    return 0;
+    // -1 only on a full board, where the env never moves
+    return search_move(&connect4_search, env->env_pieces, piece_mask, NULL);
+}
+
+// The envs share the search table; the next env move makes a new one
+void c_close(CConnect4* env) {
+    free_transposition_table(connect4_search.table);
+    connect4_search.table = NULL;
 }
 
 void compute_observation(CConnect4* env) {
@@ -327,6 +281,7 @@ void c_step(CConnect4* env) {
     }
 }
 
+#ifndef CONNECT4_HEADLESS
 const Color PUFF_RED = (Color){187, 0, 0, 255};
 const Color PUFF_CYAN = (Color){0, 187, 187, 255};
 const Color PUFF_WHITE = (Color){241, 241, 241, 241};
@@ -460,3 +415,4 @@ void close_client(Client* client) {
     if (client->puffers.id != 0) UnloadTexture(client->puffers);
     free(client);
 }
+#endif
@@ -0,0 +1,190 @@
+// Opening book: the best move of every position up to a number of pieces,
+// solved offline by tools/book_gen and looked up before searching. Included by
+// connect4.h after connect4_search.h (table_key).
+//
+// File (little-endian): a 32-byte BookHeader, then count 8-byte entries sorted
+// by key. An entry packs key << 15 | (score + 128) << 3 | move, so entries
+// sort by key and a lookup is a binary search. Keys are table_key's (under
+// 2^49): a position and its mirror image share the entry of the smaller key,
+// with the move in that orientation. The checksum is FNV-1a of the entries.
+//
+// The file is memory mapped where the OS supports it, elsewhere read into
+// the heap (web builds preload it from resources/).
+#if (defined(__unix__) || defined(__APPLE__)) && !defined(__EMSCRIPTEN__)
+    #define CONNECT4_MMAP 1
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+#endif
+
+#define BOOK_MAGIC "C4BK"
+#define BOOK_VERSION 1
+#define BOOK_FILE "connect4_book.bin"
+
+typedef struct BookHeader BookHeader;
+struct BookHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t plies;  // every position with up to plies pieces
+    uint32_t depth;  // search depth of the solver, SEARCH_MAX_DEPTH if exact
+    uint64_t count;
+    uint64_t checksum;
+};
+
+typedef struct Book Book;
+struct Book {
+    const uint64_t* entries;
+    uint64_t count;
+    int plies;
+    int depth;
+    char* file_data;
+    size_t file_size;
+    void* heap;  // NULL when mapped
+    uint64_t probes;
+    uint64_t hits;
+};
+
+// Loaded by the app (InitConnect4). compute_env_move only searches without it
+Book* connect4_book = NULL;
+
+uint64_t book_entry(uint64_t key, int score, int move) {
+    return key << 15 | (uint64_t)(score + 128) << 3 | (uint64_t)move;
+}
+
+uint64_t book_checksum(const void* data, size_t size) {
+    const unsigned char* bytes = (const unsigned char*)data;
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+void free_book(Book* book) {
+    if (book == NULL) {
+        return;
+    }
+    if (book->heap != NULL) {
+        free(book->heap);
+    }
+#ifdef CONNECT4_MMAP
+    else if (book->file_data != NULL) {
+        munmap(book->file_data, book->file_size);
+    }
+#endif
+    free(book);
+}
+
+// Returns NULL and reports the error on failure
+Book* load_book(const char* filename) {
+    Book* book = calloc(1, sizeof(Book));
+    if (book == NULL) {
+        perror("Error allocating book");
+        return NULL;
+    }
+#ifdef CONNECT4_MMAP
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        perror("Error opening book");
+        free(book);
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        fprintf(stderr, "Error reading %s: empty or unreadable\n", filename);
+        close(fd);
+        free(book);
+        return NULL;
+    }
+    void* data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        perror("Error mapping book");
+        free(book);
+        return NULL;
+    }
+    book->file_data = (char*)data;
+    book->file_size = st.st_size;
+#else
+    FILE* file = fopen(filename, "rb");
+    if (!file) {
+        perror("Error opening book");
+        free(book);
+        return NULL;
+    }
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    rewind(file);
+    book->heap = size > 0 ? malloc(size) : NULL;
+    if (book->heap == NULL || fread(book->heap, 1, size, file) != (size_t)size) {
+        fprintf(stderr, "Error reading %s: empty or unreadable\n", filename);
+        fclose(file);
+        free_book(book);
+        return NULL;
+    }
+    fclose(file);
+    book->file_data = (char*)book->heap;
+    book->file_size = size;
+#endif
+    BookHeader* header = (BookHeader*)book->file_data;
+    if (book->file_size < sizeof(BookHeader) || memcmp(header->magic, BOOK_MAGIC, 4) != 0) {
+        fprintf(stderr, "Error reading %s: not a book\n", filename);
+        free_book(book);
+        return NULL;
+    }
+    if (header->version != BOOK_VERSION) {
+        fprintf(stderr, "Error reading %s: unsupported version %u\n", filename, header->version);
+        free_book(book);
+        return NULL;
+    }
+    if (header->count != (book->file_size - sizeof(BookHeader))/sizeof(uint64_t)
+            || (book->file_size - sizeof(BookHeader)) % sizeof(uint64_t) != 0) {
+        fprintf(stderr, "Error reading %s: corrupt layout\n", filename);
+        free_book(book);
+        return NULL;
+    }
+    book->entries = (const uint64_t*)(book->file_data + sizeof(BookHeader));
+    book->count = header->count;
+    book->plies = header->plies;
+    book->depth = header->depth;
+    if (book_checksum(book->entries, book->count*sizeof(uint64_t)) != header->checksum) {
+        fprintf(stderr, "Error reading %s: checksum mismatch\n", filename);
+        free_book(book);
+        return NULL;
+    }
+    return book;
+}
+
+// The book's move and score for the side to move, in the position's own
+// orientation. False if the book does not have the position
+bool book_probe(Book* book, uint64_t pieces, uint64_t mask, int* move, int* score) {
+    book->probes++;
+    if (popcount(mask) > book->plies) {
+        return false;
+    }
+    bool mirrored;
+    uint64_t key = table_key(pieces, mask, &mirrored);
+    uint64_t lo = 0;
+    uint64_t hi = book->count;
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo)/2;
+        uint64_t entry_key = book->entries[mid] >> 15;
+        if (entry_key == key) {
+            book->hits++;
+            int column = book->entries[mid] & 7;
+            *move = mirrored ? COLUMNS - 1 - column : column;
+            if (score) {
+                *score = (int)((book->entries[mid] >> 3) & 0xff) - 128;
+            }
+            return true;
+        }
+        if (entry_key < key) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,646 @@
+// Included by connect4.h after the bitboard helpers it uses (c_bottom,
+// BOTTOM_ROW, BOARD_MASK).
+#include <string.h>
+#include <time.h>
+
+// search_move spreads over threads where pthreads are part of the platform.
+// Elsewhere (web, Windows) the threads setting is ignored
+#if (defined(__unix__) || defined(__APPLE__)) && !defined(__EMSCRIPTEN__)
+    #define CONNECT4_SMP 1
+    #include <pthread.h>
+#endif
+
+// Alpha-beta search for the env's moves, after
+// http://blog.gamesolver.org/solving-connect-four/
+//
+// A position is (pieces, mask): the pieces of the side to move and all the
+// pieces on the board. Scores are from the side to move: SEARCH_WIN - stones
+// for a win completed with `stones` pieces on the board (sooner is better),
+// the negation for a loss, 0 for a draw, and the difference in open threats
+// (cells that would complete a line) where the depth runs out.
+#define SEARCH_WIN 100
+#define SEARCH_INF 1000
+#define SEARCH_DEPTH 5
+#define SEARCH_MAX_DEPTH 42
+#define SEARCH_UI_BUDGET 0.002
+#define SEARCH_ANALYSIS_BUDGET 0.1
+#define SEARCH_CLOCK_NODES 256  // nodes between clock and halt checks
+#define SEARCH_MAX_THREADS 64
+
+// Transposition table: results of positions already searched, so the search
+// cuts off or tries the best move first when it reaches them again by another
+// move order. Each bucket of TABLE_WAYS entries is one 64-byte cache line.
+//
+// The key is the position hash of the opening book, the opponent's pieces +
+// mask + c_bottom(), which is unique per position, so a hit is never a
+// collision. A position and its mirror image share one entry.
+//
+// Replacement: a result for the same position overwrites the entry unless it
+// is shallower and the entry is from the current root search. A new position
+// takes an empty entry, else evicts the shallowest one, preferring entries of
+// earlier root searches (generation) over those of the current one.
+//
+// Threads of a parallel search share the table without locks. A slot is two
+// words, the packed entry and key ^ entry, each read and written atomically
+// but not together. A slot torn by two writers fails the check and reads as
+// a miss, and a lost update only costs a search.
+#define TABLE_EMPTY 0
+#define TABLE_EXACT 1
+#define TABLE_LOWER 2  // score >= stored score
+#define TABLE_UPPER 3  // score <= stored score
+#define TABLE_WAYS 4
+#define SEARCH_TABLE_BYTES (4 << 20)
+
+#if defined(__GNUC__)
+    #define TABLE_LOAD(p) __atomic_load_n(p, __ATOMIC_RELAXED)
+    #define TABLE_STORE(p, v) __atomic_store_n(p, v, __ATOMIC_RELAXED)
+#else
+    #define TABLE_LOAD(p) (*(p))
+    #define TABLE_STORE(p, v) (*(p) = (v))
+#endif
+
+// An entry as table_probe returns it
+typedef struct TableEntry TableEntry;
+struct TableEntry {
+    int score;
+    int depth;
+    int bound;
+    int move;  // best column, -1 if none
+    int generation;
+};
+
+// data packs score + 32768, depth, bound, move + 1 and generation in 8-bit
+// fields from bit 16 up. 0 is an empty slot
+typedef struct TableSlot TableSlot;
+struct TableSlot {
+    uint64_t check;  // key ^ data
+    uint64_t data;
+};
+
+typedef struct TableBucket TableBucket;
+struct TableBucket {
+    TableSlot slots[TABLE_WAYS];
+};
+
+typedef struct TranspositionTable TranspositionTable;
+struct TranspositionTable {
+    TableBucket* buckets;  // 64-byte aligned inside memory
+    void* memory;
+    int bits;  // log2 of the number of buckets
+    uint8_t generation;  // only changed while no search runs
+};
+
+// Table use of one search thread
+typedef struct TableStats TableStats;
+struct TableStats {
+    uint64_t probes;
+    uint64_t hits;
+    uint64_t cutoffs;
+    uint64_t stores;
+    uint64_t replaced;  // stores that evicted another position
+};
+
+// Settings and counters of the env's AI. compute_env_move searches depth
+// plies, adds the positions it visits to nodes and keeps a table of
+// SEARCH_TABLE_BYTES across moves and games. With a budget it deepens one ply
+// at a time up to depth until budget seconds have passed (the app uses
+// SEARCH_UI_BUDGET); without one (training) it always searches depth, so its
+// moves do not depend on the machine
+typedef struct Connect4Search Connect4Search;
+struct Connect4Search {
+    int depth;
+    uint64_t nodes;
+    TranspositionTable* table;  // NULL searches without one
+    double budget;  // seconds per move, 0 for none
+    double deadline;  // search_clock() time to stop at, 0 for none
+    bool stopped;  // deadline passed, the results in flight are not valid
+    int completed;  // deepest finished iteration of the last search_move
+    int threads;  // search_move threads sharing the table, 0 or 1 for one
+    int* halt;  // helpers of a parallel search stop once it is set
+    bool random_ties;  // equal best root moves are picked with rand()
+    TableStats stats;
+};
+
+// The env's opponent varies its play between equal moves, as training needs
+Connect4Search connect4_search = {.depth = SEARCH_DEPTH, .random_ties = true};
+
+// Columns from the center out, the usual best moves first
+const int SEARCH_ORDER[7] = {3, 2, 4, 1, 5, 0, 6};
+
+int popcount(uint64_t x) {
+#if defined(__GNUC__)
+    return __builtin_popcountll(x);
+#else
+    int count = 0;
+    for (; x; x &= x - 1) {
+        count++;
+    }
+    return count;
+#endif
+}
+
+uint64_t column_mask(uint64_t column) {
+    return ((UINT64_C(1) << ROWS) - 1) << column * (ROWS + 1);
+}
+
+// The cell each column would be played in, for the columns that are not full
+uint64_t possible_moves(uint64_t mask) {
+    return (mask + BOTTOM_ROW) & BOARD_MASK;
+}
+
+// Empty cells that would complete a line of four for pieces
+uint64_t winning_cells(uint64_t pieces, uint64_t mask) {
+    // Vertical
+    uint64_t r = (pieces << 1) & (pieces << 2) & (pieces << 3);
+    // Horizontal, then both diagonals: three in a row on either side of the
+    // cell, or two on one side and one on the other
+    const int shifts[3] = {ROWS + 1, ROWS, ROWS + 2};
+    for (int i = 0; i < 3; i++) {
+        int d = shifts[i];
+        uint64_t p = (pieces << d) & (pieces << 2*d);
+        r |= p & (pieces << 3*d);
+        r |= p & (pieces >> d);
+        p = (pieces >> d) & (pieces >> 2*d);
+        r |= p & (pieces << d);
+        r |= p & (pieces >> 3*d);
+    }
+    return r & (BOARD_MASK ^ mask);
+}
+
+// Moves that do not let the opponent win right away: blocks their winning
+// cell if they have one, and never plays under one. 0 if every move loses
+uint64_t non_losing_moves(uint64_t pieces, uint64_t mask) {
+    uint64_t possible = possible_moves(mask);
+    uint64_t threats = winning_cells(pieces ^ mask, mask);
+    uint64_t forced = possible & threats;
+    if (forced) {
+        // Two immediate threats can not both be blocked
+        if (forced & (forced - 1)) {
+            return 0;
+        }
+        possible = forced;
+    }
+    return possible & ~(threats >> 1);
+}
+
+// Largest power of two number of buckets that fits in bytes (at least one)
+TranspositionTable* make_transposition_table(size_t bytes) {
+    TranspositionTable* table = calloc(1, sizeof(TranspositionTable));
+    if (table == NULL) {
+        return NULL;
+    }
+    while (table->bits < 40 && (sizeof(TableBucket) << (table->bits + 1)) <= bytes) {
+        table->bits++;
+    }
+    table->memory = calloc(((size_t)1 << table->bits) + 1, sizeof(TableBucket));
+    if (table->memory == NULL) {
+        free(table);
+        return NULL;
+    }
+    uintptr_t address = (uintptr_t)table->memory;
+    table->buckets = (TableBucket*)((address + 63) & ~(uintptr_t)63);
+    return table;
+}
+
+void free_transposition_table(TranspositionTable* table) {
+    if (table == NULL) {
+        return;
+    }
+    free(table->memory);
+    free(table);
+}
+
+// Forget every position
+void table_clear(TranspositionTable* table) {
+    memset(table->buckets, 0, sizeof(TableBucket) << table->bits);
+    table->generation = 0;
+}
+
+// Swaps columns 0-6, 1-5 and 2-4
+uint64_t mirror_columns(uint64_t bits) {
+    uint64_t r = 0;
+    for (int column = 0; column < COLUMNS; column++) {
+        uint64_t c = (bits >> column*(ROWS + 1)) & ((UINT64_C(1) << (ROWS + 1)) - 1);
+        r |= c << (COLUMNS - 1 - column)*(ROWS + 1);
+    }
+    return r;
+}
+
+// The smaller key of the position and its mirror. Columns never carry into
+// each other in the sum, so the mirror of the sum is the sum of the mirrors
+uint64_t table_key(uint64_t pieces, uint64_t mask, bool* mirrored) {
+    uint64_t key = (pieces ^ mask) + mask;
+    uint64_t mirror = mirror_columns(key);
+    *mirrored = mirror < key;
+    return (*mirrored ? mirror : key) + c_bottom();
+}
+
+TableBucket* table_bucket(TranspositionTable* table, uint64_t key) {
+    return &table->buckets[(key*UINT64_C(0x9E3779B97F4A7C15)) >> (64 - table->bits)];
+}
+
+uint64_t table_pack(int score, int depth, int bound, int move, int generation) {
+    return (uint64_t)(score + 32768) | (uint64_t)depth << 16 | (uint64_t)bound << 24
+        | (uint64_t)(move + 1) << 32 | (uint64_t)generation << 40;
+}
+
+TableEntry table_unpack(uint64_t data) {
+    TableEntry entry;
+    entry.score = (int)(data & 0xffff) - 32768;
+    entry.depth = (data >> 16) & 0xff;
+    entry.bound = (data >> 24) & 0xff;
+    entry.move = (int)((data >> 32) & 0xff) - 1;
+    entry.generation = (data >> 40) & 0xff;
+    return entry;
+}
+
+// Copies the entry of the position into entry, with its move in the
+// position's own orientation. False if the table does not have it
+bool table_probe(TranspositionTable* table, TableStats* stats, uint64_t pieces, uint64_t mask,
+        TableEntry* entry) {
+    stats->probes++;
+    bool mirrored;
+    uint64_t key = table_key(pieces, mask, &mirrored);
+    TableBucket* bucket = table_bucket(table, key);
+    for (int i = 0; i < TABLE_WAYS; i++) {
+        uint64_t data = TABLE_LOAD(&bucket->slots[i].data);
+        uint64_t check = TABLE_LOAD(&bucket->slots[i].check);
+        if (data != 0 && (check ^ data) == key) {
+            stats->hits++;
+            *entry = table_unpack(data);
+            if (mirrored && entry->move >= 0) {
+                entry->move = COLUMNS - 1 - entry->move;
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+void table_store(TranspositionTable* table, TableStats* stats, uint64_t pieces, uint64_t mask,
+        int depth, int score, int bound, int move) {
+    bool mirrored;
+    uint64_t key = table_key(pieces, mask, &mirrored);
+    TableBucket* bucket = table_bucket(table, key);
+    uint64_t datas[TABLE_WAYS];
+    int slot = -1;
+    for (int i = 0; i < TABLE_WAYS; i++) {
+        datas[i] = TABLE_LOAD(&bucket->slots[i].data);
+        uint64_t check = TABLE_LOAD(&bucket->slots[i].check);
+        if (slot < 0 && datas[i] != 0 && (check ^ datas[i]) == key) {
+            TableEntry e = table_unpack(datas[i]);
+            if (depth < e.depth && e.generation == table->generation) {
+                return;
+            }
+            slot = i;
+        }
+    }
+    for (int i = 0; i < TABLE_WAYS && slot < 0; i++) {
+        if (datas[i] == 0) {
+            slot = i;
+        }
+    }
+    if (slot < 0) {
+        int lowest = 0;
+        for (int i = 0; i < TABLE_WAYS; i++) {
+            TableEntry e = table_unpack(datas[i]);
+            int priority = e.depth + (e.generation == table->generation ? 256 : 0);
+            if (slot < 0 || priority < lowest) {
+                slot = i;
+                lowest = priority;
+            }
+        }
+        stats->replaced++;
+    }
+    stats->stores++;
+    move = mirrored && move >= 0 ? COLUMNS - 1 - move : move;
+    uint64_t data = table_pack(score, depth, bound, move, table->generation);
+    TABLE_STORE(&bucket->slots[slot].data, data);
+    TABLE_STORE(&bucket->slots[slot].check, key ^ data);
+}
+
+// The columns of next in SEARCH_ORDER with first in front, if it is one of
+// them. Returns how many
+int search_order(int first, uint64_t next, int order[7]) {
+    int n = 0;
+    if (first >= 0 && (next & column_mask(first))) {
+        order[n++] = first;
+    }
+    for (int i = 0; i < COLUMNS; i++) {
+        int column = SEARCH_ORDER[i];
+        if (column != first && (next & column_mask(column))) {
+            order[n++] = column;
+        }
+    }
+    return n;
+}
+
+// search_order, then the most threats (cells that would complete a line) the
+// move leaves first. Costs more than it saves near the leaves
+int search_order_threats(int first, uint64_t next, uint64_t pieces, uint64_t mask, int order[7]) {
+    int n = 0;
+    int threats[7];
+    for (int i = 0; i < COLUMNS; i++) {
+        int column = SEARCH_ORDER[i];
+        uint64_t move = next & column_mask(column);
+        if (move == 0) {
+            continue;
+        }
+        int count = column == first ? 1000 : popcount(winning_cells(pieces | move, mask | move));
+        int j = n++;
+        for (; j > 0 && threats[j - 1] < count; j--) {
+            order[j] = order[j - 1];
+            threats[j] = threats[j - 1];
+        }
+        order[j] = column;
+        threats[j] = count;
+    }
+    return n;
+}
+
+double search_clock() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9*ts.tv_nsec;
+}
+
+bool search_expired(Connect4Search* search) {
+    if (search->halt != NULL && TABLE_LOAD(search->halt)) {
+        return true;
+    }
+    return search->deadline > 0 && search_clock() >= search->deadline;
+}
+
+// Side to move can not win with its next piece, so the search keeps to
+// positions where the previous move was non-losing. Returns 0 once stopped
+int search_negamax(Connect4Search* search, uint64_t pieces, uint64_t mask, int depth,
+        int alpha, int beta) {
+    search->nodes++;
+    if ((search->deadline > 0 || search->halt != NULL) && search->nodes % SEARCH_CLOCK_NODES == 0
+            && search_expired(search)) {
+        search->stopped = true;
+    }
+    if (search->stopped) {
+        return 0;
+    }
+    uint64_t next = non_losing_moves(pieces, mask);
+    int stones = popcount(mask);
+    if (next == 0) {
+        return -(SEARCH_WIN - (stones + 2));
+    }
+    // Neither side can win with the last two pieces
+    if (stones >= ROWS*COLUMNS - 2) {
+        return 0;
+    }
+    // Neither side wins with its next piece, so the earliest wins are this
+    // side's second piece and then the opponent's second
+    int min = -(SEARCH_WIN - (stones + 4));
+    int max = SEARCH_WIN - (stones + 3);
+    if (alpha < min) {
+        alpha = min;
+    }
+    if (beta > max) {
+        beta = max;
+    }
+    if (alpha >= beta) {
+        return alpha;
+    }
+    if (depth == 0) {
+        return popcount(winning_cells(pieces, mask)) - popcount(winning_cells(pieces ^ mask, mask));
+    }
+    int alpha_orig = alpha;
+    int best_move = -1;
+    // One ply from the leaves the probe costs more than the search
+    TranspositionTable* table = depth > 1 ? search->table : NULL;
+    if (table) {
+        TableEntry entry;
+        if (table_probe(table, &search->stats, pieces, mask, &entry)) {
+            best_move = entry.move;
+            if (entry.depth >= depth && (entry.bound == TABLE_EXACT
+                    || (entry.bound == TABLE_LOWER && entry.score >= beta)
+                    || (entry.bound == TABLE_UPPER && entry.score <= alpha))) {
+                search->stats.cutoffs++;
+                return entry.score;
+            }
+        }
+    }
+    int order[7];
+    int num_moves = depth > 2 ? search_order_threats(best_move, next, pieces, mask, order)
+        : search_order(best_move, next, order);
+    for (int i = 0; i < num_moves; i++) {
+        uint64_t move = next & column_mask(order[i]);
+        int score = -search_negamax(search, pieces ^ mask, mask | move, depth - 1, -beta, -alpha);
+        if (search->stopped) {
+            return 0;
+        }
+        if (score >= beta) {
+            alpha = score;
+            best_move = order[i];
+            break;
+        }
+        if (score > alpha) {
+            alpha = score;
+            best_move = order[i];
+        }
+    }
+    if (table) {
+        int bound = alpha >= beta ? TABLE_LOWER : alpha <= alpha_orig ? TABLE_UPPER : TABLE_EXACT;
+        table_store(table, &search->stats, pieces, mask, depth, alpha, bound, best_move);
+    }
+    return alpha;
+}
+
+// Root of search_best_move and search_move, first is tried first if it is a
+// column, else the table's move. Once stopped the score is of the moves
+// searched so far, and -1 if that is none
+int search_root(Connect4Search* search, uint64_t pieces, uint64_t mask, int depth, int first,
+        int* score) {
+    search->nodes++;
+    uint64_t possible = possible_moves(mask);
+    uint64_t wins = possible & winning_cells(pieces, mask);
+    uint64_t next = non_losing_moves(pieces, mask);
+    int stones = popcount(mask);
+    int best = -1;
+    int best_score = -SEARCH_INF;
+    if (wins || next == 0) {
+        // Win now, or lose whatever is played (then block one threat at least)
+        uint64_t blocks = possible & winning_cells(pieces ^ mask, mask);
+        uint64_t moves = wins ? wins : blocks ? blocks : possible;
+        for (int i = 0; i < COLUMNS && best < 0; i++) {
+            if (moves & column_mask(SEARCH_ORDER[i])) {
+                best = SEARCH_ORDER[i];
+            }
+        }
+        best_score = wins ? SEARCH_WIN - (stones + 1) : -(SEARCH_WIN - (stones + 2));
+    }
+    if (!wins && next) {
+        if (first < 0 && search->table) {
+            TableEntry entry;
+            if (table_probe(search->table, &search->stats, pieces, mask, &entry)) {
+                first = entry.move;
+            }
+        }
+        int order[7];
+        int num_moves = search_order(first, next, order);
+        int ties = 0;
+        for (int i = 0; i < num_moves; i++) {
+            uint64_t move = next & column_mask(order[i]);
+            // A tie needs an exact score, so random ties search one wider
+            int alpha = search->random_ties && best >= 0 ? best_score - 1 : best_score;
+            int value = -search_negamax(search, pieces ^ mask, mask | move, depth - 1,
+                -SEARCH_INF, -alpha);
+            if (search->stopped) {
+                break;
+            }
+            if (best < 0 || value > best_score) {
+                best = order[i];
+                best_score = value;
+                ties = 1;
+            } else if (search->random_ties && value == best_score && rand() % ++ties == 0) {
+                best = order[i];
+            }
+        }
+        if (search->table && !search->stopped) {
+            table_store(search->table, &search->stats, pieces, mask, depth, best_score,
+                TABLE_EXACT, best);
+        }
+    }
+    if (score) {
+        *score = best_score;
+    }
+    return best;
+}
+
+// Best column for the side to move searching depth plies (at least 1), -1 on
+// a full board. Ties go to a random move with search->random_ties, else to
+// the table's move from an earlier search, then the most central column.
+// Writes the score if given
+int search_best_move(Connect4Search* search, uint64_t pieces, uint64_t mask, int depth,
+        int* score) {
+    // A new generation ages the entries of earlier root searches
+    if (search->table) {
+        search->table->generation++;
+    }
+    return search_root(search, pieces, mask, depth, -1, score);
+}
+
+// Iterative deepening from first_depth up to search->depth, until stopped:
+// each iteration tries the previous one's best move first, and an iteration
+// cut short still counts if it finished that move, since the others then only
+// replace it when proven better. Stops early once the score is a proven win or
+// loss or the depth reaches the end of the game. Stopped before any move is
+// searched it falls back to the first non-losing column in SEARCH_ORDER (any
+// legal one if they all lose), -1 only on a full board
+int search_iterate(Connect4Search* search, uint64_t pieces, uint64_t mask, int first_depth,
+        int* score) {
+    int stones = popcount(mask);
+    uint64_t next = non_losing_moves(pieces, mask);
+    int order[7];
+    int best = search_order(-1, next ? next : possible_moves(mask), order) ? order[0] : -1;
+    int best_score = 0;
+    int first = -1;  // the table's move until an iteration has a best move
+    for (int depth = first_depth; depth <= search->depth; depth++) {
+        int value;
+        int column = search_root(search, pieces, mask, depth, first, &value);
+        if (column >= 0) {
+            best = first = column;
+            best_score = value;
+        }
+        if (search->stopped) {
+            break;
+        }
+        search->completed = depth;
+        bool proven = value >= SEARCH_WIN - ROWS*COLUMNS || value <= -(SEARCH_WIN - ROWS*COLUMNS);
+        if (proven || depth >= ROWS*COLUMNS - stones) {
+            break;
+        }
+    }
+    if (score) {
+        *score = best_score;
+    }
+    return best;
+}
+
+#ifdef CONNECT4_SMP
+typedef struct SearchHelper SearchHelper;
+struct SearchHelper {
+    Connect4Search search;
+    uint64_t pieces;
+    uint64_t mask;
+    int first_depth;
+    pthread_t thread;
+};
+
+void* search_helper(void* arg) {
+    SearchHelper* helper = (SearchHelper*)arg;
+    search_iterate(&helper->search, helper->pieces, helper->mask, helper->first_depth, NULL);
+    return NULL;
+}
+#endif
+
+// Best column within search->budget by iterative deepening (search_iterate),
+// or at search->depth without a budget. -1 on a full board. Writes the score
+// if given.
+//
+// With search->threads > 1 and a table, Lazy SMP: helper threads run their
+// own iterative deepening of the same position, half of them a ply ahead,
+// and share the table, so the calling thread finds more of its tree already
+// searched. Its result is the move; the helpers stop when it is done. Moves
+// then depend on thread timing; with one thread they are deterministic
+// unless search->random_ties
+int search_move(Connect4Search* search, uint64_t pieces, uint64_t mask, int* score) {
+    search->completed = 0;
+    if (possible_moves(mask) == 0) {
+        return -1;
+    }
+    // A new generation ages the entries of earlier root searches
+    if (search->table) {
+        search->table->generation++;
+    }
+    search->stopped = false;
+    search->deadline = search->budget > 0 ? search_clock() + search->budget : 0;
+#ifdef CONNECT4_SMP
+    int halt = 0;
+    SearchHelper helpers[SEARCH_MAX_THREADS - 1];
+    int num_helpers = 0;
+    int threads = search->threads < SEARCH_MAX_THREADS ? search->threads : SEARCH_MAX_THREADS;
+    while (search->table && num_helpers < threads - 1) {
+        SearchHelper* helper = &helpers[num_helpers];
+        helper->search = *search;
+        helper->search.nodes = 0;
+        helper->search.stats = (TableStats){0};
+        helper->search.halt = &halt;
+        helper->search.random_ties = false;
+        helper->pieces = pieces;
+        helper->mask = mask;
+        helper->first_depth = 1 + num_helpers % 2;
+        if (pthread_create(&helper->thread, NULL, search_helper, helper) != 0) {
+            break;
+        }
+        num_helpers++;
+    }
+#endif
+    int best;
+    if (search->budget > 0) {
+        best = search_iterate(search, pieces, mask, 1, score);
+    } else {
+        search->completed = search->depth;
+        best = search_root(search, pieces, mask, search->depth, -1, score);
+    }
+#ifdef CONNECT4_SMP
+    TABLE_STORE(&halt, 1);
+    for (int i = 0; i < num_helpers; i++) {
+        pthread_join(helpers[i].thread, NULL);
+        Connect4Search* helper = &helpers[i].search;
+        search->nodes += helper->nodes;
+        search->stats.probes += helper->stats.probes;
+        search->stats.hits += helper->stats.hits;
+        search->stats.cutoffs += helper->stats.cutoffs;
+        search->stats.stores += helper->stats.stores;
+        search->stats.replaced += helper->stats.replaced;
+    }
+#endif
+    search->stopped = false;
+    search->deadline = 0;
+    return best;
+}
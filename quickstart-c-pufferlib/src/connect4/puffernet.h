@@ -1,8 +1,47 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
 #include <math.h>
 #include <assert.h>
+#include <stdint.h>
+
+// Weight containers are memory mapped where the OS supports it so processes
+// loading the same file share one physical copy. Elsewhere they are read into
+// an aligned heap buffer.
+#if (defined(__unix__) || defined(__APPLE__)) && !defined(__EMSCRIPTEN__)
+    #define PUFFERNET_MMAP 1
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+#endif
+
+// SIMD kernels are compiled per function with target attributes so the binary
+// still runs on any CPU of the base architecture. The best variant is picked
+// at runtime by puffernet_kernels(). Set PUFFERNET_ISA=scalar|sse41|avx2|neon
+// to force a specific variant (e.g. to compare against the scalar reference).
+#if defined(__GNUC__)
+    #define PUFFERNET_INLINE static inline __attribute__((always_inline))
+#else
+    #define PUFFERNET_INLINE static inline
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    #define PUFFERNET_X86 1
+    #define PUFFERNET_TARGET(isa) __attribute__((target(isa)))
+    #include <immintrin.h>
+#endif
+#if defined(__aarch64__) && defined(__ARM_NEON)
+    #define PUFFERNET_NEON 1
+    #include <arm_neon.h>
+#endif
+
+// Arena allocations start on this boundary (one cache line, one AVX-512 vector)
+#define PUFFERNET_ALIGN 64
+
+size_t _align_up(size_t value, size_t alignment) {
+    return (value + alignment - 1) & ~(alignment - 1);
+}
 
 typedef struct {
     void* data;
@@ -10,16 +49,25 @@ typedef struct {
     size_t used;
 } Arena;
 
+// Zeroed bump allocator in a single heap block, freed with free_allocator.
+// Every allocation is rounded up to PUFFERNET_ALIGN, so the *_size helpers
+// below give the exact capacity needed to build a layer or network in it.
 Arena* make_allocator(size_t total_size) {
-    void* buffer = calloc(1, total_size + sizeof(Arena));
+    total_size = _align_up(total_size, PUFFERNET_ALIGN);
+    void* buffer = calloc(1, sizeof(Arena) + PUFFERNET_ALIGN + total_size);
+    if (!buffer) {
+        perror("Error allocating arena");
+        return NULL;
+    }
     Arena* allocator = (Arena*)buffer;
-    allocator->data = (void*)((char*)buffer + sizeof(Arena));
+    allocator->data = (void*)_align_up((size_t)(allocator + 1), PUFFERNET_ALIGN);
     allocator->capacity = total_size;
     allocator->used = 0;
     return allocator;
 }
 
 void* alloc(Arena* allocator, size_t size) {
+    size = _align_up(size, PUFFERNET_ALIGN);
     void* ptr = (void*)((char*)allocator->data + allocator->used);
     if (allocator->used + size > allocator->capacity) {
         return NULL;
@@ -28,44 +76,439 @@ void* alloc(Arena* allocator, size_t size) {
     return ptr;
 }
 
-// File format is obained by flattening and concatenating all pytorch layers
+void free_allocator(Arena* allocator) {
+    free(allocator);
+}
+
+// Layers are a single block: the struct followed by each of its buffers on
+// its own PUFFERNET_ALIGN boundary. The block comes from the arena when one
+// is given and from the heap (free it with free()) otherwise. Returns NULL
+// if the arena is too small or the heap is out of memory, and make_* with it.
+size_t _block_size(size_t size) {
+    return _align_up(size, PUFFERNET_ALIGN);
+}
+
+void* _make_block(Arena* arena, size_t size) {
+    if (arena == NULL) {
+        void* block = calloc(1, size);
+        if (block == NULL) {
+            perror("Error allocating layer");
+        }
+        return block;
+    }
+    void* block = alloc(arena, size);
+    if (block == NULL) {
+        fprintf(stderr, "Error: arena too small for layer (%zu bytes, %zu of %zu free)\n",
+            size, arena->capacity - arena->used, arena->capacity);
+    }
+    return block;
+}
+
+// Releases a block from a make_* that failed. Arena blocks go with the arena
+void _free_block(Arena* arena, void* block) {
+    if (arena == NULL) {
+        free(block);
+    }
+}
+
+// First buffer after a block's struct
+void* _block_data(void* block, size_t struct_size) {
+    return (char*)block + _block_size(struct_size);
+}
+
+// Returns the buffer at *cursor and advances past it
+void* _carve(char** cursor, size_t size) {
+    void* ptr = *cursor;
+    *cursor += _block_size(size);
+    return ptr;
+}
+
+// Two file formats are supported:
+//  - Raw: all pytorch layers flattened and concatenated as float32. The
+//    caller must know the float count and get_weights walks it in order.
+//  - Container (.pufw): a versioned header and tensor table followed by the
+//    tensor data. Every tensor starts on a 64 byte boundary and the data is
+//    covered by an FNV-1a checksum. get_weights hands out zero-copy pointers
+//    into the (read-only) mapping, one tensor per call, in file order.
+// load_weights detects the format from the magic bytes. Little-endian only.
+#define PUFFERNET_WEIGHTS_MAGIC "PUFW"
+#define PUFFERNET_WEIGHTS_VERSION 1
+#define PUFFERNET_WEIGHTS_ALIGN 64
+#define PUFFERNET_TENSOR_NAME 64
+#define PUFFERNET_TENSOR_DIMS 4
+
+enum {
+    DTYPE_F32 = 0,
+    DTYPE_I8 = 1,
+    DTYPE_I32 = 2,
+};
+
+size_t dtype_size(uint32_t dtype) {
+    return dtype == DTYPE_I8 ? 1 : 4;
+}
+
+// On-disk header, 64 bytes
+typedef struct WeightsHeader WeightsHeader;
+struct WeightsHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t num_tensors;
+    uint32_t alignment;
+    uint64_t data_offset;
+    uint64_t data_size;
+    uint64_t checksum;
+    uint8_t reserved[24];
+};
+
+// On-disk tensor table entry, 128 bytes. offset is relative to data_offset
+typedef struct Tensor Tensor;
+struct Tensor {
+    char name[PUFFERNET_TENSOR_NAME];
+    uint32_t dtype;
+    uint32_t ndim;
+    uint32_t shape[PUFFERNET_TENSOR_DIMS];
+    uint64_t offset;
+    uint64_t size;
+    uint8_t reserved[24];
+};
+
 typedef struct Weights Weights;
 struct Weights {
     float* data;
     int size;
     int idx;
+    // Container only. idx counts tensors handed out by get_weights
+    Tensor* tensors;
+    int num_tensors;
+    char* file_data;
+    size_t file_size;
+    void* heap;
 };
 
-void _load_weights(const char* filename, float* weights, size_t num_weights) {
+uint64_t _fnv1a(const void* data, size_t size) {
+    const unsigned char* bytes = (const unsigned char*)data;
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+bool _load_weights(const char* filename, float* weights, size_t num_weights) {
     FILE* file = fopen(filename, "rb");
     if (!file) {
         perror("Error opening file");
+        return false;
     }
-    fseek(file, 0, SEEK_END);
-    rewind(file);
     size_t read_size = fread(weights, sizeof(float), num_weights, file);
     fclose(file);
     if (read_size != num_weights) {
-        perror("Error reading file");
+        fprintf(stderr, "Error reading %s: expected %zu floats, got %zu\n",
+            filename, num_weights, read_size);
+        return false;
+    }
+    return true;
+}
+
+// Maps (or reads) the whole file. Returns false with nothing left allocated
+bool _map_file(const char* filename, Weights* weights) {
+#ifdef PUFFERNET_MMAP
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        perror("Error opening file");
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        fprintf(stderr, "Error reading %s: empty or unreadable\n", filename);
+        close(fd);
+        return false;
+    }
+    void* data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        perror("Error mapping file");
+        return false;
+    }
+    weights->file_data = (char*)data;
+    weights->file_size = st.st_size;
+    weights->heap = NULL;
+    return true;
+#else
+    FILE* file = fopen(filename, "rb");
+    if (!file) {
+        perror("Error opening file");
+        return false;
+    }
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    rewind(file);
+    if (size <= 0) {
+        fprintf(stderr, "Error reading %s: empty or unreadable\n", filename);
+        fclose(file);
+        return false;
+    }
+    void* heap = malloc(size + PUFFERNET_WEIGHTS_ALIGN);
+    if (heap == NULL) {
+        perror("Error allocating weights");
+        fclose(file);
+        return false;
+    }
+    char* data = (char*)_align_up((size_t)heap, PUFFERNET_WEIGHTS_ALIGN);
+    size_t read_size = fread(data, 1, size, file);
+    fclose(file);
+    if (read_size != (size_t)size) {
+        fprintf(stderr, "Error reading %s\n", filename);
+        free(heap);
+        return false;
+    }
+    weights->file_data = data;
+    weights->file_size = size;
+    weights->heap = heap;
+    return true;
+#endif
+}
+
+void _unmap_file(Weights* weights) {
+    if (weights->heap != NULL) {
+        free(weights->heap);
+    }
+#ifdef PUFFERNET_MMAP
+    else if (weights->file_data != NULL) {
+        munmap(weights->file_data, weights->file_size);
+    }
+#endif
+    weights->file_data = NULL;
+}
+
+bool _parse_container(const char* filename, Weights* weights) {
+    if (weights->file_size < sizeof(WeightsHeader)) {
+        fprintf(stderr, "Error reading %s: truncated header\n", filename);
+        return false;
+    }
+    WeightsHeader* header = (WeightsHeader*)weights->file_data;
+    if (header->version != PUFFERNET_WEIGHTS_VERSION) {
+        fprintf(stderr, "Error reading %s: unsupported version %u\n",
+            filename, header->version);
+        return false;
+    }
+    // Sizes are compared by subtraction so corrupt values cannot wrap around
+    size_t file_size = weights->file_size;
+    if (header->num_tensors > (file_size - sizeof(WeightsHeader))/sizeof(Tensor)
+            || sizeof(WeightsHeader) + header->num_tensors*sizeof(Tensor) > header->data_offset
+            || header->data_offset % PUFFERNET_WEIGHTS_ALIGN != 0
+            || header->data_offset > file_size
+            || header->data_size > file_size - header->data_offset) {
+        fprintf(stderr, "Error reading %s: corrupt layout\n", filename);
+        return false;
+    }
+    char* data = weights->file_data + header->data_offset;
+    if (_fnv1a(data, header->data_size) != header->checksum) {
+        fprintf(stderr, "Error reading %s: checksum mismatch\n", filename);
+        return false;
     }
+    Tensor* tensors = (Tensor*)(weights->file_data + sizeof(WeightsHeader));
+    for (uint32_t i = 0; i < header->num_tensors; i++) {
+        Tensor* t = &tensors[i];
+        // Names are used as C strings from here on
+        if (memchr(t->name, '\0', PUFFERNET_TENSOR_NAME) == NULL) {
+            fprintf(stderr, "Error reading %s: tensor %u name not terminated\n", filename, i);
+            return false;
+        }
+        if (t->offset > header->data_size || t->size > header->data_size - t->offset) {
+            fprintf(stderr, "Error reading %s: tensor %s out of bounds\n", filename, t->name);
+            return false;
+        }
+        bool valid = t->ndim <= PUFFERNET_TENSOR_DIMS
+            && (t->dtype == DTYPE_F32 || t->dtype == DTYPE_I8 || t->dtype == DTYPE_I32);
+        uint64_t bytes = valid ? dtype_size(t->dtype) : 0;
+        for (uint32_t d = 0; valid && d < t->ndim; d++) {
+            valid = t->shape[d] == 0 || bytes <= t->size/t->shape[d];
+            bytes *= t->shape[d];
+        }
+        if (!valid || bytes != t->size) {
+            fprintf(stderr, "Error reading %s: tensor %s shape or dtype does not match its size\n",
+                filename, t->name);
+            return false;
+        }
+        // Layers use tensors in place, with the alignment of arena buffers
+        if ((header->data_offset + tensors[i].offset) % PUFFERNET_ALIGN != 0) {
+            fprintf(stderr, "Error reading %s: tensor %s misaligned\n",
+                filename, tensors[i].name);
+            return false;
+        }
+    }
+    weights->tensors = tensors;
+    weights->num_tensors = header->num_tensors;
+    return true;
 }
 
+// Loads a raw file with exactly num_weights floats, or a container (in which
+// case num_weights may be 0). Returns NULL and reports the error on failure.
 Weights* load_weights(const char* filename, size_t num_weights) {
+    Weights probe = {0};
+    if (!_map_file(filename, &probe)) {
+        return NULL;
+    }
+    if (probe.file_size >= 4 && memcmp(probe.file_data, PUFFERNET_WEIGHTS_MAGIC, 4) == 0) {
+        if (!_parse_container(filename, &probe)) {
+            _unmap_file(&probe);
+            return NULL;
+        }
+        Weights* weights = calloc(1, sizeof(Weights));
+        if (weights == NULL) {
+            perror("Error allocating weights");
+            _unmap_file(&probe);
+            return NULL;
+        }
+        *weights = probe;
+        weights->data = (float*)(probe.file_data + ((WeightsHeader*)probe.file_data)->data_offset);
+        weights->size = ((WeightsHeader*)probe.file_data)->data_size/sizeof(float);
+        return weights;
+    }
+    _unmap_file(&probe);
+
+    if (num_weights == 0) {
+        fprintf(stderr, "Error reading %s: raw weight files need a float count\n", filename);
+        return NULL;
+    }
     Weights* weights = calloc(1, sizeof(Weights) + num_weights*sizeof(float));
+    if (weights == NULL) {
+        perror("Error allocating weights");
+        return NULL;
+    }
     weights->data = (float*)(weights + 1);
-    _load_weights(filename, weights->data, num_weights);
+    if (!_load_weights(filename, weights->data, num_weights)) {
+        free(weights);
+        return NULL;
+    }
     weights->size = num_weights;
     weights->idx = 0;
     return weights;
 }
 
+void free_weights(Weights* weights) {
+    if (weights == NULL) {
+        return;
+    }
+    _unmap_file(weights);
+    free(weights);
+}
+
+void* tensor_data(Weights* weights, Tensor* tensor) {
+    WeightsHeader* header = (WeightsHeader*)weights->file_data;
+    return weights->file_data + header->data_offset + tensor->offset;
+}
+
+Tensor* get_tensor(Weights* weights, const char* name) {
+    for (int i = 0; i < weights->num_tensors; i++) {
+        if (strncmp(weights->tensors[i].name, name, PUFFERNET_TENSOR_NAME) == 0) {
+            return &weights->tensors[i];
+        }
+    }
+    return NULL;
+}
+
+size_t tensor_numel(Tensor* tensor) {
+    size_t numel = 1;
+    for (uint32_t d = 0; d < tensor->ndim; d++) {
+        numel *= tensor->shape[d];
+    }
+    return numel;
+}
+
+// Next tensor get_weights would hand out, or NULL for raw files
+Tensor* next_tensor(Weights* weights) {
+    if (weights->tensors == NULL || weights->idx >= weights->num_tensors) {
+        return NULL;
+    }
+    return &weights->tensors[weights->idx];
+}
+
+// Container only: like get_weights for tensors of any dtype. Returns NULL
+// and reports the error when the next tensor is missing or does not match
+void* get_weights_typed(Weights* weights, uint32_t dtype, size_t numel) {
+    if (weights->tensors == NULL || weights->idx >= weights->num_tensors) {
+        fprintf(stderr, "Error reading weights: expected another tensor\n");
+        return NULL;
+    }
+    Tensor* tensor = &weights->tensors[weights->idx++];
+    if (tensor->dtype != dtype || tensor_numel(tensor) != numel) {
+        fprintf(stderr, "Error reading weights: tensor %s is not %zu values of dtype %u\n",
+            tensor->name, numel, dtype);
+        return NULL;
+    }
+    return tensor_data(weights, tensor);
+}
+
+// Next num_weights floats, or NULL (reported) when the file runs out or the
+// next container tensor does not match
 float* get_weights(Weights* weights, int num_weights) {
+    if (weights->tensors != NULL) {
+        return (float*)get_weights_typed(weights, DTYPE_F32, num_weights);
+    }
+    if (num_weights < 0 || num_weights > weights->size - weights->idx) {
+        fprintf(stderr, "Error reading weights: %d floats requested, %d left\n",
+            num_weights, weights->size - weights->idx);
+        return NULL;
+    }
     float* data = &weights->data[weights->idx];
     weights->idx += num_weights;
-    assert(weights->idx <= weights->size);
     return data;
 }
 
+// Writes a container. The caller fills name, dtype, ndim and shape of each
+// tensor; offsets, sizes and the checksum are computed here.
+bool save_weights(const char* filename, Tensor* tensors, void** data, int num_tensors) {
+    size_t data_size = 0;
+    for (int i = 0; i < num_tensors; i++) {
+        Tensor* t = &tensors[i];
+        data_size = _align_up(data_size, PUFFERNET_WEIGHTS_ALIGN);
+        t->offset = data_size;
+        t->size = tensor_numel(t)*dtype_size(t->dtype);
+        data_size += t->size;
+    }
+    data_size = _align_up(data_size, PUFFERNET_WEIGHTS_ALIGN);
+    char* blob = calloc(1, data_size);
+    if (blob == NULL) {
+        perror("Error allocating weights");
+        return false;
+    }
+    for (int i = 0; i < num_tensors; i++) {
+        memcpy(blob + tensors[i].offset, data[i], tensors[i].size);
+    }
+
+    WeightsHeader header = {0};
+    memcpy(header.magic, PUFFERNET_WEIGHTS_MAGIC, 4);
+    header.version = PUFFERNET_WEIGHTS_VERSION;
+    header.num_tensors = num_tensors;
+    header.alignment = PUFFERNET_WEIGHTS_ALIGN;
+    header.data_offset = _align_up(sizeof(WeightsHeader) + num_tensors*sizeof(Tensor),
+        PUFFERNET_WEIGHTS_ALIGN);
+    header.data_size = data_size;
+    header.checksum = _fnv1a(blob, data_size);
+
+    FILE* file = fopen(filename, "wb");
+    if (!file) {
+        perror("Error opening file");
+        free(blob);
+        return false;
+    }
+    char padding[PUFFERNET_WEIGHTS_ALIGN] = {0};
+    size_t table_end = sizeof(WeightsHeader) + num_tensors*sizeof(Tensor);
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1
+        && fwrite(tensors, sizeof(Tensor), num_tensors, file) == (size_t)num_tensors
+        && fwrite(padding, 1, header.data_offset - table_end, file) == header.data_offset - table_end
+        && fwrite(blob, 1, data_size, file) == data_size;
+    ok = fclose(file) == 0 && ok;
+    free(blob);
+    if (!ok) {
+        perror("Error writing file");
+    }
+    return ok;
+}
+
 // PufferNet implementation of PyTorch functions
 // These are tested against the PyTorch implementation
 void _relu(float* input, float* output, int size) {
@@ -74,42 +517,1602 @@ void _relu(float* input, float* output, int size) {
     }
 }
 
-void _gelu(float* input, float* output, int size) {
-    for (int i = 0; i < size; i++) {
-        output[i] = 0.5f*input[i]*(1 + tanhf(0.7978845608028654 * (input[i] + 0.044715f*input[i]*input[i]*input[i])));
+// Precision of exp, sigmoid, tanh and GELU in every layer and in softmax.
+// Set with puffernet_set_math or PUFFERNET_MATH=exact|accurate|fast. The
+// polynomial modes bound the relative error wherever the result is a normal
+// float (tools/bench_activations measures it). The exception is GELU below
+// x = -3, which is ill-conditioned: there accurate mode is within ~1e-5 and
+// the libm formula loses every digit.
+typedef enum {
+    PUFFERNET_MATH_EXACT,     // libm
+    PUFFERNET_MATH_ACCURATE,  // ~1e-6 relative error (default)
+    PUFFERNET_MATH_FAST,      // ~1e-3 relative error
+} PufferMath;
+
+// Read on first use, possibly by several threads at once. They all read the
+// same environment, so the mode is only published atomically like the kernels
+static int puffernet_math_mode = -1;
+#if defined(__GNUC__)
+    #define _PUFFERNET_LOAD_MATH() __atomic_load_n(&puffernet_math_mode, __ATOMIC_ACQUIRE)
+    #define _PUFFERNET_STORE_MATH(m) \
+        __atomic_store_n(&puffernet_math_mode, m, __ATOMIC_RELEASE)
+#else
+    #define _PUFFERNET_LOAD_MATH() puffernet_math_mode
+    #define _PUFFERNET_STORE_MATH(m) (puffernet_math_mode = (m))
+#endif
+
+void puffernet_set_math(PufferMath mode) {
+    _PUFFERNET_STORE_MATH((int)mode);
+}
+
+PufferMath puffernet_math() {
+    int mode = _PUFFERNET_LOAD_MATH();
+    if (mode >= 0) {
+        return (PufferMath)mode;
+    }
+    const char* forced = getenv("PUFFERNET_MATH");
+    mode = PUFFERNET_MATH_ACCURATE;
+    if (forced != NULL && strcmp(forced, "exact") == 0) {
+        mode = PUFFERNET_MATH_EXACT;
+    } else if (forced != NULL && strcmp(forced, "fast") == 0) {
+        mode = PUFFERNET_MATH_FAST;
+    }
+    _PUFFERNET_STORE_MATH(mode);
+    return (PufferMath)mode;
+}
+
+// exp is range reduced to x = n*ln2 + r with |r| <= ln2/2, exp(r) comes from
+// a degree 7 (accurate) or degree 3 (fast) polynomial and 2^n is written into
+// the exponent bits. Inputs are clamped so 2^n stays a normal float. The
+// SIMD variants below evaluate the same polynomials.
+#define PUFFERNET_EXP_MIN -87.33654f
+#define PUFFERNET_EXP_MAX 88.0f
+#define PUFFERNET_LOG2E 1.44269504089f
+#define PUFFERNET_LN2_HI 0.693359375f
+#define PUFFERNET_LN2_LO -2.12194440e-4f
+#define PUFFERNET_GELU_K 0.7978845608028654f
+
+PUFFERNET_INLINE float _exp_poly(float x, bool fast) {
+    x = fminf(fmaxf(x, PUFFERNET_EXP_MIN), PUFFERNET_EXP_MAX);
+    // Round to nearest without a libm call
+    float n = (x*PUFFERNET_LOG2E + 12582912.0f) - 12582912.0f;
+    float r = x - n*PUFFERNET_LN2_HI - n*PUFFERNET_LN2_LO;
+    float p;
+    if (fast) {
+        p = 1.6708603e-1f*r + 5.0414018e-1f;
+    } else {
+        p = ((((1.9875691500e-4f*r + 1.3981999507e-3f)*r + 8.3334519073e-3f)*r
+            + 4.1665795894e-2f)*r + 1.6666665459e-1f)*r + 5.0000001201e-1f;
+    }
+    int32_t bits = ((int32_t)n + 127) << 23;
+    float scale;
+    memcpy(&scale, &bits, sizeof(float));
+    return (p*r*r + r + 1.0f)*scale;
+}
+
+PUFFERNET_INLINE float _sigmoid_poly(float x, bool fast) {
+    return 1.0f/(1.0f + _exp_poly(-x, fast));
+}
+
+// Odd polynomial near zero keeps the relative error small where
+// 1 - 2/(exp(2x) + 1) would cancel
+PUFFERNET_INLINE float _tanh_poly(float x, bool fast) {
+    float ax = fabsf(x);
+    if (ax < 0.625f) {
+        float z = x*x;
+        return x + x*z*((((-5.70498872745e-3f*z + 2.06390887954e-2f)*z
+            - 5.37397155531e-2f)*z + 1.33314422036e-1f)*z - 3.33332819422e-1f);
     }
+    float t = 1.0f - 2.0f/(_exp_poly(2.0f*fminf(ax, 9.0f), fast) + 1.0f);
+    return copysignf(t, x);
+}
+
+// Tanh form of GELU, rewritten as x*sigmoid(2u) since 1 + tanh(u) cancels
+// for negative inputs
+PUFFERNET_INLINE float _gelu_poly(float x, bool fast) {
+    float u = PUFFERNET_GELU_K*(x + 0.044715f*x*x*x);
+    return x*_sigmoid_poly(2.0f*u, fast);
+}
+
+float _exp(float x);
+inline float _exp(float x) {
+    PufferMath mode = puffernet_math();
+    return mode == PUFFERNET_MATH_EXACT ? expf(x) : _exp_poly(x, mode == PUFFERNET_MATH_FAST);
 }
 
 float _sigmoid(float x);
 inline float _sigmoid(float x) {
-    return 1.0f / (1.0f + expf(-x));
+    PufferMath mode = puffernet_math();
+    if (mode == PUFFERNET_MATH_EXACT) {
+        return 1.0f / (1.0f + expf(-x));
+    }
+    return _sigmoid_poly(x, mode == PUFFERNET_MATH_FAST);
 }
 
-void _linear(float* input, float* weights, float* bias, float* output,
-        int batch_size, int input_dim, int output_dim) {
+float _tanh(float x);
+inline float _tanh(float x) {
+    PufferMath mode = puffernet_math();
+    return mode == PUFFERNET_MATH_EXACT ? tanhf(x) : _tanh_poly(x, mode == PUFFERNET_MATH_FAST);
+}
+
+// Elementwise activations over arrays, dispatched per ISA like _linear
+typedef void (*ActivationKernel)(float* input, float* output, int size);
+
+void _exp_array_scalar(float* input, float* output, int size) {
+    for (int i = 0; i < size; i++) {
+        output[i] = _exp(input[i]);
+    }
+}
+
+void _sigmoid_array_scalar(float* input, float* output, int size) {
+    for (int i = 0; i < size; i++) {
+        output[i] = _sigmoid(input[i]);
+    }
+}
+
+void _tanh_array_scalar(float* input, float* output, int size) {
+    for (int i = 0; i < size; i++) {
+        output[i] = _tanh(input[i]);
+    }
+}
+
+void _gelu_scalar(float* input, float* output, int size) {
+    PufferMath mode = puffernet_math();
+    if (mode != PUFFERNET_MATH_EXACT) {
+        for (int i = 0; i < size; i++) {
+            output[i] = _gelu_poly(input[i], mode == PUFFERNET_MATH_FAST);
+        }
+        return;
+    }
+    for (int i = 0; i < size; i++) {
+        output[i] = 0.5f*input[i]*(1 + tanhf(0.7978845608028654 * (input[i] + 0.044715f*input[i]*input[i]*input[i])));
+    }
+}
+
+// What a linear kernel does after adding the bias. Activations are applied
+// to each tile of finished output rows while it is still in L1, instead of in
+// a separate pass over the whole output.
+typedef enum {
+    PUFFERNET_EPILOGUE_NONE,
+    PUFFERNET_EPILOGUE_ACCUMULATE,  // add to the existing output
+    PUFFERNET_EPILOGUE_RELU,
+    PUFFERNET_EPILOGUE_GELU,
+} PufferEpilogue;
+
+// Per-shape overrides of the blocking defaults below. puffernet_tune.h installs
+// a lookup that returns the tuned value for an op and shape, or 0 to keep the
+// default. Conv scratch sizes depend on the tuned tiles, so install it before
+// building any network and keep it for the network's lifetime.
+typedef enum {
+    PUFFERNET_TUNE_LINEAR_TILE,   // (batch, input, output) -> batch rows per tile
+    PUFFERNET_TUNE_SPARSE_TILE,   // (batch, input, output, blocks) -> batch rows per tile
+    PUFFERNET_TUNE_CONV_TILE,     // (in_channels, kernel, out_channels, patches) -> patches per tile
+    PUFFERNET_TUNE_POOL_SPLIT,    // (agents, threads) -> PUFFERNET_SPLIT_* (puffernet_pool.h)
+    PUFFERNET_TUNE_POOL_THREADS,  // (agents, max threads) -> threads
+    PUFFERNET_TUNE_NUM_OPS,
+} PufferTuneOp;
+
+typedef int (*PufferTuneLookup)(PufferTuneOp op, int d0, int d1, int d2, int d3);
+// Published atomically like the kernel table. Layers resolve their tiles from
+// it when they are built, so installing tuning only affects later builds
+static PufferTuneLookup puffernet_tune_lookup = NULL;
+#if defined(__GNUC__)
+    #define _PUFFERNET_LOAD_TUNING() __atomic_load_n(&puffernet_tune_lookup, __ATOMIC_ACQUIRE)
+    #define _PUFFERNET_STORE_TUNING(l) \
+        __atomic_store_n(&puffernet_tune_lookup, l, __ATOMIC_RELEASE)
+#else
+    #define _PUFFERNET_LOAD_TUNING() puffernet_tune_lookup
+    #define _PUFFERNET_STORE_TUNING(l) (puffernet_tune_lookup = (l))
+#endif
+
+// NULL restores the defaults
+void puffernet_set_tuning(PufferTuneLookup lookup) {
+    _PUFFERNET_STORE_TUNING(lookup);
+}
+
+PufferTuneLookup puffernet_tuning() {
+    return _PUFFERNET_LOAD_TUNING();
+}
+
+static inline int _puffernet_tuned(PufferTuneOp op, int d0, int d1, int d2, int d3, int fallback) {
+    PufferTuneLookup lookup = _PUFFERNET_LOAD_TUNING();
+    int value = lookup != NULL ? lookup(op, d0, d1, d2, d3) : 0;
+    return value > 0 ? value : fallback;
+}
+
+// Batch rows per tile of the blocked linear kernels
+#define PUFFERNET_LINEAR_TILE 16
+
+int _linear_tile(int batch_size, int input_dim, int output_dim) {
+    return _puffernet_tuned(PUFFERNET_TUNE_LINEAR_TILE, batch_size, input_dim, output_dim, 0,
+        PUFFERNET_LINEAR_TILE);
+}
+
+// Block-sparse layers are tuned on their own, keyed by the kept blocks too,
+// since the work per row depends on them rather than on the dense shape
+int _sparse_linear_tile(int batch_size, int input_dim, int output_dim, int num_blocks) {
+    return _puffernet_tuned(PUFFERNET_TUNE_SPARSE_TILE, batch_size, input_dim, output_dim,
+        num_blocks, PUFFERNET_LINEAR_TILE);
+}
+
+PUFFERNET_INLINE void _linear_activation(float* output, int size,
+        PufferEpilogue epilogue, ActivationKernel relu_fn, ActivationKernel gelu_fn) {
+    if (epilogue == PUFFERNET_EPILOGUE_RELU) {
+        relu_fn(output, output, size);
+    } else if (epilogue == PUFFERNET_EPILOGUE_GELU) {
+        gelu_fn(output, output, size);
+    }
+}
+
+// Reference implementation. The SIMD variants below reorder the summation
+// (and use FMA on AVX2/NEON), so they are not bit-identical to this path.
+// For every output they stay within
+//     |simd - scalar| <= 1e-6 * (|bias| + sum_i |input_i * weight_i|)
+// which is a few ulps per term for the layer sizes used by puffernet.
+void _linear_scalar(float* input, float* weights, float* bias, float* output,
+        int batch_size, int input_dim, int output_dim, PufferEpilogue epilogue, int tile_rows) {
     for (int b = 0; b < batch_size; b++) {
         for (int o = 0; o < output_dim; o++) {
             float sum = 0.0f;
             for (int i = 0; i < input_dim; i++)
                 sum += input[b*input_dim + i] * weights[o*input_dim + i];
-            output[b*output_dim + o] = sum + bias[o];
+            if (epilogue == PUFFERNET_EPILOGUE_ACCUMULATE) {
+                output[b*output_dim + o] += sum + bias[o];
+            } else {
+                output[b*output_dim + o] = sum + bias[o];
+            }
+        }
+        _linear_activation(output + b*output_dim, output_dim, epilogue, _relu, _gelu_scalar);
+    }
+}
+
+// Computes 4 dot products of x against consecutive weight rows w, w + ldw, ...
+typedef void (*Dot4Kernel)(float* x, float* w, int ldw, int n, float* out);
+typedef float (*Dot1Kernel)(float* x, float* w, int n);
+
+void _dot4_scalar(float* x, float* w, int ldw, int n, float* out) {
+    for (int k = 0; k < 4; k++) {
+        float sum = 0.0f;
+        for (int i = 0; i < n; i++)
+            sum += x[i] * w[k*ldw + i];
+        out[k] = sum;
+    }
+}
+
+float _dot1_scalar(float* x, float* w, int n) {
+    float sum = 0.0f;
+    for (int i = 0; i < n; i++)
+        sum += x[i] * w[i];
+    return sum;
+}
+
+// Shared GEMM driver. Each block of 4 weight rows stays in L1 while a tile of
+// tile_rows batch rows streams past it, then the epilogue runs on the finished
+// tile. It is inlined into every ISA wrapper so the dot kernels are inlined too
+// and compiled for that ISA.
+PUFFERNET_INLINE void _linear_blocked(
+        float* input, float* weights, float* bias, float* output,
+        int batch_size, int input_dim, int output_dim, PufferEpilogue epilogue, int tile_rows,
+        Dot4Kernel dot4, Dot1Kernel dot1, ActivationKernel relu_fn, ActivationKernel gelu_fn) {
+    bool accumulate = epilogue == PUFFERNET_EPILOGUE_ACCUMULATE;
+    int blocked = output_dim & ~3;
+    for (int b0 = 0; b0 < batch_size; b0 += tile_rows) {
+        int b1 = b0 + tile_rows < batch_size ? b0 + tile_rows : batch_size;
+        for (int o = 0; o < blocked; o += 4) {
+            float* w = weights + o*input_dim;
+            for (int b = b0; b < b1; b++) {
+                float sums[4];
+                dot4(input + b*input_dim, w, input_dim, input_dim, sums);
+                float* out = output + b*output_dim + o;
+                for (int k = 0; k < 4; k++) {
+                    out[k] = accumulate ? out[k] + sums[k] + bias[o + k] : sums[k] + bias[o + k];
+                }
+            }
+        }
+        for (int o = blocked; o < output_dim; o++) {
+            float* w = weights + o*input_dim;
+            for (int b = b0; b < b1; b++) {
+                float sum = dot1(input + b*input_dim, w, input_dim);
+                float* out = output + b*output_dim + o;
+                *out = accumulate ? *out + sum + bias[o] : sum + bias[o];
+            }
+        }
+        _linear_activation(output + b0*output_dim, (b1 - b0)*output_dim, epilogue,
+            relu_fn, gelu_fn);
+    }
+}
+
+#define PUFFERNET_LSTM_BLOCK 8
+
+// Writes [x, h] for every batch row into buffer ([batch x (I+H)])
+void _lstm_concat(float* input, float* state_h, float* buffer,
+        int batch_size, int input_size, int hidden_size) {
+    int cat_size = input_size + hidden_size;
+    for (int b = 0; b < batch_size; b++) {
+        memcpy(buffer + b*cat_size, input + b*input_size, input_size*sizeof(float));
+        memcpy(buffer + b*cat_size + input_size, state_h + b*hidden_size,
+            hidden_size*sizeof(float));
+    }
+}
+
+// Single pass LSTM cell over packed weights (see _lstm_pack_weights). For each
+// block of hidden units the gate pre-activations, activations and state update
+// are computed while the gates are still in registers. buffer holds the
+// concatenated [x, h] from _lstm_concat. Only units [unit_start, unit_end) are
+// updated so callers can split a cell across threads. Inlined per ISA like
+// _linear_blocked, together with that ISA's activations.
+PUFFERNET_INLINE void _lstm_gates(float* gates, float* gate_bias, float* h, float* c,
+        int block, ActivationKernel sigmoid_fn, ActivationKernel tanh_fn) {
+    // Sigmoid over every gate (the cell gate lanes are unused) and tanh over
+    // the cell gates, each as one vector call
+    float act[4*PUFFERNET_LSTM_BLOCK];
+    float g[PUFFERNET_LSTM_BLOCK];
+    for (int k = 0; k < 4*block; k++) {
+        gates[k] += gate_bias[k];
+    }
+    for (int j = 0; j < block; j++) {
+        g[j] = gates[4*j + 2];
+    }
+    sigmoid_fn(gates, act, 4*block);
+    tanh_fn(g, g, block);
+    for (int j = 0; j < block; j++) {
+        c[j] = act[4*j + 1]*c[j] + act[4*j]*g[j];
+    }
+    tanh_fn(c, g, block);
+    for (int j = 0; j < block; j++) {
+        h[j] = act[4*j + 3]*g[j];
+    }
+}
+
+PUFFERNET_INLINE void _lstm_fused_blocked(float* buffer, float* state_h, float* state_c,
+        float* weights, float* bias, int batch_size, int input_size,
+        int hidden_size, int unit_start, int unit_end, Dot4Kernel dot4,
+        ActivationKernel sigmoid_fn, ActivationKernel tanh_fn) {
+    int cat_size = input_size + hidden_size;
+    for (int j0 = unit_start; j0 < unit_end; j0 += PUFFERNET_LSTM_BLOCK) {
+        int block = unit_end - j0;
+        if (block > PUFFERNET_LSTM_BLOCK) {
+            block = PUFFERNET_LSTM_BLOCK;
+        }
+        for (int b = 0; b < batch_size; b++) {
+            float gates[4*PUFFERNET_LSTM_BLOCK];
+            float* xh = buffer + b*cat_size;
+            for (int j = 0; j < block; j++) {
+                int row = 4*(j0 + j);
+                dot4(xh, weights + row*cat_size, cat_size, cat_size, &gates[4*j]);
+            }
+            _lstm_gates(gates, bias + 4*j0, state_h + b*hidden_size + j0,
+                state_c + b*hidden_size + j0, block, sigmoid_fn, tanh_fn);
+        }
+    }
+}
+
+typedef void (*LSTMKernel)(float* buffer, float* state_h, float* state_c,
+        float* weights, float* bias, int batch_size, int input_size,
+        int hidden_size, int unit_start, int unit_end);
+
+void _lstm_fused_scalar(float* buffer, float* state_h, float* state_c, float* weights,
+        float* bias, int batch_size, int input_size, int hidden_size,
+        int unit_start, int unit_end) {
+    _lstm_fused_blocked(buffer, state_h, state_c, weights, bias, batch_size,
+        input_size, hidden_size, unit_start, unit_end, _dot4_scalar,
+        _sigmoid_array_scalar, _tanh_array_scalar);
+}
+
+// Column panels for large-batch GEMMs. The weights are transposed into panels
+// of PUFFERNET_PANEL outputs, [panel][input][PUFFERNET_PANEL], so a kernel
+// broadcasts one input and multiplies it into whole output vectors: no
+// horizontal sums, and every weight load feeds several batch rows. The panel
+// count is padded with zero panels to a multiple of PUFFERNET_PANEL_GROUP, the
+// panels a single batch row runs at once. Each output is accumulated in input
+// order by one FMA chain, so a row's result does not depend on the batch size.
+#define PUFFERNET_PANEL 16
+#define PUFFERNET_PANEL_GROUP 4
+
+int panel_count(int output_dim) {
+    int panels = (output_dim + PUFFERNET_PANEL - 1)/PUFFERNET_PANEL;
+    return (panels + PUFFERNET_PANEL_GROUP - 1)/PUFFERNET_PANEL_GROUP*PUFFERNET_PANEL_GROUP;
+}
+
+size_t panel_size(int input_dim, int output_dim) {
+    return (size_t)panel_count(output_dim)*input_dim*PUFFERNET_PANEL*sizeof(float);
+}
+
+// weights is [output_dim x input_dim], panels is panel_size bytes
+void pack_panels(float* weights, int output_dim, int input_dim, float* panels) {
+    int num_panels = panel_count(output_dim);
+    for (int p = 0; p < num_panels; p++) {
+        for (int k = 0; k < input_dim; k++) {
+            float* dst = panels + ((size_t)p*input_dim + k)*PUFFERNET_PANEL;
+            for (int j = 0; j < PUFFERNET_PANEL; j++) {
+                int o = p*PUFFERNET_PANEL + j;
+                dst[j] = o < output_dim ? weights[(size_t)o*input_dim + k] : 0.0f;
+            }
+        }
+    }
+}
+
+// rows batch rows of x (stride ldx) times one panel into acc [rows x PANEL]
+typedef void (*PanelTileKernel)(float* x, int ldx, float* w, int n, float* acc);
+// One batch row times a fixed number of consecutive panels
+typedef void (*PanelRowKernel)(float* x, float* w, int n, float* acc);
+
+PUFFERNET_INLINE void _panel_store(float* acc, float* bias, float* out, int count,
+        bool accumulate) {
+    for (int j = 0; j < count; j++) {
+        out[j] = accumulate ? out[j] + acc[j] + bias[j] : acc[j] + bias[j];
+    }
+}
+
+// Batch rows in tiles of tile_rows against one panel at a time, the leftover
+// rows one by one against row_panels panels at a time. Both counts are
+// literals in every ISA wrapper so the kernels inline with fixed shapes
+PUFFERNET_INLINE void _linear_panels_blocked(float* input, float* panels, float* bias,
+        float* output, int batch_size, int input_dim, int output_dim, PufferEpilogue epilogue,
+        int tile_rows, PanelTileKernel tile, int row_panels, PanelRowKernel row,
+        ActivationKernel relu_fn, ActivationKernel gelu_fn) {
+    bool accumulate = epilogue == PUFFERNET_EPILOGUE_ACCUMULATE;
+    int num_panels = panel_count(output_dim);
+    size_t stride = (size_t)input_dim*PUFFERNET_PANEL;
+    float acc[PUFFERNET_PANEL_GROUP*PUFFERNET_PANEL];
+    int b = 0;
+    for (; b + tile_rows <= batch_size; b += tile_rows) {
+        for (int p = 0; p*PUFFERNET_PANEL < output_dim; p++) {
+            int o = p*PUFFERNET_PANEL;
+            int count = output_dim - o < PUFFERNET_PANEL ? output_dim - o : PUFFERNET_PANEL;
+            tile(input + b*input_dim, input_dim, panels + p*stride, input_dim, acc);
+            for (int r = 0; r < tile_rows; r++) {
+                _panel_store(acc + r*PUFFERNET_PANEL, bias + o,
+                    output + (b + r)*output_dim + o, count, accumulate);
+            }
+        }
+        _linear_activation(output + b*output_dim, tile_rows*output_dim, epilogue,
+            relu_fn, gelu_fn);
+    }
+    for (; b < batch_size; b++) {
+        for (int p = 0; p < num_panels && p*PUFFERNET_PANEL < output_dim; p += row_panels) {
+            row(input + b*input_dim, panels + p*stride, input_dim, acc);
+            for (int q = 0; q < row_panels && (p + q)*PUFFERNET_PANEL < output_dim; q++) {
+                int o = (p + q)*PUFFERNET_PANEL;
+                int count = output_dim - o < PUFFERNET_PANEL ? output_dim - o : PUFFERNET_PANEL;
+                _panel_store(acc + q*PUFFERNET_PANEL, bias + o, output + b*output_dim + o,
+                    count, accumulate);
+            }
+        }
+        _linear_activation(output + b*output_dim, output_dim, epilogue, relu_fn, gelu_fn);
+    }
+}
+
+typedef void (*PanelLinearKernel)(float* input, float* panels, float* bias, float* output,
+        int batch_size, int input_dim, int output_dim, PufferEpilogue epilogue);
+
+static inline void _panel_tile_scalar(float* x, int ldx, float* w, int n, float* acc) {
+    memset(acc, 0, 4*PUFFERNET_PANEL*sizeof(float));
+    for (int k = 0; k < n; k++) {
+        float* wk = w + k*PUFFERNET_PANEL;
+        for (int r = 0; r < 4; r++) {
+            float xk = x[r*ldx + k];
+            for (int j = 0; j < PUFFERNET_PANEL; j++) {
+                acc[r*PUFFERNET_PANEL + j] += xk*wk[j];
+            }
+        }
+    }
+}
+
+static inline void _panel_row_scalar(float* x, float* w, int n, float* acc) {
+    memset(acc, 0, PUFFERNET_PANEL*sizeof(float));
+    for (int k = 0; k < n; k++) {
+        for (int j = 0; j < PUFFERNET_PANEL; j++) {
+            acc[j] += x[k]*w[k*PUFFERNET_PANEL + j];
+        }
+    }
+}
+
+void _linear_panels_scalar(float* input, float* panels, float* bias, float* output,
+        int batch_size, int input_dim, int output_dim, PufferEpilogue epilogue) {
+    _linear_panels_blocked(input, panels, bias, output, batch_size, input_dim, output_dim,
+        epilogue, 4, _panel_tile_scalar, 1, _panel_row_scalar, _relu, _gelu_scalar);
+}
+
+// Block-sparse (BSR) weights for pruned layers. Rows are grouped by 4 and each
+// group keeps only the 4 x PUFFERNET_SPARSE_COLS blocks that hold a nonzero
+// weight. Blocks start on a multiple of PUFFERNET_SPARSE_COLS and store their
+// values as [row][col]; rows and columns past the matrix are zero. A group of
+// the fused LSTM matrix is exactly one hidden unit (see _lstm_pack_weights).
+#define PUFFERNET_SPARSE_COLS 8
+#define PUFFERNET_SPARSE_BLOCK (4*PUFFERNET_SPARSE_COLS)
+
+typedef struct BlockSparse BlockSparse;
+struct BlockSparse {
+    int32_t* block_ptr;
+    int32_t* block_col;
+    float* values;
+    int rows;
+    int cols;
+};
+
+int block_sparse_groups(int rows) {
+    return (rows + 3)/4;
+}
+
+int block_sparse_num_blocks(BlockSparse* weights) {
+    return weights->block_ptr[block_sparse_groups(weights->rows)];
+}
+
+// Weights with |w| <= threshold are pruned. A block is kept if any weight in
+// it survives, so threshold 0 only drops blocks that are already all zero.
+bool _block_sparse_keep(float* dense, int rows, int cols, float threshold, int row, int col) {
+    for (int r = row; r < row + 4 && r < rows; r++) {
+        for (int c = col; c < col + PUFFERNET_SPARSE_COLS && c < cols; c++) {
+            if (fabsf(dense[r*cols + c]) > threshold) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+int block_sparse_count(float* dense, int rows, int cols, float threshold) {
+    int num_blocks = 0;
+    for (int row = 0; row < rows; row += 4) {
+        for (int col = 0; col < cols; col += PUFFERNET_SPARSE_COLS) {
+            num_blocks += _block_sparse_keep(dense, rows, cols, threshold, row, col);
+        }
+    }
+    return num_blocks;
+}
+
+// Fills block_ptr (groups + 1), block_col and values (block_sparse_count blocks)
+void block_sparse_pack(float* dense, int rows, int cols, float threshold, BlockSparse* output) {
+    int n = 0;
+    output->rows = rows;
+    output->cols = cols;
+    for (int row = 0; row < rows; row += 4) {
+        output->block_ptr[row/4] = n;
+        for (int col = 0; col < cols; col += PUFFERNET_SPARSE_COLS) {
+            if (!_block_sparse_keep(dense, rows, cols, threshold, row, col)) {
+                continue;
+            }
+            float* v = output->values + n*PUFFERNET_SPARSE_BLOCK;
+            memset(v, 0, PUFFERNET_SPARSE_BLOCK*sizeof(float));
+            for (int r = row; r < row + 4 && r < rows; r++) {
+                for (int c = col; c < col + PUFFERNET_SPARSE_COLS && c < cols; c++) {
+                    float w = dense[r*cols + c];
+                    v[(r - row)*PUFFERNET_SPARSE_COLS + c - col] = fabsf(w) > threshold ? w : 0.0f;
+                }
+            }
+            output->block_col[n++] = col;
+        }
+    }
+    output->block_ptr[block_sparse_groups(rows)] = n;
+}
+
+// Computes the 4 rows of one group against x. The x2 variants do two batch
+// rows per pass so each weight block is loaded once for both.
+typedef void (*SparseDot4Kernel)(float* x, float* values, int32_t* block_col,
+        int num_blocks, int cols, float* out);
+typedef void (*SparseDot4x2Kernel)(float* x0, float* x1, float* values, int32_t* block_col,
+        int num_blocks, int cols, float* out0, float* out1);
+
+void _sparse_dot4_scalar(float* x, float* values, int32_t* block_col,
+        int num_blocks, int cols, float* out) {
+    out[0] = out[1] = out[2] = out[3] = 0.0f;
+    for (int k = 0; k < num_blocks; k++) {
+        int c = block_col[k];
+        int n = cols - c < PUFFERNET_SPARSE_COLS ? cols - c : PUFFERNET_SPARSE_COLS;
+        float* v = values + k*PUFFERNET_SPARSE_BLOCK;
+        for (int r = 0; r < 4; r++)
+            for (int i = 0; i < n; i++)
+                out[r] += x[c + i]*v[r*PUFFERNET_SPARSE_COLS + i];
+    }
+}
+
+void _sparse_dot4x2_scalar(float* x0, float* x1, float* values, int32_t* block_col,
+        int num_blocks, int cols, float* out0, float* out1) {
+    _sparse_dot4_scalar(x0, values, block_col, num_blocks, cols, out0);
+    _sparse_dot4_scalar(x1, values, block_col, num_blocks, cols, out1);
+}
+
+// The last block of a row may run past the input. Its weights are zero
+// there, but the input must not be read out of bounds
+PUFFERNET_INLINE float* _sparse_x(float* x, int col, int cols, float* tail) {
+    if (col + PUFFERNET_SPARSE_COLS <= cols) {
+        return x + col;
+    }
+    memset(tail, 0, PUFFERNET_SPARSE_COLS*sizeof(float));
+    memcpy(tail, x + col, (cols - col)*sizeof(float));
+    return tail;
+}
+
+// Same tiling and epilogue as _linear_blocked over the kept blocks only
+PUFFERNET_INLINE void _sparse_linear_blocked(float* input, BlockSparse* weights,
+        float* bias, float* output, int batch_size, PufferEpilogue epilogue, int tile,
+        SparseDot4Kernel dot4, SparseDot4x2Kernel dot4x2,
+        ActivationKernel relu_fn, ActivationKernel gelu_fn) {
+    bool accumulate = epilogue == PUFFERNET_EPILOGUE_ACCUMULATE;
+    int input_dim = weights->cols;
+    int output_dim = weights->rows;
+    int groups = block_sparse_groups(output_dim);
+    for (int b0 = 0; b0 < batch_size; b0 += tile) {
+        int b1 = b0 + tile < batch_size ? b0 + tile : batch_size;
+        for (int g = 0; g < groups; g++) {
+            int first = weights->block_ptr[g];
+            int num_blocks = weights->block_ptr[g + 1] - first;
+            float* values = weights->values + first*PUFFERNET_SPARSE_BLOCK;
+            int32_t* block_col = weights->block_col + first;
+            int o = 4*g;
+            int rows = output_dim - o < 4 ? output_dim - o : 4;
+            for (int b = b0; b < b1; b += 2) {
+                float sums[2][4];
+                int pair = b + 1 < b1 ? 2 : 1;
+                if (pair == 2) {
+                    dot4x2(input + b*input_dim, input + (b + 1)*input_dim, values,
+                        block_col, num_blocks, input_dim, sums[0], sums[1]);
+                } else {
+                    dot4(input + b*input_dim, values, block_col, num_blocks, input_dim, sums[0]);
+                }
+                for (int p = 0; p < pair; p++) {
+                    float* out = output + (b + p)*output_dim + o;
+                    for (int k = 0; k < rows; k++) {
+                        out[k] = accumulate ? out[k] + sums[p][k] + bias[o + k]
+                            : sums[p][k] + bias[o + k];
+                    }
+                }
+            }
+        }
+        _linear_activation(output + b0*output_dim, (b1 - b0)*output_dim, epilogue,
+            relu_fn, gelu_fn);
+    }
+}
+
+// _lstm_fused_blocked over a block-sparse fused matrix, one group per unit
+PUFFERNET_INLINE void _lstm_sparse_blocked(float* buffer, float* state_h, float* state_c,
+        BlockSparse* weights, float* bias, int batch_size, int input_size,
+        int hidden_size, int unit_start, int unit_end, SparseDot4Kernel dot4,
+        ActivationKernel sigmoid_fn, ActivationKernel tanh_fn) {
+    int cat_size = input_size + hidden_size;
+    for (int j0 = unit_start; j0 < unit_end; j0 += PUFFERNET_LSTM_BLOCK) {
+        int block = unit_end - j0;
+        if (block > PUFFERNET_LSTM_BLOCK) {
+            block = PUFFERNET_LSTM_BLOCK;
+        }
+        for (int b = 0; b < batch_size; b++) {
+            float gates[4*PUFFERNET_LSTM_BLOCK];
+            float* xh = buffer + b*cat_size;
+            for (int j = 0; j < block; j++) {
+                int first = weights->block_ptr[j0 + j];
+                dot4(xh, weights->values + first*PUFFERNET_SPARSE_BLOCK,
+                    weights->block_col + first, weights->block_ptr[j0 + j + 1] - first,
+                    cat_size, &gates[4*j]);
+            }
+            _lstm_gates(gates, bias + 4*j0, state_h + b*hidden_size + j0,
+                state_c + b*hidden_size + j0, block, sigmoid_fn, tanh_fn);
+        }
+    }
+}
+
+typedef void (*SparseLinearKernel)(float* input, BlockSparse* weights, float* bias,
+        float* output, int batch_size, PufferEpilogue epilogue, int tile_rows);
+typedef void (*SparseLSTMKernel)(float* buffer, float* state_h, float* state_c,
+        BlockSparse* weights, float* bias, int batch_size, int input_size,
+        int hidden_size, int unit_start, int unit_end);
+
+void _sparse_linear_scalar(float* input, BlockSparse* weights, float* bias,
+        float* output, int batch_size, PufferEpilogue epilogue, int tile_rows) {
+    _sparse_linear_blocked(input, weights, bias, output, batch_size, epilogue, tile_rows,
+        _sparse_dot4_scalar, _sparse_dot4x2_scalar, _relu, _gelu_scalar);
+}
+
+void _lstm_sparse_scalar(float* buffer, float* state_h, float* state_c,
+        BlockSparse* weights, float* bias, int batch_size, int input_size,
+        int hidden_size, int unit_start, int unit_end) {
+    _lstm_sparse_blocked(buffer, state_h, state_c, weights, bias, batch_size,
+        input_size, hidden_size, unit_start, unit_end, _sparse_dot4_scalar,
+        _sigmoid_array_scalar, _tanh_array_scalar);
+}
+
+#ifdef PUFFERNET_X86
+PUFFERNET_TARGET("sse4.1")
+static inline void _dot4_sse41(float* x, float* w, int ldw, int n, float* out) {
+    float* w0 = w;
+    float* w1 = w + ldw;
+    float* w2 = w + 2*ldw;
+    float* w3 = w + 3*ldw;
+    __m128 a0 = _mm_setzero_ps(), a1 = _mm_setzero_ps();
+    __m128 a2 = _mm_setzero_ps(), a3 = _mm_setzero_ps();
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128 xv = _mm_loadu_ps(x + i);
+        a0 = _mm_add_ps(a0, _mm_mul_ps(xv, _mm_loadu_ps(w0 + i)));
+        a1 = _mm_add_ps(a1, _mm_mul_ps(xv, _mm_loadu_ps(w1 + i)));
+        a2 = _mm_add_ps(a2, _mm_mul_ps(xv, _mm_loadu_ps(w2 + i)));
+        a3 = _mm_add_ps(a3, _mm_mul_ps(xv, _mm_loadu_ps(w3 + i)));
+    }
+    __m128 s = _mm_hadd_ps(_mm_hadd_ps(a0, a1), _mm_hadd_ps(a2, a3));
+    _mm_storeu_ps(out, s);
+    for (; i < n; i++) {
+        out[0] += x[i]*w0[i];
+        out[1] += x[i]*w1[i];
+        out[2] += x[i]*w2[i];
+        out[3] += x[i]*w3[i];
+    }
+}
+
+PUFFERNET_TARGET("sse4.1")
+static inline float _dot1_sse41(float* x, float* w, int n) {
+    __m128 acc = _mm_setzero_ps();
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(x + i), _mm_loadu_ps(w + i)));
+    }
+    acc = _mm_hadd_ps(acc, acc);
+    acc = _mm_hadd_ps(acc, acc);
+    float sum = _mm_cvtss_f32(acc);
+    for (; i < n; i++) {
+        sum += x[i]*w[i];
+    }
+    return sum;
+}
+
+// fmaxf does not vectorize without -ffast-math, so the epilogues get their own
+PUFFERNET_TARGET("sse4.1")
+void _relu_sse41(float* input, float* output, int size) {
+    int i = 0;
+    for (; i + 4 <= size; i += 4) {
+        _mm_storeu_ps(output + i, _mm_max_ps(_mm_loadu_ps(input + i), _mm_setzero_ps()));
+    }
+    _relu(input + i, output + i, size - i);
+}
+
+PUFFERNET_TARGET("sse4.1")
+void _linear_sse41(float* input, float* weights, float* bias, float* output,
+        int batch_size, int input_dim, int output_dim, PufferEpilogue epilogue, int tile_rows) {
+    _linear_blocked(input, weights, bias, output, batch_size, input_dim,
+        output_dim, epilogue, tile_rows,
+        _dot4_sse41, _dot1_sse41, _relu_sse41, _gelu_scalar);
+}
+
+PUFFERNET_TARGET("sse4.1")
+void _lstm_fused_sse41(float* buffer, float* state_h, float* state_c, float* weights,
+        float* bias, int batch_size, int input_size, int hidden_size,
+        int unit_start, int unit_end) {
+    _lstm_fused_blocked(buffer, state_h, state_c, weights, bias, batch_size,
+        input_size, hidden_size, unit_start, unit_end, _dot4_sse41,
+        _sigmoid_array_scalar, _tanh_array_scalar);
+}
+
+// Two rows of one panel, or one row of two panels: 8 accumulators either way
+PUFFERNET_TARGET("sse4.1")
+static inline void _panel_tile_sse41(float* x, int ldx, float* w, int n, float* acc) {
+    __m128 a0 = _mm_setzero_ps(), a1 = _mm_setzero_ps(), a2 = _mm_setzero_ps();
+    __m128 a3 = _mm_setzero_ps(), b0 = _mm_setzero_ps(), b1 = _mm_setzero_ps();
+    __m128 b2 = _mm_setzero_ps(), b3 = _mm_setzero_ps();
+    for (int k = 0; k < n; k++) {
+        float* wk = w + k*PUFFERNET_PANEL;
+        __m128 x0 = _mm_set1_ps(x[k]);
+        __m128 x1 = _mm_set1_ps(x[ldx + k]);
+        __m128 w0 = _mm_loadu_ps(wk);
+        __m128 w1 = _mm_loadu_ps(wk + 4);
+        __m128 w2 = _mm_loadu_ps(wk + 8);
+        __m128 w3 = _mm_loadu_ps(wk + 12);
+        a0 = _mm_add_ps(a0, _mm_mul_ps(x0, w0));
+        a1 = _mm_add_ps(a1, _mm_mul_ps(x0, w1));
+        a2 = _mm_add_ps(a2, _mm_mul_ps(x0, w2));
+        a3 = _mm_add_ps(a3, _mm_mul_ps(x0, w3));
+        b0 = _mm_add_ps(b0, _mm_mul_ps(x1, w0));
+        b1 = _mm_add_ps(b1, _mm_mul_ps(x1, w1));
+        b2 = _mm_add_ps(b2, _mm_mul_ps(x1, w2));
+        b3 = _mm_add_ps(b3, _mm_mul_ps(x1, w3));
+    }
+    _mm_storeu_ps(acc, a0);
+    _mm_storeu_ps(acc + 4, a1);
+    _mm_storeu_ps(acc + 8, a2);
+    _mm_storeu_ps(acc + 12, a3);
+    _mm_storeu_ps(acc + 16, b0);
+    _mm_storeu_ps(acc + 20, b1);
+    _mm_storeu_ps(acc + 24, b2);
+    _mm_storeu_ps(acc + 28, b3);
+}
+
+PUFFERNET_TARGET("sse4.1")
+static inline void _panel_row_sse41(float* x, float* w, int n, float* acc) {
+    float* v = w + n*PUFFERNET_PANEL;
+    __m128 a0 = _mm_setzero_ps(), a1 = _mm_setzero_ps(), a2 = _mm_setzero_ps();
+    __m128 a3 = _mm_setzero_ps(), b0 = _mm_setzero_ps(), b1 = _mm_setzero_ps();
+    __m128 b2 = _mm_setzero_ps(), b3 = _mm_setzero_ps();
+    for (int k = 0; k < n; k++) {
+        float* wk = w + k*PUFFERNET_PANEL;
+        float* vk = v + k*PUFFERNET_PANEL;
+        __m128 xk = _mm_set1_ps(x[k]);
+        a0 = _mm_add_ps(a0, _mm_mul_ps(xk, _mm_loadu_ps(wk)));
+        a1 = _mm_add_ps(a1, _mm_mul_ps(xk, _mm_loadu_ps(wk + 4)));
+        a2 = _mm_add_ps(a2, _mm_mul_ps(xk, _mm_loadu_ps(wk + 8)));
+        a3 = _mm_add_ps(a3, _mm_mul_ps(xk, _mm_loadu_ps(wk + 12)));
+        b0 = _mm_add_ps(b0, _mm_mul_ps(xk, _mm_loadu_ps(vk)));
+        b1 = _mm_add_ps(b1, _mm_mul_ps(xk, _mm_loadu_ps(vk + 4)));
+        b2 = _mm_add_ps(b2, _mm_mul_ps(xk, _mm_loadu_ps(vk + 8)));
+        b3 = _mm_add_ps(b3, _mm_mul_ps(xk, _mm_loadu_ps(vk + 12)));
+    }
+    _mm_storeu_ps(acc, a0);
+    _mm_storeu_ps(acc + 4, a1);
+    _mm_storeu_ps(acc + 8, a2);
+    _mm_storeu_ps(acc + 12, a3);
+    _mm_storeu_ps(acc + 16, b0);
+    _mm_storeu_ps(acc + 20, b1);
+    _mm_storeu_ps(acc + 24, b2);
+    _mm_storeu_ps(acc + 28, b3);
+}
+
+PUFFERNET_TARGET("sse4.1")
+void _linear_panels_sse41(float* input, float* panels, float* bias, float* output,
+        int batch_size, int input_dim, int output_dim, PufferEpilogue epilogue) {
+    _linear_panels_blocked(input, panels, bias, output, batch_size, input_dim, output_dim,
+        epilogue, 2, _panel_tile_sse41, 2, _panel_row_sse41, _relu_sse41, _gelu_scalar);
+}
+
+// A block is two 4-wide halves per row
+PUFFERNET_TARGET("sse4.1")
+static inline void _sparse_dot4_sse41(float* x, float* values, int32_t* block_col,
+        int num_blocks, int cols, float* out) {
+    __m128 a0 = _mm_setzero_ps(), a1 = _mm_setzero_ps();
+    __m128 a2 = _mm_setzero_ps(), a3 = _mm_setzero_ps();
+    for (int k = 0; k < num_blocks; k++) {
+        float tail[PUFFERNET_SPARSE_COLS];
+        float* xk = _sparse_x(x, block_col[k], cols, tail);
+        float* v = values + k*PUFFERNET_SPARSE_BLOCK;
+        __m128 lo = _mm_loadu_ps(xk);
+        __m128 hi = _mm_loadu_ps(xk + 4);
+        a0 = _mm_add_ps(a0, _mm_add_ps(_mm_mul_ps(lo, _mm_loadu_ps(v)), _mm_mul_ps(hi, _mm_loadu_ps(v + 4))));
+        a1 = _mm_add_ps(a1, _mm_add_ps(_mm_mul_ps(lo, _mm_loadu_ps(v + 8)), _mm_mul_ps(hi, _mm_loadu_ps(v + 12))));
+        a2 = _mm_add_ps(a2, _mm_add_ps(_mm_mul_ps(lo, _mm_loadu_ps(v + 16)), _mm_mul_ps(hi, _mm_loadu_ps(v + 20))));
+        a3 = _mm_add_ps(a3, _mm_add_ps(_mm_mul_ps(lo, _mm_loadu_ps(v + 24)), _mm_mul_ps(hi, _mm_loadu_ps(v + 28))));
+    }
+    _mm_storeu_ps(out, _mm_hadd_ps(_mm_hadd_ps(a0, a1), _mm_hadd_ps(a2, a3)));
+}
+
+PUFFERNET_TARGET("sse4.1")
+static inline void _sparse_dot4x2_sse41(float* x0, float* x1, float* values, int32_t* block_col,
+        int num_blocks, int cols, float* out0, float* out1) {
+    __m128 a[8];
+    for (int r = 0; r < 8; r++) {
+        a[r] = _mm_setzero_ps();
+    }
+    for (int k = 0; k < num_blocks; k++) {
+        float tail0[PUFFERNET_SPARSE_COLS], tail1[PUFFERNET_SPARSE_COLS];
+        float* xk0 = _sparse_x(x0, block_col[k], cols, tail0);
+        float* xk1 = _sparse_x(x1, block_col[k], cols, tail1);
+        __m128 lo0 = _mm_loadu_ps(xk0), hi0 = _mm_loadu_ps(xk0 + 4);
+        __m128 lo1 = _mm_loadu_ps(xk1), hi1 = _mm_loadu_ps(xk1 + 4);
+        float* v = values + k*PUFFERNET_SPARSE_BLOCK;
+        for (int r = 0; r < 4; r++) {
+            __m128 wlo = _mm_loadu_ps(v + r*PUFFERNET_SPARSE_COLS);
+            __m128 whi = _mm_loadu_ps(v + r*PUFFERNET_SPARSE_COLS + 4);
+            a[r] = _mm_add_ps(a[r], _mm_add_ps(_mm_mul_ps(lo0, wlo), _mm_mul_ps(hi0, whi)));
+            a[4 + r] = _mm_add_ps(a[4 + r], _mm_add_ps(_mm_mul_ps(lo1, wlo), _mm_mul_ps(hi1, whi)));
         }
     }
+    _mm_storeu_ps(out0, _mm_hadd_ps(_mm_hadd_ps(a[0], a[1]), _mm_hadd_ps(a[2], a[3])));
+    _mm_storeu_ps(out1, _mm_hadd_ps(_mm_hadd_ps(a[4], a[5]), _mm_hadd_ps(a[6], a[7])));
+}
+
+PUFFERNET_TARGET("sse4.1")
+void _sparse_linear_sse41(float* input, BlockSparse* weights, float* bias,
+        float* output, int batch_size, PufferEpilogue epilogue, int tile_rows) {
+    _sparse_linear_blocked(input, weights, bias, output, batch_size, epilogue, tile_rows,
+        _sparse_dot4_sse41, _sparse_dot4x2_sse41, _relu_sse41, _gelu_scalar);
+}
+
+PUFFERNET_TARGET("sse4.1")
+void _lstm_sparse_sse41(float* buffer, float* state_h, float* state_c,
+        BlockSparse* weights, float* bias, int batch_size, int input_size,
+        int hidden_size, int unit_start, int unit_end) {
+    _lstm_sparse_blocked(buffer, state_h, state_c, weights, bias, batch_size,
+        input_size, hidden_size, unit_start, unit_end, _sparse_dot4_sse41,
+        _sigmoid_array_scalar, _tanh_array_scalar);
+}
+
+PUFFERNET_TARGET("avx2,fma")
+static inline void _dot4_avx2(float* x, float* w, int ldw, int n, float* out) {
+    float* w0 = w;
+    float* w1 = w + ldw;
+    float* w2 = w + 2*ldw;
+    float* w3 = w + 3*ldw;
+    __m256 a0 = _mm256_setzero_ps(), a1 = _mm256_setzero_ps();
+    __m256 a2 = _mm256_setzero_ps(), a3 = _mm256_setzero_ps();
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 xv = _mm256_loadu_ps(x + i);
+        a0 = _mm256_fmadd_ps(xv, _mm256_loadu_ps(w0 + i), a0);
+        a1 = _mm256_fmadd_ps(xv, _mm256_loadu_ps(w1 + i), a1);
+        a2 = _mm256_fmadd_ps(xv, _mm256_loadu_ps(w2 + i), a2);
+        a3 = _mm256_fmadd_ps(xv, _mm256_loadu_ps(w3 + i), a3);
+    }
+    // Transpose-reduce: lane k of s holds the full sum of a_k
+    __m256 s = _mm256_hadd_ps(_mm256_hadd_ps(a0, a1), _mm256_hadd_ps(a2, a3));
+    __m128 r = _mm_add_ps(_mm256_castps256_ps128(s), _mm256_extractf128_ps(s, 1));
+    _mm_storeu_ps(out, r);
+    for (; i < n; i++) {
+        out[0] += x[i]*w0[i];
+        out[1] += x[i]*w1[i];
+        out[2] += x[i]*w2[i];
+        out[3] += x[i]*w3[i];
+    }
+}
+
+PUFFERNET_TARGET("avx2,fma")
+static inline float _dot1_avx2(float* x, float* w, int n) {
+    __m256 acc = _mm256_setzero_ps();
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        acc = _mm256_fmadd_ps(_mm256_loadu_ps(x + i), _mm256_loadu_ps(w + i), acc);
+    }
+    __m128 r = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+    r = _mm_hadd_ps(r, r);
+    r = _mm_hadd_ps(r, r);
+    float sum = _mm_cvtss_f32(r);
+    for (; i < n; i++) {
+        sum += x[i]*w[i];
+    }
+    return sum;
+}
+
+// Vector forms of _exp_poly and friends. The fast mode also swaps the
+// divisions for the hardware reciprocal estimate (~4e-4 relative error).
+PUFFERNET_TARGET("avx2,fma")
+static inline __m256 _exp_avx2(__m256 x, bool fast) {
+    x = _mm256_min_ps(_mm256_max_ps(x, _mm256_set1_ps(PUFFERNET_EXP_MIN)),
+        _mm256_set1_ps(PUFFERNET_EXP_MAX));
+    __m256 n = _mm256_round_ps(_mm256_mul_ps(x, _mm256_set1_ps(PUFFERNET_LOG2E)),
+        _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    __m256 r = _mm256_fnmadd_ps(n, _mm256_set1_ps(PUFFERNET_LN2_HI), x);
+    r = _mm256_fnmadd_ps(n, _mm256_set1_ps(PUFFERNET_LN2_LO), r);
+    __m256 p;
+    if (fast) {
+        p = _mm256_fmadd_ps(_mm256_set1_ps(1.6708603e-1f), r, _mm256_set1_ps(5.0414018e-1f));
+    } else {
+        p = _mm256_fmadd_ps(_mm256_set1_ps(1.9875691500e-4f), r, _mm256_set1_ps(1.3981999507e-3f));
+        p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(8.3334519073e-3f));
+        p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(4.1665795894e-2f));
+        p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(1.6666665459e-1f));
+        p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(5.0000001201e-1f));
+    }
+    __m256 e = _mm256_fmadd_ps(p, _mm256_mul_ps(r, r), _mm256_add_ps(r, _mm256_set1_ps(1.0f)));
+    __m256i bits = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(n),
+        _mm256_set1_epi32(127)), 23);
+    return _mm256_mul_ps(e, _mm256_castsi256_ps(bits));
+}
+
+PUFFERNET_TARGET("avx2,fma")
+static inline __m256 _recip_avx2(__m256 x, bool fast) {
+    return fast ? _mm256_rcp_ps(x) : _mm256_div_ps(_mm256_set1_ps(1.0f), x);
+}
+
+PUFFERNET_TARGET("avx2,fma")
+static inline __m256 _sigmoid_avx2(__m256 x, bool fast) {
+    __m256 one = _mm256_set1_ps(1.0f);
+    __m256 e = _exp_avx2(_mm256_sub_ps(_mm256_setzero_ps(), x), fast);
+    return _recip_avx2(_mm256_add_ps(one, e), fast);
+}
+
+PUFFERNET_TARGET("avx2,fma")
+static inline __m256 _tanh_avx2(__m256 x, bool fast) {
+    __m256 sign = _mm256_set1_ps(-0.0f);
+    __m256 ax = _mm256_andnot_ps(sign, x);
+    __m256 z = _mm256_mul_ps(x, x);
+    __m256 p = _mm256_fmadd_ps(_mm256_set1_ps(-5.70498872745e-3f), z, _mm256_set1_ps(2.06390887954e-2f));
+    p = _mm256_fmadd_ps(p, z, _mm256_set1_ps(-5.37397155531e-2f));
+    p = _mm256_fmadd_ps(p, z, _mm256_set1_ps(1.33314422036e-1f));
+    p = _mm256_fmadd_ps(p, z, _mm256_set1_ps(-3.33332819422e-1f));
+    __m256 small = _mm256_fmadd_ps(_mm256_mul_ps(x, z), p, x);
+    __m256 e = _exp_avx2(_mm256_mul_ps(_mm256_set1_ps(2.0f),
+        _mm256_min_ps(ax, _mm256_set1_ps(9.0f))), fast);
+    __m256 t = _mm256_fnmadd_ps(_mm256_set1_ps(2.0f),
+        _recip_avx2(_mm256_add_ps(e, _mm256_set1_ps(1.0f)), fast), _mm256_set1_ps(1.0f));
+    __m256 large = _mm256_or_ps(t, _mm256_and_ps(sign, x));
+    return _mm256_blendv_ps(large, small, _mm256_cmp_ps(ax, _mm256_set1_ps(0.625f), _CMP_LT_OQ));
+}
+
+PUFFERNET_TARGET("avx2,fma")
+static inline __m256 _gelu_avx2(__m256 x, bool fast) {
+    __m256 x3 = _mm256_mul_ps(_mm256_mul_ps(x, x), x);
+    __m256 u = _mm256_mul_ps(_mm256_set1_ps(2.0f*PUFFERNET_GELU_K),
+        _mm256_fmadd_ps(_mm256_set1_ps(0.044715f), x3, x));
+    return _mm256_mul_ps(x, _sigmoid_avx2(u, fast));
+}
+
+// Array wrapper: full vectors, then a masked tail so every element takes the
+// same path. Exact mode falls back to libm.
+#define PUFFERNET_AVX2_ACTIVATION(name, vector, exact)                             \
+PUFFERNET_TARGET("avx2,fma")                                                      \
+void name(float* input, float* output, int size) {                               \
+    PufferMath mode = puffernet_math();                                           \
+    if (mode == PUFFERNET_MATH_EXACT) {                                           \
+        exact(input, output, size);                                               \
+        return;                                                                   \
+    }                                                                             \
+    bool fast = mode == PUFFERNET_MATH_FAST;                                      \
+    int i = 0;                                                                    \
+    for (; i + 8 <= size; i += 8) {                                               \
+        _mm256_storeu_ps(output + i, vector(_mm256_loadu_ps(input + i), fast));   \
+    }                                                                             \
+    if (i < size) {                                                               \
+        __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);                \
+        __m256i mask = _mm256_cmpgt_epi32(_mm256_set1_epi32(size - i), lanes);    \
+        __m256 x = _mm256_maskload_ps(input + i, mask);                           \
+        _mm256_maskstore_ps(output + i, mask, vector(x, fast));                   \
+    }                                                                             \
+}
+
+PUFFERNET_AVX2_ACTIVATION(_exp_array_avx2, _exp_avx2, _exp_array_scalar)
+PUFFERNET_AVX2_ACTIVATION(_sigmoid_array_avx2, _sigmoid_avx2, _sigmoid_array_scalar)
+PUFFERNET_AVX2_ACTIVATION(_tanh_array_avx2, _tanh_avx2, _tanh_array_scalar)
+PUFFERNET_AVX2_ACTIVATION(_gelu_array_avx2, _gelu_avx2, _gelu_scalar)
+
+PUFFERNET_TARGET("avx2,fma")
+void _relu_avx2(float* input, float* output, int size) {
+    int i = 0;
+    for (; i + 8 <= size; i += 8) {
+        _mm256_storeu_ps(output + i,
+            _mm256_max_ps(_mm256_loadu_ps(input + i), _mm256_setzero_ps()));
+    }
+    _relu(input + i, output + i, size - i);
+}
+
+PUFFERNET_TARGET("avx2,fma")
+void _linear_avx2(float* input, float* weights, float* bias, float* output,
+        int batch_size, int input_dim, int output_dim, PufferEpilogue epilogue, int tile_rows) {
+    _linear_blocked(input, weights, bias, output, batch_size, input_dim,
+        output_dim, epilogue, tile_rows,
+        _dot4_avx2, _dot1_avx2, _relu_avx2, _gelu_array_avx2);
+}
+
+PUFFERNET_TARGET("avx2,fma")
+void _lstm_fused_avx2(float* buffer, float* state_h, float* state_c, float* weights,
+        float* bias, int batch_size, int input_size, int hidden_size,
+        int unit_start, int unit_end) {
+    _lstm_fused_blocked(buffer, state_h, state_c, weights, bias, batch_size,
+        input_size, hidden_size, unit_start, unit_end, _dot4_avx2,
+        _sigmoid_array_avx2, _tanh_array_avx2);
+}
+
+// Four rows of one panel, or one row of four panels: 8 accumulators either way
+PUFFERNET_TARGET("avx2,fma")
+static inline void _panel_tile_avx2(float* x, int ldx, float* w, int n, float* acc) {
+    __m256 a0 = _mm256_setzero_ps(), a1 = _mm256_setzero_ps();
+    __m256 a2 = _mm256_setzero_ps(), a3 = _mm256_setzero_ps();
+    __m256 a4 = _mm256_setzero_ps(), a5 = _mm256_setzero_ps();
+    __m256 a6 = _mm256_setzero_ps(), a7 = _mm256_setzero_ps();
+    for (int k = 0; k < n; k++) {
+        __m256 lo = _mm256_loadu_ps(w + k*PUFFERNET_PANEL);
+        __m256 hi = _mm256_loadu_ps(w + k*PUFFERNET_PANEL + 8);
+        __m256 x0 = _mm256_broadcast_ss(x + k);
+        __m256 x1 = _mm256_broadcast_ss(x + ldx + k);
+        __m256 x2 = _mm256_broadcast_ss(x + 2*ldx + k);
+        __m256 x3 = _mm256_broadcast_ss(x + 3*ldx + k);
+        a0 = _mm256_fmadd_ps(x0, lo, a0);
+        a1 = _mm256_fmadd_ps(x0, hi, a1);
+        a2 = _mm256_fmadd_ps(x1, lo, a2);
+        a3 = _mm256_fmadd_ps(x1, hi, a3);
+        a4 = _mm256_fmadd_ps(x2, lo, a4);
+        a5 = _mm256_fmadd_ps(x2, hi, a5);
+        a6 = _mm256_fmadd_ps(x3, lo, a6);
+        a7 = _mm256_fmadd_ps(x3, hi, a7);
+    }
+    _mm256_storeu_ps(acc, a0);
+    _mm256_storeu_ps(acc + 8, a1);
+    _mm256_storeu_ps(acc + 16, a2);
+    _mm256_storeu_ps(acc + 24, a3);
+    _mm256_storeu_ps(acc + 32, a4);
+    _mm256_storeu_ps(acc + 40, a5);
+    _mm256_storeu_ps(acc + 48, a6);
+    _mm256_storeu_ps(acc + 56, a7);
+}
+
+PUFFERNET_TARGET("avx2,fma")
+static inline void _panel_row_avx2(float* x, float* w, int n, float* acc) {
+    size_t stride = (size_t)n*PUFFERNET_PANEL;
+    float* w0 = w;
+    float* w1 = w + stride;
+    float* w2 = w + 2*stride;
+    float* w3 = w + 3*stride;
+    __m256 a0 = _mm256_setzero_ps(), a1 = _mm256_setzero_ps();
+    __m256 a2 = _mm256_setzero_ps(), a3 = _mm256_setzero_ps();
+    __m256 a4 = _mm256_setzero_ps(), a5 = _mm256_setzero_ps();
+    __m256 a6 = _mm256_setzero_ps(), a7 = _mm256_setzero_ps();
+    for (int k = 0; k < n; k++) {
+        __m256 xv = _mm256_broadcast_ss(x + k);
+        int i = k*PUFFERNET_PANEL;
+        a0 = _mm256_fmadd_ps(xv, _mm256_loadu_ps(w0 + i), a0);
+        a1 = _mm256_fmadd_ps(xv, _mm256_loadu_ps(w0 + i + 8), a1);
+        a2 = _mm256_fmadd_ps(xv, _mm256_loadu_ps(w1 + i), a2);
+        a3 = _mm256_fmadd_ps(xv, _mm256_loadu_ps(w1 + i + 8), a3);
+        a4 = _mm256_fmadd_ps(xv, _mm256_loadu_ps(w2 + i), a4);
+        a5 = _mm256_fmadd_ps(xv, _mm256_loadu_ps(w2 + i + 8), a5);
+        a6 = _mm256_fmadd_ps(xv, _mm256_loadu_ps(w3 + i), a6);
+        a7 = _mm256_fmadd_ps(xv, _mm256_loadu_ps(w3 + i + 8), a7);
+    }
+    _mm256_storeu_ps(acc, a0);
+    _mm256_storeu_ps(acc + 8, a1);
+    _mm256_storeu_ps(acc + 16, a2);
+    _mm256_storeu_ps(acc + 24, a3);
+    _mm256_storeu_ps(acc + 32, a4);
+    _mm256_storeu_ps(acc + 40, a5);
+    _mm256_storeu_ps(acc + 48, a6);
+    _mm256_storeu_ps(acc + 56, a7);
+}
+
+PUFFERNET_TARGET("avx2,fma")
+void _linear_panels_avx2(float* input, float* panels, float* bias, float* output,
+        int batch_size, int input_dim, int output_dim, PufferEpilogue epilogue) {
+    _linear_panels_blocked(input, panels, bias, output, batch_size, input_dim, output_dim,
+        epilogue, 4, _panel_tile_avx2, 4, _panel_row_avx2, _relu_avx2, _gelu_array_avx2);
+}
+
+// One 8-wide vector per block row
+PUFFERNET_TARGET("avx2,fma")
+static inline void _sparse_reduce4_avx2(__m256 a0, __m256 a1, __m256 a2, __m256 a3, float* out) {
+    __m256 s = _mm256_hadd_ps(_mm256_hadd_ps(a0, a1), _mm256_hadd_ps(a2, a3));
+    _mm_storeu_ps(out, _mm_add_ps(_mm256_castps256_ps128(s), _mm256_extractf128_ps(s, 1)));
+}
+
+PUFFERNET_TARGET("avx2,fma")
+static inline void _sparse_dot4_avx2(float* x, float* values, int32_t* block_col,
+        int num_blocks, int cols, float* out) {
+    __m256 a0 = _mm256_setzero_ps(), a1 = _mm256_setzero_ps();
+    __m256 a2 = _mm256_setzero_ps(), a3 = _mm256_setzero_ps();
+    for (int k = 0; k < num_blocks; k++) {
+        float tail[PUFFERNET_SPARSE_COLS];
+        __m256 xv = _mm256_loadu_ps(_sparse_x(x, block_col[k], cols, tail));
+        float* v = values + k*PUFFERNET_SPARSE_BLOCK;
+        a0 = _mm256_fmadd_ps(xv, _mm256_loadu_ps(v), a0);
+        a1 = _mm256_fmadd_ps(xv, _mm256_loadu_ps(v + 8), a1);
+        a2 = _mm256_fmadd_ps(xv, _mm256_loadu_ps(v + 16), a2);
+        a3 = _mm256_fmadd_ps(xv, _mm256_loadu_ps(v + 24), a3);
+    }
+    _sparse_reduce4_avx2(a0, a1, a2, a3, out);
+}
+
+PUFFERNET_TARGET("avx2,fma")
+static inline void _sparse_dot4x2_avx2(float* x0, float* x1, float* values, int32_t* block_col,
+        int num_blocks, int cols, float* out0, float* out1) {
+    __m256 a0 = _mm256_setzero_ps(), a1 = _mm256_setzero_ps();
+    __m256 a2 = _mm256_setzero_ps(), a3 = _mm256_setzero_ps();
+    __m256 b0 = _mm256_setzero_ps(), b1 = _mm256_setzero_ps();
+    __m256 b2 = _mm256_setzero_ps(), b3 = _mm256_setzero_ps();
+    for (int k = 0; k < num_blocks; k++) {
+        float tail0[PUFFERNET_SPARSE_COLS], tail1[PUFFERNET_SPARSE_COLS];
+        __m256 xv0 = _mm256_loadu_ps(_sparse_x(x0, block_col[k], cols, tail0));
+        __m256 xv1 = _mm256_loadu_ps(_sparse_x(x1, block_col[k], cols, tail1));
+        float* v = values + k*PUFFERNET_SPARSE_BLOCK;
+        __m256 w0 = _mm256_loadu_ps(v);
+        __m256 w1 = _mm256_loadu_ps(v + 8);
+        __m256 w2 = _mm256_loadu_ps(v + 16);
+        __m256 w3 = _mm256_loadu_ps(v + 24);
+        a0 = _mm256_fmadd_ps(xv0, w0, a0);
+        a1 = _mm256_fmadd_ps(xv0, w1, a1);
+        a2 = _mm256_fmadd_ps(xv0, w2, a2);
+        a3 = _mm256_fmadd_ps(xv0, w3, a3);
+        b0 = _mm256_fmadd_ps(xv1, w0, b0);
+        b1 = _mm256_fmadd_ps(xv1, w1, b1);
+        b2 = _mm256_fmadd_ps(xv1, w2, b2);
+        b3 = _mm256_fmadd_ps(xv1, w3, b3);
+    }
+    _sparse_reduce4_avx2(a0, a1, a2, a3, out0);
+    _sparse_reduce4_avx2(b0, b1, b2, b3, out1);
+}
+
+PUFFERNET_TARGET("avx2,fma")
+void _sparse_linear_avx2(float* input, BlockSparse* weights, float* bias,
+        float* output, int batch_size, PufferEpilogue epilogue, int tile_rows) {
+    _sparse_linear_blocked(input, weights, bias, output, batch_size, epilogue, tile_rows,
+        _sparse_dot4_avx2, _sparse_dot4x2_avx2, _relu_avx2, _gelu_array_avx2);
+}
+
+PUFFERNET_TARGET("avx2,fma")
+void _lstm_sparse_avx2(float* buffer, float* state_h, float* state_c,
+        BlockSparse* weights, float* bias, int batch_size, int input_size,
+        int hidden_size, int unit_start, int unit_end) {
+    _lstm_sparse_blocked(buffer, state_h, state_c, weights, bias, batch_size,
+        input_size, hidden_size, unit_start, unit_end, _sparse_dot4_avx2,
+        _sigmoid_array_avx2, _tanh_array_avx2);
+}
+#endif
+
+#ifdef PUFFERNET_NEON
+static inline void _dot4_neon(float* x, float* w, int ldw, int n, float* out) {
+    float* w0 = w;
+    float* w1 = w + ldw;
+    float* w2 = w + 2*ldw;
+    float* w3 = w + 3*ldw;
+    float32x4_t a0 = vdupq_n_f32(0), a1 = vdupq_n_f32(0);
+    float32x4_t a2 = vdupq_n_f32(0), a3 = vdupq_n_f32(0);
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        float32x4_t xv = vld1q_f32(x + i);
+        a0 = vfmaq_f32(a0, xv, vld1q_f32(w0 + i));
+        a1 = vfmaq_f32(a1, xv, vld1q_f32(w1 + i));
+        a2 = vfmaq_f32(a2, xv, vld1q_f32(w2 + i));
+        a3 = vfmaq_f32(a3, xv, vld1q_f32(w3 + i));
+    }
+    float32x4_t s = vpaddq_f32(vpaddq_f32(a0, a1), vpaddq_f32(a2, a3));
+    vst1q_f32(out, s);
+    for (; i < n; i++) {
+        out[0] += x[i]*w0[i];
+        out[1] += x[i]*w1[i];
+        out[2] += x[i]*w2[i];
+        out[3] += x[i]*w3[i];
+    }
+}
+
+static inline float _dot1_neon(float* x, float* w, int n) {
+    float32x4_t acc = vdupq_n_f32(0);
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        acc = vfmaq_f32(acc, vld1q_f32(x + i), vld1q_f32(w + i));
+    }
+    float sum = vaddvq_f32(acc);
+    for (; i < n; i++) {
+        sum += x[i]*w[i];
+    }
+    return sum;
+}
+
+static inline float32x4_t _exp_neon(float32x4_t x, bool fast) {
+    x = vminq_f32(vmaxq_f32(x, vdupq_n_f32(PUFFERNET_EXP_MIN)), vdupq_n_f32(PUFFERNET_EXP_MAX));
+    float32x4_t n = vrndnq_f32(vmulq_f32(x, vdupq_n_f32(PUFFERNET_LOG2E)));
+    float32x4_t r = vfmsq_f32(x, n, vdupq_n_f32(PUFFERNET_LN2_HI));
+    r = vfmsq_f32(r, n, vdupq_n_f32(PUFFERNET_LN2_LO));
+    float32x4_t p;
+    if (fast) {
+        p = vfmaq_f32(vdupq_n_f32(5.0414018e-1f), vdupq_n_f32(1.6708603e-1f), r);
+    } else {
+        p = vfmaq_f32(vdupq_n_f32(1.3981999507e-3f), vdupq_n_f32(1.9875691500e-4f), r);
+        p = vfmaq_f32(vdupq_n_f32(8.3334519073e-3f), p, r);
+        p = vfmaq_f32(vdupq_n_f32(4.1665795894e-2f), p, r);
+        p = vfmaq_f32(vdupq_n_f32(1.6666665459e-1f), p, r);
+        p = vfmaq_f32(vdupq_n_f32(5.0000001201e-1f), p, r);
+    }
+    float32x4_t e = vfmaq_f32(vaddq_f32(r, vdupq_n_f32(1.0f)), p, vmulq_f32(r, r));
+    int32x4_t bits = vshlq_n_s32(vaddq_s32(vcvtq_s32_f32(n), vdupq_n_s32(127)), 23);
+    return vmulq_f32(e, vreinterpretq_f32_s32(bits));
+}
+
+// The estimate alone is only 8 bits, one Newton step brings it to ~1e-5
+static inline float32x4_t _recip_neon(float32x4_t x, bool fast) {
+    if (!fast) {
+        return vdivq_f32(vdupq_n_f32(1.0f), x);
+    }
+    float32x4_t r = vrecpeq_f32(x);
+    return vmulq_f32(r, vrecpsq_f32(x, r));
+}
+
+static inline float32x4_t _sigmoid_neon(float32x4_t x, bool fast) {
+    float32x4_t e = _exp_neon(vnegq_f32(x), fast);
+    return _recip_neon(vaddq_f32(vdupq_n_f32(1.0f), e), fast);
+}
+
+static inline float32x4_t _tanh_neon(float32x4_t x, bool fast) {
+    float32x4_t ax = vabsq_f32(x);
+    float32x4_t z = vmulq_f32(x, x);
+    float32x4_t p = vfmaq_f32(vdupq_n_f32(2.06390887954e-2f), vdupq_n_f32(-5.70498872745e-3f), z);
+    p = vfmaq_f32(vdupq_n_f32(-5.37397155531e-2f), p, z);
+    p = vfmaq_f32(vdupq_n_f32(1.33314422036e-1f), p, z);
+    p = vfmaq_f32(vdupq_n_f32(-3.33332819422e-1f), p, z);
+    float32x4_t small = vfmaq_f32(x, vmulq_f32(x, z), p);
+    float32x4_t e = _exp_neon(vmulq_f32(vdupq_n_f32(2.0f), vminq_f32(ax, vdupq_n_f32(9.0f))), fast);
+    float32x4_t t = vfmsq_f32(vdupq_n_f32(1.0f), vdupq_n_f32(2.0f),
+        _recip_neon(vaddq_f32(e, vdupq_n_f32(1.0f)), fast));
+    uint32x4_t sign = vandq_u32(vreinterpretq_u32_f32(x), vdupq_n_u32(0x80000000u));
+    float32x4_t large = vreinterpretq_f32_u32(vorrq_u32(vreinterpretq_u32_f32(t), sign));
+    return vbslq_f32(vcltq_f32(ax, vdupq_n_f32(0.625f)), small, large);
+}
+
+static inline float32x4_t _gelu_neon(float32x4_t x, bool fast) {
+    float32x4_t x3 = vmulq_f32(vmulq_f32(x, x), x);
+    float32x4_t u = vmulq_f32(vdupq_n_f32(2.0f*PUFFERNET_GELU_K),
+        vfmaq_f32(x, vdupq_n_f32(0.044715f), x3));
+    return vmulq_f32(x, _sigmoid_neon(u, fast));
+}
+
+// The tail goes through a padded copy so every element takes the same path
+#define PUFFERNET_NEON_ACTIVATION(name, vector, exact)                    \
+void name(float* input, float* output, int size) {                       \
+    PufferMath mode = puffernet_math();                                   \
+    if (mode == PUFFERNET_MATH_EXACT) {                                   \
+        exact(input, output, size);                                       \
+        return;                                                           \
+    }                                                                     \
+    bool fast = mode == PUFFERNET_MATH_FAST;                              \
+    int i = 0;                                                            \
+    for (; i + 4 <= size; i += 4) {                                       \
+        vst1q_f32(output + i, vector(vld1q_f32(input + i), fast));        \
+    }                                                                     \
+    if (i < size) {                                                       \
+        float tail[4] = {0};                                              \
+        memcpy(tail, input + i, (size - i)*sizeof(float));                \
+        vst1q_f32(tail, vector(vld1q_f32(tail), fast));                   \
+        memcpy(output + i, tail, (size - i)*sizeof(float));               \
+    }                                                                     \
+}
+
+PUFFERNET_NEON_ACTIVATION(_exp_array_neon, _exp_neon, _exp_array_scalar)
+PUFFERNET_NEON_ACTIVATION(_sigmoid_array_neon, _sigmoid_neon, _sigmoid_array_scalar)
+PUFFERNET_NEON_ACTIVATION(_tanh_array_neon, _tanh_neon, _tanh_array_scalar)
+PUFFERNET_NEON_ACTIVATION(_gelu_array_neon, _gelu_neon, _gelu_scalar)
+
+void _relu_neon(float* input, float* output, int size) {
+    int i = 0;
+    for (; i + 4 <= size; i += 4) {
+        vst1q_f32(output + i, vmaxq_f32(vld1q_f32(input + i), vdupq_n_f32(0.0f)));
+    }
+    _relu(input + i, output + i, size - i);
+}
+
+void _linear_neon(float* input, float* weights, float* bias, float* output,
+        int batch_size, int input_dim, int output_dim, PufferEpilogue epilogue, int tile_rows) {
+    _linear_blocked(input, weights, bias, output, batch_size, input_dim,
+        output_dim, epilogue, tile_rows,
+        _dot4_neon, _dot1_neon, _relu_neon, _gelu_array_neon);
+}
+
+void _lstm_fused_neon(float* buffer, float* state_h, float* state_c, float* weights,
+        float* bias, int batch_size, int input_size, int hidden_size,
+        int unit_start, int unit_end) {
+    _lstm_fused_blocked(buffer, state_h, state_c, weights, bias, batch_size,
+        input_size, hidden_size, unit_start, unit_end, _dot4_neon,
+        _sigmoid_array_neon, _tanh_array_neon);
+}
+
+// Four rows of one panel, or one row of four panels: 16 accumulators either way
+static inline void _panel_tile_neon(float* x, int ldx, float* w, int n, float* acc) {
+    float32x4_t a[16];
+    for (int v = 0; v < 16; v++) {
+        a[v] = vdupq_n_f32(0);
+    }
+    for (int k = 0; k < n; k++) {
+        float32x4_t wv[4];
+        for (int v = 0; v < 4; v++) {
+            wv[v] = vld1q_f32(w + k*PUFFERNET_PANEL + 4*v);
+        }
+        for (int r = 0; r < 4; r++) {
+            float32x4_t xv = vdupq_n_f32(x[r*ldx + k]);
+            for (int v = 0; v < 4; v++) {
+                a[4*r + v] = vfmaq_f32(a[4*r + v], xv, wv[v]);
+            }
+        }
+    }
+    for (int v = 0; v < 16; v++) {
+        vst1q_f32(acc + 4*v, a[v]);
+    }
+}
+
+static inline void _panel_row_neon(float* x, float* w, int n, float* acc) {
+    size_t stride = (size_t)n*PUFFERNET_PANEL;
+    float32x4_t a[16];
+    for (int v = 0; v < 16; v++) {
+        a[v] = vdupq_n_f32(0);
+    }
+    for (int k = 0; k < n; k++) {
+        float32x4_t xv = vdupq_n_f32(x[k]);
+        for (int q = 0; q < 4; q++) {
+            float* wk = w + q*stride + k*PUFFERNET_PANEL;
+            for (int v = 0; v < 4; v++) {
+                a[4*q + v] = vfmaq_f32(a[4*q + v], xv, vld1q_f32(wk + 4*v));
+            }
+        }
+    }
+    for (int v = 0; v < 16; v++) {
+        vst1q_f32(acc + 4*v, a[v]);
+    }
+}
+
+void _linear_panels_neon(float* input, float* panels, float* bias, float* output,
+        int batch_size, int input_dim, int output_dim, PufferEpilogue epilogue) {
+    _linear_panels_blocked(input, panels, bias, output, batch_size, input_dim, output_dim,
+        epilogue, 4, _panel_tile_neon, 4, _panel_row_neon, _relu_neon, _gelu_array_neon);
+}
+
+// A block is two 4-wide halves per row
+static inline void _sparse_dot4_neon(float* x, float* values, int32_t* block_col,
+        int num_blocks, int cols, float* out) {
+    float32x4_t a[4];
+    for (int r = 0; r < 4; r++) {
+        a[r] = vdupq_n_f32(0);
+    }
+    for (int k = 0; k < num_blocks; k++) {
+        float tail[PUFFERNET_SPARSE_COLS];
+        float* xk = _sparse_x(x, block_col[k], cols, tail);
+        float32x4_t lo = vld1q_f32(xk), hi = vld1q_f32(xk + 4);
+        float* v = values + k*PUFFERNET_SPARSE_BLOCK;
+        for (int r = 0; r < 4; r++) {
+            a[r] = vfmaq_f32(a[r], lo, vld1q_f32(v + r*PUFFERNET_SPARSE_COLS));
+            a[r] = vfmaq_f32(a[r], hi, vld1q_f32(v + r*PUFFERNET_SPARSE_COLS + 4));
+        }
+    }
+    vst1q_f32(out, vpaddq_f32(vpaddq_f32(a[0], a[1]), vpaddq_f32(a[2], a[3])));
+}
+
+static inline void _sparse_dot4x2_neon(float* x0, float* x1, float* values, int32_t* block_col,
+        int num_blocks, int cols, float* out0, float* out1) {
+    float32x4_t a[8];
+    for (int r = 0; r < 8; r++) {
+        a[r] = vdupq_n_f32(0);
+    }
+    for (int k = 0; k < num_blocks; k++) {
+        float tail0[PUFFERNET_SPARSE_COLS], tail1[PUFFERNET_SPARSE_COLS];
+        float* xk0 = _sparse_x(x0, block_col[k], cols, tail0);
+        float* xk1 = _sparse_x(x1, block_col[k], cols, tail1);
+        float32x4_t lo0 = vld1q_f32(xk0), hi0 = vld1q_f32(xk0 + 4);
+        float32x4_t lo1 = vld1q_f32(xk1), hi1 = vld1q_f32(xk1 + 4);
+        float* v = values + k*PUFFERNET_SPARSE_BLOCK;
+        for (int r = 0; r < 4; r++) {
+            float32x4_t wlo = vld1q_f32(v + r*PUFFERNET_SPARSE_COLS);
+            float32x4_t whi = vld1q_f32(v + r*PUFFERNET_SPARSE_COLS + 4);
+            a[r] = vfmaq_f32(vfmaq_f32(a[r], lo0, wlo), hi0, whi);
+            a[4 + r] = vfmaq_f32(vfmaq_f32(a[4 + r], lo1, wlo), hi1, whi);
+        }
+    }
+    vst1q_f32(out0, vpaddq_f32(vpaddq_f32(a[0], a[1]), vpaddq_f32(a[2], a[3])));
+    vst1q_f32(out1, vpaddq_f32(vpaddq_f32(a[4], a[5]), vpaddq_f32(a[6], a[7])));
+}
+
+void _sparse_linear_neon(float* input, BlockSparse* weights, float* bias,
+        float* output, int batch_size, PufferEpilogue epilogue, int tile_rows) {
+    _sparse_linear_blocked(input, weights, bias, output, batch_size, epilogue, tile_rows,
+        _sparse_dot4_neon, _sparse_dot4x2_neon, _relu_neon, _gelu_array_neon);
+}
+
+void _lstm_sparse_neon(float* buffer, float* state_h, float* state_c,
+        BlockSparse* weights, float* bias, int batch_size, int input_size,
+        int hidden_size, int unit_start, int unit_end) {
+    _lstm_sparse_blocked(buffer, state_h, state_c, weights, bias, batch_size,
+        input_size, hidden_size, unit_start, unit_end, _sparse_dot4_neon,
+        _sigmoid_array_neon, _tanh_array_neon);
+}
+#endif
+
+// Runtime kernel dispatch
+// tile_rows is resolved once by the layer (_linear_tile), not per call
+typedef void (*LinearKernel)(float* input, float* weights, float* bias, float* output,
+        int batch_size, int input_dim, int output_dim, PufferEpilogue epilogue, int tile_rows);
+
+// SSE4.1 has no vector activations of its own and uses the scalar polynomials
+typedef struct Kernels Kernels;
+struct Kernels {
+    const char* name;
+    LinearKernel linear;
+    Dot4Kernel dot4;
+    LSTMKernel lstm;
+    SparseLinearKernel sparse_linear;
+    SparseLSTMKernel sparse_lstm;
+    PanelLinearKernel panel_linear;
+    ActivationKernel exp_array;
+    ActivationKernel sigmoid_array;
+    ActivationKernel tanh_array;
+    ActivationKernel gelu;
+};
+
+static const Kernels PUFFERNET_KERNELS[] = {
+    {"scalar", _linear_scalar, _dot4_scalar, _lstm_fused_scalar, _sparse_linear_scalar,
+        _lstm_sparse_scalar, _linear_panels_scalar, _exp_array_scalar, _sigmoid_array_scalar,
+        _tanh_array_scalar, _gelu_scalar},
+#ifdef PUFFERNET_X86
+    {"sse41", _linear_sse41, _dot4_sse41, _lstm_fused_sse41, _sparse_linear_sse41,
+        _lstm_sparse_sse41, _linear_panels_sse41, _exp_array_scalar, _sigmoid_array_scalar,
+        _tanh_array_scalar, _gelu_scalar},
+    {"avx2", _linear_avx2, _dot4_avx2, _lstm_fused_avx2, _sparse_linear_avx2,
+        _lstm_sparse_avx2, _linear_panels_avx2, _exp_array_avx2, _sigmoid_array_avx2,
+        _tanh_array_avx2, _gelu_array_avx2},
+#endif
+#ifdef PUFFERNET_NEON
+    {"neon", _linear_neon, _dot4_neon, _lstm_fused_neon, _sparse_linear_neon,
+        _lstm_sparse_neon, _linear_panels_neon, _exp_array_neon, _sigmoid_array_neon,
+        _tanh_array_neon, _gelu_array_neon},
+#endif
+};
+static const int PUFFERNET_NUM_KERNELS = sizeof(PUFFERNET_KERNELS)/sizeof(Kernels);
+// Chosen on first use, possibly by several threads at once (the pool, a
+// parallel search). They all choose the same variant, so the pointer is only
+// published atomically. puffernet_select_kernels is meant to run before them
+static const Kernels* puffernet_active_kernels = NULL;
+#if defined(__GNUC__)
+    #define _PUFFERNET_LOAD_KERNELS() __atomic_load_n(&puffernet_active_kernels, __ATOMIC_ACQUIRE)
+    #define _PUFFERNET_STORE_KERNELS(k) \
+        __atomic_store_n(&puffernet_active_kernels, k, __ATOMIC_RELEASE)
+#else
+    #define _PUFFERNET_LOAD_KERNELS() puffernet_active_kernels
+    #define _PUFFERNET_STORE_KERNELS(k) (puffernet_active_kernels = (k))
+#endif
+
+bool puffernet_cpu_supports(const char* name) {
+    if (strcmp(name, "scalar") == 0) {
+        return true;
+    }
+#ifdef PUFFERNET_X86
+    __builtin_cpu_init();
+    if (strcmp(name, "sse41") == 0) {
+        return __builtin_cpu_supports("sse4.1");
+    }
+    if (strcmp(name, "avx2") == 0) {
+        return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    }
+#endif
+#ifdef PUFFERNET_NEON
+    if (strcmp(name, "neon") == 0) {
+        return true;
+    }
+#endif
+    return false;
+}
+
+// Force a kernel variant by name. Returns false if it is not available
+bool puffernet_select_kernels(const char* name) {
+    for (int i = 0; i < PUFFERNET_NUM_KERNELS; i++) {
+        if (strcmp(PUFFERNET_KERNELS[i].name, name) == 0 && puffernet_cpu_supports(name)) {
+            _PUFFERNET_STORE_KERNELS(&PUFFERNET_KERNELS[i]);
+            return true;
+        }
+    }
+    return false;
+}
+
+const Kernels* puffernet_kernels() {
+    const Kernels* kernels = _PUFFERNET_LOAD_KERNELS();
+    if (kernels != NULL) {
+        return kernels;
+    }
+    const char* forced = getenv("PUFFERNET_ISA");
+    if (forced != NULL && puffernet_select_kernels(forced)) {
+        return _PUFFERNET_LOAD_KERNELS();
+    }
+    // Table is ordered from slowest to fastest
+    for (int i = PUFFERNET_NUM_KERNELS - 1; i >= 0; i--) {
+        if (puffernet_cpu_supports(PUFFERNET_KERNELS[i].name)) {
+            kernels = &PUFFERNET_KERNELS[i];
+            break;
+        }
+    }
+    _PUFFERNET_STORE_KERNELS(kernels);
+    return kernels;
+}
+
+void _linear(float* input, float* weights, float* bias, float* output,
+        int batch_size, int input_dim, int output_dim) {
+    puffernet_kernels()->linear(input, weights, bias, output,
+        batch_size, input_dim, output_dim, PUFFERNET_EPILOGUE_NONE, PUFFERNET_LINEAR_TILE);
+}
+
+void _linear_accumulate(float* input, float* weights, float* bias, float* output,
+        int batch_size, int input_dim, int output_dim) {
+    puffernet_kernels()->linear(input, weights, bias, output,
+        batch_size, input_dim, output_dim, PUFFERNET_EPILOGUE_ACCUMULATE, PUFFERNET_LINEAR_TILE);
+}
+
+// Linear followed by ReLU or GELU in one pass
+void _linear_epilogue(float* input, float* weights, float* bias, float* output,
+        int batch_size, int input_dim, int output_dim, PufferEpilogue epilogue) {
+    puffernet_kernels()->linear(input, weights, bias, output,
+        batch_size, input_dim, output_dim, epilogue, PUFFERNET_LINEAR_TILE);
+}
+
+void _exp_array(float* input, float* output, int size) {
+    puffernet_kernels()->exp_array(input, output, size);
 }
 
-void _linear_accumulate(float* input, float* weights, float* bias, float* output,
-        int batch_size, int input_dim, int output_dim) {
-    for (int b = 0; b < batch_size; b++) {
-        for (int o = 0; o < output_dim; o++) {
-            float sum = 0.0f;
-            for (int i = 0; i < input_dim; i++)
-                sum += input[b*input_dim + i] * weights[o*input_dim + i];
-            output[b*output_dim + o] += sum + bias[o];
-        }
-    }
+void _sigmoid_array(float* input, float* output, int size) {
+    puffernet_kernels()->sigmoid_array(input, output, size);
+}
+
+void _tanh_array(float* input, float* output, int size) {
+    puffernet_kernels()->tanh_array(input, output, size);
 }
 
-void _conv2d(float* input, float* weights, float* bias,
+void _gelu(float* input, float* output, int size) {
+    puffernet_kernels()->gelu(input, output, size);
+}
+
+// Direct convolution, kept to validate _conv2d
+void _conv2d_reference(float* input, float* weights, float* bias,
         float* output, int batch_size, int in_width, int in_height,
         int in_channels, int out_channels, int kernel_size, int stride) {
     int h_out = (in_height - kernel_size)/stride + 1;
@@ -150,6 +2153,80 @@ void _conv2d(float* input, float* weights, float* bias,
     }
 }
 
+// Patches per im2col tile by default. A tile of columns and its outputs stay
+// in L2 while every block of 4 filters streams over it.
+#define PUFFERNET_CONV_TILE_BYTES (64*1024)
+
+int _conv2d_tile(int in_channels, int kernel_size, int out_channels, int num_patches) {
+    int patch_size = in_channels*kernel_size*kernel_size;
+    int tile = PUFFERNET_CONV_TILE_BYTES/(patch_size*(int)sizeof(float));
+    if (tile < 4) {
+        tile = 4;
+    }
+    tile = _puffernet_tuned(PUFFERNET_TUNE_CONV_TILE, in_channels, kernel_size,
+        out_channels, num_patches, tile);
+    return tile < num_patches ? tile : num_patches;
+}
+
+// Floats of scratch _conv2d needs: one tile of columns plus its outputs
+int _conv2d_scratch_size(int in_width, int in_height, int in_channels,
+        int out_channels, int kernel_size, int stride) {
+    int h_out = (in_height - kernel_size)/stride + 1;
+    int w_out = (in_width - kernel_size)/stride + 1;
+    int tile = _conv2d_tile(in_channels, kernel_size, out_channels, h_out*w_out);
+    return tile*(in_channels*kernel_size*kernel_size + out_channels);
+}
+
+// Copies patches [p_start, p_end) of one image into consecutive rows of
+// columns, each laid out like a filter ([ic][kh][kw])
+void _im2col(float* input, float* columns, int in_width, int in_height,
+        int in_channels, int kernel_size, int stride, int w_out, int p_start, int p_end) {
+    float* col = columns;
+    for (int p = p_start; p < p_end; p++) {
+        int h = p/w_out;
+        int w = p%w_out;
+        for (int ic = 0; ic < in_channels; ic++) {
+            float* row = input + ic*in_height*in_width + h*stride*in_width + w*stride;
+            for (int kh = 0; kh < kernel_size; kh++) {
+                memcpy(col, row + kh*in_width, kernel_size*sizeof(float));
+                col += kernel_size;
+            }
+        }
+    }
+}
+
+// Lowers each tile of output positions to a GEMM of patches x filters on the
+// SIMD linear kernels, then writes the tile back in NCHW order. scratch holds
+// tile*(patch size + out_channels) floats, tile from _conv2d_tile. epilogue is
+// applied by the GEMM (NONE or RELU).
+void _conv2d(float* input, float* weights, float* bias, float* output, float* scratch,
+        int batch_size, int in_width, int in_height, int in_channels,
+        int out_channels, int kernel_size, int stride, int tile, PufferEpilogue epilogue) {
+    int h_out = (in_height - kernel_size)/stride + 1;
+    int w_out = (in_width - kernel_size)/stride + 1;
+    int num_patches = h_out*w_out;
+    int patch_size = in_channels*kernel_size*kernel_size;
+    float* columns = scratch;
+    float* tile_output = scratch + tile*patch_size;
+    for (int b = 0; b < batch_size; b++) {
+        float* image = input + b*in_channels*in_height*in_width;
+        float* out = output + b*out_channels*num_patches;
+        for (int p0 = 0; p0 < num_patches; p0 += tile) {
+            int n = num_patches - p0 < tile ? num_patches - p0 : tile;
+            _im2col(image, columns, in_width, in_height, in_channels,
+                kernel_size, stride, w_out, p0, p0 + n);
+            puffernet_kernels()->linear(columns, weights, bias, tile_output,
+                n, patch_size, out_channels, epilogue, PUFFERNET_LINEAR_TILE);
+            for (int oc = 0; oc < out_channels; oc++) {
+                float* dst = out + oc*num_patches + p0;
+                for (int p = 0; p < n; p++) {
+                    dst[p] = tile_output[p*out_channels + oc];
+                }
+            }
+        }
+    }
+}
+
 void _conv3d(float* input, float* weights, float* bias,
         float* output, int batch_size, int in_width, int in_height, int in_depth,
         int in_channels, int out_channels, int kernel_size, int stride) {
@@ -199,6 +2276,8 @@ void _conv3d(float* input, float* weights, float* bias,
     }
 }
 
+// Unfused reference cell. tools/gradcheck checks every fused and block-sparse
+// LSTM kernel against it
 void _lstm(float* input, float* state_h, float* state_c, float* weights_input,
         float* weights_state, float* bias_input, float*bias_state,
         float *buffer, int batch_size, int input_size, int hidden_size) {
@@ -238,6 +2317,33 @@ void _lstm(float* input, float* state_h, float* state_c, float* weights_input,
     }
 }
 
+// Packs PyTorch's separate [4H x I] and [4H x H] LSTM weights into one
+// [4H x (I+H)] matrix. Rows are interleaved per hidden unit (i, f, g, o of
+// unit 0, then unit 1, ...) so one 4-row dot product yields all gates of a unit.
+void _lstm_pack_weights(float* weights_input, float* weights_state,
+        float* bias_input, float* bias_state, float* weights_fused,
+        float* bias_fused, int input_size, int hidden_size) {
+    int cat_size = input_size + hidden_size;
+    for (int j = 0; j < hidden_size; j++) {
+        for (int g = 0; g < 4; g++) {
+            int src = g*hidden_size + j;
+            int dst = 4*j + g;
+            memcpy(weights_fused + dst*cat_size,
+                weights_input + src*input_size, input_size*sizeof(float));
+            memcpy(weights_fused + dst*cat_size + input_size,
+                weights_state + src*hidden_size, hidden_size*sizeof(float));
+            bias_fused[dst] = bias_input[src] + bias_state[src];
+        }
+    }
+}
+
+void _lstm_fused(float* input, float* state_h, float* state_c, float* weights,
+        float* bias, float* buffer, int batch_size, int input_size, int hidden_size) {
+    _lstm_concat(input, state_h, buffer, batch_size, input_size, hidden_size);
+    puffernet_kernels()->lstm(buffer, state_h, state_c, weights, bias,
+        batch_size, input_size, hidden_size, 0, hidden_size);
+}
+
 void _embedding(int* input, float* weights, float* output, int batch_size, int num_embeddings, int embedding_dim) {
     for (int b = 0; b < batch_size; b++) {
         memcpy(output + b*embedding_dim, weights + input[b]*embedding_dim, embedding_dim*sizeof(float));
@@ -316,31 +2422,118 @@ void _argmax_multidiscrete(float* input, int* output, int batch_size, int logit_
     }
 }
 
-void _softmax_multidiscrete(float* input, int* output, int batch_size, int logit_sizes[], int num_actions) {
+// xoshiro128+ (Blackman & Vigna) streams for sampling. Each agent owns one,
+// so results do not depend on how a batch is split across threads and there
+// is no shared state like rand().
+typedef struct PufferRNG PufferRNG;
+struct PufferRNG {
+    uint32_t s[4];
+};
+
+uint64_t _splitmix64(uint64_t* x) {
+    uint64_t z = (*x += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30))*0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27))*0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+// Streams with the same seed and different ids are independent
+void rng_seed(PufferRNG* rng, uint64_t seed, uint64_t stream) {
+    uint64_t x = seed ^ _splitmix64(&stream);
+    uint64_t a = _splitmix64(&x);
+    uint64_t b = _splitmix64(&x);
+    rng->s[0] = (uint32_t)a;
+    rng->s[1] = (uint32_t)(a >> 32);
+    rng->s[2] = (uint32_t)b;
+    rng->s[3] = (uint32_t)(b >> 32);
+    if ((a | b) == 0) {
+        rng->s[0] = 1;
+    }
+}
+
+static inline uint32_t _rotl32(uint32_t x, int k) {
+    return (x << k) | (x >> (32 - k));
+}
+
+uint32_t rng_next(PufferRNG* rng) {
+    uint32_t* s = rng->s;
+    uint32_t result = s[0] + s[3];
+    uint32_t t = s[1] << 9;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = _rotl32(s[3], 11);
+    return result;
+}
+
+// Uniform in [0, 1) from the top 24 bits (the low bits of xoshiro128+ are weak)
+float rng_uniform(PufferRNG* rng) {
+    return (rng_next(rng) >> 8)*(1.0f/16777216.0f);
+}
+
+// Samples each action head from softmax(logits). The max is subtracted before
+// exp so large logits cannot overflow, exp runs once per logit into scratch
+// (sum of logit_sizes floats per agent) and the draw is compared against the
+// unnormalized cumulative sum. rngs holds one stream per agent.
+void _softmax_multidiscrete(float* input, int* output, float* scratch, PufferRNG* rngs,
+        int batch_size, int logit_sizes[], int num_actions) {
     int in_adr = 0;
     for (int b = 0; b < batch_size; b++) {
         for (int a = 0; a < num_actions; a++) {
-            int out_adr = b*num_actions + a;
-            float logit_exp_sum = 0;
-            int num_action_types = logit_sizes[a];
-            for (int i = 0; i < num_action_types; i++) {
-                logit_exp_sum += expf(input[in_adr + i]);
+            int n = logit_sizes[a];
+            float* logits = input + in_adr;
+            float* exps = scratch + in_adr;
+            float max_logit = logits[0];
+            for (int i = 1; i < n; i++) {
+                max_logit = fmaxf(max_logit, logits[i]);
             }
-            float prob = rand() / (float)RAND_MAX;
-            float logit_prob = 0;
-            output[out_adr] = 0;
-            for (int i = 0; i < num_action_types; i++) {
-                logit_prob += expf(input[in_adr + i]) / logit_exp_sum;
-                if (prob < logit_prob) {
-                    output[out_adr] = i;
+            for (int i = 0; i < n; i++) {
+                exps[i] = logits[i] - max_logit;
+            }
+            _exp_array(exps, exps, n);
+            float sum = 0.0f;
+            for (int i = 0; i < n; i++) {
+                sum += exps[i];
+            }
+            float target = rng_uniform(&rngs[b])*sum;
+            // Falls back to the last action if rounding leaves target >= sum
+            int action = n - 1;
+            float cumulative = 0.0f;
+            for (int i = 0; i < n - 1; i++) {
+                cumulative += exps[i];
+                if (target < cumulative) {
+                    action = i;
                     break;
                 }
             }
-            in_adr += num_action_types;
+            output[b*num_actions + a] = action;
+            in_adr += n;
         }
     }
 }
 
+// Gumbel-max: argmax(logits + G) with G = -log(-log(u)) samples the same
+// distribution as the softmax without normalizing. The noise for the whole
+// batch is drawn first, so the per-logit work is branch free.
+void _gumbel_multidiscrete(float* input, int* output, float* scratch, PufferRNG* rngs,
+        int batch_size, int logit_sizes[], int num_actions) {
+    int atn_sum = 0;
+    for (int a = 0; a < num_actions; a++) {
+        atn_sum += logit_sizes[a];
+    }
+    for (int b = 0; b < batch_size; b++) {
+        float* noise = scratch + b*atn_sum;
+        for (int i = 0; i < atn_sum; i++) {
+            // Shift away from 0 so the inner log is finite
+            float u = (rng_next(&rngs[b]) >> 8)*(1.0f/16777216.0f) + 0.5f/16777216.0f;
+            noise[i] = input[b*atn_sum + i] - logf(-logf(u));
+        }
+    }
+    _argmax_multidiscrete(scratch, output, batch_size, logit_sizes, num_actions);
+}
+
 void _max_dim1(float* input, float* output, int batch_size, int seq_len, int feature_dim) {
     for (int b = 0; b < batch_size; b++) {
         for (int f = 0; f < feature_dim; f++) {
@@ -356,39 +2549,306 @@ void _max_dim1(float* input, float* output, int batch_size, int seq_len, int fea
     }
 }
 
-// User API. Provided to help organize layers
+// User API. Provided to help organize layers. Every make_* takes an optional
+// arena (NULL allocates from the heap) and has a *_size helper with the exact
+// number of arena bytes it uses. The _make_* variants take their output (and
+// scratch) from a planned activation buffer instead, see PufferGraph.
+
+// Pruned layers are stored block-sparse in a container written by
+// tools/sparsify, as <name>.block_ptr and <name>.block_col (i32) followed by
+// <name>.block_val (f32). Linear and LSTM pick them up automatically and use
+// them in place.
+bool _next_is_sparse(Weights* weights) {
+    Tensor* next = next_tensor(weights);
+    return next != NULL && next->dtype == DTYPE_I32;
+}
+
+// Containers written by tools/pufw_convert store each LSTM already packed
+// (see _lstm_pack_weights) as <name>.weight_fused and <name>.bias_fused, so
+// every net mapping the file shares one copy instead of packing its own.
+bool _next_is_fused(Weights* weights) {
+    Tensor* next = next_tensor(weights);
+    if (next == NULL) {
+        return false;
+    }
+    size_t length = strlen(next->name);
+    return length >= 13 && strcmp(next->name + length - 13, ".weight_fused") == 0;
+}
+
+// The next LSTM's fused matrix and bias: in place if the file stores them
+// packed, else PyTorch's four tensors packed into the buffers passed in
+void _get_lstm_weights(Weights* weights, int input_size, int hidden_size,
+        float** weights_fused, float** bias_fused) {
+    int rows = 4*hidden_size;
+    if (_next_is_fused(weights)) {
+        *weights_fused = get_weights(weights, rows*(input_size + hidden_size));
+        *bias_fused = get_weights(weights, rows);
+        return;
+    }
+    float* weights_input = get_weights(weights, rows*input_size);
+    float* weights_state = get_weights(weights, rows*hidden_size);
+    float* bias_input = get_weights(weights, rows);
+    float* bias_state = get_weights(weights, rows);
+    _lstm_pack_weights(weights_input, weights_state, bias_input, bias_state,
+        *weights_fused, *bias_fused, input_size, hidden_size);
+}
+
+// The kernels index with block_ptr and block_col unchecked, so a corrupt
+// file is rejected here. Returns false and reports the error
+bool _load_block_sparse(Weights* weights, int rows, int cols, BlockSparse* output) {
+    int groups = block_sparse_groups(rows);
+    output->rows = rows;
+    output->cols = cols;
+    output->block_ptr = get_weights_typed(weights, DTYPE_I32, groups + 1);
+    if (output->block_ptr == NULL) {
+        return false;
+    }
+    if (output->block_ptr[0] != 0) {
+        fprintf(stderr, "Error reading weights: block_ptr does not start at 0\n");
+        return false;
+    }
+    for (int g = 0; g < groups; g++) {
+        if (output->block_ptr[g] > output->block_ptr[g + 1]) {
+            fprintf(stderr, "Error reading weights: block_ptr decreases at group %d\n", g);
+            return false;
+        }
+    }
+    // block_ptr[groups] is the block count, so it matches the tensors below
+    int num_blocks = output->block_ptr[groups];
+    output->block_col = get_weights_typed(weights, DTYPE_I32, num_blocks);
+    if (output->block_col == NULL) {
+        return false;
+    }
+    for (int k = 0; k < num_blocks; k++) {
+        if (output->block_col[k] < 0 || output->block_col[k] >= cols) {
+            fprintf(stderr, "Error reading weights: block %d column %d out of range\n",
+                k, output->block_col[k]);
+            return false;
+        }
+    }
+    output->values = get_weights_typed(weights, DTYPE_F32,
+        (size_t)num_blocks*PUFFERNET_SPARSE_BLOCK);
+    return output->values != NULL;
+}
+
+size_t _block_sparse_size(int rows, int num_blocks) {
+    return _block_size((block_sparse_groups(rows) + 1)*sizeof(int32_t))
+        + _block_size(num_blocks*sizeof(int32_t))
+        + _block_size((size_t)num_blocks*PUFFERNET_SPARSE_BLOCK*sizeof(float));
+}
+
+void _carve_block_sparse(char** cursor, int rows, int num_blocks, BlockSparse* output) {
+    output->block_ptr = _carve(cursor, (block_sparse_groups(rows) + 1)*sizeof(int32_t));
+    output->block_col = _carve(cursor, num_blocks*sizeof(int32_t));
+    output->values = _carve(cursor, (size_t)num_blocks*PUFFERNET_SPARSE_BLOCK*sizeof(float));
+}
+
+// weights is NULL when the layer is block-sparse
 typedef struct Linear Linear;
 struct Linear {
     float* output;
     float* weights;
     float* bias;
+    BlockSparse sparse;
     int batch_size;
     int input_dim;
     int output_dim;
+    int tile;  // batch rows per kernel tile, resolved when the layer is built
+    PufferEpilogue epilogue;
 };
 
-Linear* make_linear(Weights* weights, int batch_size, int input_dim, int output_dim) {
-    size_t buffer_size = batch_size*output_dim*sizeof(float);
-    Linear* layer = calloc(1, sizeof(Linear) + buffer_size);
+size_t linear_size(int batch_size, int input_dim, int output_dim) {
+    return _block_size(sizeof(Linear)) + _block_size(batch_size*output_dim*sizeof(float));
+}
+
+Linear* _make_linear(Weights* weights, int batch_size, int input_dim, int output_dim,
+        PufferEpilogue epilogue, float* output, Arena* arena) {
+    size_t size = output ? _block_size(sizeof(Linear)) : linear_size(batch_size, input_dim, output_dim);
+    Linear* layer = _make_block(arena, size);
+    if (layer == NULL) {
+        return NULL;
+    }
+    *layer = (Linear){
+        .output = output ? output : _block_data(layer, sizeof(Linear)),
+        .batch_size = batch_size,
+        .input_dim = input_dim,
+        .output_dim = output_dim,
+        .epilogue = epilogue,
+    };
+    if (_next_is_sparse(weights)) {
+        if (!_load_block_sparse(weights, output_dim, input_dim, &layer->sparse)) {
+            _free_block(arena, layer);
+            return NULL;
+        }
+        layer->tile = _sparse_linear_tile(batch_size, input_dim, output_dim,
+            block_sparse_num_blocks(&layer->sparse));
+    } else {
+        layer->weights = get_weights(weights, output_dim*input_dim);
+        layer->tile = _linear_tile(batch_size, input_dim, output_dim);
+    }
+    layer->bias = get_weights(weights, output_dim);
+    return layer;
+}
+
+Linear* make_linear(Weights* weights, int batch_size, int input_dim, int output_dim, Arena* arena) {
+    return _make_linear(weights, batch_size, input_dim, output_dim,
+        PUFFERNET_EPILOGUE_NONE, NULL, arena);
+}
+
+// Fused Linear+ReLU and Linear+GELU. Same weights and output as a Linear
+// followed by the activation layer, without the second pass over the output
+Linear* make_linear_relu(Weights* weights, int batch_size, int input_dim, int output_dim, Arena* arena) {
+    return _make_linear(weights, batch_size, input_dim, output_dim,
+        PUFFERNET_EPILOGUE_RELU, NULL, arena);
+}
+
+Linear* make_linear_gelu(Weights* weights, int batch_size, int input_dim, int output_dim, Arena* arena) {
+    return _make_linear(weights, batch_size, input_dim, output_dim,
+        PUFFERNET_EPILOGUE_GELU, NULL, arena);
+}
+
+// Prunes dense weights at load time: weights with |w| <= threshold are
+// dropped, then every all-zero block. Block-sparse container weights are used
+// as they are.
+Linear* make_sparse_linear(Weights* weights, int batch_size, int input_dim, int output_dim,
+        float threshold, Arena* arena) {
+    if (_next_is_sparse(weights)) {
+        return make_linear(weights, batch_size, input_dim, output_dim, arena);
+    }
+    float* dense = get_weights(weights, output_dim*input_dim);
+    if (dense == NULL) {
+        return NULL;
+    }
+    int num_blocks = block_sparse_count(dense, output_dim, input_dim, threshold);
+    Linear* layer = _make_block(arena, linear_size(batch_size, input_dim, output_dim)
+        + _block_sparse_size(output_dim, num_blocks));
+    if (layer == NULL) {
+        return NULL;
+    }
+    char* cursor = _block_data(layer, sizeof(Linear));
     *layer = (Linear){
-        .output = (float*)(layer + 1),
-        .weights = get_weights(weights, output_dim*input_dim),
-        .bias = get_weights(weights, output_dim),
+        .output = _carve(&cursor, batch_size*output_dim*sizeof(float)),
         .batch_size = batch_size,
         .input_dim = input_dim,
         .output_dim = output_dim,
     };
+    _carve_block_sparse(&cursor, output_dim, num_blocks, &layer->sparse);
+    block_sparse_pack(dense, output_dim, input_dim, threshold, &layer->sparse);
+    layer->tile = _sparse_linear_tile(batch_size, input_dim, output_dim, num_blocks);
+    layer->bias = get_weights(weights, output_dim);
     return layer;
 }
 
+void _linear_layer(Linear* layer, float* input, float* output, int batch_size,
+        PufferEpilogue epilogue) {
+    if (layer->sparse.block_ptr != NULL) {
+        puffernet_kernels()->sparse_linear(input, &layer->sparse, layer->bias,
+            output, batch_size, epilogue, layer->tile);
+    } else {
+        puffernet_kernels()->linear(input, layer->weights, layer->bias, output,
+            batch_size, layer->input_dim, layer->output_dim, epilogue, layer->tile);
+    }
+}
+
+// Batch rows [start, end) only, so threads can split the batch
+void linear_rows(Linear* layer, float* input, int start, int end) {
+    _linear_layer(layer, input + start*layer->input_dim,
+        layer->output + start*layer->output_dim, end - start, layer->epilogue);
+}
+
 void linear(Linear* layer, float* input) {
-    _linear(input, layer->weights, layer->bias, layer->output,
-        layer->batch_size, layer->input_dim, layer->output_dim);
+    _linear_layer(layer, input, layer->output, layer->batch_size, layer->epilogue);
 }
 
 void linear_accumulate(Linear* layer, float* input) {
-    _linear_accumulate(input, layer->weights, layer->bias, layer->output,
-        layer->batch_size, layer->input_dim, layer->output_dim);
+    _linear_layer(layer, input, layer->output, layer->batch_size,
+        PUFFERNET_EPILOGUE_ACCUMULATE);
+}
+
+// Actor and value heads as one GEMM over atn_sum + 1 packed weight rows, so
+// the hidden state is read once per step. The merged rows land in output and
+// are split into logits [batch x atn_sum] and values [batch]. Consumes the
+// same weights as make_linear for the actor followed by the value head.
+typedef struct ActorValue ActorValue;
+struct ActorValue {
+    float* logits;
+    float* values;
+    float* output;
+    float* weights;
+    float* bias;
+    int batch_size;
+    int input_dim;
+    int atn_sum;
+    int tile;
+};
+
+size_t _actor_value_weights_size(int input_dim, int atn_sum) {
+    return _block_size((atn_sum + 1)*input_dim*sizeof(float))
+        + _block_size((atn_sum + 1)*sizeof(float));
+}
+
+size_t actor_value_size(int batch_size, int input_dim, int atn_sum) {
+    return _block_size(sizeof(ActorValue))
+        + _actor_value_weights_size(input_dim, atn_sum)
+        + _block_size(batch_size*atn_sum*sizeof(float))
+        + _block_size(batch_size*sizeof(float))
+        + _block_size(batch_size*(atn_sum + 1)*sizeof(float));
+}
+
+// Planned when logits is given, then values and output must be too
+ActorValue* _make_actor_value(Weights* weights, int batch_size, int input_dim, int atn_sum,
+        float* logits, float* values, float* output, Arena* arena) {
+    size_t size = logits ? _block_size(sizeof(ActorValue)) + _actor_value_weights_size(input_dim, atn_sum)
+        : actor_value_size(batch_size, input_dim, atn_sum);
+    ActorValue* layer = _make_block(arena, size);
+    if (layer == NULL) {
+        return NULL;
+    }
+    char* cursor = _block_data(layer, sizeof(ActorValue));
+    float* packed = _carve(&cursor, (atn_sum + 1)*input_dim*sizeof(float));
+    float* bias = _carve(&cursor, (atn_sum + 1)*sizeof(float));
+    if (logits == NULL) {
+        logits = _carve(&cursor, batch_size*atn_sum*sizeof(float));
+        values = _carve(&cursor, batch_size*sizeof(float));
+        output = _carve(&cursor, batch_size*(atn_sum + 1)*sizeof(float));
+    }
+    memcpy(packed, get_weights(weights, atn_sum*input_dim), atn_sum*input_dim*sizeof(float));
+    memcpy(bias, get_weights(weights, atn_sum), atn_sum*sizeof(float));
+    memcpy(packed + atn_sum*input_dim, get_weights(weights, input_dim), input_dim*sizeof(float));
+    memcpy(bias + atn_sum, get_weights(weights, 1), sizeof(float));
+    *layer = (ActorValue){
+        .logits = logits,
+        .values = values,
+        .output = output,
+        .weights = packed,
+        .bias = bias,
+        .batch_size = batch_size,
+        .input_dim = input_dim,
+        .atn_sum = atn_sum,
+        .tile = _linear_tile(batch_size, input_dim, atn_sum + 1),
+    };
+    return layer;
+}
+
+ActorValue* make_actor_value(Weights* weights, int batch_size, int input_dim, int atn_sum, Arena* arena) {
+    return _make_actor_value(weights, batch_size, input_dim, atn_sum, NULL, NULL, NULL, arena);
+}
+
+// Batch rows [start, end) only, so threads can split the batch
+void actor_value_rows(ActorValue* layer, float* input, int start, int end) {
+    int atn_sum = layer->atn_sum;
+    int row = atn_sum + 1;
+    puffernet_kernels()->linear(input + start*layer->input_dim, layer->weights, layer->bias,
+        layer->output + start*row, end - start, layer->input_dim, row,
+        PUFFERNET_EPILOGUE_NONE, layer->tile);
+    for (int b = start; b < end; b++) {
+        memcpy(layer->logits + b*atn_sum, layer->output + b*row, atn_sum*sizeof(float));
+        layer->values[b] = layer->output[b*row + atn_sum];
+    }
+}
+
+void actor_value(ActorValue* layer, float* input) {
+    actor_value_rows(layer, input, 0, layer->batch_size);
 }
 
 typedef struct ReLU ReLU;
@@ -398,17 +2858,28 @@ struct ReLU {
     int input_dim;
 };
 
-ReLU* make_relu(int batch_size, int input_dim) {
-    size_t buffer_size = batch_size*input_dim*sizeof(float);
-    ReLU* layer = calloc(1, sizeof(ReLU) + buffer_size);
+size_t relu_size(int batch_size, int input_dim) {
+    return _block_size(sizeof(ReLU)) + _block_size(batch_size*input_dim*sizeof(float));
+}
+
+ReLU* _make_relu(int batch_size, int input_dim, float* output, Arena* arena) {
+    size_t size = output ? _block_size(sizeof(ReLU)) : relu_size(batch_size, input_dim);
+    ReLU* layer = _make_block(arena, size);
+    if (layer == NULL) {
+        return NULL;
+    }
     *layer = (ReLU){
-        .output = (float*)(layer + 1),
+        .output = output ? output : _block_data(layer, sizeof(ReLU)),
         .batch_size = batch_size,
         .input_dim = input_dim,
     };
     return layer;
 }
 
+ReLU* make_relu(int batch_size, int input_dim, Arena* arena) {
+    return _make_relu(batch_size, input_dim, NULL, arena);
+}
+
 void relu(ReLU* layer, float* input) {
     _relu(input, layer->output, layer->batch_size*layer->input_dim);
 }
@@ -420,17 +2891,28 @@ struct GELU {
     int input_dim;
 };
 
-GELU* make_gelu(int batch_size, int input_dim) {
-    size_t buffer_size = batch_size*input_dim*sizeof(float);
-    GELU* layer = calloc(1, sizeof(GELU) + buffer_size);
+size_t gelu_size(int batch_size, int input_dim) {
+    return _block_size(sizeof(GELU)) + _block_size(batch_size*input_dim*sizeof(float));
+}
+
+GELU* _make_gelu(int batch_size, int input_dim, float* output, Arena* arena) {
+    size_t size = output ? _block_size(sizeof(GELU)) : gelu_size(batch_size, input_dim);
+    GELU* layer = _make_block(arena, size);
+    if (layer == NULL) {
+        return NULL;
+    }
     *layer = (GELU){
-        .output = (float*)(layer + 1),
+        .output = output ? output : _block_data(layer, sizeof(GELU)),
         .batch_size = batch_size,
         .input_dim = input_dim,
     };
     return layer;
 }
 
+GELU* make_gelu(int batch_size, int input_dim, Arena* arena) {
+    return _make_gelu(batch_size, input_dim, NULL, arena);
+}
+
 void gelu(GELU* layer, float* input) {
     _gelu(input, layer->output, layer->batch_size*layer->input_dim);
 }
@@ -443,11 +2925,17 @@ struct MaxDim1 {
     int feature_dim;
 };
 
-MaxDim1* make_max_dim1(int batch_size, int seq_len, int feature_dim) {
-    size_t buffer_size = batch_size*feature_dim*sizeof(float);
-    MaxDim1* layer = calloc(1, sizeof(MaxDim1) + buffer_size);
+size_t max_dim1_size(int batch_size, int seq_len, int feature_dim) {
+    return _block_size(sizeof(MaxDim1)) + _block_size(batch_size*feature_dim*sizeof(float));
+}
+
+MaxDim1* make_max_dim1(int batch_size, int seq_len, int feature_dim, Arena* arena) {
+    MaxDim1* layer = _make_block(arena, max_dim1_size(batch_size, seq_len, feature_dim));
+    if (layer == NULL) {
+        return NULL;
+    }
     *layer = (MaxDim1){
-        .output = (float*)(layer + 1),
+        .output = _block_data(layer, sizeof(MaxDim1)),
         .batch_size = batch_size,
         .seq_len = seq_len,
         .feature_dim = feature_dim,
@@ -464,6 +2952,7 @@ struct Conv2D {
     float* output;
     float* weights;
     float* bias;
+    float* scratch;
     int batch_size;
     int in_width;
     int in_height;
@@ -471,17 +2960,50 @@ struct Conv2D {
     int out_channels;
     int kernel_size;
     int stride;
+    int out_width;
+    int out_height;
+    int tile;  // patches per im2col tile, scratch is sized for it
+    PufferEpilogue epilogue;
 };
 
-Conv2D* make_conv2d(Weights* weights, int batch_size, int in_width, int in_height,
+size_t conv2d_size(int batch_size, int in_width, int in_height,
         int in_channels, int out_channels, int kernel_size, int stride) {
-    size_t buffer_size = batch_size*out_channels*in_height*in_width*sizeof(float);
+    int h_out = (in_height - kernel_size)/stride + 1;
+    int w_out = (in_width - kernel_size)/stride + 1;
+    int scratch_size = _conv2d_scratch_size(in_width, in_height, in_channels,
+        out_channels, kernel_size, stride);
+    return _block_size(sizeof(Conv2D))
+        + _block_size(batch_size*out_channels*h_out*w_out*sizeof(float))
+        + _block_size(scratch_size*sizeof(float));
+}
+
+// Planned when output is given, then scratch must hold _conv2d_scratch_size
+// floats. The tile is resolved here once, so retuning later cannot outgrow it
+Conv2D* _make_conv2d(Weights* weights, int batch_size, int in_width, int in_height,
+        int in_channels, int out_channels, int kernel_size, int stride,
+        PufferEpilogue epilogue, float* output, float* scratch, Arena* arena) {
+    int h_out = (in_height - kernel_size)/stride + 1;
+    int w_out = (in_width - kernel_size)/stride + 1;
     int num_weights = out_channels*in_channels*kernel_size*kernel_size;
-    Conv2D* layer = calloc(1, sizeof(Conv2D) + buffer_size);
+    int tile = _conv2d_tile(in_channels, kernel_size, out_channels, h_out*w_out);
+    size_t scratch_size = tile*(in_channels*kernel_size*kernel_size + out_channels)*sizeof(float);
+    size_t size = output ? _block_size(sizeof(Conv2D)) : _block_size(sizeof(Conv2D))
+        + _block_size(batch_size*out_channels*h_out*w_out*sizeof(float))
+        + _block_size(scratch_size);
+    Conv2D* layer = _make_block(arena, size);
+    if (layer == NULL) {
+        return NULL;
+    }
+    if (output == NULL) {
+        char* cursor = _block_data(layer, sizeof(Conv2D));
+        output = _carve(&cursor, batch_size*out_channels*h_out*w_out*sizeof(float));
+        scratch = _carve(&cursor, scratch_size);
+    }
     *layer = (Conv2D){
-        .output = (float*)(layer + 1),
+        .output = output,
         .weights = get_weights(weights, num_weights),
         .bias = get_weights(weights, out_channels),
+        .scratch = scratch,
         .batch_size = batch_size,
         .in_width = in_width,
         .in_height = in_height,
@@ -489,14 +3011,31 @@ Conv2D* make_conv2d(Weights* weights, int batch_size, int in_width, int in_heigh
         .out_channels = out_channels,
         .kernel_size = kernel_size,
         .stride = stride,
+        .out_width = w_out,
+        .out_height = h_out,
+        .tile = tile,
+        .epilogue = epilogue,
     };
     return layer;
 }
 
+Conv2D* make_conv2d(Weights* weights, int batch_size, int in_width, int in_height,
+        int in_channels, int out_channels, int kernel_size, int stride, Arena* arena) {
+    return _make_conv2d(weights, batch_size, in_width, in_height, in_channels,
+        out_channels, kernel_size, stride, PUFFERNET_EPILOGUE_NONE, NULL, NULL, arena);
+}
+
+// Conv2D followed by ReLU, applied to each GEMM tile
+Conv2D* make_conv2d_relu(Weights* weights, int batch_size, int in_width, int in_height,
+        int in_channels, int out_channels, int kernel_size, int stride, Arena* arena) {
+    return _make_conv2d(weights, batch_size, in_width, in_height, in_channels,
+        out_channels, kernel_size, stride, PUFFERNET_EPILOGUE_RELU, NULL, NULL, arena);
+}
+
 void conv2d(Conv2D* layer, float* input) {
-    _conv2d(input, layer->weights, layer->bias, layer->output,
-        layer->batch_size, layer->in_width, layer->in_height,
-        layer->in_channels, layer->out_channels, layer->kernel_size, layer->stride);
+    _conv2d(input, layer->weights, layer->bias, layer->output, layer->scratch,
+        layer->batch_size, layer->in_width, layer->in_height, layer->in_channels,
+        layer->out_channels, layer->kernel_size, layer->stride, layer->tile, layer->epilogue);
 }
 
 typedef struct Conv3D Conv3D;
@@ -514,14 +3053,25 @@ struct Conv3D {
     int stride;
 };
 
-Conv3D* make_conv3d(Weights* weights, int batch_size, int in_width, int in_height, int in_depth,
+size_t conv3d_size(int batch_size, int in_width, int in_height, int in_depth,
         int in_channels, int out_channels, int kernel_size, int stride) {
-    
-    size_t buffer_size = batch_size*out_channels*in_depth*in_height*in_width*sizeof(float);
+    int d_out = (in_depth - kernel_size)/stride + 1;
+    int h_out = (in_height - kernel_size)/stride + 1;
+    int w_out = (in_width - kernel_size)/stride + 1;
+    return _block_size(sizeof(Conv3D))
+        + _block_size(batch_size*out_channels*d_out*h_out*w_out*sizeof(float));
+}
+
+Conv3D* make_conv3d(Weights* weights, int batch_size, int in_width, int in_height, int in_depth,
+        int in_channels, int out_channels, int kernel_size, int stride, Arena* arena) {
     int num_weights = out_channels*in_channels*kernel_size*kernel_size*kernel_size;
-    Conv3D* layer = calloc(1, sizeof(Conv3D) + buffer_size);
+    Conv3D* layer = _make_block(arena, conv3d_size(batch_size, in_width, in_height,
+        in_depth, in_channels, out_channels, kernel_size, stride));
+    if (layer == NULL) {
+        return NULL;
+    }
     *layer = (Conv3D){
-        .output = (float*)(layer + 1),
+        .output = _block_data(layer, sizeof(Conv3D)),
         .weights = get_weights(weights, num_weights),
         .bias = get_weights(weights, out_channels),
         .batch_size = batch_size,
@@ -536,50 +3086,359 @@ Conv3D* make_conv3d(Weights* weights, int batch_size, int in_width, int in_heigh
     return layer;
 }
 
-void conv3d(Conv3D* layer, float* input) {
-    _conv3d(input, layer->weights, layer->bias, layer->output,
-        layer->batch_size, layer->in_width, layer->in_height, layer->in_depth,
-        layer->in_channels, layer->out_channels, layer->kernel_size, layer->stride);
+void conv3d(Conv3D* layer, float* input) {
+    _conv3d(input, layer->weights, layer->bias, layer->output,
+        layer->batch_size, layer->in_width, layer->in_height, layer->in_depth,
+        layer->in_channels, layer->out_channels, layer->kernel_size, layer->stride);
+}
+
+// Block-sparse LSTMs (from tools/sparsify) store only the fused matrix and
+// bias: weights_fused and the unpacked weight pointers are NULL. Pre-packed
+// LSTMs (from tools/pufw_convert) point weights_fused and bias_fused into the
+// file and leave the unpacked pointers NULL.
+typedef struct LSTM LSTM;
+struct LSTM {
+    float* state_h;
+    float* state_c;
+    float* weights_input;
+    float* weights_state;
+    float* bias_input;
+    float*bias_state;
+    float* weights_fused;
+    float* bias_fused;
+    BlockSparse sparse;
+    float *buffer;
+    int batch_size;
+    int input_size;
+    int hidden_size;
+};
+
+// Persistent part of the layer: struct, recurrent state and packed weights
+size_t _lstm_persistent_size(int batch_size, int input_size, int hidden_size) {
+    size_t state_size = batch_size*hidden_size*sizeof(float);
+    size_t cat_size = input_size + hidden_size;
+    return _block_size(sizeof(LSTM)) + 2*_block_size(state_size)
+        + _block_size(4*hidden_size*cat_size*sizeof(float))
+        + _block_size(4*hidden_size*sizeof(float));
+}
+
+size_t lstm_size(int batch_size, int input_size, int hidden_size) {
+    return _lstm_persistent_size(batch_size, input_size, hidden_size)
+        + _block_size(batch_size*(input_size + hidden_size)*sizeof(float));
+}
+
+// Planned when buffer (the [x, h] scratch) is given. The sizes are an upper
+// bound for block-sparse and pre-packed weights, which are not packed here
+LSTM* _make_lstm(Weights* weights, int batch_size, int input_size, int hidden_size,
+        float* buffer, Arena* arena) {
+    int state_size = batch_size*hidden_size;
+    int cat_size = input_size + hidden_size;
+    bool sparse = _next_is_sparse(weights);
+    bool fused = _next_is_fused(weights);
+    size_t size = buffer ? _lstm_persistent_size(batch_size, input_size, hidden_size)
+        : lstm_size(batch_size, input_size, hidden_size);
+    if (sparse || fused) {
+        size -= _block_size(4*hidden_size*cat_size*sizeof(float))
+            + _block_size(4*hidden_size*sizeof(float));
+    }
+    LSTM* layer = _make_block(arena, size);
+    if (layer == NULL) {
+        return NULL;
+    }
+    char* cursor = _block_data(layer, sizeof(LSTM));
+    float* state_h = _carve(&cursor, state_size*sizeof(float));
+    float* state_c = _carve(&cursor, state_size*sizeof(float));
+    if (sparse || fused) {
+        if (buffer == NULL) {
+            buffer = _carve(&cursor, batch_size*cat_size*sizeof(float));
+        }
+        *layer = (LSTM){
+            .state_h = state_h,
+            .state_c = state_c,
+            .buffer = buffer,
+            .batch_size = batch_size,
+            .input_size = input_size,
+            .hidden_size = hidden_size,
+        };
+        if (sparse) {
+            if (!_load_block_sparse(weights, 4*hidden_size, cat_size, &layer->sparse)) {
+                _free_block(arena, layer);
+                return NULL;
+            }
+            layer->bias_fused = get_weights(weights, 4*hidden_size);
+        } else {
+            _get_lstm_weights(weights, input_size, hidden_size, &layer->weights_fused,
+                &layer->bias_fused);
+        }
+        return layer;
+    }
+    float* weights_fused = _carve(&cursor, 4*hidden_size*cat_size*sizeof(float));
+    float* bias_fused = _carve(&cursor, 4*hidden_size*sizeof(float));
+    if (buffer == NULL) {
+        buffer = _carve(&cursor, batch_size*cat_size*sizeof(float));
+    }
+    *layer = (LSTM){
+        .state_h = state_h,
+        .state_c = state_c,
+        .weights_input = get_weights(weights, 4*hidden_size*input_size),
+        .weights_state = get_weights(weights, 4*hidden_size*hidden_size),
+        .bias_input = get_weights(weights, 4*hidden_size),
+        .bias_state = get_weights(weights, 4*hidden_size),
+        .weights_fused = weights_fused,
+        .bias_fused = bias_fused,
+        .buffer = buffer,
+        .batch_size = batch_size,
+        .input_size = input_size,
+        .hidden_size = hidden_size,
+
+    };
+    _lstm_pack_weights(layer->weights_input, layer->weights_state,
+        layer->bias_input, layer->bias_state, layer->weights_fused,
+        layer->bias_fused, input_size, hidden_size);
+    return layer;
+}
+
+LSTM* make_lstm(Weights* weights, int batch_size, int input_size, int hidden_size, Arena* arena) {
+    return _make_lstm(weights, batch_size, input_size, hidden_size, NULL, arena);
+}
+
+// Packs the dense weights and prunes the fused matrix like make_sparse_linear
+LSTM* make_sparse_lstm(Weights* weights, int batch_size, int input_size, int hidden_size,
+        float threshold, Arena* arena) {
+    if (_next_is_sparse(weights)) {
+        return make_lstm(weights, batch_size, input_size, hidden_size, arena);
+    }
+    int rows = 4*hidden_size;
+    int cat_size = input_size + hidden_size;
+    float* packed_buffer = calloc((size_t)rows*cat_size, sizeof(float));
+    float* bias_buffer = calloc(rows, sizeof(float));
+    if (packed_buffer == NULL || bias_buffer == NULL) {
+        perror("Error allocating LSTM weights");
+        free(packed_buffer);
+        free(bias_buffer);
+        return NULL;
+    }
+    float* packed = packed_buffer;
+    float* bias = bias_buffer;
+    _get_lstm_weights(weights, input_size, hidden_size, &packed, &bias);
+    int num_blocks = block_sparse_count(packed, rows, cat_size, threshold);
+    size_t state_size = batch_size*hidden_size*sizeof(float);
+    LSTM* layer = _make_block(arena, _block_size(sizeof(LSTM)) + 2*_block_size(state_size)
+        + _block_size(rows*sizeof(float)) + _block_size(batch_size*cat_size*sizeof(float))
+        + _block_sparse_size(rows, num_blocks));
+    if (layer == NULL) {
+        free(packed_buffer);
+        free(bias_buffer);
+        return NULL;
+    }
+    char* cursor = _block_data(layer, sizeof(LSTM));
+    *layer = (LSTM){
+        .state_h = _carve(&cursor, state_size),
+        .state_c = _carve(&cursor, state_size),
+        .bias_fused = _carve(&cursor, rows*sizeof(float)),
+        .buffer = _carve(&cursor, batch_size*cat_size*sizeof(float)),
+        .batch_size = batch_size,
+        .input_size = input_size,
+        .hidden_size = hidden_size,
+    };
+    _carve_block_sparse(&cursor, rows, num_blocks, &layer->sparse);
+    block_sparse_pack(packed, rows, cat_size, threshold, &layer->sparse);
+    memcpy(layer->bias_fused, bias, rows*sizeof(float));
+    free(packed_buffer);
+    free(bias_buffer);
+    return layer;
+}
+
+// Cell update of batch rows [start, end) and hidden units [unit_start,
+// unit_end) from the [x, h] already in buffer
+void lstm_cell(LSTM* layer, int start, int end, int unit_start, int unit_end) {
+    int hidden_size = layer->hidden_size;
+    int cat_size = layer->input_size + hidden_size;
+    float* buffer = layer->buffer + start*cat_size;
+    float* state_h = layer->state_h + start*hidden_size;
+    float* state_c = layer->state_c + start*hidden_size;
+    if (layer->sparse.block_ptr != NULL) {
+        puffernet_kernels()->sparse_lstm(buffer, state_h, state_c, &layer->sparse,
+            layer->bias_fused, end - start, layer->input_size, hidden_size,
+            unit_start, unit_end);
+    } else {
+        puffernet_kernels()->lstm(buffer, state_h, state_c, layer->weights_fused,
+            layer->bias_fused, end - start, layer->input_size, hidden_size,
+            unit_start, unit_end);
+    }
+}
+
+// Batch rows [start, end) only, so threads can split the batch
+void lstm_rows(LSTM* layer, float* input, int start, int end) {
+    int hidden_size = layer->hidden_size;
+    _lstm_concat(input + start*layer->input_size, layer->state_h + start*hidden_size,
+        layer->buffer + start*(layer->input_size + hidden_size), end - start,
+        layer->input_size, hidden_size);
+    lstm_cell(layer, start, end, 0, hidden_size);
 }
 
-typedef struct LSTM LSTM;
-struct LSTM {
+void lstm(LSTM* layer, float* input) {
+    lstm_rows(layer, input, 0, layer->batch_size);
+}
+
+// Recurrent state of one agent, kept outside the layer so any number of
+// agents can share one set of weights. lstm_gather copies the states of the
+// agents that act this step into batch rows [0, n) and lstm_scatter writes
+// the new state back (2*hidden_size floats each way, next to 8*hidden_size^2
+// MACs for the cell). The sampling stream lives here too, so an agent draws
+// the same actions whichever batch row it lands in.
+typedef struct LSTMState LSTMState;
+struct LSTMState {
     float* state_h;
     float* state_c;
-    float* weights_input;
-    float* weights_state;
-    float* bias_input;
-    float*bias_state;
-    float *buffer;
-    int batch_size;
-    int input_size;
+    PufferRNG rng;
     int hidden_size;
 };
 
-LSTM* make_lstm(Weights* weights, int batch_size, int input_size, int hidden_size) {
-    int state_size = batch_size*hidden_size;
-    LSTM* layer = calloc(1, sizeof(LSTM) + 6*state_size*sizeof(float));
-    float* buffer = (float*)(layer + 1);
-    *layer = (LSTM){
-        .state_h = buffer,
-        .state_c = buffer + state_size,
-        .weights_input = get_weights(weights, 4*hidden_size*input_size),
-        .weights_state = get_weights(weights, 4*hidden_size*hidden_size),
-        .bias_input = get_weights(weights, 4*hidden_size),
-        .bias_state = get_weights(weights, 4*hidden_size),
-        .buffer = buffer + 2*state_size,
-        .batch_size = batch_size,
-        .input_size = input_size,
-        .hidden_size = hidden_size,
+size_t lstm_state_size(int hidden_size) {
+    return _block_size(sizeof(LSTMState)) + 2*_block_size(hidden_size*sizeof(float));
+}
 
-    };
-    return layer;
+// Zero state, sampling stream 0 of seed 0. Reseed with lstm_state_seed
+LSTMState* make_lstm_state(int hidden_size, Arena* arena) {
+    LSTMState* state = _make_block(arena, lstm_state_size(hidden_size));
+    if (state == NULL) {
+        return NULL;
+    }
+    char* cursor = _block_data(state, sizeof(LSTMState));
+    state->state_h = _carve(&cursor, hidden_size*sizeof(float));
+    state->state_c = _carve(&cursor, hidden_size*sizeof(float));
+    state->hidden_size = hidden_size;
+    rng_seed(&state->rng, 0, 0);
+    return state;
 }
 
-void lstm(LSTM* layer, float* input) {
-    _lstm(input, layer->state_h, layer->state_c, layer->weights_input,
-        layer->weights_state, layer->bias_input, layer->bias_state,
-        layer->buffer, layer->batch_size, layer->input_size, layer->hidden_size);
+void lstm_state_seed(LSTMState* state, uint64_t seed, uint64_t stream) {
+    rng_seed(&state->rng, seed, stream);
+}
+
+// Start of an episode
+void lstm_state_reset(LSTMState* state) {
+    memset(state->state_h, 0, state->hidden_size*sizeof(float));
+    memset(state->state_c, 0, state->hidden_size*sizeof(float));
+}
+
+void lstm_gather(LSTM* layer, LSTMState** states, int n) {
+    int hidden_size = layer->hidden_size;
+    assert(n <= layer->batch_size);
+    for (int b = 0; b < n; b++) {
+        assert(states[b]->hidden_size == hidden_size);
+        memcpy(layer->state_h + b*hidden_size, states[b]->state_h, hidden_size*sizeof(float));
+        memcpy(layer->state_c + b*hidden_size, states[b]->state_c, hidden_size*sizeof(float));
+    }
+}
+
+void lstm_scatter(LSTM* layer, LSTMState** states, int n) {
+    int hidden_size = layer->hidden_size;
+    for (int b = 0; b < n; b++) {
+        memcpy(states[b]->state_h, layer->state_h + b*hidden_size, hidden_size*sizeof(float));
+        memcpy(states[b]->state_c, layer->state_c + b*hidden_size, hidden_size*sizeof(float));
+    }
+}
+
+// Copies state into snapshot, sampling stream included, so restoring and
+// stepping again draws the same actions
+void lstm_state_save(LSTMState* state, LSTMState* snapshot) {
+    assert(snapshot->hidden_size == state->hidden_size);
+    memcpy(snapshot->state_h, state->state_h, state->hidden_size*sizeof(float));
+    memcpy(snapshot->state_c, state->state_c, state->hidden_size*sizeof(float));
+    snapshot->rng = state->rng;
+}
+
+void lstm_state_restore(LSTMState* state, LSTMState* snapshot) {
+    lstm_state_save(snapshot, state);
+}
+
+// Fixed pool of LSTMStates for search: every slot is carved up front in one
+// block and handed out from a free list, so forking during a move never
+// allocates. Released slots are reused first while they are still in cache.
+typedef struct LSTMStatePool LSTMStatePool;
+struct LSTMStatePool {
+    LSTMState* states;
+    LSTMState** free_list;
+    int num_free;
+    int capacity;
+    int hidden_size;
+};
+
+size_t lstm_state_pool_size(int capacity, int hidden_size) {
+    return _block_size(sizeof(LSTMStatePool))
+        + _block_size(capacity*sizeof(LSTMState))
+        + _block_size(capacity*sizeof(LSTMState*))
+        + (size_t)capacity*2*_block_size(hidden_size*sizeof(float));
+}
+
+LSTMStatePool* make_lstm_state_pool(int capacity, int hidden_size, Arena* arena) {
+    LSTMStatePool* pool = _make_block(arena, lstm_state_pool_size(capacity, hidden_size));
+    if (pool == NULL) {
+        return NULL;
+    }
+    char* cursor = _block_data(pool, sizeof(LSTMStatePool));
+    pool->states = _carve(&cursor, capacity*sizeof(LSTMState));
+    pool->free_list = _carve(&cursor, capacity*sizeof(LSTMState*));
+    pool->capacity = capacity;
+    pool->hidden_size = hidden_size;
+    for (int i = 0; i < capacity; i++) {
+        LSTMState* state = &pool->states[i];
+        state->state_h = _carve(&cursor, hidden_size*sizeof(float));
+        state->state_c = _carve(&cursor, hidden_size*sizeof(float));
+        state->hidden_size = hidden_size;
+        // Handed out from the front first
+        pool->free_list[capacity - 1 - i] = state;
+    }
+    pool->num_free = capacity;
+    return pool;
+}
+
+// Zero state, or NULL when the pool is exhausted
+LSTMState* lstm_state_alloc(LSTMStatePool* pool) {
+    if (pool->num_free == 0) {
+        return NULL;
+    }
+    LSTMState* state = pool->free_list[--pool->num_free];
+    lstm_state_reset(state);
+    rng_seed(&state->rng, 0, 0);
+    return state;
+}
+
+void lstm_state_release(LSTMStatePool* pool, LSTMState* state) {
+    assert(state >= pool->states && state < pool->states + pool->capacity);
+    assert(pool->num_free < pool->capacity);
+    pool->free_list[pool->num_free++] = state;
+}
+
+void lstm_state_release_all(LSTMStatePool* pool, LSTMState** states, int n) {
+    for (int i = n - 1; i >= 0; i--) {
+        lstm_state_release(pool, states[i]);
+    }
+}
+
+// n copies of parent's recurrent state in children. Child i samples from
+// stream i of a seed drawn from parent's stream, so rollouts from the same
+// position diverge while parent itself is left untouched. Returns false and
+// forks nothing if the pool has fewer than n free slots.
+bool lstm_state_fork(LSTMStatePool* pool, LSTMState* parent, LSTMState** children, int n) {
+    assert(parent->hidden_size == pool->hidden_size);
+    if (n > pool->num_free) {
+        return false;
+    }
+    PufferRNG rng = parent->rng;
+    // Separate statements, the order of two draws in one expression is unspecified
+    uint64_t hi = rng_next(&rng);
+    uint64_t lo = rng_next(&rng);
+    uint64_t seed = hi << 32 | lo;
+    for (int i = 0; i < n; i++) {
+        LSTMState* child = children[i] = pool->free_list[--pool->num_free];
+        memcpy(child->state_h, parent->state_h, pool->hidden_size*sizeof(float));
+        memcpy(child->state_c, parent->state_c, pool->hidden_size*sizeof(float));
+        rng_seed(&child->rng, seed, i);
+    }
+    return true;
 }
 
 typedef struct Embedding Embedding;
@@ -591,11 +3450,18 @@ struct Embedding {
     int embedding_dim;
 };
 
-Embedding* make_embedding(Weights* weights, int batch_size, int num_embeddings, int embedding_dim) {
-    size_t output_size = batch_size*embedding_dim*sizeof(float);
-    Embedding* layer = (Embedding*)calloc(1, sizeof(Embedding) + batch_size + output_size);
+size_t embedding_size(int batch_size, int num_embeddings, int embedding_dim) {
+    return _block_size(sizeof(Embedding)) + _block_size(batch_size*embedding_dim*sizeof(float));
+}
+
+Embedding* make_embedding(Weights* weights, int batch_size, int num_embeddings,
+        int embedding_dim, Arena* arena) {
+    Embedding* layer = _make_block(arena, embedding_size(batch_size, num_embeddings, embedding_dim));
+    if (layer == NULL) {
+        return NULL;
+    }
     *layer = (Embedding){
-        .output = (float*)(layer + 1),
+        .output = _block_data(layer, sizeof(Embedding)),
         .weights = get_weights(weights, num_embeddings*embedding_dim),
         .batch_size = batch_size,
         .num_embeddings = num_embeddings,
@@ -617,11 +3483,17 @@ struct LayerNorm {
     int input_dim;
 };
 
-LayerNorm* make_layernorm(Weights* weights, int batch_size, int input_dim) {
-    size_t output_size = batch_size*input_dim*sizeof(float);
-    LayerNorm* layer = calloc(1, sizeof(LayerNorm) + output_size);
+size_t layernorm_size(int batch_size, int input_dim) {
+    return _block_size(sizeof(LayerNorm)) + _block_size(batch_size*input_dim*sizeof(float));
+}
+
+LayerNorm* make_layernorm(Weights* weights, int batch_size, int input_dim, Arena* arena) {
+    LayerNorm* layer = _make_block(arena, layernorm_size(batch_size, input_dim));
+    if (layer == NULL) {
+        return NULL;
+    }
     *layer = (LayerNorm){
-        .output = (float*)(layer + 1),
+        .output = _block_data(layer, sizeof(LayerNorm)),
         .weights = get_weights(weights, input_dim),
         .bias = get_weights(weights, input_dim),
         .batch_size = batch_size,
@@ -643,11 +3515,17 @@ struct OneHot {
     int num_classes;
 };
 
-OneHot* make_one_hot(int batch_size, int input_size, int num_classes) {
-    size_t buffer_size = batch_size*input_size*num_classes*sizeof(int);
-    OneHot* layer = calloc(1, sizeof(OneHot) + buffer_size);
+size_t one_hot_size(int batch_size, int input_size, int num_classes) {
+    return _block_size(sizeof(OneHot)) + _block_size(batch_size*input_size*num_classes*sizeof(int));
+}
+
+OneHot* make_one_hot(int batch_size, int input_size, int num_classes, Arena* arena) {
+    OneHot* layer = _make_block(arena, one_hot_size(batch_size, input_size, num_classes));
+    if (layer == NULL) {
+        return NULL;
+    }
     *layer = (OneHot){
-        .output = (int*)(layer + 1),
+        .output = _block_data(layer, sizeof(OneHot)),
         .batch_size = batch_size,
         .input_size = input_size,
         .num_classes = num_classes,
@@ -667,11 +3545,17 @@ struct CatDim1 {
     int y_size;
 };
 
-CatDim1* make_cat_dim1(int batch_size, int x_size, int y_size) {
-    size_t buffer_size = batch_size*(x_size + y_size)*sizeof(float);
-    CatDim1* layer = calloc(1, sizeof(CatDim1) + buffer_size);
+size_t cat_dim1_size(int batch_size, int x_size, int y_size) {
+    return _block_size(sizeof(CatDim1)) + _block_size(batch_size*(x_size + y_size)*sizeof(float));
+}
+
+CatDim1* make_cat_dim1(int batch_size, int x_size, int y_size, Arena* arena) {
+    CatDim1* layer = _make_block(arena, cat_dim1_size(batch_size, x_size, y_size));
+    if (layer == NULL) {
+        return NULL;
+    }
     *layer = (CatDim1){
-        .output = (float*)(layer + 1),
+        .output = _block_data(layer, sizeof(CatDim1)),
         .batch_size = batch_size,
         .x_size = x_size,
         .y_size = y_size,
@@ -688,13 +3572,44 @@ struct Multidiscrete {
     int batch_size;
     int logit_sizes[32];
     int num_actions;
+    int atn_sum;
+    float* scratch;
+    PufferRNG* rngs;
 };
 
-Multidiscrete* make_multidiscrete(int batch_size, int logit_sizes[], int num_actions) {
-    Multidiscrete* layer = calloc(1, sizeof(Multidiscrete));
+size_t multidiscrete_size(int batch_size, int logit_sizes[], int num_actions) {
+    int atn_sum = 0;
+    for (int i = 0; i < num_actions; i++) {
+        atn_sum += logit_sizes[i];
+    }
+    return _block_size(sizeof(Multidiscrete))
+        + _block_size(batch_size*atn_sum*sizeof(float))
+        + _block_size(batch_size*sizeof(PufferRNG));
+}
+
+// Agent b samples from stream b of seed
+void multidiscrete_seed(Multidiscrete* layer, uint64_t seed) {
+    for (int b = 0; b < layer->batch_size; b++) {
+        rng_seed(&layer->rngs[b], seed, b);
+    }
+}
+
+// Seeded with 0, reseed with multidiscrete_seed
+Multidiscrete* make_multidiscrete(int batch_size, int logit_sizes[], int num_actions, Arena* arena) {
+    Multidiscrete* layer = _make_block(arena, multidiscrete_size(batch_size, logit_sizes, num_actions));
+    if (layer == NULL) {
+        return NULL;
+    }
     layer->batch_size = batch_size;
     layer->num_actions = num_actions;
     memcpy(layer->logit_sizes, logit_sizes, num_actions*sizeof(int));
+    for (int i = 0; i < num_actions; i++) {
+        layer->atn_sum += logit_sizes[i];
+    }
+    char* cursor = _block_data(layer, sizeof(Multidiscrete));
+    layer->scratch = _carve(&cursor, batch_size*layer->atn_sum*sizeof(float));
+    layer->rngs = _carve(&cursor, batch_size*sizeof(PufferRNG));
+    multidiscrete_seed(layer, 0);
     return layer;
 }
 
@@ -703,51 +3618,316 @@ void argmax_multidiscrete(Multidiscrete* layer, float* input, int* output) {
 }
 
 void softmax_multidiscrete(Multidiscrete* layer, float* input, int* output) {
-    _softmax_multidiscrete(input, output, layer->batch_size, layer->logit_sizes, layer->num_actions);
+    _softmax_multidiscrete(input, output, layer->scratch, layer->rngs,
+        layer->batch_size, layer->logit_sizes, layer->num_actions);
+}
+
+// Samples agents [start, end) only. Agents use their own stream and scratch,
+// so disjoint ranges can run on different threads
+void softmax_multidiscrete_rows(Multidiscrete* layer, float* input, int* output, int start, int end) {
+    _softmax_multidiscrete(input + start*layer->atn_sum, output + start*layer->num_actions,
+        layer->scratch + start*layer->atn_sum, layer->rngs + start,
+        end - start, layer->logit_sizes, layer->num_actions);
+}
+
+void gumbel_multidiscrete(Multidiscrete* layer, float* input, int* output) {
+    _gumbel_multidiscrete(input, output, layer->scratch, layer->rngs,
+        layer->batch_size, layer->logit_sizes, layer->num_actions);
+}
+
+// Activation memory planner. A graph lists the activations of a forward pass
+// in execution order: each node is one layer output (size bytes for the whole
+// batch, 0 if the layer writes persistent state such as an LSTM) plus scratch
+// bytes it needs only while it runs. graph_plan computes when every output
+// is last read and packs the outputs into a few shared slots, reusing a slot
+// once its tensor is dead. Elementwise nodes marked inplace write over their
+// input if nothing reads it afterwards, so a chain of layers ping-pongs
+// between two slots. Nodes marked output (e.g. logits and values read after
+// the forward pass) get a slot of their own and are never overwritten.
+#define PUFFERNET_GRAPH_NODES 64
+#define PUFFERNET_GRAPH_INPUTS 4
+#define PUFFERNET_GRAPH_INPUT -1
+
+typedef struct GraphNode GraphNode;
+struct GraphNode {
+    const char* name;
+    size_t size;
+    size_t scratch;
+    int inputs[PUFFERNET_GRAPH_INPUTS];
+    int num_inputs;
+    bool inplace;
+    bool output;
+    // Filled by graph_plan
+    int slot;
+    int scratch_slot;
+    size_t offset;
+    size_t scratch_offset;
+};
+
+typedef struct PufferGraph PufferGraph;
+struct PufferGraph {
+    GraphNode nodes[PUFFERNET_GRAPH_NODES];
+    int num_nodes;
+    size_t slot_sizes[2*PUFFERNET_GRAPH_NODES];
+    int num_slots;
+    // Filled by graph_plan: planned bytes and bytes with a buffer per tensor
+    size_t size;
+    size_t unplanned_size;
+};
+
+// Adds a node reading input (a node id or PUFFERNET_GRAPH_INPUT) and returns its id
+int graph_add(PufferGraph* graph, const char* name, size_t size, int input) {
+    assert(graph->num_nodes < PUFFERNET_GRAPH_NODES);
+    int id = graph->num_nodes++;
+    graph->nodes[id] = (GraphNode){
+        .name = name,
+        .size = size,
+        .inputs = {input},
+        .num_inputs = 1,
+    };
+    return id;
+}
+
+void graph_add_input(PufferGraph* graph, int node, int input) {
+    GraphNode* n = &graph->nodes[node];
+    assert(n->num_inputs < PUFFERNET_GRAPH_INPUTS);
+    n->inputs[n->num_inputs++] = input;
+}
+
+int graph_find(PufferGraph* graph, const char* name) {
+    for (int i = 0; i < graph->num_nodes; i++) {
+        if (strcmp(graph->nodes[i].name, name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Smallest free slot that fits, else the largest free slot (which grows),
+// else a new slot. Free means the tensor in it was last read before step.
+int _graph_slot(PufferGraph* graph, int* busy_until, int step, size_t size) {
+    int fit = -1;
+    int largest = -1;
+    for (int s = 0; s < graph->num_slots; s++) {
+        if (busy_until[s] >= step) {
+            continue;
+        }
+        size_t slot_size = graph->slot_sizes[s];
+        if (slot_size >= size && (fit < 0 || slot_size < graph->slot_sizes[fit])) {
+            fit = s;
+        }
+        if (largest < 0 || slot_size > graph->slot_sizes[largest]) {
+            largest = s;
+        }
+    }
+    int slot = fit >= 0 ? fit : largest;
+    if (slot < 0) {
+        slot = graph->num_slots++;
+        graph->slot_sizes[slot] = 0;
+    }
+    if (graph->slot_sizes[slot] < size) {
+        graph->slot_sizes[slot] = size;
+    }
+    return slot;
+}
+
+// Returns the planned activation bytes. Offsets are PUFFERNET_ALIGN aligned
+size_t graph_plan(PufferGraph* graph) {
+    int n = graph->num_nodes;
+    int last_use[PUFFERNET_GRAPH_NODES];
+    int busy_until[2*PUFFERNET_GRAPH_NODES];
+    for (int i = 0; i < n; i++) {
+        last_use[i] = graph->nodes[i].output ? n : i;
+    }
+    for (int i = 0; i < n; i++) {
+        GraphNode* node = &graph->nodes[i];
+        for (int k = 0; k < node->num_inputs; k++) {
+            int input = node->inputs[k];
+            if (input >= 0 && last_use[input] < i) {
+                last_use[input] = i;
+            }
+        }
+    }
+
+    graph->num_slots = 0;
+    graph->unplanned_size = 0;
+    for (int i = 0; i < n; i++) {
+        GraphNode* node = &graph->nodes[i];
+        size_t size = _block_size(node->size);
+        size_t scratch = _block_size(node->scratch);
+        graph->unplanned_size += size + scratch;
+        node->slot = -1;
+        node->scratch_slot = -1;
+        // Inputs are still busy at step i, so scratch cannot alias them and
+        // the output cannot alias the scratch
+        if (scratch > 0) {
+            node->scratch_slot = _graph_slot(graph, busy_until, i, scratch);
+            busy_until[node->scratch_slot] = i;
+        }
+        if (size == 0) {
+            continue;
+        }
+        int input = node->inputs[0];
+        if (node->inplace && input >= 0 && last_use[input] == i && graph->nodes[input].slot >= 0) {
+            node->slot = graph->nodes[input].slot;
+            if (graph->slot_sizes[node->slot] < size) {
+                graph->slot_sizes[node->slot] = size;
+            }
+        } else if (node->output) {
+            // Outputs never share a slot, so batch slices computed by
+            // different threads cannot overwrite each other's inputs
+            node->slot = graph->num_slots++;
+            graph->slot_sizes[node->slot] = size;
+        } else {
+            node->slot = _graph_slot(graph, busy_until, i, size);
+        }
+        busy_until[node->slot] = last_use[i];
+    }
+
+    size_t slot_offsets[2*PUFFERNET_GRAPH_NODES];
+    graph->size = 0;
+    for (int s = 0; s < graph->num_slots; s++) {
+        slot_offsets[s] = graph->size;
+        graph->size += graph->slot_sizes[s];
+    }
+    for (int i = 0; i < n; i++) {
+        GraphNode* node = &graph->nodes[i];
+        node->offset = node->slot >= 0 ? slot_offsets[node->slot] : 0;
+        node->scratch_offset = node->scratch_slot >= 0 ? slot_offsets[node->scratch_slot] : 0;
+    }
+    return graph->size;
+}
+
+// Output and scratch of a named node inside a buffer of graph->size bytes
+float* graph_output(PufferGraph* graph, void* activations, const char* name) {
+    int node = graph_find(graph, name);
+    assert(node >= 0 && graph->nodes[node].slot >= 0);
+    return (float*)((char*)activations + graph->nodes[node].offset);
+}
+
+float* graph_scratch(PufferGraph* graph, void* activations, const char* name) {
+    int node = graph_find(graph, name);
+    assert(node >= 0 && graph->nodes[node].scratch_slot >= 0);
+    return (float*)((char*)activations + graph->nodes[node].scratch_offset);
+}
+
+void graph_print(PufferGraph* graph) {
+    for (int i = 0; i < graph->num_nodes; i++) {
+        GraphNode* node = &graph->nodes[i];
+        printf("  %-10s %10zu bytes", node->name, node->size);
+        if (node->slot >= 0) {
+            printf(" at %10zu (slot %d)", node->offset, node->slot);
+        }
+        if (node->scratch_slot >= 0) {
+            printf("  scratch %zu at %zu (slot %d)", node->scratch,
+                node->scratch_offset, node->scratch_slot);
+        }
+        printf("\n");
+    }
+    printf("  planned %zu bytes in %d slots, unplanned %zu bytes\n",
+        graph->size, graph->num_slots, graph->unplanned_size);
+}
+
+// Default models. Each network lives in a single arena: pass NULL to have
+// make_* allocate one of exactly *_size bytes (freed in one call by free_*),
+// or a caller arena with that much room left, e.g. one per thread for
+// replicas. Networks in a caller arena are released with the arena and their
+// free_* does nothing. Their activations are planned with a PufferGraph, so
+// layer outputs share memory: only the recurrent state and the actor/value
+// outputs hold their values after a forward pass.
+
+// Points *arena at a new arena of size bytes if the caller gave none.
+// Returns the arena the network owns, or NULL if it does not own one
+Arena* _network_arena(Arena** arena, size_t size) {
+    if (*arena != NULL) {
+        return NULL;
+    }
+    *arena = make_allocator(size);
+    return *arena;
 }
 
-// Default models
+// Logits and values are outputs of their own, the merged GEMM rows are scratch
+void _actor_value_graph(PufferGraph* graph, int input, int num_agents, int atn_sum) {
+    size_t row = num_agents*sizeof(float);
+    int logits = graph_add(graph, "logits", row*atn_sum, input);
+    graph->nodes[logits].scratch = row*(atn_sum + 1);
+    graph->nodes[logits].output = true;
+    int values = graph_add(graph, "values", row, input);
+    graph->nodes[values].output = true;
+}
 
 typedef struct Default Default;
 struct Default {
     int num_agents;
     float* obs;
     Linear* encoder;
-    ReLU* relu1;
-    Linear* actor;
-    Linear* value_fn;
+    ActorValue* actor_value;
     Multidiscrete* multidiscrete;
+    float* activations;
+    Arena* arena;
 };
 
-Default* make_default(Weights* weights, int num_agents, int input_dim, int hidden_dim, int action_dim) {
-    Default* net = calloc(1, sizeof(Default));
+void default_graph(PufferGraph* graph, int num_agents, int hidden_dim, int action_dim) {
+    *graph = (PufferGraph){0};
+    size_t row = num_agents*sizeof(float);
+    int encoder = graph_add(graph, "encoder", row*hidden_dim, PUFFERNET_GRAPH_INPUT);
+    _actor_value_graph(graph, encoder, num_agents, action_dim);
+    graph_plan(graph);
+}
+
+size_t default_size(int num_agents, int input_dim, int hidden_dim, int action_dim) {
+    PufferGraph graph;
+    default_graph(&graph, num_agents, hidden_dim, action_dim);
+    return _block_size(sizeof(Default))
+        + _block_size(num_agents*input_dim*sizeof(float))
+        + _block_size(graph.size)
+        + _block_size(sizeof(Linear))
+        + _block_size(sizeof(ActorValue)) + _actor_value_weights_size(hidden_dim, action_dim)
+        + multidiscrete_size(num_agents, &action_dim, 1);
+}
+
+Default* make_default(Weights* weights, int num_agents, int input_dim,
+        int hidden_dim, int action_dim, Arena* arena) {
+    Arena* owned = _network_arena(&arena,
+        default_size(num_agents, input_dim, hidden_dim, action_dim));
+    if (arena == NULL) {
+        return NULL;
+    }
+    PufferGraph graph;
+    default_graph(&graph, num_agents, hidden_dim, action_dim);
+    Default* net = _make_block(arena, sizeof(Default));
+    float* obs = _make_block(arena, num_agents*input_dim*sizeof(float));
+    float* act = _make_block(arena, graph.size);
+    if (net == NULL || obs == NULL || act == NULL) {
+        free_allocator(owned);
+        return NULL;
+    }
     net->num_agents = num_agents;
-    net->obs = (float*)calloc(num_agents*input_dim, sizeof(float));
-    net->encoder = make_linear(weights, num_agents, input_dim, hidden_dim);
-    net->relu1 = make_relu(num_agents, hidden_dim);
-    net->actor = make_linear(weights, num_agents, hidden_dim, action_dim);
-    net->value_fn = make_linear(weights, num_agents, hidden_dim, 1);
+    net->arena = owned;
+    net->obs = obs;
+    net->activations = act;
+    net->encoder = _make_linear(weights, num_agents, input_dim, hidden_dim,
+        PUFFERNET_EPILOGUE_RELU, graph_output(&graph, act, "encoder"), arena);
+    net->actor_value = _make_actor_value(weights, num_agents, hidden_dim, action_dim,
+        graph_output(&graph, act, "logits"), graph_output(&graph, act, "values"),
+        graph_scratch(&graph, act, "logits"), arena);
     int logit_sizes[1] = {action_dim};
-    net->multidiscrete = make_multidiscrete(num_agents, logit_sizes, 1);
+    net->multidiscrete = make_multidiscrete(num_agents, logit_sizes, 1, arena);
+    if (net->encoder == NULL || net->actor_value == NULL || net->multidiscrete == NULL) {
+        free_allocator(owned);
+        return NULL;
+    }
     return net;
 }
 
 void free_default(Default* net) {
-    free(net->obs);
-    free(net->encoder);
-    free(net->relu1);
-    free(net->actor);
-    free(net->value_fn);
-    free(net->multidiscrete);
-    free(net);
+    free_allocator(net->arena);
 }
 
 void forward_default(Default* net, float* observations, int* actions) {
     linear(net->encoder, observations);
-    relu(net->relu1, net->encoder->output);
-    linear(net->actor, net->relu1->output);
-    linear(net->value_fn, net->relu1->output);
-    softmax_multidiscrete(net->multidiscrete, net->actor->output, actions);
+    actor_value(net->actor_value, net->encoder->output);
+    softmax_multidiscrete(net->multidiscrete, net->actor_value->logits, actions);
 }
 
 typedef struct LinearLSTM LinearLSTM;
@@ -755,106 +3935,563 @@ struct LinearLSTM {
     int num_agents;
     float* obs;
     Linear* encoder;
-    GELU* gelu1;
     LSTM* lstm;
-    Linear* actor;
-    Linear* value_fn;
+    ActorValue* actor_value;
     Multidiscrete* multidiscrete;
+    float* activations;
+    Arena* arena;
 };
 
-LinearLSTM* make_linearlstm(Weights* weights, int num_agents, int input_dim, int logit_sizes[], int num_actions) {
-    LinearLSTM* net = calloc(1, sizeof(LinearLSTM));
-    net->num_agents = num_agents;
-    net->obs = calloc(num_agents*input_dim, sizeof(float));
-    net->encoder = make_linear(weights, num_agents, input_dim, 128);
-    net->gelu1 = make_gelu(num_agents, 128);
+void linearlstm_graph(PufferGraph* graph, int num_agents, int input_dim, int atn_sum) {
+    *graph = (PufferGraph){0};
+    size_t row = num_agents*sizeof(float);
+    int encoder = graph_add(graph, "encoder", row*128, PUFFERNET_GRAPH_INPUT);
+    // Writes the persistent state, scratch is the [x, h] buffer
+    int lstm = graph_add(graph, "lstm", 0, encoder);
+    graph->nodes[lstm].scratch = row*(128 + 128);
+    _actor_value_graph(graph, lstm, num_agents, atn_sum);
+    graph_plan(graph);
+}
+
+size_t linearlstm_size(int num_agents, int input_dim, int logit_sizes[], int num_actions) {
+    int atn_sum = 0;
+    for (int i = 0; i < num_actions; i++) {
+        atn_sum += logit_sizes[i];
+    }
+    PufferGraph graph;
+    linearlstm_graph(&graph, num_agents, input_dim, atn_sum);
+    return _block_size(sizeof(LinearLSTM))
+        + _block_size(num_agents*input_dim*sizeof(float))
+        + _block_size(graph.size)
+        + _block_size(sizeof(Linear))
+        + _block_size(sizeof(ActorValue)) + _actor_value_weights_size(128, atn_sum)
+        + _lstm_persistent_size(num_agents, 128, 128)
+        + multidiscrete_size(num_agents, logit_sizes, num_actions);
+}
+
+LinearLSTM* make_linearlstm(Weights* weights, int num_agents, int input_dim,
+        int logit_sizes[], int num_actions, Arena* arena) {
+    Arena* owned = _network_arena(&arena,
+        linearlstm_size(num_agents, input_dim, logit_sizes, num_actions));
+    if (arena == NULL) {
+        return NULL;
+    }
     int atn_sum = 0;
     for (int i = 0; i < num_actions; i++) {
         atn_sum += logit_sizes[i];
     }
-    net->actor = make_linear(weights, num_agents, 128, atn_sum);
-    net->value_fn = make_linear(weights, num_agents, 128, 1);
-    net->lstm = make_lstm(weights, num_agents, 128, 128);
-    net->multidiscrete = make_multidiscrete(num_agents, logit_sizes, num_actions);
+    PufferGraph graph;
+    linearlstm_graph(&graph, num_agents, input_dim, atn_sum);
+    LinearLSTM* net = _make_block(arena, sizeof(LinearLSTM));
+    float* obs = _make_block(arena, num_agents*input_dim*sizeof(float));
+    float* act = _make_block(arena, graph.size);
+    if (net == NULL || obs == NULL || act == NULL) {
+        free_allocator(owned);
+        return NULL;
+    }
+    net->num_agents = num_agents;
+    net->arena = owned;
+    net->obs = obs;
+    net->activations = act;
+    net->encoder = _make_linear(weights, num_agents, input_dim, 128,
+        PUFFERNET_EPILOGUE_GELU, graph_output(&graph, act, "encoder"), arena);
+    net->actor_value = _make_actor_value(weights, num_agents, 128, atn_sum,
+        graph_output(&graph, act, "logits"), graph_output(&graph, act, "values"),
+        graph_scratch(&graph, act, "logits"), arena);
+    net->lstm = _make_lstm(weights, num_agents, 128, 128,
+        graph_scratch(&graph, act, "lstm"), arena);
+    net->multidiscrete = make_multidiscrete(num_agents, logit_sizes, num_actions, arena);
+    if (net->encoder == NULL || net->actor_value == NULL || net->lstm == NULL
+            || net->multidiscrete == NULL) {
+        free_allocator(owned);
+        return NULL;
+    }
     return net;
 }
 
 void free_linearlstm(LinearLSTM* net) {
-    free(net->obs);
-    free(net->encoder);
-    free(net->gelu1);
-    free(net->actor);
-    free(net->value_fn);
-    free(net->lstm);
-    free(net->multidiscrete);
-    free(net);
+    free_allocator(net->arena);
 }
 
 void forward_linearlstm(LinearLSTM* net, float* observations, int* actions) {
     linear(net->encoder, observations);
-    gelu(net->gelu1, net->encoder->output);
-    lstm(net->lstm, net->gelu1->output);
-    linear(net->actor, net->lstm->state_h);
-    linear(net->value_fn, net->lstm->state_h);
-    softmax_multidiscrete(net->multidiscrete, net->actor->output, actions);
+    lstm(net->lstm, net->encoder->output);
+    actor_value(net->actor_value, net->lstm->state_h);
+    softmax_multidiscrete(net->multidiscrete, net->actor_value->logits, actions);
+}
+
+// Dynamic batch: steps the n <= num_agents agents whose states are given,
+// observations and actions in the same order. Row b of the logits and values
+// belongs to states[b]. The net's own recurrent state is scratch here.
+void forward_linearlstm_states(LinearLSTM* net, LSTMState** states, int n,
+        float* observations, int* actions) {
+    LSTM* lstm = net->lstm;
+    Multidiscrete* md = net->multidiscrete;
+    lstm_gather(lstm, states, n);
+    for (int b = 0; b < n; b++) {
+        md->rngs[b] = states[b]->rng;
+    }
+    linear_rows(net->encoder, observations, 0, n);
+    lstm_rows(lstm, net->encoder->output, 0, n);
+    actor_value_rows(net->actor_value, lstm->state_h, 0, n);
+    softmax_multidiscrete_rows(md, net->actor_value->logits, actions, 0, n);
+    lstm_scatter(lstm, states, n);
+    for (int b = 0; b < n; b++) {
+        states[b]->rng = md->rngs[b];
+    }
+}
+
+size_t linearlstm_shared_size(int num_agents, int input_dim, int logit_sizes[], int num_actions) {
+    int atn_sum = 0;
+    for (int i = 0; i < num_actions; i++) {
+        atn_sum += logit_sizes[i];
+    }
+    PufferGraph graph;
+    linearlstm_graph(&graph, num_agents, input_dim, atn_sum);
+    return _block_size(sizeof(LinearLSTM))
+        + _block_size(num_agents*input_dim*sizeof(float))
+        + _block_size(graph.size)
+        + _block_size(sizeof(Linear))
+        + _block_size(sizeof(ActorValue))
+        + _block_size(sizeof(LSTM)) + 2*_block_size(num_agents*128*sizeof(float))
+        + multidiscrete_size(num_agents, logit_sizes, num_actions);
+}
+
+// Another instance of base's weights with activations and recurrent state
+// for num_agents of its own, e.g. one per thread. Nothing is copied but the
+// layer structs, so base must outlive it.
+LinearLSTM* make_linearlstm_shared(LinearLSTM* base, int num_agents, Arena* arena) {
+    Multidiscrete* base_md = base->multidiscrete;
+    int input_dim = base->encoder->input_dim;
+    int atn_sum = base_md->atn_sum;
+    Arena* owned = _network_arena(&arena, linearlstm_shared_size(num_agents, input_dim,
+        base_md->logit_sizes, base_md->num_actions));
+    if (arena == NULL) {
+        return NULL;
+    }
+    PufferGraph graph;
+    linearlstm_graph(&graph, num_agents, input_dim, atn_sum);
+    LinearLSTM* net = _make_block(arena, sizeof(LinearLSTM));
+    float* obs = _make_block(arena, num_agents*input_dim*sizeof(float));
+    float* act = _make_block(arena, graph.size);
+    Linear* encoder = _make_block(arena, sizeof(Linear));
+    ActorValue* actor_value = _make_block(arena, sizeof(ActorValue));
+    LSTM* lstm = _make_block(arena, _block_size(sizeof(LSTM))
+        + 2*_block_size(num_agents*128*sizeof(float)));
+    Multidiscrete* md = make_multidiscrete(num_agents, base_md->logit_sizes,
+        base_md->num_actions, arena);
+    if (net == NULL || obs == NULL || act == NULL || encoder == NULL
+            || actor_value == NULL || lstm == NULL || md == NULL) {
+        free_allocator(owned);
+        return NULL;
+    }
+    net->num_agents = num_agents;
+    net->arena = owned;
+    net->obs = obs;
+    net->activations = act;
+    net->multidiscrete = md;
+
+    net->encoder = encoder;
+    *net->encoder = *base->encoder;
+    net->encoder->output = graph_output(&graph, act, "encoder");
+    net->encoder->batch_size = num_agents;
+
+    net->actor_value = actor_value;
+    *net->actor_value = *base->actor_value;
+    net->actor_value->logits = graph_output(&graph, act, "logits");
+    net->actor_value->values = graph_output(&graph, act, "values");
+    net->actor_value->output = graph_scratch(&graph, act, "logits");
+    net->actor_value->batch_size = num_agents;
+
+    net->lstm = lstm;
+    char* cursor = _block_data(lstm, sizeof(LSTM));
+    *lstm = *base->lstm;
+    lstm->state_h = _carve(&cursor, num_agents*128*sizeof(float));
+    lstm->state_c = _carve(&cursor, num_agents*128*sizeof(float));
+    lstm->buffer = graph_scratch(&graph, act, "lstm");
+    lstm->batch_size = num_agents;
+    return net;
+}
+
+// Sequence mode for observations known in advance (replaying recorded games).
+// Only the recurrence depends on the previous step, so the encoder, the LSTM
+// input projection x*W_ih + b_ih + b_hh and the heads each run as one GEMM
+// over all steps, and the sequential part per step is h*W_hh plus the gates.
+// The workspace holds column-panel copies of the dense weights (see
+// pack_panels), the LSTM's unpacked from its fused matrix back to PyTorch's
+// gate-major order (i, f, g, o blocks of hidden_size rows). Block-sparse layers keep their own kernels: a sparse
+// encoder runs as is, a sparse LSTM steps the fused cell. The encoder output
+// is dead once projected, so the hidden states of every step reuse its
+// buffer, and the merged head rows reuse the gates.
+typedef struct LinearLSTMSequence LinearLSTMSequence;
+struct LinearLSTMSequence {
+    LinearLSTM* net;
+    int max_steps;
+    float* encoder_panels;  // NULL for a block-sparse encoder
+    float* input_panels;    // W_ih, NULL for a block-sparse LSTM
+    float* state_panels;    // W_hh
+    float* gate_bias;       // b_ih + b_hh, gate-major
+    float* zero_bias;       // for the W_hh pass, which accumulates
+    float* head_panels;
+    float* hidden;  // [steps x batch x 128] encoder output, then h per step
+    float* gates;   // [steps x batch x 512] gate pre-activations, then heads
+    float* logits;  // [steps x batch x atn_sum]
+    float* values;  // [steps x batch]
+};
+
+size_t linearlstm_sequence_size(int num_agents, int input_dim, int atn_sum, int max_steps) {
+    size_t rows = (size_t)max_steps*num_agents;
+    return _block_size(sizeof(LinearLSTMSequence))
+        + _block_size(panel_size(input_dim, 128))
+        + 2*_block_size(panel_size(128, 4*128))
+        + 2*_block_size(4*128*sizeof(float))
+        + _block_size(panel_size(128, atn_sum + 1))
+        + _block_size(rows*128*sizeof(float))
+        + _block_size(rows*4*128*sizeof(float))
+        + _block_size(rows*atn_sum*sizeof(float))
+        + _block_size(rows*sizeof(float));
+}
+
+// Panels of columns [start, start + cols) of the fused LSTM matrix, with the
+// rows in gate-major order (row g*H + j is fused row 4*j + g)
+void _pack_lstm_panels(float* weights_fused, int input_size, int hidden_size, int start,
+        int cols, float* panels) {
+    int rows = 4*hidden_size;
+    int cat_size = input_size + hidden_size;
+    int num_panels = panel_count(rows);
+    for (int p = 0; p < num_panels; p++) {
+        for (int k = 0; k < cols; k++) {
+            float* dst = panels + ((size_t)p*cols + k)*PUFFERNET_PANEL;
+            for (int j = 0; j < PUFFERNET_PANEL; j++) {
+                int o = p*PUFFERNET_PANEL + j;
+                int row = 4*(o % hidden_size) + o/hidden_size;
+                dst[j] = o < rows ? weights_fused[(size_t)row*cat_size + start + k] : 0.0f;
+            }
+        }
+    }
+}
+
+// Workspace for up to max_steps steps of net's batch. Packs its own copy of
+// the weights, so rebuild it if net's weights change
+LinearLSTMSequence* make_linearlstm_sequence(LinearLSTM* net, int max_steps, Arena* arena) {
+    Linear* encoder = net->encoder;
+    LSTM* lstm = net->lstm;
+    ActorValue* heads = net->actor_value;
+    int input_dim = encoder->input_dim;
+    int H = lstm->hidden_size;
+    int A = heads->atn_sum;
+    assert(encoder->output_dim == 128 && H == 128 && A + 1 <= 4*H);
+    size_t rows = (size_t)max_steps*net->num_agents;
+    LinearLSTMSequence* seq = _make_block(arena,
+        linearlstm_sequence_size(net->num_agents, input_dim, A, max_steps));
+    if (seq == NULL) {
+        return NULL;
+    }
+    char* cursor = _block_data(seq, sizeof(LinearLSTMSequence));
+    seq->net = net;
+    seq->max_steps = max_steps;
+    seq->encoder_panels = _carve(&cursor, panel_size(input_dim, H));
+    seq->input_panels = _carve(&cursor, panel_size(H, 4*H));
+    seq->state_panels = _carve(&cursor, panel_size(H, 4*H));
+    seq->gate_bias = _carve(&cursor, 4*H*sizeof(float));
+    seq->zero_bias = _carve(&cursor, 4*H*sizeof(float));
+    seq->head_panels = _carve(&cursor, panel_size(H, A + 1));
+    seq->hidden = _carve(&cursor, rows*H*sizeof(float));
+    seq->gates = _carve(&cursor, rows*4*H*sizeof(float));
+    seq->logits = _carve(&cursor, rows*A*sizeof(float));
+    seq->values = _carve(&cursor, rows*sizeof(float));
+    if (encoder->weights != NULL) {
+        pack_panels(encoder->weights, H, input_dim, seq->encoder_panels);
+    } else {
+        seq->encoder_panels = NULL;
+    }
+    if (lstm->weights_fused != NULL) {
+        _pack_lstm_panels(lstm->weights_fused, H, H, 0, H, seq->input_panels);
+        _pack_lstm_panels(lstm->weights_fused, H, H, H, H, seq->state_panels);
+        for (int o = 0; o < 4*H; o++) {
+            seq->gate_bias[o] = lstm->bias_fused[4*(o % H) + o/H];
+        }
+        memset(seq->zero_bias, 0, 4*H*sizeof(float));
+    } else {
+        seq->input_panels = NULL;
+        seq->state_panels = NULL;
+    }
+    pack_panels(heads->weights, A + 1, H, seq->head_panels);
+    return seq;
+}
+
+// c = f*c + i*g, h = o*tanh(c) from gate-major pre-activations, in place
+void _lstm_cell_gate_major(float* gates, float* state_c, float* state_h,
+        int batch_size, int hidden_size) {
+    const Kernels* kernels = puffernet_kernels();
+    for (int b = 0; b < batch_size; b++) {
+        float* i = gates + b*4*hidden_size;
+        float* f = i + hidden_size;
+        float* g = f + hidden_size;
+        float* o = g + hidden_size;
+        float* c = state_c + b*hidden_size;
+        float* h = state_h + b*hidden_size;
+        kernels->sigmoid_array(i, i, 2*hidden_size);
+        kernels->tanh_array(g, g, hidden_size);
+        kernels->sigmoid_array(o, o, hidden_size);
+        for (int j = 0; j < hidden_size; j++) {
+            c[j] = f[j]*c[j] + i[j]*g[j];
+        }
+        kernels->tanh_array(c, h, hidden_size);
+        for (int j = 0; j < hidden_size; j++) {
+            h[j] *= o[j];
+        }
+    }
+}
+
+// Same as num_steps calls of forward_linearlstm on observations [steps x
+// batch x input_dim], writing actions [steps x batch] and every step's logits
+// and values into seq. Agents sample in the same order from the same streams,
+// and the recurrent state is left after the last step. net->actor_value is not
+// updated. Results match the step path to float rounding (~1e-6).
+void forward_linearlstm_sequence(LinearLSTMSequence* seq, float* observations,
+        int* actions, int num_steps) {
+    PanelLinearKernel panel_linear = puffernet_kernels()->panel_linear;
+    LinearLSTM* net = seq->net;
+    Linear* encoder = net->encoder;
+    LSTM* lstm = net->lstm;
+    ActorValue* heads = net->actor_value;
+    Multidiscrete* md = net->multidiscrete;
+    int B = net->num_agents;
+    int H = lstm->hidden_size;
+    int A = heads->atn_sum;
+    int rows = num_steps*B;
+    assert(num_steps <= seq->max_steps);
+
+    if (seq->encoder_panels != NULL) {
+        panel_linear(observations, seq->encoder_panels, encoder->bias, seq->hidden,
+            rows, encoder->input_dim, H, encoder->epilogue);
+    } else {
+        _linear_layer(encoder, observations, seq->hidden, rows, encoder->epilogue);
+    }
+    if (seq->input_panels != NULL) {
+        panel_linear(seq->hidden, seq->input_panels, seq->gate_bias, seq->gates,
+            rows, H, 4*H, PUFFERNET_EPILOGUE_NONE);
+        float* h = lstm->state_h;
+        for (int t = 0; t < num_steps; t++) {
+            float* gates = seq->gates + t*B*4*H;
+            panel_linear(h, seq->state_panels, seq->zero_bias, gates, B, H, 4*H,
+                PUFFERNET_EPILOGUE_ACCUMULATE);
+            h = seq->hidden + t*B*H;
+            _lstm_cell_gate_major(gates, lstm->state_c, h, B, H);
+        }
+        memcpy(lstm->state_h, h, B*H*sizeof(float));
+    } else {
+        for (int t = 0; t < num_steps; t++) {
+            float* h = seq->hidden + t*B*H;
+            lstm_rows(lstm, h, 0, B);
+            memcpy(h, lstm->state_h, B*H*sizeof(float));
+        }
+    }
+
+    float* output = seq->gates;
+    panel_linear(seq->hidden, seq->head_panels, heads->bias, output, rows, H, A + 1,
+        PUFFERNET_EPILOGUE_NONE);
+    for (int r = 0; r < rows; r++) {
+        memcpy(seq->logits + r*A, output + r*(A + 1), A*sizeof(float));
+        seq->values[r] = output[r*(A + 1) + A];
+    }
+    for (int t = 0; t < num_steps; t++) {
+        softmax_multidiscrete(md, seq->logits + t*B*A, actions + t*B*md->num_actions);
+    }
+}
+
+// Fixed-shape LinearLSTM forward passes. PUFFERNET_FIXED_LINEARLSTM(name,
+// batch, input, hidden, atn_sum) emits forward_linearlstm_<name>, which has
+// the same signature as forward_linearlstm but runs the scalar kernels with
+// every dimension a literal, so the blocked kernels are inlined with constant
+// trip counts the compiler can unroll and vectorize. At batch 1 the encoder
+// also writes straight into the LSTM's [x, h] buffer, so encoder->output is
+// not updated. The tiles are the defaults; tuned values do not apply here.
+// Only the scalar kernels (the web build) take this path: under SSE4.1 and
+// AVX2 the generic SIMD kernels were as fast or faster. Networks of any other
+// shape, and batch sizes the macro was not built for, fall back to
+// forward_linearlstm. The Connect4 policy is
+//     PUFFERNET_FIXED_LINEARLSTM(connect4, 1, 42, 128, 7)
+PUFFERNET_INLINE void _forward_linearlstm_fixed(LinearLSTM* net, float* observations,
+        int* actions, int B, int I, int H, int A, Dot4Kernel dot4, Dot1Kernel dot1,
+        ActivationKernel sigmoid_fn, ActivationKernel tanh_fn, ActivationKernel gelu_fn) {
+    Linear* encoder = net->encoder;
+    LSTM* lstm = net->lstm;
+    ActorValue* heads = net->actor_value;
+    if (B == 1) {
+        _linear_blocked(observations, encoder->weights, encoder->bias, lstm->buffer,
+            1, I, H, PUFFERNET_EPILOGUE_GELU, PUFFERNET_LINEAR_TILE, dot4, dot1, _relu, gelu_fn);
+        memcpy(lstm->buffer + H, lstm->state_h, H*sizeof(float));
+    } else {
+        _linear_blocked(observations, encoder->weights, encoder->bias, encoder->output,
+            B, I, H, PUFFERNET_EPILOGUE_GELU, PUFFERNET_LINEAR_TILE, dot4, dot1, _relu, gelu_fn);
+        _lstm_concat(encoder->output, lstm->state_h, lstm->buffer, B, H, H);
+    }
+    _lstm_fused_blocked(lstm->buffer, lstm->state_h, lstm->state_c, lstm->weights_fused,
+        lstm->bias_fused, B, H, H, 0, H, dot4, sigmoid_fn, tanh_fn);
+    _linear_blocked(lstm->state_h, heads->weights, heads->bias, heads->output,
+        B, H, A + 1, PUFFERNET_EPILOGUE_NONE, PUFFERNET_LINEAR_TILE, dot4, dot1, _relu,
+        gelu_fn);
+    for (int b = 0; b < B; b++) {
+        memcpy(heads->logits + b*A, heads->output + b*(A + 1), A*sizeof(float));
+        heads->values[b] = heads->output[b*(A + 1) + A];
+    }
+    softmax_multidiscrete(net->multidiscrete, heads->logits, actions);
+}
+
+// Dense weights only, block-sparse nets take the generic path
+bool linearlstm_has_shape(LinearLSTM* net, int batch_size, int input_dim,
+        int hidden_dim, int atn_sum) {
+    return net->encoder->weights != NULL && net->lstm->weights_fused != NULL
+        && net->num_agents == batch_size
+        && net->encoder->input_dim == input_dim
+        && net->encoder->output_dim == hidden_dim
+        && net->lstm->input_size == hidden_dim
+        && net->lstm->hidden_size == hidden_dim
+        && net->actor_value->atn_sum == atn_sum;
+}
+
+#define _PUFFERNET_FIXED_VARIANT(name, isa, target, B, I, H, A, dot4, dot1,      \
+        sigmoid_fn, tanh_fn, gelu_fn)                                             \
+target                                                                            \
+void _forward_linearlstm_##name##_##isa(LinearLSTM* net, float* observations,    \
+        int* actions) {                                                           \
+    _forward_linearlstm_fixed(net, observations, actions, B, I, H, A,            \
+        dot4, dot1, sigmoid_fn, tanh_fn, gelu_fn);                                \
+}
+
+typedef void (*LinearLSTMForward)(LinearLSTM* net, float* observations, int* actions);
+
+// Also emits linearlstm_<name>_kernel(net), the function forward_linearlstm_<name>
+// runs for net under the active kernels (forward_linearlstm if the shape differs
+// or the kernels are SIMD, where the fixed shape measured no faster)
+#define PUFFERNET_FIXED_LINEARLSTM(name, B, I, H, A)                              \
+_PUFFERNET_FIXED_VARIANT(name, scalar, , B, I, H, A, _dot4_scalar, _dot1_scalar,  \
+    _sigmoid_array_scalar, _tanh_array_scalar, _gelu_scalar)                      \
+LinearLSTMForward linearlstm_##name##_kernel(LinearLSTM* net) {                   \
+    if (!linearlstm_has_shape(net, B, I, H, A)                                    \
+            || puffernet_kernels()->lstm != _lstm_fused_scalar) {                 \
+        return forward_linearlstm;                                                \
+    }                                                                             \
+    return _forward_linearlstm_##name##_scalar;                                   \
+}                                                                                 \
+void forward_linearlstm_##name(LinearLSTM* net, float* observations, int* actions) { \
+    linearlstm_##name##_kernel(net)(net, observations, actions);                  \
 }
 
 typedef struct ConvLSTM ConvLSTM; struct ConvLSTM {
     int num_agents;
     float* obs;
     Conv2D* conv1;
-    ReLU* relu1;
     Conv2D* conv2;
-    ReLU* relu2;
     Linear* linear;
     LSTM* lstm;
-    Linear* actor;
-    Linear* value_fn;
+    ActorValue* actor_value;
     Multidiscrete* multidiscrete;
+    float* activations;
+    Arena* arena;
 };
 
-ConvLSTM* make_convlstm(Weights* weights, int num_agents, int input_dim,
-        int input_channels, int cnn_channels, int hidden_dim, int action_dim) {
-    ConvLSTM* net = calloc(1, sizeof(ConvLSTM));
+// conv1 is 5x5 stride 3 and conv2 3x3 stride 1, both followed by ReLU. The
+// conv2 feature map is flattened into the linear layer, so input_dim 11 gives
+// the 1x1 map of the original PufferLib policy and larger inputs just widen it.
+int _convlstm_conv1_dim(int input_dim) {
+    return (input_dim - 5)/3 + 1;
+}
+
+int _convlstm_conv2_dim(int input_dim) {
+    return _convlstm_conv1_dim(input_dim) - 2;
+}
+
+void convlstm_graph(PufferGraph* graph, int num_agents, int input_dim, int input_channels,
+        int cnn_channels, int hidden_dim, int action_dim) {
+    *graph = (PufferGraph){0};
+    size_t row = num_agents*sizeof(float);
+    int dim1 = _convlstm_conv1_dim(input_dim);
+    int dim2 = _convlstm_conv2_dim(input_dim);
+    int conv1 = graph_add(graph, "conv1", row*cnn_channels*dim1*dim1, PUFFERNET_GRAPH_INPUT);
+    graph->nodes[conv1].scratch = _conv2d_scratch_size(input_dim, input_dim,
+        input_channels, cnn_channels, 5, 3)*sizeof(float);
+    int conv2 = graph_add(graph, "conv2", row*cnn_channels*dim2*dim2, conv1);
+    graph->nodes[conv2].scratch = _conv2d_scratch_size(dim1, dim1,
+        cnn_channels, cnn_channels, 3, 1)*sizeof(float);
+    int linear = graph_add(graph, "linear", row*hidden_dim, conv2);
+    int lstm = graph_add(graph, "lstm", 0, linear);
+    graph->nodes[lstm].scratch = row*2*hidden_dim;
+    _actor_value_graph(graph, lstm, num_agents, action_dim);
+    graph_plan(graph);
+}
+
+size_t convlstm_size(int num_agents, int input_dim, int input_channels,
+        int cnn_channels, int hidden_dim, int action_dim) {
+    PufferGraph graph;
+    convlstm_graph(&graph, num_agents, input_dim, input_channels,
+        cnn_channels, hidden_dim, action_dim);
+    return _block_size(sizeof(ConvLSTM))
+        + _block_size(num_agents*input_dim*input_dim*input_channels*sizeof(float))
+        + _block_size(graph.size)
+        + 2*_block_size(sizeof(Conv2D)) + _block_size(sizeof(Linear))
+        + _block_size(sizeof(ActorValue)) + _actor_value_weights_size(hidden_dim, action_dim)
+        + _lstm_persistent_size(num_agents, hidden_dim, hidden_dim)
+        + multidiscrete_size(num_agents, &action_dim, 1);
+}
+
+ConvLSTM* make_convlstm(Weights* weights, int num_agents, int input_dim, int input_channels,
+        int cnn_channels, int hidden_dim, int action_dim, Arena* arena) {
+    Arena* owned = _network_arena(&arena, convlstm_size(num_agents, input_dim,
+        input_channels, cnn_channels, hidden_dim, action_dim));
+    if (arena == NULL) {
+        return NULL;
+    }
+    int dim1 = _convlstm_conv1_dim(input_dim);
+    int dim2 = _convlstm_conv2_dim(input_dim);
+    PufferGraph graph;
+    convlstm_graph(&graph, num_agents, input_dim, input_channels,
+        cnn_channels, hidden_dim, action_dim);
+    ConvLSTM* net = _make_block(arena, sizeof(ConvLSTM));
+    float* obs = _make_block(arena, num_agents*input_dim*input_dim*input_channels*sizeof(float));
+    float* act = _make_block(arena, graph.size);
+    if (net == NULL || obs == NULL || act == NULL) {
+        free_allocator(owned);
+        return NULL;
+    }
     net->num_agents = num_agents;
-    net->obs = calloc(num_agents*input_dim*input_dim*input_channels, sizeof(float));
-    net->conv1 = make_conv2d(weights, num_agents, input_dim,
-        input_dim, input_channels, cnn_channels, 5, 3);
-    net->relu1 = make_relu(num_agents, hidden_dim*3*3);
-    net->conv2 = make_conv2d(weights, num_agents, 3, 3, cnn_channels, cnn_channels, 3, 1);
-    net->relu2 = make_relu(num_agents, hidden_dim);
-    net->linear = make_linear(weights, num_agents, cnn_channels, hidden_dim);
-    net->actor = make_linear(weights, num_agents, hidden_dim, action_dim);
-    net->value_fn = make_linear(weights, num_agents, hidden_dim, 1);
-    net->lstm = make_lstm(weights, num_agents, hidden_dim, hidden_dim);
+    net->arena = owned;
+    net->obs = obs;
+    net->activations = act;
+    net->conv1 = _make_conv2d(weights, num_agents, input_dim, input_dim, input_channels,
+        cnn_channels, 5, 3, PUFFERNET_EPILOGUE_RELU, graph_output(&graph, act, "conv1"),
+        graph_scratch(&graph, act, "conv1"), arena);
+    net->conv2 = _make_conv2d(weights, num_agents, dim1, dim1, cnn_channels,
+        cnn_channels, 3, 1, PUFFERNET_EPILOGUE_RELU, graph_output(&graph, act, "conv2"),
+        graph_scratch(&graph, act, "conv2"), arena);
+    net->linear = _make_linear(weights, num_agents, cnn_channels*dim2*dim2, hidden_dim,
+        PUFFERNET_EPILOGUE_NONE, graph_output(&graph, act, "linear"), arena);
+    net->actor_value = _make_actor_value(weights, num_agents, hidden_dim, action_dim,
+        graph_output(&graph, act, "logits"), graph_output(&graph, act, "values"),
+        graph_scratch(&graph, act, "logits"), arena);
+    net->lstm = _make_lstm(weights, num_agents, hidden_dim, hidden_dim,
+        graph_scratch(&graph, act, "lstm"), arena);
     int logit_sizes[1] = {action_dim};
-    net->multidiscrete = make_multidiscrete(num_agents, logit_sizes, 1);
+    net->multidiscrete = make_multidiscrete(num_agents, logit_sizes, 1, arena);
+    if (net->conv1 == NULL || net->conv2 == NULL || net->linear == NULL
+            || net->actor_value == NULL || net->lstm == NULL || net->multidiscrete == NULL) {
+        free_allocator(owned);
+        return NULL;
+    }
     return net;
 }
 
 void free_convlstm(ConvLSTM* net) {
-    free(net->obs);
-    free(net->conv1);
-    free(net->relu1);
-    free(net->conv2);
-    free(net->relu2);
-    free(net->linear);
-    free(net->actor);
-    free(net->value_fn);
-    free(net->lstm);
-    free(net->multidiscrete);
-    free(net);
+    free_allocator(net->arena);
 }
 
 void forward_convlstm(ConvLSTM* net, float* observations, int* actions) {
     conv2d(net->conv1, observations);
-    relu(net->relu1, net->conv1->output);
-    conv2d(net->conv2, net->relu1->output);
-    relu(net->relu2, net->conv2->output);
-    linear(net->linear, net->relu2->output);
+    conv2d(net->conv2, net->conv1->output);
+    linear(net->linear, net->conv2->output);
     lstm(net->lstm, net->linear->output);
-    linear(net->actor, net->lstm->state_h);
-    linear(net->value_fn, net->lstm->state_h);
-    softmax_multidiscrete(net->multidiscrete, net->actor->output, actions);
+    actor_value(net->actor_value, net->lstm->state_h);
+    softmax_multidiscrete(net->multidiscrete, net->actor_value->logits, actions);
 }
-
@@ -0,0 +1,280 @@
+// Persistent worker pool and multi-threaded batched inference for puffernet.
+// Include after puffernet.h. Needs pthreads, so it is not part of the web build.
+//
+// pool_run splits [0, range) into one contiguous slice per thread. The caller
+// runs slice 0 and the workers always get the same slices, so with
+// linearlstm_first_touch (and pinned workers) each thread's activations live
+// in memory local to the core that computes them.
+#include <pthread.h>
+#if defined(__linux__) && defined(_GNU_SOURCE)
+    #include <sched.h>
+    #define PUFFERNET_PIN_THREADS 1
+#endif
+
+// Spins before a worker or the caller falls back to blocking on a condvar.
+// Keeps wake-up latency low for back to back forward passes.
+#define PUFFERNET_POOL_SPIN 4000
+
+typedef void (*PoolTask)(void* ctx, int thread, int start, int end);
+
+typedef struct ThreadPool ThreadPool;
+
+typedef struct PoolWorker PoolWorker;
+struct PoolWorker {
+    ThreadPool* pool;
+    pthread_t thread;
+    int index;
+};
+
+struct ThreadPool {
+    int num_threads;
+    bool pinned;
+    PoolWorker* workers;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t done;
+    // Written under lock, read with atomics while spinning
+    unsigned generation;
+    int remaining;
+    bool shutdown;
+    PoolTask task;
+    void* ctx;
+    int range;
+};
+
+static inline void _pool_pause() {
+#ifdef PUFFERNET_X86
+    _mm_pause();
+#endif
+}
+
+void _pool_slice(int range, int thread, int num_threads, int* start, int* end) {
+    *start = (int)((long)range*thread/num_threads);
+    *end = (int)((long)range*(thread + 1)/num_threads);
+}
+
+void* _pool_worker(void* arg) {
+    PoolWorker* worker = (PoolWorker*)arg;
+    ThreadPool* pool = worker->pool;
+#ifdef PUFFERNET_PIN_THREADS
+    if (pool->pinned) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(worker->index % CPU_SETSIZE, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+#endif
+    unsigned seen = 0;
+    while (true) {
+        int spins = 0;
+        while (__atomic_load_n(&pool->generation, __ATOMIC_ACQUIRE) == seen) {
+            if (++spins < PUFFERNET_POOL_SPIN) {
+                _pool_pause();
+                continue;
+            }
+            pthread_mutex_lock(&pool->lock);
+            while (pool->generation == seen) {
+                pthread_cond_wait(&pool->wake, &pool->lock);
+            }
+            pthread_mutex_unlock(&pool->lock);
+        }
+        seen = __atomic_load_n(&pool->generation, __ATOMIC_ACQUIRE);
+        if (pool->shutdown) {
+            return NULL;
+        }
+        int start, end;
+        _pool_slice(pool->range, worker->index, pool->num_threads, &start, &end);
+        if (start < end) {
+            pool->task(pool->ctx, worker->index, start, end);
+        }
+        if (__atomic_sub_fetch(&pool->remaining, 1, __ATOMIC_ACQ_REL) == 0) {
+            pthread_mutex_lock(&pool->lock);
+            pthread_cond_signal(&pool->done);
+            pthread_mutex_unlock(&pool->lock);
+        }
+    }
+}
+
+// num_threads includes the calling thread. pin binds worker i to core i
+// (Linux builds with _GNU_SOURCE only)
+ThreadPool* make_thread_pool(int num_threads, bool pin) {
+    if (num_threads < 1) {
+        num_threads = 1;
+    }
+    ThreadPool* pool = calloc(1, sizeof(ThreadPool) + (num_threads - 1)*sizeof(PoolWorker));
+    pool->num_threads = num_threads;
+    pool->pinned = pin;
+    pool->workers = (PoolWorker*)(pool + 1);
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    for (int i = 1; i < num_threads; i++) {
+        PoolWorker* worker = &pool->workers[i - 1];
+        worker->pool = pool;
+        worker->index = i;
+        if (pthread_create(&worker->thread, NULL, _pool_worker, worker) != 0) {
+            perror("Error creating worker thread");
+            pool->num_threads = i;
+            break;
+        }
+    }
+    return pool;
+}
+
+// Runs task over [0, range) on all threads and returns when every slice is done
+void pool_run(ThreadPool* pool, PoolTask task, void* ctx, int range) {
+    if (pool->num_threads == 1) {
+        if (range > 0) {
+            task(ctx, 0, 0, range);
+        }
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    pool->task = task;
+    pool->ctx = ctx;
+    pool->range = range;
+    __atomic_store_n(&pool->remaining, pool->num_threads - 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&pool->generation, 1, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+
+    int start, end;
+    _pool_slice(range, 0, pool->num_threads, &start, &end);
+    if (start < end) {
+        task(ctx, 0, start, end);
+    }
+
+    int spins = 0;
+    while (__atomic_load_n(&pool->remaining, __ATOMIC_ACQUIRE) != 0) {
+        if (++spins < PUFFERNET_POOL_SPIN) {
+            _pool_pause();
+            continue;
+        }
+        pthread_mutex_lock(&pool->lock);
+        while (__atomic_load_n(&pool->remaining, __ATOMIC_ACQUIRE) != 0) {
+            pthread_cond_wait(&pool->done, &pool->lock);
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+void free_thread_pool(ThreadPool* pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = true;
+    __atomic_add_fetch(&pool->generation, 1, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 1; i < pool->num_threads; i++) {
+        pthread_join(pool->workers[i - 1].thread, NULL);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->wake);
+    pthread_cond_destroy(&pool->done);
+    free(pool);
+}
+
+// LinearLSTM over a pool. Batches of at least one agent per thread are split
+// by agent and run the whole layer chain, sampling included, without
+// synchronizing. Every agent samples from its own RNG stream, so actions are
+// the same for any thread count. Smaller batches split the output rows of the
+// encoder and the hidden units of the LSTM instead and sample on the caller.
+// A tuned PUFFERNET_TUNE_POOL_SPLIT for the batch and thread count overrides
+// that choice.
+#define PUFFERNET_SPLIT_AGENTS 1
+#define PUFFERNET_SPLIT_UNITS 2
+
+typedef struct LinearLSTMJob LinearLSTMJob;
+struct LinearLSTMJob {
+    LinearLSTM* net;
+    float* observations;
+    int* actions;
+};
+
+void _linearlstm_agents_task(void* ctx, int thread, int start, int end) {
+    LinearLSTMJob* job = (LinearLSTMJob*)ctx;
+    LinearLSTM* net = job->net;
+    linear_rows(net->encoder, job->observations, start, end);
+    lstm_rows(net->lstm, net->encoder->output, start, end);
+    actor_value_rows(net->actor_value, net->lstm->state_h, start, end);
+    softmax_multidiscrete_rows(net->multidiscrete, net->actor_value->logits,
+        job->actions, start, end);
+}
+
+void _linearlstm_encoder_rows_task(void* ctx, int thread, int start, int end) {
+    LinearLSTMJob* job = (LinearLSTMJob*)ctx;
+    Linear* encoder = job->net->encoder;
+    int input_dim = encoder->input_dim;
+    int output_dim = encoder->output_dim;
+    // Whole tiles, so the fused activation sees the same vector lanes as one thread
+    start *= PUFFERNET_LINEAR_TILE;
+    end *= PUFFERNET_LINEAR_TILE;
+    if (end > output_dim) {
+        end = output_dim;
+    }
+    for (int b = 0; b < encoder->batch_size; b++) {
+        _linear_epilogue(job->observations + b*input_dim, encoder->weights + start*input_dim,
+            encoder->bias + start, encoder->output + b*output_dim + start, 1, input_dim,
+            end - start, encoder->epilogue);
+    }
+}
+
+void _linearlstm_units_task(void* ctx, int thread, int start, int end) {
+    LSTM* lstm = ((LinearLSTMJob*)ctx)->net->lstm;
+    int unit_end = end*PUFFERNET_LSTM_BLOCK;
+    if (unit_end > lstm->hidden_size) {
+        unit_end = lstm->hidden_size;
+    }
+    lstm_cell(lstm, 0, lstm->batch_size, start*PUFFERNET_LSTM_BLOCK, unit_end);
+}
+
+void forward_linearlstm_pool(LinearLSTM* net, ThreadPool* pool, float* observations, int* actions) {
+    LinearLSTMJob job = {net, observations, actions};
+    int split = _puffernet_tuned(PUFFERNET_TUNE_POOL_SPLIT, net->num_agents, pool->num_threads, 0, 0,
+        net->num_agents >= pool->num_threads ? PUFFERNET_SPLIT_AGENTS : PUFFERNET_SPLIT_UNITS);
+    if (split == PUFFERNET_SPLIT_AGENTS) {
+        pool_run(pool, _linearlstm_agents_task, &job, net->num_agents);
+    } else {
+        LSTM* lstm = net->lstm;
+        // The encoder is small, a block-sparse one just runs on the caller
+        if (net->encoder->weights == NULL) {
+            linear(net->encoder, observations);
+        } else {
+            int tiles = (net->encoder->output_dim + PUFFERNET_LINEAR_TILE - 1)/PUFFERNET_LINEAR_TILE;
+            pool_run(pool, _linearlstm_encoder_rows_task, &job, tiles);
+        }
+        _lstm_concat(net->encoder->output, lstm->state_h, lstm->buffer,
+            lstm->batch_size, lstm->input_size, lstm->hidden_size);
+        int blocks = (lstm->hidden_size + PUFFERNET_LSTM_BLOCK - 1)/PUFFERNET_LSTM_BLOCK;
+        pool_run(pool, _linearlstm_units_task, &job, blocks);
+        actor_value(net->actor_value, lstm->state_h);
+        softmax_multidiscrete(net->multidiscrete, net->actor_value->logits, actions);
+    }
+}
+
+void _linearlstm_touch_task(void* ctx, int thread, int start, int end) {
+    LinearLSTM* net = ((LinearLSTMJob*)ctx)->net;
+    int n = end - start;
+    Linear* encoder = net->encoder;
+    memset(encoder->output + start*encoder->output_dim, 0, n*encoder->output_dim*sizeof(float));
+    ActorValue* heads = net->actor_value;
+    memset(heads->logits + start*heads->atn_sum, 0, n*heads->atn_sum*sizeof(float));
+    memset(heads->values + start, 0, n*sizeof(float));
+    memset(heads->output + start*(heads->atn_sum + 1), 0,
+        n*(heads->atn_sum + 1)*sizeof(float));
+    LSTM* lstm = net->lstm;
+    int cat_size = lstm->input_size + lstm->hidden_size;
+    memset(lstm->state_h + start*lstm->hidden_size, 0, n*lstm->hidden_size*sizeof(float));
+    memset(lstm->state_c + start*lstm->hidden_size, 0, n*lstm->hidden_size*sizeof(float));
+    memset(lstm->buffer + start*cat_size, 0, n*cat_size*sizeof(float));
+    Multidiscrete* md = net->multidiscrete;
+    memset(md->scratch + start*md->atn_sum, 0, n*md->atn_sum*sizeof(float));
+}
+
+// First-touch placement: each thread zeroes the slice of every activation
+// buffer it will later compute, so the OS backs those pages with memory local
+// to that thread. Call once after make_linearlstm, before the first forward.
+// Resets the recurrent state.
+void linearlstm_first_touch(LinearLSTM* net, ThreadPool* pool) {
+    LinearLSTMJob job = {net, NULL, NULL};
+    pool_run(pool, _linearlstm_touch_task, &job, net->num_agents);
+}
@@ -0,0 +1,617 @@
+// INT8 inference path for puffernet. Include after puffernet.h.
+//
+// Weights are quantized symmetrically per output channel (one float scale per
+// row, int8 values in [-127, 127]). Activations are quantized per batch row at
+// runtime, so no activation calibration data is needed. Products accumulate
+// in int32 and are rescaled with weight_scale*input_scale before the bias.
+//
+// Rows are padded to a multiple of 4 and columns to a multiple of 32 with
+// zeros, so the kernels never need tail loops.
+//
+// Layers can be built from float weights (quantized at load time) or from a
+// .pufw container written by tools/quantize, where each layer is stored as
+// <name>.qweight (i8), <name>.scale (f32) and <name>.bias (f32).
+
+#define PUFFERNET_QROWS 4
+#define PUFFERNET_QCOLS 32
+
+// Computes 4 int8 dot products of x against consecutive rows w, w + ldw, ...
+typedef void (*QDot4Kernel)(const int8_t* x, const int8_t* w, int ldw, int n, int32_t* out);
+// Quantizes one activation row to int8 and returns its scale
+typedef float (*QuantizeKernel)(float* input, int8_t* output, int size);
+
+void _qdot4_scalar(const int8_t* x, const int8_t* w, int ldw, int n, int32_t* out) {
+    for (int k = 0; k < 4; k++) {
+        int32_t sum = 0;
+        for (int i = 0; i < n; i++)
+            sum += (int32_t)x[i] * (int32_t)w[k*ldw + i];
+        out[k] = sum;
+    }
+}
+
+// Dynamic per-row activation quantization. Returns the scale. Ties round
+// away from zero, which the SIMD variants reproduce exactly
+float _quantize_input_scalar(float* input, int8_t* output, int size) {
+    float max_abs = 0.0f;
+    for (int i = 0; i < size; i++) {
+        float a = fabsf(input[i]);
+        max_abs = a > max_abs ? a : max_abs;
+    }
+    if (max_abs == 0.0f) {
+        memset(output, 0, size);
+        return 0.0f;
+    }
+    float inv_scale = 127.0f/max_abs;
+    for (int i = 0; i < size; i++) {
+        float v = input[i]*inv_scale;
+        output[i] = (int8_t)(int32_t)(v + (v < 0.0f ? -0.5f : 0.5f));
+    }
+    return max_abs/127.0f;
+}
+
+#ifdef PUFFERNET_X86
+// vpmaddubsw multiplies unsigned by signed bytes. Moving the sign of x onto w
+// keeps both operands within 127 so the int16 pair sums cannot saturate.
+PUFFERNET_TARGET("avx2")
+static inline __m256i _qmadd_avx2(__m256i acc, __m256i ax, __m256i w, __m256i x) {
+    __m256i pairs = _mm256_maddubs_epi16(ax, _mm256_sign_epi8(w, x));
+    return _mm256_add_epi32(acc, _mm256_madd_epi16(pairs, _mm256_set1_epi16(1)));
+}
+
+PUFFERNET_TARGET("avx2")
+static inline void _qreduce4_avx2(__m256i a0, __m256i a1, __m256i a2, __m256i a3, int32_t* out) {
+    __m256i s = _mm256_hadd_epi32(_mm256_hadd_epi32(a0, a1), _mm256_hadd_epi32(a2, a3));
+    __m128i r = _mm_add_epi32(_mm256_castsi256_si128(s), _mm256_extracti128_si256(s, 1));
+    _mm_storeu_si128((__m128i*)out, r);
+}
+
+PUFFERNET_TARGET("avx2")
+void _qdot4_avx2(const int8_t* x, const int8_t* w, int ldw, int n, int32_t* out) {
+    __m256i a0 = _mm256_setzero_si256(), a1 = _mm256_setzero_si256();
+    __m256i a2 = _mm256_setzero_si256(), a3 = _mm256_setzero_si256();
+    for (int i = 0; i < n; i += 32) {
+        __m256i xv = _mm256_loadu_si256((const __m256i*)(x + i));
+        __m256i ax = _mm256_sign_epi8(xv, xv);
+        a0 = _qmadd_avx2(a0, ax, _mm256_loadu_si256((const __m256i*)(w + i)), xv);
+        a1 = _qmadd_avx2(a1, ax, _mm256_loadu_si256((const __m256i*)(w + ldw + i)), xv);
+        a2 = _qmadd_avx2(a2, ax, _mm256_loadu_si256((const __m256i*)(w + 2*ldw + i)), xv);
+        a3 = _qmadd_avx2(a3, ax, _mm256_loadu_si256((const __m256i*)(w + 3*ldw + i)), xv);
+    }
+    _qreduce4_avx2(a0, a1, a2, a3, out);
+}
+
+// Same rounding as _quantize_input_scalar, 32 values per step
+PUFFERNET_TARGET("avx2")
+float _quantize_input_avx2(float* input, int8_t* output, int size) {
+    __m256 sign = _mm256_set1_ps(-0.0f);
+    __m256 vmax = _mm256_setzero_ps();
+    int i = 0;
+    for (; i + 8 <= size; i += 8) {
+        vmax = _mm256_max_ps(vmax, _mm256_andnot_ps(sign, _mm256_loadu_ps(input + i)));
+    }
+    __m128 m = _mm_max_ps(_mm256_castps256_ps128(vmax), _mm256_extractf128_ps(vmax, 1));
+    m = _mm_max_ps(m, _mm_movehl_ps(m, m));
+    m = _mm_max_ss(m, _mm_shuffle_ps(m, m, 1));
+    float max_abs = _mm_cvtss_f32(m);
+    for (; i < size; i++) {
+        float a = fabsf(input[i]);
+        max_abs = a > max_abs ? a : max_abs;
+    }
+    if (max_abs == 0.0f) {
+        memset(output, 0, size);
+        return 0.0f;
+    }
+    float inv_scale = 127.0f/max_abs;
+    __m256 scale = _mm256_set1_ps(inv_scale);
+    __m256 half = _mm256_set1_ps(0.5f);
+    __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    i = 0;
+    for (; i + 32 <= size; i += 32) {
+        __m256i q[4];
+        for (int k = 0; k < 4; k++) {
+            __m256 v = _mm256_mul_ps(_mm256_loadu_ps(input + i + 8*k), scale);
+            v = _mm256_add_ps(v, _mm256_or_ps(half, _mm256_and_ps(v, sign)));
+            q[k] = _mm256_cvttps_epi32(v);
+        }
+        __m256i packed = _mm256_packs_epi16(_mm256_packs_epi32(q[0], q[1]),
+            _mm256_packs_epi32(q[2], q[3]));
+        _mm256_storeu_si256((__m256i*)(output + i),
+            _mm256_permutevar8x32_epi32(packed, order));
+    }
+    for (; i < size; i++) {
+        float v = input[i]*inv_scale;
+        output[i] = (int8_t)(int32_t)(v + (v < 0.0f ? -0.5f : 0.5f));
+    }
+    return max_abs/127.0f;
+}
+
+// VNNI fuses the maddubs/madd/add chain into one vpdpbusd. Uses the EVEX
+// (AVX512-VNNI + VL) encoding on 256-bit registers.
+PUFFERNET_TARGET("avx2,avx512vnni,avx512vl")
+void _qdot4_vnni(const int8_t* x, const int8_t* w, int ldw, int n, int32_t* out) {
+    __m256i a0 = _mm256_setzero_si256(), a1 = _mm256_setzero_si256();
+    __m256i a2 = _mm256_setzero_si256(), a3 = _mm256_setzero_si256();
+    for (int i = 0; i < n; i += 32) {
+        __m256i xv = _mm256_loadu_si256((const __m256i*)(x + i));
+        __m256i ax = _mm256_sign_epi8(xv, xv);
+        a0 = _mm256_dpbusd_epi32(a0, ax, _mm256_sign_epi8(_mm256_loadu_si256((const __m256i*)(w + i)), xv));
+        a1 = _mm256_dpbusd_epi32(a1, ax, _mm256_sign_epi8(_mm256_loadu_si256((const __m256i*)(w + ldw + i)), xv));
+        a2 = _mm256_dpbusd_epi32(a2, ax, _mm256_sign_epi8(_mm256_loadu_si256((const __m256i*)(w + 2*ldw + i)), xv));
+        a3 = _mm256_dpbusd_epi32(a3, ax, _mm256_sign_epi8(_mm256_loadu_si256((const __m256i*)(w + 3*ldw + i)), xv));
+    }
+    _qreduce4_avx2(a0, a1, a2, a3, out);
+}
+#endif
+
+#ifdef PUFFERNET_NEON
+// sdot is compile-time only (-march=armv8.2-a+dotprod or Apple silicon).
+// Otherwise widen to int16 and pairwise accumulate.
+static inline int32x4_t _qmadd_neon(int32x4_t acc, int8x16_t x, int8x16_t w) {
+#ifdef __ARM_FEATURE_DOTPROD
+    return vdotq_s32(acc, x, w);
+#else
+    int16x8_t p = vmull_s8(vget_low_s8(x), vget_low_s8(w));
+    p = vmlal_s8(p, vget_high_s8(x), vget_high_s8(w));
+    return vpadalq_s16(acc, p);
+#endif
+}
+
+void _qdot4_neon(const int8_t* x, const int8_t* w, int ldw, int n, int32_t* out) {
+    int32x4_t a0 = vdupq_n_s32(0), a1 = vdupq_n_s32(0);
+    int32x4_t a2 = vdupq_n_s32(0), a3 = vdupq_n_s32(0);
+    for (int i = 0; i < n; i += 16) {
+        int8x16_t xv = vld1q_s8(x + i);
+        a0 = _qmadd_neon(a0, xv, vld1q_s8(w + i));
+        a1 = _qmadd_neon(a1, xv, vld1q_s8(w + ldw + i));
+        a2 = _qmadd_neon(a2, xv, vld1q_s8(w + 2*ldw + i));
+        a3 = _qmadd_neon(a3, xv, vld1q_s8(w + 3*ldw + i));
+    }
+    vst1q_s32(out, vpaddq_s32(vpaddq_s32(a0, a1), vpaddq_s32(a2, a3)));
+}
+#endif
+
+typedef struct QKernels QKernels;
+struct QKernels {
+    const char* name;
+    QDot4Kernel qdot4;
+    QuantizeKernel quantize;
+};
+
+static const QKernels PUFFERNET_QKERNELS[] = {
+    {"scalar", _qdot4_scalar, _quantize_input_scalar},
+#ifdef PUFFERNET_X86
+    {"avx2", _qdot4_avx2, _quantize_input_avx2},
+    {"vnni", _qdot4_vnni, _quantize_input_avx2},
+#endif
+#ifdef PUFFERNET_NEON
+    {"neon", _qdot4_neon, _quantize_input_scalar},
+#endif
+};
+static const int PUFFERNET_NUM_QKERNELS = sizeof(PUFFERNET_QKERNELS)/sizeof(QKernels);
+static const QKernels* puffernet_active_qkernels = NULL;
+
+bool puffernet_cpu_supports_q(const char* name) {
+#ifdef PUFFERNET_X86
+    __builtin_cpu_init();
+    if (strcmp(name, "vnni") == 0) {
+        return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("avx512vnni")
+            && __builtin_cpu_supports("avx512vl");
+    }
+#endif
+    return puffernet_cpu_supports(name);
+}
+
+// Force an int8 kernel variant by name. Returns false if it is not available
+bool puffernet_select_qkernels(const char* name) {
+    for (int i = 0; i < PUFFERNET_NUM_QKERNELS; i++) {
+        if (strcmp(PUFFERNET_QKERNELS[i].name, name) == 0 && puffernet_cpu_supports_q(name)) {
+            puffernet_active_qkernels = &PUFFERNET_QKERNELS[i];
+            return true;
+        }
+    }
+    return false;
+}
+
+// Same selection rules as puffernet_kernels, overridable with PUFFERNET_QISA
+const QKernels* puffernet_qkernels() {
+    if (puffernet_active_qkernels != NULL) {
+        return puffernet_active_qkernels;
+    }
+    const char* forced = getenv("PUFFERNET_QISA");
+    if (forced != NULL && puffernet_select_qkernels(forced)) {
+        return puffernet_active_qkernels;
+    }
+    for (int i = PUFFERNET_NUM_QKERNELS - 1; i >= 0; i--) {
+        if (puffernet_cpu_supports_q(PUFFERNET_QKERNELS[i].name)) {
+            puffernet_active_qkernels = &PUFFERNET_QKERNELS[i];
+            break;
+        }
+    }
+    return puffernet_active_qkernels;
+}
+
+int _qpad(int value, int multiple) {
+    return (value + multiple - 1)/multiple*multiple;
+}
+
+// Per-row symmetric quantization. The clipping threshold of each row is
+// calibrated by picking the fraction of max|w| that minimizes the squared
+// reconstruction error, which trades a few clipped outliers for resolution.
+void quantize_rows(float* weights, int rows, int cols, int8_t* output,
+        float* scales, int ld_output) {
+    for (int r = 0; r < rows; r++) {
+        float* w = weights + r*cols;
+        int8_t* q = output + r*ld_output;
+        float max_abs = 0.0f;
+        for (int i = 0; i < cols; i++) {
+            max_abs = fmaxf(max_abs, fabsf(w[i]));
+        }
+        if (max_abs == 0.0f) {
+            scales[r] = 0.0f;
+            memset(q, 0, cols);
+            continue;
+        }
+        float best_scale = max_abs/127.0f;
+        float best_err = INFINITY;
+        for (int step = 0; step <= 20; step++) {
+            float scale = max_abs*(1.0f - 0.01f*step)/127.0f;
+            float err = 0.0f;
+            for (int i = 0; i < cols; i++) {
+                float v = fminf(fmaxf(roundf(w[i]/scale), -127.0f), 127.0f);
+                float diff = v*scale - w[i];
+                err += diff*diff;
+            }
+            if (err < best_err) {
+                best_err = err;
+                best_scale = scale;
+            }
+        }
+        for (int i = 0; i < cols; i++) {
+            q[i] = (int8_t)fminf(fmaxf(roundf(w[i]/best_scale), -127.0f), 127.0f);
+        }
+        scales[r] = best_scale;
+    }
+}
+
+void _qlinear(float* input, int8_t* qinput, int8_t* weights, float* scales,
+        float* bias, float* output, int batch_size, int input_dim, int output_dim,
+        int ld_weights) {
+    const QKernels* qkernels = puffernet_qkernels();
+    QDot4Kernel qdot4 = qkernels->qdot4;
+    float input_scales[batch_size];
+    for (int b = 0; b < batch_size; b++) {
+        input_scales[b] = qkernels->quantize(input + b*input_dim,
+            qinput + b*ld_weights, input_dim);
+    }
+    for (int o = 0; o < output_dim; o += PUFFERNET_QROWS) {
+        for (int b = 0; b < batch_size; b++) {
+            int32_t acc[4];
+            qdot4(qinput + b*ld_weights, weights + o*ld_weights, ld_weights, ld_weights, acc);
+            int rows = output_dim - o < 4 ? output_dim - o : 4;
+            for (int k = 0; k < rows; k++) {
+                output[b*output_dim + o + k] = acc[k]*scales[o + k]*input_scales[b] + bias[o + k];
+            }
+        }
+    }
+}
+
+typedef struct QLinear QLinear;
+struct QLinear {
+    float* output;
+    int8_t* weights;
+    float* scales;
+    float* bias;
+    int8_t* qinput;
+    int batch_size;
+    int input_dim;
+    int output_dim;
+    int ld_weights;
+};
+
+// Upper bound: prequantized weights from a container are not copied
+size_t qlinear_size(int batch_size, int input_dim, int output_dim) {
+    int rows = _qpad(output_dim, PUFFERNET_QROWS);
+    int cols = _qpad(input_dim, PUFFERNET_QCOLS);
+    return _block_size(sizeof(QLinear)) + _block_size(batch_size*output_dim*sizeof(float))
+        + _block_size(batch_size*cols) + _block_size(rows*sizeof(float)) + _block_size(rows*cols);
+}
+
+QLinear* make_qlinear(Weights* weights, int batch_size, int input_dim, int output_dim, Arena* arena) {
+    int rows = _qpad(output_dim, PUFFERNET_QROWS);
+    int cols = _qpad(input_dim, PUFFERNET_QCOLS);
+    Tensor* next = next_tensor(weights);
+    bool prequantized = next != NULL && next->dtype == DTYPE_I8;
+    size_t size = qlinear_size(batch_size, input_dim, output_dim);
+    if (prequantized) {
+        size -= _block_size(rows*sizeof(float)) + _block_size(rows*cols);
+    }
+    QLinear* layer = _make_block(arena, size);
+    if (layer == NULL) {
+        return NULL;
+    }
+    char* cursor = _block_data(layer, sizeof(QLinear));
+    float* output = _carve(&cursor, batch_size*output_dim*sizeof(float));
+    int8_t* qinput = _carve(&cursor, batch_size*cols);
+    *layer = (QLinear){
+        .output = output,
+        .qinput = qinput,
+        .batch_size = batch_size,
+        .input_dim = input_dim,
+        .output_dim = output_dim,
+        .ld_weights = cols,
+    };
+    if (prequantized) {
+        layer->weights = get_weights_typed(weights, DTYPE_I8, rows*cols);
+        layer->scales = get_weights_typed(weights, DTYPE_F32, rows);
+        layer->bias = get_weights(weights, output_dim);
+    } else {
+        layer->scales = _carve(&cursor, rows*sizeof(float));
+        layer->weights = _carve(&cursor, rows*cols);
+        quantize_rows(get_weights(weights, output_dim*input_dim), output_dim,
+            input_dim, layer->weights, layer->scales, cols);
+        layer->bias = get_weights(weights, output_dim);
+    }
+    return layer;
+}
+
+void qlinear(QLinear* layer, float* input) {
+    _qlinear(input, layer->qinput, layer->weights, layer->scales, layer->bias,
+        layer->output, layer->batch_size, layer->input_dim, layer->output_dim,
+        layer->ld_weights);
+}
+
+// Quantized counterpart of _lstm_fused over the same interleaved gate layout.
+// Each block of units is dequantized into float gates and finished by
+// _lstm_gates with the vector activations, like the float kernels
+void _qlstm(float* input, float* state_h, float* state_c, int8_t* weights,
+        float* scales, float* bias, float* buffer, int8_t* qbuffer,
+        int batch_size, int input_size, int hidden_size, int ld_weights) {
+    const QKernels* qkernels = puffernet_qkernels();
+    QDot4Kernel qdot4 = qkernels->qdot4;
+    const Kernels* kernels = puffernet_kernels();
+    int cat_size = input_size + hidden_size;
+    float input_scales[batch_size];
+    for (int b = 0; b < batch_size; b++) {
+        float* xh = buffer + b*cat_size;
+        memcpy(xh, input + b*input_size, input_size*sizeof(float));
+        memcpy(xh + input_size, state_h + b*hidden_size, hidden_size*sizeof(float));
+        input_scales[b] = qkernels->quantize(xh, qbuffer + b*ld_weights, cat_size);
+    }
+    for (int j0 = 0; j0 < hidden_size; j0 += PUFFERNET_LSTM_BLOCK) {
+        int block = hidden_size - j0;
+        if (block > PUFFERNET_LSTM_BLOCK) {
+            block = PUFFERNET_LSTM_BLOCK;
+        }
+        int row0 = 4*j0;
+        for (int b = 0; b < batch_size; b++) {
+            int32_t acc[4*PUFFERNET_LSTM_BLOCK];
+            float gates[4*PUFFERNET_LSTM_BLOCK];
+            for (int j = 0; j < block; j++) {
+                qdot4(qbuffer + b*ld_weights, weights + (row0 + 4*j)*ld_weights,
+                    ld_weights, ld_weights, &acc[4*j]);
+            }
+            float s = input_scales[b];
+            for (int k = 0; k < 4*block; k++) {
+                gates[k] = acc[k]*scales[row0 + k]*s;
+            }
+            _lstm_gates(gates, bias + row0, state_h + b*hidden_size + j0,
+                state_c + b*hidden_size + j0, block, kernels->sigmoid_array,
+                kernels->tanh_array);
+        }
+    }
+}
+
+typedef struct QLSTM QLSTM;
+struct QLSTM {
+    float* state_h;
+    float* state_c;
+    int8_t* weights;
+    float* scales;
+    float* bias;
+    float* buffer;
+    int8_t* qbuffer;
+    int batch_size;
+    int input_size;
+    int hidden_size;
+    int ld_weights;
+};
+
+// Upper bound: prequantized weights from a container are not copied
+size_t qlstm_size(int batch_size, int input_size, int hidden_size) {
+    int rows = 4*hidden_size;
+    int cat_size = input_size + hidden_size;
+    int cols = _qpad(cat_size, PUFFERNET_QCOLS);
+    return _block_size(sizeof(QLSTM)) + 2*_block_size(batch_size*hidden_size*sizeof(float))
+        + _block_size(batch_size*cat_size*sizeof(float)) + _block_size(batch_size*cols)
+        + 2*_block_size(rows*sizeof(float)) + _block_size(rows*cols);
+}
+
+QLSTM* make_qlstm(Weights* weights, int batch_size, int input_size, int hidden_size, Arena* arena) {
+    int rows = 4*hidden_size;
+    int cat_size = input_size + hidden_size;
+    int cols = _qpad(cat_size, PUFFERNET_QCOLS);
+    int state_size = batch_size*hidden_size;
+    Tensor* next = next_tensor(weights);
+    bool prequantized = next != NULL && next->dtype == DTYPE_I8;
+    size_t size = qlstm_size(batch_size, input_size, hidden_size);
+    if (prequantized) {
+        size -= 2*_block_size(rows*sizeof(float)) + _block_size(rows*cols);
+    }
+    QLSTM* layer = _make_block(arena, size);
+    if (layer == NULL) {
+        return NULL;
+    }
+    char* cursor = _block_data(layer, sizeof(QLSTM));
+    float* state_h = _carve(&cursor, state_size*sizeof(float));
+    float* state_c = _carve(&cursor, state_size*sizeof(float));
+    float* buffer = _carve(&cursor, batch_size*cat_size*sizeof(float));
+    int8_t* qbuffer = _carve(&cursor, batch_size*cols);
+    *layer = (QLSTM){
+        .state_h = state_h,
+        .state_c = state_c,
+        .buffer = buffer,
+        .qbuffer = qbuffer,
+        .batch_size = batch_size,
+        .input_size = input_size,
+        .hidden_size = hidden_size,
+        .ld_weights = cols,
+    };
+    if (prequantized) {
+        layer->weights = get_weights_typed(weights, DTYPE_I8, rows*cols);
+        layer->scales = get_weights_typed(weights, DTYPE_F32, rows);
+        layer->bias = get_weights(weights, rows);
+    } else {
+        layer->scales = _carve(&cursor, rows*sizeof(float));
+        layer->bias = _carve(&cursor, rows*sizeof(float));
+        layer->weights = _carve(&cursor, rows*cols);
+        float* packed_buffer = calloc(rows*cat_size, sizeof(float));
+        float* packed = packed_buffer;
+        float* bias = layer->bias;
+        _get_lstm_weights(weights, input_size, hidden_size, &packed, &bias);
+        if (bias != layer->bias) {
+            memcpy(layer->bias, bias, rows*sizeof(float));
+        }
+        quantize_rows(packed, rows, cat_size, layer->weights, layer->scales, cols);
+        free(packed_buffer);
+    }
+    return layer;
+}
+
+void qlstm(QLSTM* layer, float* input) {
+    _qlstm(input, layer->state_h, layer->state_c, layer->weights, layer->scales,
+        layer->bias, layer->buffer, layer->qbuffer, layer->batch_size,
+        layer->input_size, layer->hidden_size, layer->ld_weights);
+}
+
+// Quantized models. Same weight order as their float counterparts
+
+typedef struct QDefault QDefault;
+struct QDefault {
+    int num_agents;
+    QLinear* encoder;
+    ReLU* relu1;
+    QLinear* actor;
+    QLinear* value_fn;
+    Multidiscrete* multidiscrete;
+    Arena* arena;
+};
+
+size_t qdefault_size(int num_agents, int input_dim, int hidden_dim, int action_dim) {
+    return _block_size(sizeof(QDefault))
+        + qlinear_size(num_agents, input_dim, hidden_dim)
+        + relu_size(num_agents, hidden_dim)
+        + qlinear_size(num_agents, hidden_dim, action_dim)
+        + qlinear_size(num_agents, hidden_dim, 1)
+        + multidiscrete_size(num_agents, &action_dim, 1);
+}
+
+QDefault* make_qdefault(Weights* weights, int num_agents, int input_dim,
+        int hidden_dim, int action_dim, Arena* arena) {
+    Arena* owned = _network_arena(&arena,
+        qdefault_size(num_agents, input_dim, hidden_dim, action_dim));
+    if (arena == NULL) {
+        return NULL;
+    }
+    QDefault* net = _make_block(arena, sizeof(QDefault));
+    if (net == NULL) {
+        free_allocator(owned);
+        return NULL;
+    }
+    net->num_agents = num_agents;
+    net->arena = owned;
+    net->encoder = make_qlinear(weights, num_agents, input_dim, hidden_dim, arena);
+    net->relu1 = make_relu(num_agents, hidden_dim, arena);
+    net->actor = make_qlinear(weights, num_agents, hidden_dim, action_dim, arena);
+    net->value_fn = make_qlinear(weights, num_agents, hidden_dim, 1, arena);
+    int logit_sizes[1] = {action_dim};
+    net->multidiscrete = make_multidiscrete(num_agents, logit_sizes, 1, arena);
+    if (net->encoder == NULL || net->relu1 == NULL || net->actor == NULL
+            || net->value_fn == NULL || net->multidiscrete == NULL) {
+        free_allocator(owned);
+        return NULL;
+    }
+    return net;
+}
+
+void free_qdefault(QDefault* net) {
+    free_allocator(net->arena);
+}
+
+void forward_qdefault(QDefault* net, float* observations, int* actions) {
+    qlinear(net->encoder, observations);
+    relu(net->relu1, net->encoder->output);
+    qlinear(net->actor, net->relu1->output);
+    qlinear(net->value_fn, net->relu1->output);
+    softmax_multidiscrete(net->multidiscrete, net->actor->output, actions);
+}
+
+typedef struct QLinearLSTM QLinearLSTM;
+struct QLinearLSTM {
+    int num_agents;
+    QLinear* encoder;
+    GELU* gelu1;
+    QLSTM* lstm;
+    QLinear* actor;
+    QLinear* value_fn;
+    Multidiscrete* multidiscrete;
+    Arena* arena;
+};
+
+size_t qlinearlstm_size(int num_agents, int input_dim, int logit_sizes[], int num_actions) {
+    int atn_sum = 0;
+    for (int i = 0; i < num_actions; i++) {
+        atn_sum += logit_sizes[i];
+    }
+    return _block_size(sizeof(QLinearLSTM))
+        + qlinear_size(num_agents, input_dim, 128)
+        + gelu_size(num_agents, 128)
+        + qlinear_size(num_agents, 128, atn_sum)
+        + qlinear_size(num_agents, 128, 1)
+        + qlstm_size(num_agents, 128, 128)
+        + multidiscrete_size(num_agents, logit_sizes, num_actions);
+}
+
+QLinearLSTM* make_qlinearlstm(Weights* weights, int num_agents, int input_dim,
+        int logit_sizes[], int num_actions, Arena* arena) {
+    Arena* owned = _network_arena(&arena,
+        qlinearlstm_size(num_agents, input_dim, logit_sizes, num_actions));
+    if (arena == NULL) {
+        return NULL;
+    }
+    QLinearLSTM* net = _make_block(arena, sizeof(QLinearLSTM));
+    if (net == NULL) {
+        free_allocator(owned);
+        return NULL;
+    }
+    net->num_agents = num_agents;
+    net->arena = owned;
+    net->encoder = make_qlinear(weights, num_agents, input_dim, 128, arena);
+    net->gelu1 = make_gelu(num_agents, 128, arena);
+    int atn_sum = 0;
+    for (int i = 0; i < num_actions; i++) {
+        atn_sum += logit_sizes[i];
+    }
+    net->actor = make_qlinear(weights, num_agents, 128, atn_sum, arena);
+    net->value_fn = make_qlinear(weights, num_agents, 128, 1, arena);
+    net->lstm = make_qlstm(weights, num_agents, 128, 128, arena);
+    net->multidiscrete = make_multidiscrete(num_agents, logit_sizes, num_actions, arena);
+    if (net->encoder == NULL || net->gelu1 == NULL || net->actor == NULL
+            || net->value_fn == NULL || net->lstm == NULL || net->multidiscrete == NULL) {
+        free_allocator(owned);
+        return NULL;
+    }
+    return net;
+}
+
+void free_qlinearlstm(QLinearLSTM* net) {
+    free_allocator(net->arena);
+}
+
+void forward_qlinearlstm(QLinearLSTM* net, float* observations, int* actions) {
+    qlinear(net->encoder, observations);
+    gelu(net->gelu1, net->encoder->output);
+    qlstm(net->lstm, net->gelu1->output);
+    qlinear(net->actor, net->lstm->state_h);
+    qlinear(net->value_fn, net->lstm->state_h);
+    softmax_multidiscrete(net->multidiscrete, net->actor->output, actions);
+}
@@ -0,0 +1,753 @@
+// Training for puffernet: gradients of the layers, backprop through time for
+// the LSTM, Adam, and a trainable LinearLSTM. Include after puffernet.h.
+//
+// Backward functions take what they need of the forward pass and add their
+// parameter gradients into the given buffers (+=), so the steps of a window
+// sum up before one optimizer step. Input gradients are overwritten. The
+// training forwards use libm activations instead of the inference polynomials
+// so the analytic gradients agree with finite differences; the two forwards
+// differ by about 1e-6 per activation.
+//
+// The inner loops are axpy (y += a*x) over rows and the Adam update, both
+// dispatched like the forward kernels from puffernet_kernels()->name.
+
+typedef void (*AxpyKernel)(float alpha, float* x, float* y, int size);
+typedef void (*AdamKernel)(float* params, float* grads, float* m, float* v, int size,
+        float lr, float beta1, float beta2, float eps, float correction1, float correction2);
+
+void _axpy_scalar(float alpha, float* x, float* y, int size) {
+    for (int i = 0; i < size; i++) {
+        y[i] += alpha*x[i];
+    }
+}
+
+// correction1 and correction2 are 1/(1 - beta^t) of the step
+void _adam_scalar(float* params, float* grads, float* m, float* v, int size,
+        float lr, float beta1, float beta2, float eps, float correction1, float correction2) {
+    for (int i = 0; i < size; i++) {
+        float g = grads[i];
+        m[i] = beta1*m[i] + (1.0f - beta1)*g;
+        v[i] = beta2*v[i] + (1.0f - beta2)*g*g;
+        params[i] -= lr*(m[i]*correction1)/(sqrtf(v[i]*correction2) + eps);
+    }
+}
+
+#ifdef PUFFERNET_X86
+PUFFERNET_TARGET("sse4.1")
+void _axpy_sse41(float alpha, float* x, float* y, int size) {
+    __m128 a = _mm_set1_ps(alpha);
+    int i = 0;
+    for (; i + 4 <= size; i += 4) {
+        _mm_storeu_ps(y + i, _mm_add_ps(_mm_loadu_ps(y + i),
+            _mm_mul_ps(a, _mm_loadu_ps(x + i))));
+    }
+    _axpy_scalar(alpha, x + i, y + i, size - i);
+}
+
+PUFFERNET_TARGET("sse4.1")
+void _adam_sse41(float* params, float* grads, float* m, float* v, int size,
+        float lr, float beta1, float beta2, float eps, float correction1, float correction2) {
+    __m128 b1 = _mm_set1_ps(beta1), nb1 = _mm_set1_ps(1.0f - beta1);
+    __m128 b2 = _mm_set1_ps(beta2), nb2 = _mm_set1_ps(1.0f - beta2);
+    __m128 c1 = _mm_set1_ps(correction1), c2 = _mm_set1_ps(correction2);
+    __m128 step = _mm_set1_ps(lr), epsilon = _mm_set1_ps(eps);
+    int i = 0;
+    for (; i + 4 <= size; i += 4) {
+        __m128 g = _mm_loadu_ps(grads + i);
+        __m128 mi = _mm_add_ps(_mm_mul_ps(b1, _mm_loadu_ps(m + i)), _mm_mul_ps(nb1, g));
+        __m128 vi = _mm_add_ps(_mm_mul_ps(b2, _mm_loadu_ps(v + i)),
+            _mm_mul_ps(nb2, _mm_mul_ps(g, g)));
+        _mm_storeu_ps(m + i, mi);
+        _mm_storeu_ps(v + i, vi);
+        __m128 denom = _mm_add_ps(_mm_sqrt_ps(_mm_mul_ps(vi, c2)), epsilon);
+        __m128 update = _mm_div_ps(_mm_mul_ps(step, _mm_mul_ps(mi, c1)), denom);
+        _mm_storeu_ps(params + i, _mm_sub_ps(_mm_loadu_ps(params + i), update));
+    }
+    _adam_scalar(params + i, grads + i, m + i, v + i, size - i,
+        lr, beta1, beta2, eps, correction1, correction2);
+}
+
+PUFFERNET_TARGET("avx2,fma")
+void _axpy_avx2(float alpha, float* x, float* y, int size) {
+    __m256 a = _mm256_set1_ps(alpha);
+    int i = 0;
+    for (; i + 16 <= size; i += 16) {
+        __m256 y0 = _mm256_fmadd_ps(a, _mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i));
+        __m256 y1 = _mm256_fmadd_ps(a, _mm256_loadu_ps(x + i + 8), _mm256_loadu_ps(y + i + 8));
+        _mm256_storeu_ps(y + i, y0);
+        _mm256_storeu_ps(y + i + 8, y1);
+    }
+    for (; i + 8 <= size; i += 8) {
+        _mm256_storeu_ps(y + i,
+            _mm256_fmadd_ps(a, _mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i)));
+    }
+    _axpy_scalar(alpha, x + i, y + i, size - i);
+}
+
+PUFFERNET_TARGET("avx2,fma")
+void _adam_avx2(float* params, float* grads, float* m, float* v, int size,
+        float lr, float beta1, float beta2, float eps, float correction1, float correction2) {
+    __m256 b1 = _mm256_set1_ps(beta1), nb1 = _mm256_set1_ps(1.0f - beta1);
+    __m256 b2 = _mm256_set1_ps(beta2), nb2 = _mm256_set1_ps(1.0f - beta2);
+    __m256 c1 = _mm256_set1_ps(correction1), c2 = _mm256_set1_ps(correction2);
+    __m256 step = _mm256_set1_ps(lr), epsilon = _mm256_set1_ps(eps);
+    int i = 0;
+    for (; i + 8 <= size; i += 8) {
+        __m256 g = _mm256_loadu_ps(grads + i);
+        __m256 mi = _mm256_fmadd_ps(b1, _mm256_loadu_ps(m + i), _mm256_mul_ps(nb1, g));
+        __m256 vi = _mm256_fmadd_ps(b2, _mm256_loadu_ps(v + i),
+            _mm256_mul_ps(nb2, _mm256_mul_ps(g, g)));
+        _mm256_storeu_ps(m + i, mi);
+        _mm256_storeu_ps(v + i, vi);
+        __m256 denom = _mm256_add_ps(_mm256_sqrt_ps(_mm256_mul_ps(vi, c2)), epsilon);
+        __m256 update = _mm256_div_ps(_mm256_mul_ps(step, _mm256_mul_ps(mi, c1)), denom);
+        _mm256_storeu_ps(params + i, _mm256_sub_ps(_mm256_loadu_ps(params + i), update));
+    }
+    _adam_scalar(params + i, grads + i, m + i, v + i, size - i,
+        lr, beta1, beta2, eps, correction1, correction2);
+}
+#endif
+
+#ifdef PUFFERNET_NEON
+void _axpy_neon(float alpha, float* x, float* y, int size) {
+    float32x4_t a = vdupq_n_f32(alpha);
+    int i = 0;
+    for (; i + 8 <= size; i += 8) {
+        float32x4_t y0 = vfmaq_f32(vld1q_f32(y + i), a, vld1q_f32(x + i));
+        float32x4_t y1 = vfmaq_f32(vld1q_f32(y + i + 4), a, vld1q_f32(x + i + 4));
+        vst1q_f32(y + i, y0);
+        vst1q_f32(y + i + 4, y1);
+    }
+    _axpy_scalar(alpha, x + i, y + i, size - i);
+}
+
+void _adam_neon(float* params, float* grads, float* m, float* v, int size,
+        float lr, float beta1, float beta2, float eps, float correction1, float correction2) {
+    float32x4_t b1 = vdupq_n_f32(beta1), nb1 = vdupq_n_f32(1.0f - beta1);
+    float32x4_t b2 = vdupq_n_f32(beta2), nb2 = vdupq_n_f32(1.0f - beta2);
+    float32x4_t c1 = vdupq_n_f32(correction1), c2 = vdupq_n_f32(correction2);
+    float32x4_t step = vdupq_n_f32(lr), epsilon = vdupq_n_f32(eps);
+    int i = 0;
+    for (; i + 4 <= size; i += 4) {
+        float32x4_t g = vld1q_f32(grads + i);
+        float32x4_t mi = vfmaq_f32(vmulq_f32(nb1, g), b1, vld1q_f32(m + i));
+        float32x4_t vi = vfmaq_f32(vmulq_f32(nb2, vmulq_f32(g, g)), b2, vld1q_f32(v + i));
+        vst1q_f32(m + i, mi);
+        vst1q_f32(v + i, vi);
+        float32x4_t denom = vaddq_f32(vsqrtq_f32(vmulq_f32(vi, c2)), epsilon);
+        float32x4_t update = vdivq_f32(vmulq_f32(step, vmulq_f32(mi, c1)), denom);
+        vst1q_f32(params + i, vsubq_f32(vld1q_f32(params + i), update));
+    }
+    _adam_scalar(params + i, grads + i, m + i, v + i, size - i,
+        lr, beta1, beta2, eps, correction1, correction2);
+}
+#endif
+
+typedef struct TrainKernels TrainKernels;
+struct TrainKernels {
+    const char* name;
+    AxpyKernel axpy;
+    AdamKernel adam;
+};
+
+static const TrainKernels PUFFERNET_TRAIN_KERNELS[] = {
+    {"scalar", _axpy_scalar, _adam_scalar},
+#ifdef PUFFERNET_X86
+    {"sse41", _axpy_sse41, _adam_sse41},
+    {"avx2", _axpy_avx2, _adam_avx2},
+#endif
+#ifdef PUFFERNET_NEON
+    {"neon", _axpy_neon, _adam_neon},
+#endif
+};
+
+// Same variant as the forward kernels, so PUFFERNET_ISA covers both
+const TrainKernels* puffernet_train_kernels() {
+    const char* name = puffernet_kernels()->name;
+    int count = sizeof(PUFFERNET_TRAIN_KERNELS)/sizeof(TrainKernels);
+    for (int i = 0; i < count; i++) {
+        if (strcmp(PUFFERNET_TRAIN_KERNELS[i].name, name) == 0) {
+            return &PUFFERNET_TRAIN_KERNELS[i];
+        }
+    }
+    return &PUFFERNET_TRAIN_KERNELS[0];
+}
+
+void _axpy(float alpha, float* x, float* y, int size) {
+    puffernet_train_kernels()->axpy(alpha, x, y, size);
+}
+
+// Gradients of _linear. grad_output is [B x O]. grad_input [B x I] is
+// overwritten and may be NULL, grad_weights [O x I] and grad_bias [O] (may be
+// NULL) are accumulated
+void _linear_backward(float* input, float* weights, float* grad_output,
+        float* grad_input, float* grad_weights, float* grad_bias,
+        int batch_size, int input_dim, int output_dim) {
+    AxpyKernel axpy = puffernet_train_kernels()->axpy;
+    for (int b = 0; b < batch_size; b++) {
+        float* go = grad_output + b*output_dim;
+        float* x = input + b*input_dim;
+        if (grad_input != NULL) {
+            memset(grad_input + b*input_dim, 0, input_dim*sizeof(float));
+        }
+        for (int o = 0; o < output_dim; o++) {
+            if (go[o] == 0.0f) {
+                continue;
+            }
+            axpy(go[o], x, grad_weights + o*input_dim, input_dim);
+            if (grad_input != NULL) {
+                axpy(go[o], weights + o*input_dim, grad_input + b*input_dim, input_dim);
+            }
+        }
+        if (grad_bias != NULL) {
+            for (int o = 0; o < output_dim; o++) {
+                grad_bias[o] += go[o];
+            }
+        }
+    }
+}
+
+// From the ReLU output. grad_input may alias grad_output
+void _relu_backward(float* output, float* grad_output, float* grad_input, int size) {
+    for (int i = 0; i < size; i++) {
+        grad_input[i] = output[i] > 0.0f ? grad_output[i] : 0.0f;
+    }
+}
+
+// Tanh form of GELU with libm, the function _gelu approximates
+void _gelu_train(float* input, float* output, int size) {
+    for (int i = 0; i < size; i++) {
+        float x = input[i];
+        float u = PUFFERNET_GELU_K*(x + 0.044715f*x*x*x);
+        output[i] = 0.5f*x*(1.0f + tanhf(u));
+    }
+}
+
+// From the GELU input. grad_input may alias grad_output
+void _gelu_backward(float* input, float* grad_output, float* grad_input, int size) {
+    for (int i = 0; i < size; i++) {
+        float x = input[i];
+        float t = tanhf(PUFFERNET_GELU_K*(x + 0.044715f*x*x*x));
+        float du = PUFFERNET_GELU_K*(1.0f + 3.0f*0.044715f*x*x);
+        grad_input[i] = grad_output[i]*(0.5f*(1.0f + t) + 0.5f*x*(1.0f - t*t)*du);
+    }
+}
+
+// From the _layernorm input. grad_input [B x D] is overwritten, grad_weights
+// and grad_bias [D] are accumulated
+void _layernorm_backward(float* input, float* weights, float* grad_output,
+        float* grad_input, float* grad_weights, float* grad_bias,
+        int batch_size, int input_dim) {
+    for (int b = 0; b < batch_size; b++) {
+        float* x = input + b*input_dim;
+        float* go = grad_output + b*input_dim;
+        float* gi = grad_input + b*input_dim;
+        float mean = 0.0f;
+        for (int i = 0; i < input_dim; i++) {
+            mean += x[i];
+        }
+        mean /= (float)input_dim;
+        float variance = 0.0f;
+        for (int i = 0; i < input_dim; i++) {
+            variance += (x[i] - mean)*(x[i] - mean);
+        }
+        variance /= (float)input_dim;
+        float inv = 1.0f/sqrtf(variance + 1e-5f);
+
+        // dx = inv*(dn - mean(dn) - n*mean(dn*n)) with n the normalized input
+        float sum_dn = 0.0f;
+        float sum_dn_n = 0.0f;
+        for (int i = 0; i < input_dim; i++) {
+            float n = (x[i] - mean)*inv;
+            float dn = go[i]*weights[i];
+            grad_weights[i] += go[i]*n;
+            grad_bias[i] += go[i];
+            sum_dn += dn;
+            sum_dn_n += dn*n;
+        }
+        sum_dn /= (float)input_dim;
+        sum_dn_n /= (float)input_dim;
+        for (int i = 0; i < input_dim; i++) {
+            float n = (x[i] - mean)*inv;
+            gi[i] = inv*(go[i]*weights[i] - sum_dn - n*sum_dn_n);
+        }
+    }
+}
+
+// Log-softmax of a categorical policy head. logp is [B x A]. Writes the
+// log-probability of each taken action and the entropy of each row
+void _categorical_forward(float* logits, int* actions, float* logp,
+        float* action_logp, float* entropy, int batch_size, int num_logits) {
+    for (int b = 0; b < batch_size; b++) {
+        float* z = logits + b*num_logits;
+        float* lp = logp + b*num_logits;
+        float max_logit = z[0];
+        for (int i = 1; i < num_logits; i++) {
+            max_logit = fmaxf(max_logit, z[i]);
+        }
+        float sum = 0.0f;
+        for (int i = 0; i < num_logits; i++) {
+            sum += expf(z[i] - max_logit);
+        }
+        float lse = max_logit + logf(sum);
+        float h = 0.0f;
+        for (int i = 0; i < num_logits; i++) {
+            lp[i] = z[i] - lse;
+            h -= expf(lp[i])*lp[i];
+        }
+        action_logp[b] = lp[actions[b]];
+        entropy[b] = h;
+    }
+}
+
+// Gradient of grad_logp*log p(action) + grad_entropy*entropy per row with
+// respect to the logits, from the logp of _categorical_forward:
+//     d log p(a)/dz = onehot(a) - p,  dH/dz = -p*(log p + H)
+void _categorical_backward(float* logp, int* actions, float* grad_logp,
+        float* grad_entropy, float* grad_logits, int batch_size, int num_logits) {
+    for (int b = 0; b < batch_size; b++) {
+        float* lp = logp + b*num_logits;
+        float* gz = grad_logits + b*num_logits;
+        float h = 0.0f;
+        for (int i = 0; i < num_logits; i++) {
+            h -= expf(lp[i])*lp[i];
+        }
+        for (int i = 0; i < num_logits; i++) {
+            float p = expf(lp[i]);
+            gz[i] = -grad_logp[b]*p - grad_entropy[b]*p*(lp[i] + h);
+        }
+        gz[actions[b]] += grad_logp[b];
+    }
+}
+
+float _sigmoid_train(float x) {
+    return 1.0f/(1.0f + expf(-x));
+}
+
+// One LSTM step (PyTorch gate order i, f, g, o) keeping what backprop needs:
+// gates [B x 4H] holds the activated gates, tanh_c = tanh(c)
+void _lstm_train_step(float* input, float* h_prev, float* c_prev,
+        float* weights_input, float* weights_state, float* bias_input, float* bias_state,
+        float* gates, float* h, float* c, float* tanh_c,
+        int batch_size, int input_size, int hidden_size) {
+    int H = hidden_size;
+    _linear(input, weights_input, bias_input, gates, batch_size, input_size, 4*H);
+    _linear_accumulate(h_prev, weights_state, bias_state, gates, batch_size, H, 4*H);
+    for (int b = 0; b < batch_size; b++) {
+        float* gate = gates + b*4*H;
+        for (int j = 0; j < H; j++) {
+            float i = _sigmoid_train(gate[j]);
+            float f = _sigmoid_train(gate[H + j]);
+            float g = tanhf(gate[2*H + j]);
+            float o = _sigmoid_train(gate[3*H + j]);
+            gate[j] = i;
+            gate[H + j] = f;
+            gate[2*H + j] = g;
+            gate[3*H + j] = o;
+            int k = b*H + j;
+            c[k] = f*c_prev[k] + i*g;
+            tanh_c[k] = tanhf(c[k]);
+            h[k] = o*tanh_c[k];
+        }
+    }
+}
+
+// Backward of _lstm_train_step. grad_h is the total gradient of h and grad_c
+// the gradient of c from later steps. Writes grad_input, grad_h_prev and
+// grad_c_prev (which may alias grad_h and grad_c), accumulates the parameter
+// gradients.
+// grad_gates [B x 4H] is scratch
+void _lstm_backward_step(float* input, float* h_prev, float* c_prev,
+        float* weights_input, float* weights_state, float* gates, float* tanh_c,
+        float* grad_h, float* grad_c, float* grad_gates,
+        float* grad_input, float* grad_h_prev, float* grad_c_prev,
+        float* grad_weights_input, float* grad_weights_state,
+        float* grad_bias_input, float* grad_bias_state,
+        int batch_size, int input_size, int hidden_size) {
+    int H = hidden_size;
+    for (int b = 0; b < batch_size; b++) {
+        float* gate = gates + b*4*H;
+        float* dgate = grad_gates + b*4*H;
+        for (int j = 0; j < H; j++) {
+            int k = b*H + j;
+            float i = gate[j], f = gate[H + j], g = gate[2*H + j], o = gate[3*H + j];
+            float dc = grad_c[k] + grad_h[k]*o*(1.0f - tanh_c[k]*tanh_c[k]);
+            dgate[j] = dc*g*i*(1.0f - i);
+            dgate[H + j] = dc*c_prev[k]*f*(1.0f - f);
+            dgate[2*H + j] = dc*i*(1.0f - g*g);
+            dgate[3*H + j] = grad_h[k]*tanh_c[k]*o*(1.0f - o);
+            grad_c_prev[k] = dc*f;
+        }
+    }
+    _linear_backward(input, weights_input, grad_gates, grad_input, grad_weights_input,
+        grad_bias_input, batch_size, input_size, 4*H);
+    _linear_backward(h_prev, weights_state, grad_gates, grad_h_prev, grad_weights_state,
+        grad_bias_state, batch_size, H, 4*H);
+}
+
+// Adam (Kingma & Ba) over one flat parameter buffer
+typedef struct Adam Adam;
+struct Adam {
+    float lr;
+    float beta1;
+    float beta2;
+    float eps;
+    int steps;
+    size_t size;
+    float* m;
+    float* v;
+};
+
+size_t adam_size(size_t num_params) {
+    return _block_size(sizeof(Adam)) + 2*_block_size(num_params*sizeof(float));
+}
+
+Adam* make_adam(size_t num_params, float lr, Arena* arena) {
+    Adam* adam = _make_block(arena, adam_size(num_params));
+    if (adam == NULL) {
+        return NULL;
+    }
+    char* cursor = _block_data(adam, sizeof(Adam));
+    *adam = (Adam){
+        .lr = lr,
+        .beta1 = 0.9f,
+        .beta2 = 0.999f,
+        .eps = 1e-8f,
+        .size = num_params,
+        .m = _carve(&cursor, num_params*sizeof(float)),
+        .v = _carve(&cursor, num_params*sizeof(float)),
+    };
+    return adam;
+}
+
+void adam_step(Adam* adam, float* params, float* grads) {
+    adam->steps++;
+    float correction1 = 1.0f/(1.0f - powf(adam->beta1, adam->steps));
+    float correction2 = 1.0f/(1.0f - powf(adam->beta2, adam->steps));
+    puffernet_train_kernels()->adam(params, grads, adam->m, adam->v, (int)adam->size,
+        adam->lr, adam->beta1, adam->beta2, adam->eps, correction1, correction2);
+}
+
+// Scales grads so their L2 norm is at most max_norm. Returns the norm before
+float clip_grad_norm(float* grads, size_t size, float max_norm) {
+    double sum = 0.0;
+    for (size_t i = 0; i < size; i++) {
+        sum += (double)grads[i]*grads[i];
+    }
+    float norm = (float)sqrt(sum);
+    if (norm > max_norm) {
+        float scale = max_norm/(norm + 1e-6f);
+        for (size_t i = 0; i < size; i++) {
+            grads[i] *= scale;
+        }
+    }
+    return norm;
+}
+
+// Trainable LinearLSTM with a single categorical action head. The parameters
+// are one buffer in the raw order make_linearlstm reads, so they can be saved
+// as a raw weights file or wrapped by linearlstm_train_weights to build an
+// inference net (which copies the packed LSTM and head weights: rebuild it
+// after each update). make_linearlstm is fixed to hidden size 128; other
+// sizes are for gradient checks.
+//
+// forward runs a window of steps over [steps x B] observations, keeping every
+// activation, and backward accumulates the gradients of the loss given its
+// gradients w.r.t. the logits and values. An episode that starts at step t
+// has starts[t*B + b] set; its state is zeroed there and no gradient flows
+// back across it. Gradients are truncated at the start of the window.
+typedef struct LinearLSTMTrain LinearLSTMTrain;
+struct LinearLSTMTrain {
+    int batch_size;
+    int max_steps;
+    int steps;  // of the last forward
+    int input_dim;
+    int hidden_size;
+    int num_logits;
+    size_t num_params;
+    float* params;
+    float* grads;
+    Weights weights;
+    // Views of params, then the same offsets into grads
+    float* encoder_weights;
+    float* encoder_bias;
+    float* actor_weights;
+    float* actor_bias;
+    float* value_weights;
+    float* value_bias;
+    float* weights_input;
+    float* weights_state;
+    float* bias_input;
+    float* bias_state;
+    // Window activations, [steps x B x ...]
+    float* obs;
+    float* starts;
+    float* encoder_pre;
+    float* encoded;
+    float* h_prev;
+    float* c_prev;
+    float* gates;
+    float* h;
+    float* c;
+    float* tanh_c;
+    float* logits;
+    float* values;
+    // Backward scratch, [B x ...]
+    float* grad_h;
+    float* grad_c;
+    float* grad_head;
+    float* grad_encoded;
+    float* grad_gates;
+    Arena* arena;
+};
+
+size_t linearlstm_train_num_params(int input_dim, int hidden_size, int num_logits) {
+    size_t H = hidden_size;
+    return H*input_dim + H + num_logits*H + num_logits + H + 1 + 8*H*H + 8*H;
+}
+
+size_t linearlstm_train_size(int batch_size, int max_steps, int input_dim,
+        int hidden_size, int num_logits) {
+    size_t rows = (size_t)batch_size*max_steps;
+    size_t H = hidden_size;
+    size_t params = linearlstm_train_num_params(input_dim, hidden_size, num_logits);
+    return _block_size(sizeof(LinearLSTMTrain))
+        + 2*_block_size(params*sizeof(float))
+        + _block_size(rows*input_dim*sizeof(float))
+        + 2*_block_size(rows*sizeof(float))
+        + 7*_block_size(rows*H*sizeof(float))
+        + _block_size(rows*4*H*sizeof(float))
+        + _block_size(rows*num_logits*sizeof(float))
+        + 4*_block_size(batch_size*H*sizeof(float))
+        + _block_size(batch_size*4*H*sizeof(float));
+}
+
+// The 10 tensors of a parameter-shaped buffer in make_linearlstm order
+void _linearlstm_train_views(LinearLSTMTrain* model, float* base, float** views,
+        size_t* sizes) {
+    size_t H = model->hidden_size;
+    size_t counts[10] = {
+        H*model->input_dim, H, model->num_logits*H, model->num_logits, H, 1,
+        4*H*H, 4*H*H, 4*H, 4*H,
+    };
+    for (int i = 0; i < 10; i++) {
+        views[i] = base;
+        base += counts[i];
+        if (sizes != NULL) {
+            sizes[i] = counts[i];
+        }
+    }
+}
+
+// Parameters start at zero, see linearlstm_train_init
+LinearLSTMTrain* make_linearlstm_train(int batch_size, int max_steps, int input_dim,
+        int hidden_size, int num_logits, Arena* arena) {
+    Arena* owned = _network_arena(&arena, linearlstm_train_size(batch_size, max_steps,
+        input_dim, hidden_size, num_logits));
+    if (arena == NULL) {
+        return NULL;
+    }
+    size_t rows = (size_t)batch_size*max_steps;
+    size_t H = hidden_size;
+    size_t params = linearlstm_train_num_params(input_dim, hidden_size, num_logits);
+    LinearLSTMTrain* model = _make_block(arena, linearlstm_train_size(batch_size,
+        max_steps, input_dim, hidden_size, num_logits));
+    if (model == NULL) {
+        free_allocator(owned);
+        return NULL;
+    }
+    char* cursor = _block_data(model, sizeof(LinearLSTMTrain));
+    *model = (LinearLSTMTrain){
+        .batch_size = batch_size,
+        .max_steps = max_steps,
+        .input_dim = input_dim,
+        .hidden_size = hidden_size,
+        .num_logits = num_logits,
+        .num_params = params,
+        .params = _carve(&cursor, params*sizeof(float)),
+        .grads = _carve(&cursor, params*sizeof(float)),
+        .obs = _carve(&cursor, rows*input_dim*sizeof(float)),
+        .starts = _carve(&cursor, rows*sizeof(float)),
+        .values = _carve(&cursor, rows*sizeof(float)),
+        .encoder_pre = _carve(&cursor, rows*H*sizeof(float)),
+        .encoded = _carve(&cursor, rows*H*sizeof(float)),
+        .h_prev = _carve(&cursor, rows*H*sizeof(float)),
+        .c_prev = _carve(&cursor, rows*H*sizeof(float)),
+        .h = _carve(&cursor, rows*H*sizeof(float)),
+        .c = _carve(&cursor, rows*H*sizeof(float)),
+        .tanh_c = _carve(&cursor, rows*H*sizeof(float)),
+        .gates = _carve(&cursor, rows*4*H*sizeof(float)),
+        .logits = _carve(&cursor, rows*num_logits*sizeof(float)),
+        .grad_h = _carve(&cursor, batch_size*H*sizeof(float)),
+        .grad_c = _carve(&cursor, batch_size*H*sizeof(float)),
+        .grad_head = _carve(&cursor, batch_size*H*sizeof(float)),
+        .grad_encoded = _carve(&cursor, batch_size*H*sizeof(float)),
+        .grad_gates = _carve(&cursor, batch_size*4*H*sizeof(float)),
+        .arena = owned,
+    };
+    model->weights = (Weights){.data = model->params, .size = (int)params};
+    float* views[10];
+    _linearlstm_train_views(model, model->params, views, NULL);
+    model->encoder_weights = views[0];
+    model->encoder_bias = views[1];
+    model->actor_weights = views[2];
+    model->actor_bias = views[3];
+    model->value_weights = views[4];
+    model->value_bias = views[5];
+    model->weights_input = views[6];
+    model->weights_state = views[7];
+    model->bias_input = views[8];
+    model->bias_state = views[9];
+    return model;
+}
+
+void free_linearlstm_train(LinearLSTMTrain* model) {
+    free_allocator(model->arena);
+}
+
+// Uniform(-1/sqrt(fan_in), 1/sqrt(fan_in)) like torch.nn.Linear and LSTM,
+// with the actor weights scaled down so the initial policy is near uniform
+void linearlstm_train_init(LinearLSTMTrain* model, uint64_t seed) {
+    PufferRNG rng;
+    rng_seed(&rng, seed, 0);
+    float* views[10];
+    size_t sizes[10];
+    _linearlstm_train_views(model, model->params, views, sizes);
+    float H = model->hidden_size;
+    float fan_in[10] = {model->input_dim, model->input_dim, H, H, H, H, H, H, H, H};
+    for (int i = 0; i < 10; i++) {
+        float bound = 1.0f/sqrtf(fan_in[i]);
+        if (i == 2) {
+            bound *= 0.01f;
+        }
+        for (size_t j = 0; j < sizes[i]; j++) {
+            views[i][j] = bound*(2.0f*rng_uniform(&rng) - 1.0f);
+        }
+    }
+}
+
+// Copies raw weights in make_linearlstm order. Returns false on a size mismatch
+bool linearlstm_train_load(LinearLSTMTrain* model, Weights* weights) {
+    if ((size_t)weights->size != model->num_params) {
+        fprintf(stderr, "Expected %zu weights, got %d\n", model->num_params, weights->size);
+        return false;
+    }
+    memcpy(model->params, weights->data, model->num_params*sizeof(float));
+    return true;
+}
+
+// For make_linearlstm. Shares the parameter buffer
+Weights* linearlstm_train_weights(LinearLSTMTrain* model) {
+    model->weights.idx = 0;
+    return &model->weights;
+}
+
+// Writes the parameters as a raw weights file
+bool linearlstm_train_save(LinearLSTMTrain* model, const char* filename) {
+    FILE* file = fopen(filename, "wb");
+    if (!file) {
+        perror("Error opening weights file");
+        return false;
+    }
+    size_t written = fwrite(model->params, sizeof(float), model->num_params, file);
+    bool ok = fclose(file) == 0 && written == model->num_params;
+    if (!ok) {
+        perror("Error writing weights file");
+    }
+    return ok;
+}
+
+// Initial state h0, c0 is [B x H], NULL for zeros. Logits and values of step t are at
+// model->logits + t*B*A and model->values + t*B
+void linearlstm_train_forward(LinearLSTMTrain* model, float* observations,
+        float* starts, float* h0, float* c0, int steps) {
+    assert(steps <= model->max_steps);
+    int B = model->batch_size, I = model->input_dim, H = model->hidden_size;
+    int A = model->num_logits;
+    model->steps = steps;
+    memcpy(model->obs, observations, (size_t)steps*B*I*sizeof(float));
+    memcpy(model->starts, starts, (size_t)steps*B*sizeof(float));
+    for (int t = 0; t < steps; t++) {
+        size_t row = (size_t)t*B;
+        float* encoder_pre = model->encoder_pre + row*H;
+        float* encoded = model->encoded + row*H;
+        float* h_prev = model->h_prev + row*H;
+        float* c_prev = model->c_prev + row*H;
+        float* h_last = t == 0 ? h0 : model->h + (row - B)*H;
+        float* c_last = t == 0 ? c0 : model->c + (row - B)*H;
+        if (h_last == NULL) {
+            memset(h_prev, 0, B*H*sizeof(float));
+            memset(c_prev, 0, B*H*sizeof(float));
+        } else {
+            memcpy(h_prev, h_last, B*H*sizeof(float));
+            memcpy(c_prev, c_last, B*H*sizeof(float));
+        }
+        for (int b = 0; b < B; b++) {
+            if (starts[row + b] != 0.0f) {
+                memset(h_prev + b*H, 0, H*sizeof(float));
+                memset(c_prev + b*H, 0, H*sizeof(float));
+            }
+        }
+        _linear(model->obs + row*I, model->encoder_weights, model->encoder_bias,
+            encoder_pre, B, I, H);
+        _gelu_train(encoder_pre, encoded, B*H);
+        _lstm_train_step(encoded, h_prev, c_prev, model->weights_input,
+            model->weights_state, model->bias_input, model->bias_state,
+            model->gates + row*4*H, model->h + row*H, model->c + row*H,
+            model->tanh_c + row*H, B, H, H);
+        _linear(model->h + row*H, model->actor_weights, model->actor_bias,
+            model->logits + row*A, B, H, A);
+        _linear(model->h + row*H, model->value_weights, model->value_bias,
+            model->values + row, B, H, 1);
+    }
+}
+
+// Accumulates into model->grads (zero them with linearlstm_train_zero_grad)
+// given the loss gradients w.r.t. the logits [steps x B x A] and values
+// [steps x B] of the last forward
+void linearlstm_train_backward(LinearLSTMTrain* model, float* grad_logits,
+        float* grad_values) {
+    int B = model->batch_size, I = model->input_dim, H = model->hidden_size;
+    int A = model->num_logits;
+    float* g[10];
+    _linearlstm_train_views(model, model->grads, g, NULL);
+    float *g_encoder_w = g[0], *g_encoder_b = g[1], *g_actor_w = g[2], *g_actor_b = g[3];
+    float *g_value_w = g[4], *g_value_b = g[5], *g_weights_input = g[6];
+    float *g_weights_state = g[7], *g_bias_input = g[8], *g_bias_state = g[9];
+    memset(model->grad_h, 0, B*H*sizeof(float));
+    memset(model->grad_c, 0, B*H*sizeof(float));
+    for (int t = model->steps - 1; t >= 0; t--) {
+        size_t row = (size_t)t*B;
+        float* h = model->h + row*H;
+        // grad_h holds the gradient from step t + 1, add the heads'
+        _linear_backward(h, model->actor_weights, grad_logits + row*A, model->grad_head,
+            g_actor_w, g_actor_b, B, H, A);
+        for (int k = 0; k < B*H; k++) {
+            model->grad_h[k] += model->grad_head[k];
+        }
+        _linear_backward(h, model->value_weights, grad_values + row, model->grad_head,
+            g_value_w, g_value_b, B, H, 1);
+        for (int k = 0; k < B*H; k++) {
+            model->grad_h[k] += model->grad_head[k];
+        }
+        _lstm_backward_step(model->encoded + row*H, model->h_prev + row*H,
+            model->c_prev + row*H, model->weights_input, model->weights_state,
+            model->gates + row*4*H, model->tanh_c + row*H, model->grad_h, model->grad_c,
+            model->grad_gates, model->grad_encoded, model->grad_h, model->grad_c,
+            g_weights_input, g_weights_state, g_bias_input, g_bias_state, B, H, H);
+        for (int b = 0; b < B; b++) {
+            if (model->starts[row + b] != 0.0f) {
+                memset(model->grad_h + b*H, 0, H*sizeof(float));
+                memset(model->grad_c + b*H, 0, H*sizeof(float));
+            }
+        }
+        _gelu_backward(model->encoder_pre + row*H, model->grad_encoded,
+            model->grad_encoded, B*H);
+        _linear_backward(model->obs + row*I, model->encoder_weights, model->grad_encoded,
+            NULL, g_encoder_w, g_encoder_b, B, I, H);
+    }
+}
+
+void linearlstm_train_zero_grad(LinearLSTMTrain* model) {
+    memset(model->grads, 0, model->num_params*sizeof(float));
+}
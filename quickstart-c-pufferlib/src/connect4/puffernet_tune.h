@@ -0,0 +1,548 @@
+// Kernel autotuning for puffernet. Include after puffernet.h (and after
+// puffernet_pool.h for tune_pool).
+//
+// The tune_* functions time the candidate blocking of one layer shape on this
+// host and record the winner in a TuneCache, keyed by CPU model, kernel
+// variant, op and shape (see PufferTuneOp). A shape that is already cached is
+// not timed again. tune_install makes the kernels consult the cache. Conv
+// scratch sizes depend on the tuned tiles, so tune and install before building
+// the networks that use them.
+//
+// The cache is a small text file with one tab-separated entry per line:
+//     cpu model, kernels, op, d0 d1 d2 d3, value, ns per call, default ns
+// Entries for other CPUs and kernel variants are kept when the file is saved,
+// so one file can be shared by a fleet of different hosts.
+#include <time.h>
+#ifdef __APPLE__
+    #include <sys/sysctl.h>
+#endif
+
+#define PUFFERNET_TUNE_VERSION "# puffernet tune cache v1"
+// A candidate has to beat the default by this much to replace it
+#define PUFFERNET_TUNE_MARGIN 0.03
+
+static const char* PUFFERNET_TUNE_OPS[PUFFERNET_TUNE_NUM_OPS] = {
+    "linear_tile", "sparse_tile", "conv_tile", "pool_split", "pool_threads",
+};
+
+typedef struct TuneEntry TuneEntry;
+struct TuneEntry {
+    char cpu[64];
+    char kernels[16];
+    int op;
+    int dims[4];
+    int value;
+    double ns;
+    double default_ns;
+    bool local;  // cpu and kernels match this process
+};
+
+typedef struct TuneCache TuneCache;
+struct TuneCache {
+    TuneEntry* entries;
+    int count;
+    int capacity;
+};
+
+// CPU model string, tabs and newlines replaced. "unknown" if it can't be read
+const char* puffernet_cpu_model() {
+    static char model[64] = {0};
+    if (model[0] != '\0') {
+        return model;
+    }
+    snprintf(model, sizeof(model), "unknown");
+#if defined(__APPLE__)
+    size_t size = sizeof(model);
+    if (sysctlbyname("machdep.cpu.brand_string", model, &size, NULL, 0) != 0) {
+        snprintf(model, sizeof(model), "unknown");
+    }
+#elif defined(__linux__)
+    FILE* file = fopen("/proc/cpuinfo", "r");
+    if (file) {
+        // x86 has "model name", most ARM kernels only "CPU part"
+        const char* keys[2] = {"model name", "CPU part"};
+        char line[256];
+        char found[2][64] = {{0}};
+        while (fgets(line, sizeof(line), file)) {
+            char* colon = strchr(line, ':');
+            for (int k = 0; k < 2 && colon != NULL; k++) {
+                if (found[k][0] == '\0' && strncmp(line, keys[k], strlen(keys[k])) == 0) {
+                    snprintf(found[k], sizeof(found[k]), "%s", colon + 1 + (colon[1] == ' '));
+                }
+            }
+        }
+        fclose(file);
+        if (found[0][0] != '\0') {
+            snprintf(model, sizeof(model), "%s", found[0]);
+        } else if (found[1][0] != '\0') {
+            snprintf(model, sizeof(model), "arm part %.48s", found[1]);
+        }
+    }
+#endif
+    for (char* c = model; *c != '\0'; c++) {
+        if (*c == '\t' || *c == '\n') {
+            *c = *c == '\n' ? '\0' : ' ';
+        }
+    }
+    return model;
+}
+
+bool _tune_is_local(TuneEntry* entry) {
+    return strcmp(entry->cpu, puffernet_cpu_model()) == 0
+        && strcmp(entry->kernels, puffernet_kernels()->name) == 0;
+}
+
+TuneCache* make_tune_cache() {
+    return calloc(1, sizeof(TuneCache));
+}
+
+void free_tune_cache(TuneCache* cache) {
+    if (cache == NULL) {
+        return;
+    }
+    free(cache->entries);
+    free(cache);
+}
+
+TuneEntry* tune_cache_get(TuneCache* cache, PufferTuneOp op, int d0, int d1, int d2, int d3) {
+    for (int i = 0; i < cache->count; i++) {
+        TuneEntry* e = &cache->entries[i];
+        if (e->local && e->op == (int)op && e->dims[0] == d0 && e->dims[1] == d1
+                && e->dims[2] == d2 && e->dims[3] == d3) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+TuneEntry* _tune_cache_add(TuneCache* cache) {
+    if (cache->count == cache->capacity) {
+        cache->capacity = cache->capacity ? 2*cache->capacity : 32;
+        cache->entries = realloc(cache->entries, cache->capacity*sizeof(TuneEntry));
+    }
+    TuneEntry* entry = &cache->entries[cache->count++];
+    memset(entry, 0, sizeof(TuneEntry));
+    return entry;
+}
+
+// Adds or replaces the entry for this host
+TuneEntry* tune_cache_put(TuneCache* cache, PufferTuneOp op, int d0, int d1, int d2, int d3,
+        int value, double ns, double default_ns) {
+    TuneEntry* entry = tune_cache_get(cache, op, d0, d1, d2, d3);
+    if (entry == NULL) {
+        entry = _tune_cache_add(cache);
+        snprintf(entry->cpu, sizeof(entry->cpu), "%s", puffernet_cpu_model());
+        snprintf(entry->kernels, sizeof(entry->kernels), "%s", puffernet_kernels()->name);
+        entry->op = op;
+        entry->dims[0] = d0;
+        entry->dims[1] = d1;
+        entry->dims[2] = d2;
+        entry->dims[3] = d3;
+        entry->local = true;
+    }
+    entry->value = value;
+    entry->ns = ns;
+    entry->default_ns = default_ns;
+    return entry;
+}
+
+// An empty cache if the file does not exist yet. Malformed lines are skipped
+TuneCache* tune_cache_load(const char* filename) {
+    TuneCache* cache = make_tune_cache();
+    FILE* file = fopen(filename, "r");
+    if (!file) {
+        return cache;
+    }
+    char line[512];
+    int line_number = 0;
+    while (fgets(line, sizeof(line), file)) {
+        line_number++;
+        if (line[0] == '#' || line[0] == '\n') {
+            continue;
+        }
+        char* fields[7];
+        int n = 0;
+        char* field = strtok(line, "\t\n");
+        for (; field != NULL && n < 7; field = strtok(NULL, "\t\n")) {
+            fields[n++] = field;
+        }
+        int op = -1;
+        for (int i = 0; n == 7 && i < PUFFERNET_TUNE_NUM_OPS; i++) {
+            if (strcmp(fields[2], PUFFERNET_TUNE_OPS[i]) == 0) {
+                op = i;
+            }
+        }
+        TuneEntry entry = {0};
+        if (op < 0 || sscanf(fields[3], "%d %d %d %d", &entry.dims[0], &entry.dims[1],
+                &entry.dims[2], &entry.dims[3]) != 4) {
+            fprintf(stderr, "Skipping line %d of %s\n", line_number, filename);
+            continue;
+        }
+        snprintf(entry.cpu, sizeof(entry.cpu), "%s", fields[0]);
+        snprintf(entry.kernels, sizeof(entry.kernels), "%s", fields[1]);
+        entry.op = op;
+        entry.value = atoi(fields[4]);
+        entry.ns = atof(fields[5]);
+        entry.default_ns = atof(fields[6]);
+        entry.local = _tune_is_local(&entry);
+        *_tune_cache_add(cache) = entry;
+    }
+    fclose(file);
+    return cache;
+}
+
+// Writes a temporary file and renames it, so readers never see half a cache
+bool tune_cache_save(TuneCache* cache, const char* filename) {
+    char tmp[1024];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", filename);
+    FILE* file = fopen(tmp, "w");
+    if (!file) {
+        perror("Error writing tune cache");
+        return false;
+    }
+    fprintf(file, "%s\n", PUFFERNET_TUNE_VERSION);
+    for (int i = 0; i < cache->count; i++) {
+        TuneEntry* e = &cache->entries[i];
+        fprintf(file, "%s\t%s\t%s\t%d %d %d %d\t%d\t%.0f\t%.0f\n", e->cpu, e->kernels,
+            PUFFERNET_TUNE_OPS[e->op], e->dims[0], e->dims[1], e->dims[2], e->dims[3],
+            e->value, e->ns, e->default_ns);
+    }
+    if (fclose(file) != 0 || rename(tmp, filename) != 0) {
+        perror("Error writing tune cache");
+        remove(tmp);
+        return false;
+    }
+    return true;
+}
+
+// While a candidate is timed, lookups of its op return it instead of the cache
+static TuneCache* _tune_installed = NULL;
+static int _tune_trial_op = -1;
+static int _tune_trial_value = 0;
+
+int _tune_lookup(PufferTuneOp op, int d0, int d1, int d2, int d3) {
+    if ((int)op == _tune_trial_op) {
+        return _tune_trial_value;
+    }
+    if (_tune_installed == NULL) {
+        return 0;
+    }
+    TuneEntry* entry = tune_cache_get(_tune_installed, op, d0, d1, d2, d3);
+    return entry != NULL ? entry->value : 0;
+}
+
+// The kernels use cache's values from now on. NULL restores the defaults
+void tune_install(TuneCache* cache) {
+    _tune_installed = cache;
+    puffernet_set_tuning(cache != NULL ? _tune_lookup : NULL);
+}
+
+double _tune_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9*ts.tv_nsec;
+}
+
+typedef void (*TuneBody)(void* ctx);
+
+// ns per call of body with op forced to value (0 for the default): the best
+// of 5 rounds, each at least seconds/5 long
+double _tune_time(TuneBody body, void* ctx, PufferTuneOp op, int value, double seconds) {
+    PufferTuneLookup saved = puffernet_tuning();
+    puffernet_set_tuning(_tune_lookup);
+    _tune_trial_op = op;
+    _tune_trial_value = value;
+    body(ctx);
+    double best = 1e30;
+    for (int round = 0; round < 5; round++) {
+        long calls = 0;
+        double start = _tune_now();
+        double elapsed = 0.0;
+        while (elapsed < seconds/5 || calls < 3) {
+            body(ctx);
+            calls++;
+            elapsed = _tune_now() - start;
+        }
+        best = fmin(best, 1e9*elapsed/calls);
+    }
+    _tune_trial_op = -1;
+    puffernet_set_tuning(saved);
+    return best;
+}
+
+// Times every candidate against the default and stores the winner. The
+// default is kept unless a candidate is PUFFERNET_TUNE_MARGIN faster
+TuneEntry* _tune_select(TuneCache* cache, PufferTuneOp op, int dims[4], int default_value,
+        int* candidates, int num_candidates, TuneBody body, void* ctx, double seconds) {
+    double default_ns = _tune_time(body, ctx, op, 0, seconds);
+    int best = default_value;
+    double best_ns = default_ns;
+    for (int i = 0; i < num_candidates; i++) {
+        if (candidates[i] == default_value) {
+            continue;
+        }
+        double ns = _tune_time(body, ctx, op, candidates[i], seconds);
+        if (ns < best_ns && ns < (1.0 - PUFFERNET_TUNE_MARGIN)*default_ns) {
+            best = candidates[i];
+            best_ns = ns;
+        }
+    }
+    return tune_cache_put(cache, op, dims[0], dims[1], dims[2], dims[3], best, best_ns, default_ns);
+}
+
+float* _tune_random(size_t n) {
+    float* data = malloc(n*sizeof(float));
+    for (size_t i = 0; i < n; i++) {
+        data[i] = 2.0f*rand()/(float)RAND_MAX - 1.0f;
+    }
+    return data;
+}
+
+typedef struct TuneLinear TuneLinear;
+struct TuneLinear {
+    float* input;
+    float* weights;
+    float* bias;
+    float* output;
+    int batch_size;
+    int input_dim;
+    int output_dim;
+};
+
+void _tune_linear_body(void* ctx) {
+    TuneLinear* t = (TuneLinear*)ctx;
+    puffernet_kernels()->linear(t->input, t->weights, t->bias, t->output, t->batch_size,
+        t->input_dim, t->output_dim, PUFFERNET_EPILOGUE_NONE,
+        _linear_tile(t->batch_size, t->input_dim, t->output_dim));
+}
+
+// Batch rows per tile of the linear kernels for one shape
+TuneEntry* tune_linear(TuneCache* cache, int batch_size, int input_dim, int output_dim,
+        double seconds) {
+    int dims[4] = {batch_size, input_dim, output_dim, 0};
+    TuneEntry* entry = tune_cache_get(cache, PUFFERNET_TUNE_LINEAR_TILE,
+        dims[0], dims[1], dims[2], dims[3]);
+    if (entry != NULL) {
+        return entry;
+    }
+    TuneLinear t = {
+        _tune_random((size_t)batch_size*input_dim), _tune_random((size_t)output_dim*input_dim),
+        _tune_random(output_dim), malloc((size_t)batch_size*output_dim*sizeof(float)),
+        batch_size, input_dim, output_dim,
+    };
+    int candidates[8];
+    int n = 0;
+    for (int tile = 1; tile <= 128 && n < 8; tile *= 2) {
+        if (tile < 2*batch_size) {
+            candidates[n++] = tile;
+        }
+    }
+    entry = _tune_select(cache, PUFFERNET_TUNE_LINEAR_TILE, dims, PUFFERNET_LINEAR_TILE,
+        candidates, n, _tune_linear_body, &t, seconds);
+    free(t.input);
+    free(t.weights);
+    free(t.bias);
+    free(t.output);
+    return entry;
+}
+
+typedef struct TuneSparse TuneSparse;
+struct TuneSparse {
+    float* input;
+    BlockSparse* weights;
+    float* bias;
+    float* output;
+    int batch_size;
+};
+
+void _tune_sparse_body(void* ctx) {
+    TuneSparse* t = (TuneSparse*)ctx;
+    BlockSparse* w = t->weights;
+    puffernet_kernels()->sparse_linear(t->input, w, t->bias, t->output, t->batch_size,
+        PUFFERNET_EPILOGUE_NONE, _sparse_linear_tile(t->batch_size, w->cols, w->rows,
+            block_sparse_num_blocks(w)));
+}
+
+// Batch rows per tile of the block-sparse linear kernels for one layer's
+// weights (tools/sparsify or make_sparse_linear)
+TuneEntry* tune_sparse_linear(TuneCache* cache, int batch_size, BlockSparse* weights,
+        double seconds) {
+    int dims[4] = {batch_size, weights->cols, weights->rows, block_sparse_num_blocks(weights)};
+    TuneEntry* entry = tune_cache_get(cache, PUFFERNET_TUNE_SPARSE_TILE,
+        dims[0], dims[1], dims[2], dims[3]);
+    if (entry != NULL) {
+        return entry;
+    }
+    TuneSparse t = {
+        _tune_random((size_t)batch_size*weights->cols), weights, _tune_random(weights->rows),
+        malloc((size_t)batch_size*weights->rows*sizeof(float)), batch_size,
+    };
+    int candidates[8];
+    int n = 0;
+    for (int tile = 1; tile <= 128 && n < 8; tile *= 2) {
+        if (tile < 2*batch_size) {
+            candidates[n++] = tile;
+        }
+    }
+    entry = _tune_select(cache, PUFFERNET_TUNE_SPARSE_TILE, dims, PUFFERNET_LINEAR_TILE,
+        candidates, n, _tune_sparse_body, &t, seconds);
+    free(t.input);
+    free(t.bias);
+    free(t.output);
+    return entry;
+}
+
+typedef struct TuneConv TuneConv;
+struct TuneConv {
+    float* input;
+    float* weights;
+    float* bias;
+    float* output;
+    float* scratch;
+    int batch_size;
+    int in_width;
+    int in_height;
+    int in_channels;
+    int out_channels;
+    int kernel_size;
+    int stride;
+};
+
+void _tune_conv_body(void* ctx) {
+    TuneConv* t = (TuneConv*)ctx;
+    int num_patches = ((t->in_height - t->kernel_size)/t->stride + 1)
+        *((t->in_width - t->kernel_size)/t->stride + 1);
+    // Resolved per call, so the trial tile is seen through the lookup
+    int tile = _conv2d_tile(t->in_channels, t->kernel_size, t->out_channels, num_patches);
+    _conv2d(t->input, t->weights, t->bias, t->output, t->scratch, t->batch_size,
+        t->in_width, t->in_height, t->in_channels, t->out_channels, t->kernel_size,
+        t->stride, tile, PUFFERNET_EPILOGUE_RELU);
+}
+
+// Patches per im2col tile of _conv2d for one layer shape. The batch size
+// only sets how much work is timed, tiles are per image
+TuneEntry* tune_conv2d(TuneCache* cache, int batch_size, int in_width, int in_height,
+        int in_channels, int out_channels, int kernel_size, int stride, double seconds) {
+    int h_out = (in_height - kernel_size)/stride + 1;
+    int w_out = (in_width - kernel_size)/stride + 1;
+    int num_patches = h_out*w_out;
+    int patch_size = in_channels*kernel_size*kernel_size;
+    int dims[4] = {in_channels, kernel_size, out_channels, num_patches};
+    TuneEntry* entry = tune_cache_get(cache, PUFFERNET_TUNE_CONV_TILE,
+        dims[0], dims[1], dims[2], dims[3]);
+    if (entry != NULL) {
+        return entry;
+    }
+    // Column tiles of 8 KiB to 1 MiB
+    int candidates[8];
+    int n = 0;
+    for (int kib = 8; kib <= 1024; kib *= 2) {
+        int tile = kib*1024/(patch_size*(int)sizeof(float));
+        tile = tile < 4 ? 4 : tile;
+        tile = tile < num_patches ? tile : num_patches;
+        if (n == 0 || candidates[n - 1] != tile) {
+            candidates[n++] = tile;
+        }
+    }
+    PufferTuneLookup saved = puffernet_tuning();
+    puffernet_set_tuning(NULL);
+    int default_tile = _conv2d_tile(in_channels, kernel_size, out_channels, num_patches);
+    puffernet_set_tuning(saved);
+    int max_tile = candidates[n - 1] > default_tile ? candidates[n - 1] : default_tile;
+    TuneConv t = {
+        _tune_random((size_t)batch_size*in_channels*in_height*in_width),
+        _tune_random((size_t)out_channels*patch_size), _tune_random(out_channels),
+        malloc((size_t)batch_size*out_channels*num_patches*sizeof(float)),
+        malloc((size_t)max_tile*(patch_size + out_channels)*sizeof(float)),
+        batch_size, in_width, in_height, in_channels, out_channels, kernel_size, stride,
+    };
+    entry = _tune_select(cache, PUFFERNET_TUNE_CONV_TILE, dims, default_tile,
+        candidates, n, _tune_conv_body, &t, seconds);
+    free(t.input);
+    free(t.weights);
+    free(t.bias);
+    free(t.output);
+    free(t.scratch);
+    return entry;
+}
+
+// Every tunable layer of make_linearlstm. Returns how many shapes were timed
+int tune_linearlstm(TuneCache* cache, int num_agents, int input_dim, int atn_sum,
+        double seconds) {
+    int before = cache->count;
+    tune_linear(cache, num_agents, input_dim, 128, seconds);
+    tune_linear(cache, num_agents, 128, atn_sum + 1, seconds);
+    return cache->count - before;
+}
+
+// Every tunable layer of make_convlstm. Returns how many shapes were timed
+int tune_convlstm(TuneCache* cache, int num_agents, int input_dim, int input_channels,
+        int cnn_channels, int hidden_dim, int atn_sum, double seconds) {
+    int before = cache->count;
+    int dim1 = _convlstm_conv1_dim(input_dim);
+    int dim2 = _convlstm_conv2_dim(input_dim);
+    tune_conv2d(cache, num_agents, input_dim, input_dim, input_channels, cnn_channels, 5, 3,
+        seconds);
+    tune_conv2d(cache, num_agents, dim1, dim1, cnn_channels, cnn_channels, 3, 1, seconds);
+    tune_linear(cache, num_agents, cnn_channels*dim2*dim2, hidden_dim, seconds);
+    tune_linear(cache, num_agents, hidden_dim, atn_sum + 1, seconds);
+    return cache->count - before;
+}
+
+#ifdef PUFFERNET_SPLIT_AGENTS
+typedef struct TunePool TunePool;
+struct TunePool {
+    LinearLSTM* net;
+    ThreadPool* pool;
+    float* obs;
+    int* actions;
+};
+
+void _tune_pool_body(void* ctx) {
+    TunePool* t = (TunePool*)ctx;
+    forward_linearlstm_pool(t->net, t->pool, t->obs, t->actions);
+}
+
+// Thread count (1, 2, 4, ... max_threads) and batch split of
+// forward_linearlstm_pool for net's batch. Stores the split per thread count
+// and returns the fastest thread count for the caller's make_thread_pool
+int tune_pool(TuneCache* cache, LinearLSTM* net, int max_threads, double seconds) {
+    int agents = net->num_agents;
+    TuneEntry* cached = tune_cache_get(cache, PUFFERNET_TUNE_POOL_THREADS,
+        agents, max_threads, 0, 0);
+    if (cached != NULL) {
+        return cached->value;
+    }
+    TunePool t = {net, NULL, _tune_random((size_t)agents*net->encoder->input_dim),
+        calloc(agents*net->multidiscrete->num_actions, sizeof(int))};
+    int splits[2] = {PUFFERNET_SPLIT_AGENTS, PUFFERNET_SPLIT_UNITS};
+    int best_threads = 1;
+    double best_ns = 1e30;
+    double default_ns = 0.0;
+    int threads = 1;
+    while (true) {
+        t.pool = make_thread_pool(threads, true);
+        int dims[4] = {agents, t.pool->num_threads, 0, 0};
+        int default_split = agents >= t.pool->num_threads
+            ? PUFFERNET_SPLIT_AGENTS : PUFFERNET_SPLIT_UNITS;
+        TuneEntry* entry = _tune_select(cache, PUFFERNET_TUNE_POOL_SPLIT, dims, default_split,
+            splits, 2, _tune_pool_body, &t, seconds);
+        // Without tuning callers would use every thread
+        default_ns = entry->ns;
+        if (entry->ns < best_ns) {
+            best_ns = entry->ns;
+            best_threads = t.pool->num_threads;
+        }
+        free_thread_pool(t.pool);
+        if (threads == max_threads) {
+            break;
+        }
+        threads = threads*2 < max_threads ? threads*2 : max_threads;
+    }
+    free(t.obs);
+    free(t.actions);
+    tune_cache_put(cache, PUFFERNET_TUNE_POOL_THREADS, agents, max_threads, 0, 0,
+        best_threads, best_ns, default_ns);
+    return best_threads;
+}
+#endif
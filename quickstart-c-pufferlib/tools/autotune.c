@@ -0,0 +1,122 @@
+// Offline autotuning of the puffernet kernels for this host.
+//
+// Usage: autotune [cache] [max_threads] [seconds_per_candidate]
+//
+// Tunes the linear tiles of the Connect4 LinearLSTM at batch 1, 64 and 1024,
+// the conv and linear tiles of the ConvLSTM shapes from bench_conv at batch
+// 16, the thread count and batch split of forward_linearlstm_pool at batch 64
+// and 1024, and the block-sparse tile of its encoder (make_sparse_linear,
+// every block kept) at batch 64 and 1024. Winners are added to the cache file (default
+// puffernet_tune.txt), shapes already cached for this CPU are skipped, so a
+// second run only reads the file. Then checks that networks built with the
+// cache installed produce the same actions as with the defaults.
+#include "puffernet.h"
+#include "puffernet_pool.h"
+#include "puffernet_tune.h"
+#include "bench.h"
+#include <unistd.h>
+
+typedef struct Config Config;
+struct Config {
+    int input_dim;
+    int input_channels;
+    int cnn_channels;
+};
+
+static void print_entry(TuneEntry* e, bool tuned) {
+    char shape[64];
+    snprintf(shape, sizeof(shape), "%dx%dx%dx%d", e->dims[0], e->dims[1], e->dims[2], e->dims[3]);
+    printf("%-13s %-20s %6d %12.0f %12.0f %8.2fx  %s\n", PUFFERNET_TUNE_OPS[e->op], shape,
+        e->value, e->ns, e->default_ns, e->default_ns/e->ns, tuned ? "tuned" : "cached");
+}
+
+// Actions of a fresh ConvLSTM over a few steps of fixed observations
+static void convlstm_actions(Config cfg, int batch, int* actions, int steps) {
+    size_t num_weights = convlstm_num_weights(cfg.input_dim, cfg.input_channels,
+        cfg.cnn_channels, 128, 6);
+    Weights* weights = make_synthetic_weights(num_weights, 0.05f, 42);
+    ConvLSTM* net = make_convlstm(weights, batch, cfg.input_dim, cfg.input_channels,
+        cfg.cnn_channels, 128, 6, NULL);
+    multidiscrete_seed(net->multidiscrete, 5);
+    int obs_size = batch*cfg.input_channels*cfg.input_dim*cfg.input_dim;
+    float* obs = malloc(obs_size*sizeof(float));
+    srand(9);
+    for (int t = 0; t < steps; t++) {
+        for (int j = 0; j < obs_size; j++) {
+            obs[j] = rand()/(float)RAND_MAX;
+        }
+        forward_convlstm(net, obs, actions + t*batch);
+    }
+    free(obs);
+    free_convlstm(net);
+    free_weights(weights);
+}
+
+int main(int argc, char** argv) {
+    const char* path = argc > 1 ? argv[1] : "puffernet_tune.txt";
+    int max_threads = argc > 2 ? atoi(argv[2]) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    double seconds = argc > 3 ? atof(argv[3]) : 0.05;
+    Config configs[] = {{11, 3, 32}, {42, 3, 32}, {84, 4, 32}};
+    int num_configs = sizeof(configs)/sizeof(Config);
+    int batches[3] = {1, 64, 1024};
+
+    TuneCache* cache = tune_cache_load(path);
+    int loaded = cache->count;
+    printf("cpu %s, kernels %s, %d entries in %s\n", puffernet_cpu_model(),
+        puffernet_kernels()->name, loaded, path);
+    double start = now_sec();
+    for (int i = 0; i < 3; i++) {
+        tune_linearlstm(cache, batches[i], 42, 7, seconds);
+    }
+    for (int c = 0; c < num_configs; c++) {
+        tune_convlstm(cache, 16, configs[c].input_dim, configs[c].input_channels,
+            configs[c].cnn_channels, 128, 6, seconds);
+    }
+    int logit_sizes[1] = {7};
+    Weights* weights = make_synthetic_weights(linearlstm_num_weights(42, 7), 0.1f, 42);
+    for (int i = 1; i < 3; i++) {
+        weights->idx = 0;
+        LinearLSTM* net = make_linearlstm(weights, batches[i], 42, logit_sizes, 1, NULL);
+        tune_pool(cache, net, max_threads, seconds);
+        free_linearlstm(net);
+        weights->idx = 0;
+        Linear* encoder = make_sparse_linear(weights, batches[i], 42, 128, 0.0f, NULL);
+        tune_sparse_linear(cache, batches[i], &encoder->sparse, seconds);
+        free(encoder);
+    }
+    free_weights(weights);
+    double elapsed = now_sec() - start;
+
+    printf("%-13s %-20s %6s %12s %12s %9s\n", "op", "shape", "value", "ns", "default ns",
+        "speedup");
+    int local = 0;
+    for (int i = 0; i < cache->count; i++) {
+        if (cache->entries[i].local) {
+            print_entry(&cache->entries[i], i >= loaded);
+            local++;
+        }
+    }
+    printf("%d shapes for this host, %d tuned in %.1f s\n", local, cache->count - loaded, elapsed);
+    bool saved = cache->count == loaded || tune_cache_save(cache, path);
+
+    // Tiles change the summation order at most, never the sampled actions
+    int steps = 4;
+    int mismatches = 0;
+    for (int c = 0; c < num_configs; c++) {
+        int* defaults = malloc(steps*16*sizeof(int));
+        int* tuned = malloc(steps*16*sizeof(int));
+        tune_install(NULL);
+        convlstm_actions(configs[c], 16, defaults, steps);
+        tune_install(cache);
+        convlstm_actions(configs[c], 16, tuned, steps);
+        for (int i = 0; i < steps*16; i++) {
+            mismatches += defaults[i] != tuned[i];
+        }
+        free(defaults);
+        free(tuned);
+    }
+    tune_install(NULL);
+    printf("tuned ConvLSTM actions: %d mismatches\n", mismatches);
+    free_tune_cache(cache);
+    return saved && mismatches == 0 ? 0 : 1;
+}
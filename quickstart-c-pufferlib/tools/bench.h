@@ -0,0 +1,49 @@
+// Shared helpers for the puffernet benchmarks. Include after puffernet.h.
+#include <time.h>
+
+static double now_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9*ts.tv_nsec;
+}
+
+// Raw-layout weights filled with uniform noise in [-scale, scale]. Freed with
+// free_weights like any other raw file.
+static Weights* make_synthetic_weights(size_t num_weights, float scale, unsigned seed) {
+    Weights* weights = calloc(1, sizeof(Weights) + num_weights*sizeof(float));
+    weights->data = (float*)(weights + 1);
+    weights->size = num_weights;
+    srand(seed);
+    for (size_t i = 0; i < num_weights; i++) {
+        weights->data[i] = scale*(2.0f*rand()/(float)RAND_MAX - 1.0f);
+    }
+    return weights;
+}
+
+// Number of floats make_default consumes
+static size_t default_num_weights(int input_dim, int hidden_dim, int action_dim) {
+    return (size_t)hidden_dim*input_dim + hidden_dim
+        + action_dim*hidden_dim + action_dim
+        + hidden_dim + 1;
+}
+
+// Number of floats make_linearlstm consumes
+static size_t linearlstm_num_weights(int input_dim, int num_logits) {
+    int hidden = 128;
+    return (size_t)hidden*input_dim + hidden
+        + num_logits*hidden + num_logits
+        + hidden + 1
+        + 4*hidden*hidden*2 + 4*hidden*2;
+}
+
+// Number of floats make_convlstm consumes
+static size_t convlstm_num_weights(int input_dim, int input_channels,
+        int cnn_channels, int hidden_dim, int action_dim) {
+    int dim2 = _convlstm_conv2_dim(input_dim);
+    return (size_t)cnn_channels*input_channels*5*5 + cnn_channels
+        + cnn_channels*cnn_channels*3*3 + cnn_channels
+        + (size_t)hidden_dim*cnn_channels*dim2*dim2 + hidden_dim
+        + action_dim*hidden_dim + action_dim
+        + hidden_dim + 1
+        + 4*hidden_dim*hidden_dim*2 + 4*hidden_dim*2;
+}
@@ -0,0 +1,115 @@
+// Accuracy and throughput of the puffernet activations in each math mode.
+//
+// Usage: bench_activations [seconds_per_point]
+//
+// Error is measured against double precision libm over a dense sweep of each
+// function's useful range, as max relative error (where the true result is a
+// normal float) and max absolute error. Throughput is elements/sec through
+// the dispatched array kernels on a 4096 element buffer, for the best ISA and
+// for the scalar variant.
+#include "puffernet.h"
+#include "bench.h"
+#include <float.h>
+
+#define SWEEP 2000000
+#define BUFFER 4096
+
+typedef double (*Reference)(double x);
+
+typedef struct Function Function;
+struct Function {
+    const char* name;
+    void (*array)(float* input, float* output, int size);
+    Reference reference;
+    float lo;
+    float hi;
+};
+
+static double ref_exp(double x) {
+    return exp(x);
+}
+
+static double ref_sigmoid(double x) {
+    return 1.0/(1.0 + exp(-x));
+}
+
+static double ref_tanh(double x) {
+    return tanh(x);
+}
+
+// Same function as 0.5*x*(1 + tanh(u)), without the cancellation for x < 0
+static double ref_gelu(double x) {
+    double u = 0.7978845608028654*(x + 0.044715*x*x*x);
+    return x/(1.0 + exp(-2.0*u));
+}
+
+static void measure_error(Function* fn, float* input, float* output, double* max_rel, double* max_abs) {
+    *max_rel = 0.0;
+    *max_abs = 0.0;
+    for (int start = 0; start < SWEEP; start += BUFFER) {
+        int n = SWEEP - start < BUFFER ? SWEEP - start : BUFFER;
+        for (int i = 0; i < n; i++) {
+            double t = (start + i)/(double)(SWEEP - 1);
+            input[i] = (float)(fn->lo + t*(fn->hi - fn->lo));
+        }
+        fn->array(input, output, n);
+        for (int i = 0; i < n; i++) {
+            double expected = fn->reference(input[i]);
+            double err = fabs(output[i] - expected);
+            *max_abs = fmax(*max_abs, err);
+            if (fabs(expected) >= FLT_MIN) {
+                *max_rel = fmax(*max_rel, err/fabs(expected));
+            }
+        }
+    }
+}
+
+static double measure_rate(Function* fn, float* input, float* output, double seconds) {
+    for (int i = 0; i < BUFFER; i++) {
+        input[i] = fn->lo + (fn->hi - fn->lo)*rand()/(float)RAND_MAX;
+    }
+    long iters = 0;
+    double start = now_sec();
+    double elapsed = 0.0;
+    while (elapsed < seconds) {
+        fn->array(input, output, BUFFER);
+        iters++;
+        elapsed = now_sec() - start;
+    }
+    return iters*(double)BUFFER/elapsed;
+}
+
+int main(int argc, char** argv) {
+    double seconds = argc > 1 ? atof(argv[1]) : 0.2;
+    Function functions[] = {
+        {"exp", _exp_array, ref_exp, -87.0f, 88.0f},
+        {"sigmoid", _sigmoid_array, ref_sigmoid, -80.0f, 80.0f},
+        {"tanh", _tanh_array, ref_tanh, -10.0f, 10.0f},
+        {"gelu", _gelu, ref_gelu, -10.0f, 10.0f},
+    };
+    const char* modes[] = {"exact", "accurate", "fast"};
+    const char* best = puffernet_kernels()->name;
+    float* input = malloc(BUFFER*sizeof(float));
+    float* output = malloc(BUFFER*sizeof(float));
+
+    printf("%-8s %-9s %12s %12s %14s %14s\n", "function", "mode",
+        "max rel err", "max abs err", "Melem/s", "Melem/s scalar");
+    for (int f = 0; f < 4; f++) {
+        Function* fn = &functions[f];
+        for (int m = 0; m < 3; m++) {
+            puffernet_set_math((PufferMath)m);
+            double max_rel, max_abs;
+            puffernet_select_kernels(best);
+            measure_error(fn, input, output, &max_rel, &max_abs);
+            double rate = measure_rate(fn, input, output, seconds);
+            puffernet_select_kernels("scalar");
+            double scalar_rate = measure_rate(fn, input, output, seconds);
+            printf("%-8s %-9s %12.2e %12.2e %14.1f %14.1f\n", fn->name, modes[m],
+                max_rel, max_abs, rate/1e6, scalar_rate/1e6);
+        }
+    }
+    printf("kernels %s\n", best);
+    free(input);
+    free(output);
+    return 0;
+}
@@ -0,0 +1,107 @@
+// Many agents on one set of LinearLSTM weights with dynamic batches.
+//
+// Usage: bench_agents [num_agents] [max_batch] [act_percent] [ticks]
+//
+// Every agent owns only an LSTMState. Each tick a random act_percent of the
+// agents need a move; they are gathered into batches of at most max_batch and
+// stepped with forward_linearlstm_states. The first few agents are shadowed by
+// a batch 1 instance from make_linearlstm_shared fed the same observations,
+// and the logits and actions of both must match. Reports agents/sec and
+// memory against one network per agent.
+#include "puffernet.h"
+#include "bench.h"
+
+#define SHADOWED 4
+
+int main(int argc, char** argv) {
+    int num_agents = argc > 1 ? atoi(argv[1]) : 1000;
+    int max_batch = argc > 2 ? atoi(argv[2]) : 64;
+    int act_percent = argc > 3 ? atoi(argv[3]) : 25;
+    int ticks = argc > 4 ? atoi(argv[4]) : 200;
+    int logit_sizes[1] = {7};
+    Weights* weights = make_synthetic_weights(linearlstm_num_weights(42, 7), 0.1f, 42);
+
+    LinearLSTM* net = make_linearlstm(weights, max_batch, 42, logit_sizes, 1, NULL);
+    LSTMState** agents = calloc(num_agents, sizeof(LSTMState*));
+    for (int i = 0; i < num_agents; i++) {
+        agents[i] = make_lstm_state(128, NULL);
+        lstm_state_seed(agents[i], 7, i);
+    }
+    LinearLSTM* shadows[SHADOWED];
+    for (int i = 0; i < SHADOWED && i < num_agents; i++) {
+        shadows[i] = make_linearlstm_shared(net, 1, NULL);
+        rng_seed(&shadows[i]->multidiscrete->rngs[0], 7, i);
+    }
+
+    LSTMState** batch = calloc(max_batch, sizeof(LSTMState*));
+    int* ids = calloc(max_batch, sizeof(int));
+    float* obs = calloc(max_batch*42, sizeof(float));
+    int* actions = calloc(max_batch, sizeof(int));
+    long steps = 0, batches = 0, mismatches = 0;
+    float max_diff = 0.0f;
+    double elapsed = 0.0;
+    srand(1);
+    for (int tick = 0; tick < ticks; tick++) {
+        int n = 0;
+        for (int i = 0; i <= num_agents; i++) {
+            if (n == max_batch || (i == num_agents && n > 0)) {
+                double start = now_sec();
+                forward_linearlstm_states(net, batch, n, obs, actions);
+                elapsed += now_sec() - start;
+                for (int b = 0; b < n; b++) {
+                    if (ids[b] >= SHADOWED) {
+                        continue;
+                    }
+                    LinearLSTM* shadow = shadows[ids[b]];
+                    int action;
+                    forward_linearlstm(shadow, obs + b*42, &action);
+                    mismatches += action != actions[b];
+                    for (int a = 0; a < 7; a++) {
+                        max_diff = fmaxf(max_diff, fabsf(shadow->actor_value->logits[a]
+                            - net->actor_value->logits[b*7 + a]));
+                    }
+                }
+                steps += n;
+                batches++;
+                n = 0;
+            }
+            if (i == num_agents || rand() % 100 >= act_percent) {
+                continue;
+            }
+            for (int j = 0; j < 42; j++) {
+                obs[n*42 + j] = (float)(rand()%3 - 1);
+            }
+            ids[n] = i;
+            batch[n++] = agents[i];
+        }
+    }
+
+    size_t net_bytes = linearlstm_size(max_batch, 42, logit_sizes, 1);
+    size_t state_bytes = lstm_state_size(128);
+    size_t per_net = linearlstm_size(1, 42, logit_sizes, 1);
+    printf("kernels %s, %d agents, batches of <= %d, %d%% act per tick\n",
+        puffernet_kernels()->name, num_agents, max_batch, act_percent);
+    printf("steps             %ld in %ld batches (mean %.1f)\n",
+        steps, batches, (double)steps/batches);
+    printf("agents/sec        %.0f\n", steps/elapsed);
+    printf("shadowed agents   max logit diff %.2e, %ld action mismatches\n", max_diff, mismatches);
+    printf("memory            shared %zu bytes (net %zu + %zu per agent)\n",
+        net_bytes + num_agents*state_bytes, net_bytes, state_bytes);
+    printf("                  one net per agent %zu bytes (%zu each), %.1fx more\n",
+        num_agents*per_net, per_net, (double)num_agents*per_net/(net_bytes + num_agents*state_bytes));
+
+    for (int i = 0; i < SHADOWED && i < num_agents; i++) {
+        free_linearlstm(shadows[i]);
+    }
+    for (int i = 0; i < num_agents; i++) {
+        free(agents[i]);
+    }
+    free(agents);
+    free(batch);
+    free(ids);
+    free(obs);
+    free(actions);
+    free_linearlstm(net);
+    free_weights(weights);
+    return mismatches == 0 && max_diff < 1e-5f ? 0 : 1;
+}
@@ -0,0 +1,61 @@
+// Batched multi-agent inference scaling for forward_linearlstm_pool.
+//
+// Usage: bench_batch [max_threads] [seconds_per_point]
+//
+// Builds the Connect4-shaped LinearLSTM (42 -> 128 -> LSTM 128 -> 7) with
+// synthetic weights and reports agents/sec for batch sizes 1, 64, 1024 and
+// 8192 at 1, 2, 4, ... max_threads threads (default: all online cores).
+#include "puffernet.h"
+#include "puffernet_pool.h"
+#include "bench.h"
+#include <unistd.h>
+
+int main(int argc, char** argv) {
+    int max_threads = argc > 1 ? atoi(argv[1]) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    double seconds = argc > 2 ? atof(argv[2]) : 0.5;
+    int batch_sizes[] = {1, 64, 1024, 8192};
+    int logit_sizes[1] = {7};
+    size_t num_weights = linearlstm_num_weights(42, 7);
+
+    printf("kernels %s, up to %d threads\n", puffernet_kernels()->name, max_threads);
+    printf("%8s %8s %14s %9s\n", "batch", "threads", "agents/sec", "speedup");
+    for (int i = 0; i < 4; i++) {
+        int batch = batch_sizes[i];
+        float* obs = calloc(batch*42, sizeof(float));
+        int* actions = calloc(batch, sizeof(int));
+        for (int j = 0; j < batch*42; j++) {
+            obs[j] = (float)(rand()%3 - 1);
+        }
+        double base = 0.0;
+        // 1, 2, 4, ... then max_threads itself once
+        for (int threads = 1; threads <= max_threads; threads = threads*2 > max_threads
+                && threads < max_threads ? max_threads : threads*2) {
+            Weights* weights = make_synthetic_weights(num_weights, 0.1f, 42);
+            LinearLSTM* net = make_linearlstm(weights, batch, 42, logit_sizes, 1, NULL);
+            ThreadPool* pool = make_thread_pool(threads, true);
+            linearlstm_first_touch(net, pool);
+            forward_linearlstm_pool(net, pool, obs, actions);
+
+            long iters = 0;
+            double start = now_sec();
+            double elapsed = 0.0;
+            while (elapsed < seconds) {
+                forward_linearlstm_pool(net, pool, obs, actions);
+                iters++;
+                elapsed = now_sec() - start;
+            }
+            double rate = iters*(double)batch/elapsed;
+            if (threads == 1) {
+                base = rate;
+            }
+            printf("%8d %8d %14.0f %8.2fx\n", batch, threads, rate, rate/base);
+
+            free_thread_pool(pool);
+            free_linearlstm(net);
+            free_weights(weights);
+        }
+        free(obs);
+        free(actions);
+    }
+    return 0;
+}
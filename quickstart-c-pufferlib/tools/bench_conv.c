@@ -0,0 +1,131 @@
+// forward_convlstm on pixel observations: im2col + GEMM against the direct
+// reference convolution.
+//
+// Usage: bench_conv [seconds_per_point]
+//
+// For each input size and batch, checks that both conv paths agree and
+// reports the time per forward pass, the share spent in the two conv layers
+// and the speedup over the reference.
+#include "puffernet.h"
+#include "bench.h"
+
+typedef struct Config Config;
+struct Config {
+    int input_dim;
+    int input_channels;
+    int cnn_channels;
+};
+
+static void conv2d_reference(Conv2D* layer, float* input) {
+    _conv2d_reference(input, layer->weights, layer->bias, layer->output,
+        layer->batch_size, layer->in_width, layer->in_height,
+        layer->in_channels, layer->out_channels, layer->kernel_size, layer->stride);
+    if (layer->epilogue == PUFFERNET_EPILOGUE_RELU) {
+        int n = layer->batch_size*layer->out_channels*layer->out_height*layer->out_width;
+        _relu(layer->output, layer->output, n);
+    }
+}
+
+static void forward_convlstm_reference(ConvLSTM* net, float* observations, int* actions) {
+    conv2d_reference(net->conv1, observations);
+    conv2d_reference(net->conv2, net->conv1->output);
+    linear(net->linear, net->conv2->output);
+    lstm(net->lstm, net->linear->output);
+    actor_value(net->actor_value, net->lstm->state_h);
+    softmax_multidiscrete(net->multidiscrete, net->actor_value->logits, actions);
+}
+
+static float max_conv_error(ConvLSTM* net, float* obs) {
+    Conv2D* layers[2] = {net->conv1, net->conv2};
+    float* inputs[2] = {obs, net->conv1->output};
+    float max_err = 0.0f;
+    for (int i = 0; i < 2; i++) {
+        Conv2D* layer = layers[i];
+        int n = layer->batch_size*layer->out_channels*layer->out_height*layer->out_width;
+        float* expected = malloc(n*sizeof(float));
+        conv2d_reference(layer, inputs[i]);
+        memcpy(expected, layer->output, n*sizeof(float));
+        conv2d(layer, inputs[i]);
+        for (int j = 0; j < n; j++) {
+            max_err = fmaxf(max_err, fabsf(expected[j] - layer->output[j]));
+        }
+        free(expected);
+    }
+    return max_err;
+}
+
+typedef void (*Forward)(ConvLSTM* net, float* observations, int* actions);
+
+static double time_per_call(Forward forward, ConvLSTM* net, float* obs, int* actions, double seconds) {
+    forward(net, obs, actions);
+    long iters = 0;
+    double start = now_sec();
+    double elapsed = 0.0;
+    while (elapsed < seconds || iters < 3) {
+        forward(net, obs, actions);
+        iters++;
+        elapsed = now_sec() - start;
+    }
+    return elapsed/iters;
+}
+
+static double time_convs(ConvLSTM* net, float* obs, double seconds) {
+    long iters = 0;
+    double start = now_sec();
+    double elapsed = 0.0;
+    while (elapsed < seconds || iters < 3) {
+        conv2d(net->conv1, obs);
+        conv2d(net->conv2, net->conv1->output);
+        iters++;
+        elapsed = now_sec() - start;
+    }
+    return elapsed/iters;
+}
+
+int main(int argc, char** argv) {
+    double seconds = argc > 1 ? atof(argv[1]) : 0.5;
+    // Grid world crops (original PufferLib shape), then downsampled and
+    // Atari-sized frames
+    Config configs[] = {{11, 3, 32}, {42, 3, 32}, {64, 3, 32}, {84, 4, 32}};
+    int batch_sizes[] = {1, 16, 64};
+    int hidden_dim = 128;
+    int action_dim = 6;
+
+    printf("kernels %s\n", puffernet_kernels()->name);
+    printf("%12s %6s %12s %12s %8s %9s %10s\n", "input", "batch",
+        "im2col ms", "direct ms", "conv %", "speedup", "max err");
+    for (int c = 0; c < (int)(sizeof(configs)/sizeof(Config)); c++) {
+        Config cfg = configs[c];
+        size_t num_weights = convlstm_num_weights(cfg.input_dim, cfg.input_channels,
+            cfg.cnn_channels, hidden_dim, action_dim);
+        for (int i = 0; i < 3; i++) {
+            int batch = batch_sizes[i];
+            int obs_size = batch*cfg.input_channels*cfg.input_dim*cfg.input_dim;
+            float* obs = malloc(obs_size*sizeof(float));
+            int* actions = calloc(batch, sizeof(int));
+            for (int j = 0; j < obs_size; j++) {
+                obs[j] = rand()/(float)RAND_MAX;
+            }
+            Weights* weights = make_synthetic_weights(num_weights, 0.05f, 42);
+            ConvLSTM* net = make_convlstm(weights, batch, cfg.input_dim,
+                cfg.input_channels, cfg.cnn_channels, hidden_dim, action_dim, NULL);
+
+            float max_err = max_conv_error(net, obs);
+            double fast = time_per_call(forward_convlstm, net, obs, actions, seconds);
+            double conv = time_convs(net, obs, seconds/2);
+            double direct = time_per_call(forward_convlstm_reference, net, obs, actions, seconds);
+
+            char input[32];
+            snprintf(input, sizeof(input), "%dx%dx%d", cfg.input_channels,
+                cfg.input_dim, cfg.input_dim);
+            printf("%12s %6d %12.3f %12.3f %7.1f%% %8.2fx %10.2e\n", input, batch,
+                1e3*fast, 1e3*direct, 100.0*conv/fast, direct/fast, max_err);
+
+            free_convlstm(net);
+            free_weights(weights);
+            free(obs);
+            free(actions);
+        }
+    }
+    return 0;
+}
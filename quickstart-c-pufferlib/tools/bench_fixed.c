@@ -0,0 +1,97 @@
+// Single-move latency of the Connect4 policy: the fixed-shape forward pass
+// from PUFFERNET_FIXED_LINEARLSTM against the generic forward_linearlstm.
+//
+// Usage: bench_fixed [seconds_per_point]
+//
+// Runs the batch 1 LinearLSTM (42 -> 128 -> LSTM 128 -> 7) with synthetic
+// weights under every kernel variant the CPU supports, checks that both paths
+// produce the same logits, values and state, and reports microseconds per step.
+// The fixed path is only selected under the scalar kernels; the SIMD rows check
+// that forward_linearlstm_connect4 falls back to the generic pass.
+#include "puffernet.h"
+#include "bench.h"
+
+PUFFERNET_FIXED_LINEARLSTM(connect4, 1, 42, 128, 7)
+
+#define STEPS 64
+
+static double time_per_step(LinearLSTMForward forward, LinearLSTM* net,
+        float* obs, double seconds) {
+    int actions[1];
+    long iters = 0;
+    double start = now_sec();
+    double elapsed = 0.0;
+    while (elapsed < seconds) {
+        for (int s = 0; s < STEPS; s++) {
+            forward(net, obs + (s % 8)*42, actions);
+        }
+        iters += STEPS;
+        elapsed = now_sec() - start;
+    }
+    return 1e6*elapsed/iters;
+}
+
+static float max_diff(float* a, float* b, int n) {
+    float diff = 0.0f;
+    for (int i = 0; i < n; i++) {
+        diff = fmaxf(diff, fabsf(a[i] - b[i]));
+    }
+    return diff;
+}
+
+int main(int argc, char** argv) {
+    double seconds = argc > 1 ? atof(argv[1]) : 0.5;
+    int logit_sizes[1] = {7};
+    Weights* weights = make_synthetic_weights(linearlstm_num_weights(42, 7), 0.1f, 42);
+    float obs[8*42];
+    for (int i = 0; i < 8*42; i++) {
+        obs[i] = (float)(rand()%3 - 1);
+    }
+
+    printf("%8s %8s %12s %12s %9s %12s\n", "kernels", "path", "generic us", "fixed us",
+        "speedup", "max diff");
+    for (int k = 0; k < PUFFERNET_NUM_KERNELS; k++) {
+        if (!puffernet_select_kernels(PUFFERNET_KERNELS[k].name)) {
+            continue;
+        }
+        weights->idx = 0;
+        LinearLSTM* generic = make_linearlstm(weights, 1, 42, logit_sizes, 1, NULL);
+        weights->idx = 0;
+        LinearLSTM* fixed = make_linearlstm(weights, 1, 42, logit_sizes, 1, NULL);
+        bool scalar = strcmp(PUFFERNET_KERNELS[k].name, "scalar") == 0;
+        bool selected = linearlstm_connect4_kernel(fixed) != forward_linearlstm;
+        if (selected != scalar) {
+            fprintf(stderr, "%s: fixed-shape kernel %s\n", PUFFERNET_KERNELS[k].name,
+                scalar ? "not selected" : "selected");
+            return 1;
+        }
+
+        // Same observation sequence through both, compared after every step
+        float diff = 0.0f;
+        int actions[1];
+        for (int s = 0; s < 32; s++) {
+            forward_linearlstm(generic, obs + (s % 8)*42, actions);
+            forward_linearlstm_connect4(fixed, obs + (s % 8)*42, actions);
+            diff = fmaxf(diff, max_diff(generic->actor_value->logits, fixed->actor_value->logits, 7));
+            diff = fmaxf(diff, max_diff(generic->actor_value->values, fixed->actor_value->values, 1));
+            diff = fmaxf(diff, max_diff(generic->lstm->state_h, fixed->lstm->state_h, 128));
+            diff = fmaxf(diff, max_diff(generic->lstm->state_c, fixed->lstm->state_c, 128));
+        }
+
+        double generic_us = time_per_step(forward_linearlstm, generic, obs, seconds);
+        double fixed_us = time_per_step(forward_linearlstm_connect4, fixed, obs, seconds);
+        printf("%8s %8s %12.3f %12.3f %8.2fx %12.2e\n", PUFFERNET_KERNELS[k].name,
+            selected ? "fixed" : "generic", generic_us, fixed_us, generic_us/fixed_us, diff);
+        free_linearlstm(generic);
+        free_linearlstm(fixed);
+    }
+
+    // Other shapes take the generic path
+    weights->idx = 0;
+    LinearLSTM* batched = make_linearlstm(weights, 4, 42, logit_sizes, 1, NULL);
+    printf("batch 4 fallback: %s\n",
+        linearlstm_connect4_kernel(batched) == forward_linearlstm ? "generic" : "fixed");
+    free_linearlstm(batched);
+    free_weights(weights);
+    return 0;
+}
@@ -0,0 +1,617 @@
+// Per-layer time and roofline report for the puffernet models.
+//
+// Usage: bench_layers [-o out.json] [-b baseline.json] [-r ratio] [-t seconds]
+//
+// Builds forward_default, forward_linearlstm and forward_convlstm with
+// synthetic weights over a grid of batch sizes and hidden dims (LinearLSTM is
+// fixed at 128 hidden) and times every layer on its own, plus the full
+// forward pass. For each it reports time, GFLOP/s, the minimum bytes the layer
+// has to move (weights, inputs and outputs once) and the share of the roofline
+// bound min(peak GFLOP/s, intensity * bandwidth). Peak is the multiply-add
+// throughput at the dispatched kernels' vector width and bandwidth the read
+// rate over a working set of the layer's size, both measured on this machine.
+//
+// Linear, LSTM and conv layers count 2 flops per multiply-add. Elementwise
+// layers and sampling count one flop per element.
+//
+// -o writes the results as JSON, one layer per line. -b compares against a
+// previous -o file and exits with status 1 if any layer is slower than the
+// baseline by more than ratio (default 1.10).
+#include "puffernet.h"
+#include "bench.h"
+
+#define MAX_RESULTS 512
+#define NAME_SIZE 32
+
+typedef enum {
+    PROBE_LINEAR,
+    PROBE_LSTM,
+    PROBE_CONV2D,
+    PROBE_ACTOR_VALUE,
+    PROBE_SOFTMAX,
+    PROBE_FORWARD,
+} ProbeKind;
+
+typedef void (*ForwardFn)(void* net, float* observations, int* actions);
+
+// One timed unit: a layer with its input, or a whole forward pass
+typedef struct Probe Probe;
+struct Probe {
+    const char* layer;
+    ProbeKind kind;
+    void* target;
+    float* input;
+    int* actions;
+    ForwardFn forward;
+    double flops;
+    double bytes;
+};
+
+typedef struct Result Result;
+struct Result {
+    char model[NAME_SIZE];
+    char layer[NAME_SIZE];
+    int batch;
+    int hidden;
+    double us;
+    double gflops;
+    double bytes;
+    double roofline;
+};
+
+// Working sets reported as L1, L2 and main memory bandwidth
+#define NUM_LEVELS 3
+static const size_t level_sizes[NUM_LEVELS] = {16 << 10, 512 << 10, 64 << 20};
+static const char* level_names[NUM_LEVELS] = {"l1", "l2", "dram"};
+static double level_bandwidth[NUM_LEVELS];
+static double peak_gflops;
+// Read bandwidth by working set, one entry per power of two, measured on first use
+#define MAX_SIZE_LOG 32
+static double size_bandwidth[MAX_SIZE_LOG];
+static double probe_seconds = 0.02;
+
+static void run_probe(Probe* p) {
+    switch (p->kind) {
+        case PROBE_LINEAR: linear(p->target, p->input); break;
+        case PROBE_LSTM: lstm(p->target, p->input); break;
+        case PROBE_CONV2D: conv2d(p->target, p->input); break;
+        case PROBE_ACTOR_VALUE: actor_value(p->target, p->input); break;
+        case PROBE_SOFTMAX: softmax_multidiscrete(p->target, p->input, p->actions); break;
+        case PROBE_FORWARD: p->forward(p->target, p->input, p->actions); break;
+    }
+}
+
+// Best of 5 timed runs, each repeating the probe for probe_seconds/5
+static double time_probe(Probe* p) {
+    run_probe(p);
+    double best = 1e30;
+    for (int rep = 0; rep < 5; rep++) {
+        long iters = 0;
+        double start = now_sec();
+        double elapsed = 0.0;
+        while (elapsed < probe_seconds/5 || iters == 0) {
+            run_probe(p);
+            iters++;
+            elapsed = now_sec() - start;
+        }
+        best = fmin(best, elapsed/iters);
+    }
+    return best;
+}
+
+// Fused activations add one flop per output
+static Probe linear_probe(const char* name, Linear* l, float* input) {
+    double b = l->batch_size, i = l->input_dim, o = l->output_dim;
+    double act = l->epilogue == PUFFERNET_EPILOGUE_RELU || l->epilogue == PUFFERNET_EPILOGUE_GELU;
+    return (Probe){name, PROBE_LINEAR, l, input,
+        .flops = 2*b*i*o + b*o + act*b*o,
+        .bytes = 4*(o*i + o + b*i + b*o)};
+}
+
+static Probe actor_value_probe(ActorValue* l, float* input) {
+    double b = l->batch_size, i = l->input_dim, o = l->atn_sum + 1;
+    return (Probe){"actor_value", PROBE_ACTOR_VALUE, l, input,
+        .flops = 2*b*i*o + b*o,
+        .bytes = 4*(o*i + o + b*i + b*o)};
+}
+
+static Probe lstm_probe(const char* name, LSTM* l, float* input) {
+    double b = l->batch_size, i = l->input_size, h = l->hidden_size;
+    return (Probe){name, PROBE_LSTM, l, input,
+        .flops = 2*b*4*h*(i + h) + 4*b*4*h,
+        .bytes = 4*(4*h*(i + h) + 4*h + b*(i + 4*h))};
+}
+
+static Probe conv2d_probe(const char* name, Conv2D* l, float* input) {
+    double b = l->batch_size, ic = l->in_channels, oc = l->out_channels;
+    double k = l->kernel_size;
+    double in = (double)l->in_width*l->in_height, out = (double)l->out_width*l->out_height;
+    double act = l->epilogue == PUFFERNET_EPILOGUE_RELU;
+    return (Probe){name, PROBE_CONV2D, l, input,
+        .flops = 2*b*oc*out*ic*k*k + b*oc*out + act*b*oc*out,
+        .bytes = 4*(oc*ic*k*k + oc + b*ic*in + b*oc*out)};
+}
+
+static Probe softmax_probe(Multidiscrete* md, float* logits, int* actions) {
+    double n = (double)md->batch_size*md->atn_sum;
+    return (Probe){"multidiscrete", PROBE_SOFTMAX, md, logits, actions,
+        .flops = n, .bytes = 4*(n + md->batch_size)};
+}
+
+static Probe forward_probe(void* net, ForwardFn forward, float* obs, int* actions,
+        Probe* layers, int num_layers) {
+    Probe p = {"forward", PROBE_FORWARD, net, obs, actions, forward};
+    for (int i = 0; i < num_layers; i++) {
+        p.flops += layers[i].flops;
+        p.bytes += layers[i].bytes;
+    }
+    return p;
+}
+
+// Multiply-add throughput with PEAK_CHAINS independent chains, enough to
+// cover the FMA latency on every port, kept in registers by the unroll.
+// Nothing the kernels do can beat it at their vector width, unlike a single
+// dot4 loop, which the blocked GEMMs outrun by reusing loads.
+#define PEAK_CHAINS 12
+#define PEAK_ITERS (1 << 20)
+
+static double peak_scalar() {
+    float acc[PEAK_CHAINS];
+    for (int c = 0; c < PEAK_CHAINS; c++) {
+        acc[c] = (float)c;
+    }
+    double start = now_sec();
+    for (int i = 0; i < PEAK_ITERS; i++) {
+        #pragma GCC unroll 12
+        for (int c = 0; c < PEAK_CHAINS; c++) {
+            acc[c] = acc[c]*0.999f + 0.001f;
+        }
+    }
+    double seconds = now_sec() - start;
+    __asm__ volatile("" : : "r"(acc) : "memory");
+    return 1e-9*2.0*PEAK_CHAINS*PEAK_ITERS/seconds;
+}
+
+// Read-only sweeps with independent vector loads, the way the kernels stream
+// weights. Each returns the sum so the loads are kept
+static float sweep_scalar(float* data, size_t n) {
+    float acc[8] = {0};
+    for (size_t i = 0; i < n; i += 8) {
+        #pragma GCC unroll 8
+        for (int k = 0; k < 8; k++) {
+            acc[k] += data[i + k];
+        }
+    }
+    return acc[0] + acc[1] + acc[2] + acc[3] + acc[4] + acc[5] + acc[6] + acc[7];
+}
+
+#ifdef PUFFERNET_X86
+PUFFERNET_TARGET("sse4.1")
+static double peak_sse41() {
+    __m128 acc[PEAK_CHAINS];
+    __m128 x = _mm_set1_ps(0.999f), y = _mm_set1_ps(0.001f);
+    for (int c = 0; c < PEAK_CHAINS; c++) {
+        acc[c] = _mm_set1_ps((float)c);
+    }
+    double start = now_sec();
+    for (int i = 0; i < PEAK_ITERS; i++) {
+        #pragma GCC unroll 12
+        for (int c = 0; c < PEAK_CHAINS; c++) {
+            acc[c] = _mm_add_ps(_mm_mul_ps(acc[c], x), y);
+        }
+    }
+    double seconds = now_sec() - start;
+    __asm__ volatile("" : : "r"(acc) : "memory");
+    return 1e-9*2.0*4*PEAK_CHAINS*PEAK_ITERS/seconds;
+}
+
+PUFFERNET_TARGET("sse4.1")
+static float sweep_sse41(float* data, size_t n) {
+    __m128 a0 = _mm_setzero_ps(), a1 = _mm_setzero_ps();
+    __m128 a2 = _mm_setzero_ps(), a3 = _mm_setzero_ps();
+    for (size_t i = 0; i < n; i += 16) {
+        a0 = _mm_add_ps(a0, _mm_load_ps(data + i));
+        a1 = _mm_add_ps(a1, _mm_load_ps(data + i + 4));
+        a2 = _mm_add_ps(a2, _mm_load_ps(data + i + 8));
+        a3 = _mm_add_ps(a3, _mm_load_ps(data + i + 12));
+    }
+    __m128 sum = _mm_add_ps(_mm_add_ps(a0, a1), _mm_add_ps(a2, a3));
+    return _mm_cvtss_f32(_mm_hadd_ps(_mm_hadd_ps(sum, sum), sum));
+}
+
+PUFFERNET_TARGET("avx2,fma")
+static double peak_avx2() {
+    __m256 acc[PEAK_CHAINS];
+    __m256 x = _mm256_set1_ps(0.999f), y = _mm256_set1_ps(0.001f);
+    for (int c = 0; c < PEAK_CHAINS; c++) {
+        acc[c] = _mm256_set1_ps((float)c);
+    }
+    double start = now_sec();
+    for (int i = 0; i < PEAK_ITERS; i++) {
+        #pragma GCC unroll 12
+        for (int c = 0; c < PEAK_CHAINS; c++) {
+            acc[c] = _mm256_fmadd_ps(acc[c], x, y);
+        }
+    }
+    double seconds = now_sec() - start;
+    __asm__ volatile("" : : "r"(acc) : "memory");
+    return 1e-9*2.0*8*PEAK_CHAINS*PEAK_ITERS/seconds;
+}
+
+PUFFERNET_TARGET("avx2,fma")
+static float sweep_avx2(float* data, size_t n) {
+    __m256 a0 = _mm256_setzero_ps(), a1 = _mm256_setzero_ps();
+    __m256 a2 = _mm256_setzero_ps(), a3 = _mm256_setzero_ps();
+    for (size_t i = 0; i < n; i += 32) {
+        a0 = _mm256_add_ps(a0, _mm256_load_ps(data + i));
+        a1 = _mm256_add_ps(a1, _mm256_load_ps(data + i + 8));
+        a2 = _mm256_add_ps(a2, _mm256_load_ps(data + i + 16));
+        a3 = _mm256_add_ps(a3, _mm256_load_ps(data + i + 24));
+    }
+    __m256 sum = _mm256_add_ps(_mm256_add_ps(a0, a1), _mm256_add_ps(a2, a3));
+    __m128 half = _mm_add_ps(_mm256_castps256_ps128(sum), _mm256_extractf128_ps(sum, 1));
+    return _mm_cvtss_f32(_mm_hadd_ps(_mm_hadd_ps(half, half), half));
+}
+#endif
+
+#ifdef PUFFERNET_NEON
+static double peak_neon() {
+    float32x4_t acc[PEAK_CHAINS];
+    float32x4_t x = vdupq_n_f32(0.999f), y = vdupq_n_f32(0.001f);
+    for (int c = 0; c < PEAK_CHAINS; c++) {
+        acc[c] = vdupq_n_f32((float)c);
+    }
+    double start = now_sec();
+    for (int i = 0; i < PEAK_ITERS; i++) {
+        #pragma GCC unroll 12
+        for (int c = 0; c < PEAK_CHAINS; c++) {
+            acc[c] = vfmaq_f32(y, acc[c], x);
+        }
+    }
+    double seconds = now_sec() - start;
+    __asm__ volatile("" : : "r"(acc) : "memory");
+    return 1e-9*2.0*4*PEAK_CHAINS*PEAK_ITERS/seconds;
+}
+
+static float sweep_neon(float* data, size_t n) {
+    float32x4_t a0 = vdupq_n_f32(0.0f), a1 = vdupq_n_f32(0.0f);
+    float32x4_t a2 = vdupq_n_f32(0.0f), a3 = vdupq_n_f32(0.0f);
+    for (size_t i = 0; i < n; i += 16) {
+        a0 = vaddq_f32(a0, vld1q_f32(data + i));
+        a1 = vaddq_f32(a1, vld1q_f32(data + i + 4));
+        a2 = vaddq_f32(a2, vld1q_f32(data + i + 8));
+        a3 = vaddq_f32(a3, vld1q_f32(data + i + 12));
+    }
+    return vaddvq_f32(vaddq_f32(vaddq_f32(a0, a1), vaddq_f32(a2, a3)));
+}
+#endif
+
+static double measure_peak() {
+    const char* name = puffernet_kernels()->name;
+    (void)name;
+#ifdef PUFFERNET_X86
+    if (strcmp(name, "avx2") == 0) {
+        return peak_avx2();
+    }
+    if (strcmp(name, "sse41") == 0) {
+        return peak_sse41();
+    }
+#endif
+#ifdef PUFFERNET_NEON
+    if (strcmp(name, "neon") == 0) {
+        return peak_neon();
+    }
+#endif
+    return peak_scalar();
+}
+
+static float sweep(float* data, size_t n) {
+    const char* name = puffernet_kernels()->name;
+    (void)name;
+#ifdef PUFFERNET_X86
+    if (strcmp(name, "avx2") == 0) {
+        return sweep_avx2(data, n);
+    }
+    if (strcmp(name, "sse41") == 0) {
+        return sweep_sse41(data, n);
+    }
+#endif
+#ifdef PUFFERNET_NEON
+    if (strcmp(name, "neon") == 0) {
+        return sweep_neon(data, n);
+    }
+#endif
+    return sweep_scalar(data, n);
+}
+
+// GB/s of repeated sweeps over size bytes, best of 3
+static double measure_bandwidth(size_t size) {
+    size_t n = size/sizeof(float);
+    float* data = aligned_alloc(PUFFERNET_ALIGN, size);
+    for (size_t i = 0; i < n; i++) {
+        data[i] = 1.0f;
+    }
+    long iters = (256 << 20)/size;
+    iters = iters < 1 ? 1 : iters;
+    double best = 1e30;
+    volatile float sink = 0.0f;
+    for (int rep = 0; rep < 3; rep++) {
+        double start = now_sec();
+        for (long i = 0; i < iters; i++) {
+            sink += sweep(data, n);
+        }
+        best = fmin(best, now_sec() - start);
+    }
+    free(data);
+    return 1e-9*size*iters/best;
+}
+
+// A layer is held to the read bandwidth over a working set as large as its
+// bytes rounded down to a power of two: a smaller set sits in the same or a
+// faster level, so this bounds the layer whatever the cache sizes are
+static double bandwidth_for(double bytes) {
+    int log = 12;
+    while (log + 1 < MAX_SIZE_LOG && (double)((size_t)1 << (log + 1)) <= bytes) {
+        log++;
+    }
+    if (size_bandwidth[log] == 0.0) {
+        size_bandwidth[log] = measure_bandwidth((size_t)1 << log);
+    }
+    return size_bandwidth[log];
+}
+
+// Compute peak: measure_peak for the dispatched kernels, best of 5. The
+// bandwidths reported for L1, L2 and main memory are bandwidth_for sizes.
+static void measure_roofline() {
+    for (int rep = 0; rep < 5; rep++) {
+        peak_gflops = fmax(peak_gflops, measure_peak());
+    }
+    for (int level = 0; level < NUM_LEVELS; level++) {
+        level_bandwidth[level] = bandwidth_for(level_sizes[level]);
+    }
+}
+
+static void run_default(void* net, float* observations, int* actions) {
+    forward_default(net, observations, actions);
+}
+
+static void run_linearlstm(void* net, float* observations, int* actions) {
+    forward_linearlstm(net, observations, actions);
+}
+
+static void run_convlstm(void* net, float* observations, int* actions) {
+    forward_convlstm(net, observations, actions);
+}
+
+static void record(Result* results, int* count, const char* model, int batch,
+        int hidden, Probe* p) {
+    double seconds = time_probe(p);
+    double intensity = p->flops/p->bytes;
+    double bound = fmin(peak_gflops, intensity*bandwidth_for(p->bytes));
+    Result* r = &results[(*count)++];
+    snprintf(r->model, NAME_SIZE, "%s", model);
+    snprintf(r->layer, NAME_SIZE, "%s", p->layer);
+    r->batch = batch;
+    r->hidden = hidden;
+    r->us = 1e6*seconds;
+    r->gflops = 1e-9*p->flops/seconds;
+    r->bytes = p->bytes;
+    r->roofline = r->gflops/bound;
+    printf("%-10s %6d %6d %-13s %11.2f %9.2f %12.0f %7.2f %8.1f%%\n", model, batch,
+        hidden, p->layer, r->us, r->gflops, p->bytes, intensity, 100*r->roofline);
+}
+
+static void bench_default(Result* results, int* count, int batch, int hidden) {
+    Weights* weights = make_synthetic_weights(default_num_weights(42, hidden, 7), 0.1f, 1);
+    Default* net = make_default(weights, batch, 42, hidden, 7, NULL);
+    float* obs = calloc(batch*42, sizeof(float));
+    int* actions = calloc(batch, sizeof(int));
+    for (int i = 0; i < batch*42; i++) {
+        obs[i] = (float)(rand()%3 - 1);
+    }
+    Probe probes[4] = {
+        linear_probe("encoder", net->encoder, obs),
+        actor_value_probe(net->actor_value, net->encoder->output),
+        softmax_probe(net->multidiscrete, net->actor_value->logits, actions),
+    };
+    probes[3] = forward_probe(net, run_default, obs, actions, probes, 3);
+    // Layers read each other's outputs, so every probe starts from a fresh
+    // forward pass
+    for (int i = 0; i < 4; i++) {
+        forward_default(net, obs, actions);
+        record(results, count, "default", batch, hidden, &probes[i]);
+    }
+    free(obs);
+    free(actions);
+    free_default(net);
+    free_weights(weights);
+}
+
+static void bench_linearlstm(Result* results, int* count, int batch) {
+    int logit_sizes[1] = {7};
+    Weights* weights = make_synthetic_weights(linearlstm_num_weights(42, 7), 0.1f, 1);
+    LinearLSTM* net = make_linearlstm(weights, batch, 42, logit_sizes, 1, NULL);
+    float* obs = calloc(batch*42, sizeof(float));
+    int* actions = calloc(batch, sizeof(int));
+    for (int i = 0; i < batch*42; i++) {
+        obs[i] = (float)(rand()%3 - 1);
+    }
+    Probe probes[5] = {
+        linear_probe("encoder", net->encoder, obs),
+        lstm_probe("lstm", net->lstm, net->encoder->output),
+        actor_value_probe(net->actor_value, net->lstm->state_h),
+        softmax_probe(net->multidiscrete, net->actor_value->logits, actions),
+    };
+    probes[4] = forward_probe(net, run_linearlstm, obs, actions, probes, 4);
+    for (int i = 0; i < 5; i++) {
+        forward_linearlstm(net, obs, actions);
+        record(results, count, "linearlstm", batch, 128, &probes[i]);
+    }
+    free(obs);
+    free(actions);
+    free_linearlstm(net);
+    free_weights(weights);
+}
+
+static void bench_convlstm(Result* results, int* count, int batch, int hidden) {
+    int input_dim = 11, channels = 3, cnn = 32;
+    Weights* weights = make_synthetic_weights(
+        convlstm_num_weights(input_dim, channels, cnn, hidden, 7), 0.1f, 1);
+    ConvLSTM* net = make_convlstm(weights, batch, input_dim, channels, cnn, hidden, 7, NULL);
+    int obs_size = batch*input_dim*input_dim*channels;
+    float* obs = calloc(obs_size, sizeof(float));
+    int* actions = calloc(batch, sizeof(int));
+    for (int i = 0; i < obs_size; i++) {
+        obs[i] = (float)rand()/RAND_MAX;
+    }
+    Probe probes[7] = {
+        conv2d_probe("conv1", net->conv1, obs),
+        conv2d_probe("conv2", net->conv2, net->conv1->output),
+        linear_probe("linear", net->linear, net->conv2->output),
+        lstm_probe("lstm", net->lstm, net->linear->output),
+        actor_value_probe(net->actor_value, net->lstm->state_h),
+        softmax_probe(net->multidiscrete, net->actor_value->logits, actions),
+    };
+    probes[6] = forward_probe(net, run_convlstm, obs, actions, probes, 6);
+    for (int i = 0; i < 7; i++) {
+        forward_convlstm(net, obs, actions);
+        record(results, count, "convlstm", batch, hidden, &probes[i]);
+    }
+    free(obs);
+    free(actions);
+    free_convlstm(net);
+    free_weights(weights);
+}
+
+static bool write_json(const char* path, Result* results, int count) {
+    FILE* file = fopen(path, "w");
+    if (!file) {
+        perror("Error opening file");
+        return false;
+    }
+    fprintf(file, "{\n  \"kernels\": \"%s\",\n  \"peak_gflops\": %.3f,\n",
+        puffernet_kernels()->name, peak_gflops);
+    for (int level = 0; level < NUM_LEVELS; level++) {
+        fprintf(file, "  \"%s_gbs\": %.3f,\n", level_names[level], level_bandwidth[level]);
+    }
+    fprintf(file, "  \"results\": [\n");
+    for (int i = 0; i < count; i++) {
+        Result* r = &results[i];
+        fprintf(file, "    {\"model\": \"%s\", \"batch\": %d, \"hidden\": %d, \"layer\": \"%s\", "
+            "\"us\": %.4f, \"gflops\": %.4f, \"bytes\": %.0f, \"roofline\": %.4f}%s\n",
+            r->model, r->batch, r->hidden, r->layer, r->us, r->gflops, r->bytes,
+            r->roofline, i + 1 < count ? "," : "");
+    }
+    fprintf(file, "  ]\n}\n");
+    fclose(file);
+    return true;
+}
+
+// Reads back the per-layer lines of a file written by write_json
+static int read_json(const char* path, Result* results) {
+    FILE* file = fopen(path, "r");
+    if (!file) {
+        perror("Error opening file");
+        return -1;
+    }
+    char line[512];
+    int count = 0;
+    while (count < MAX_RESULTS && fgets(line, sizeof(line), file)) {
+        Result* r = &results[count];
+        if (sscanf(line, " {\"model\": \"%31[^\"]\", \"batch\": %d, \"hidden\": %d, "
+                "\"layer\": \"%31[^\"]\", \"us\": %lf", r->model, &r->batch,
+                &r->hidden, r->layer, &r->us) == 5) {
+            count++;
+        }
+    }
+    fclose(file);
+    return count;
+}
+
+static int compare(Result* results, int count, Result* baseline, int baseline_count,
+        double ratio) {
+    int regressions = 0;
+    int matched = 0;
+    printf("\n%-10s %6s %6s %-13s %11s %11s %8s\n", "model", "batch", "hidden",
+        "layer", "base us", "us", "ratio");
+    for (int i = 0; i < count; i++) {
+        Result* r = &results[i];
+        for (int j = 0; j < baseline_count; j++) {
+            Result* b = &baseline[j];
+            if (strcmp(r->model, b->model) != 0 || strcmp(r->layer, b->layer) != 0
+                    || r->batch != b->batch || r->hidden != b->hidden) {
+                continue;
+            }
+            double change = r->us/b->us;
+            bool slower = change > ratio;
+            regressions += slower;
+            matched++;
+            printf("%-10s %6d %6d %-13s %11.2f %11.2f %7.2fx%s\n", r->model, r->batch,
+                r->hidden, r->layer, b->us, r->us, change, slower ? "  REGRESSION" : "");
+            break;
+        }
+    }
+    printf("%d of %d layers matched the baseline, %d slower than %.2fx\n",
+        matched, count, regressions, ratio);
+    return regressions;
+}
+
+int main(int argc, char** argv) {
+    const char* out_path = NULL;
+    const char* baseline_path = NULL;
+    double ratio = 1.10;
+    for (int i = 1; i < argc; i++) {
+        if (i + 1 < argc && strcmp(argv[i], "-o") == 0) {
+            out_path = argv[++i];
+        } else if (i + 1 < argc && strcmp(argv[i], "-b") == 0) {
+            baseline_path = argv[++i];
+        } else if (i + 1 < argc && strcmp(argv[i], "-r") == 0) {
+            ratio = atof(argv[++i]);
+        } else if (i + 1 < argc && strcmp(argv[i], "-t") == 0) {
+            probe_seconds = atof(argv[++i]);
+        } else {
+            fprintf(stderr, "Usage: bench_layers [-o out.json] [-b baseline.json] "
+                "[-r ratio] [-t seconds]\n");
+            return 2;
+        }
+    }
+
+    measure_roofline();
+    printf("kernels %s, peak %.1f GFLOP/s, bandwidth", puffernet_kernels()->name, peak_gflops);
+    for (int level = 0; level < NUM_LEVELS; level++) {
+        printf(" %s %.1f GB/s", level_names[level], level_bandwidth[level]);
+    }
+    printf("\n");
+    printf("%-10s %6s %6s %-13s %11s %9s %12s %7s %9s\n", "model", "batch", "hidden",
+        "layer", "us", "GFLOP/s", "bytes", "flop/B", "roofline");
+
+    int batches[3] = {1, 64, 1024};
+    int hiddens[3] = {64, 128, 256};
+    Result* results = calloc(MAX_RESULTS, sizeof(Result));
+    int count = 0;
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            bench_default(results, &count, batches[i], hiddens[j]);
+        }
+        bench_linearlstm(results, &count, batches[i]);
+        for (int j = 0; j < 3; j++) {
+            bench_convlstm(results, &count, batches[i], hiddens[j]);
+        }
+    }
+
+    if (out_path != NULL && !write_json(out_path, results, count)) {
+        return 1;
+    }
+    int status = 0;
+    if (baseline_path != NULL) {
+        Result* baseline = calloc(MAX_RESULTS, sizeof(Result));
+        int baseline_count = read_json(baseline_path, baseline);
+        if (baseline_count < 0) {
+            return 1;
+        }
+        status = compare(results, count, baseline, baseline_count, ratio) > 0;
+        free(baseline);
+    }
+    free(results);
+    return status;
+}
@@ -0,0 +1,306 @@
+// Policy rollouts from forked LSTM states against replaying the history.
+//
+// Usage: bench_lookahead [history_moves] [rollouts_per_move] [depth] [seconds]
+//
+// Plays history_moves random moves for both sides while the policy steps on
+// every player turn. From that position each legal column gets
+// rollouts_per_move continuations: the player plays the column, then both
+// sides play depth more moves (player sampled from the policy, the opponent
+// uniformly) and the continuation scores the policy's value estimate, or the
+// result if the game ended. Continuations are stepped together as one dynamic
+// batch with forward_linearlstm_states.
+//
+// The fork path starts every continuation from lstm_state_fork of the root
+// state, the replay path rebuilds it by stepping the whole history again.
+// Both must score the same, the report compares continuations/sec.
+#define CONNECT4_HEADLESS
+#include "connect4.h"
+#include "puffernet.h"
+#include "bench.h"
+
+#define MAX_HISTORY 40
+
+typedef struct Rollout Rollout;
+struct Rollout {
+    uint64_t player_pieces;
+    uint64_t env_pieces;
+    float value;
+    bool done;
+};
+
+static void board_observation(CConnect4* env, uint64_t player_pieces, uint64_t env_pieces,
+        float* obs) {
+    env->player_pieces = player_pieces;
+    env->env_pieces = env_pieces;
+    memset(env->observations, 0, 42*sizeof(float));
+    compute_observation(env);
+    memcpy(obs, env->observations, 42*sizeof(float));
+}
+
+static int random_column(uint64_t mask, PufferRNG* rng) {
+    int legal[7];
+    int n = 0;
+    for (int c = 0; c < 7; c++) {
+        if (!invalid_move(c, mask)) {
+            legal[n++] = c;
+        }
+    }
+    return legal[rng_next(rng) % n];
+}
+
+// Plays column for the player then a random reply. Returns true if the game ended
+static bool play_round(Rollout* r, int column, PufferRNG* rng) {
+    uint64_t mask = r->player_pieces | r->env_pieces;
+    if (invalid_move(column, mask)) {
+        column = random_column(mask, rng);
+    }
+    r->player_pieces = play(column, mask, r->env_pieces);
+    mask = r->player_pieces | r->env_pieces;
+    if (won(r->player_pieces)) {
+        r->value = 1.0f;
+        return r->done = true;
+    }
+    if (draw(mask)) {
+        r->value = 0.0f;
+        return r->done = true;
+    }
+    r->env_pieces = play(random_column(mask, rng), mask, r->player_pieces);
+    mask = r->player_pieces | r->env_pieces;
+    if (won(r->env_pieces)) {
+        r->value = -1.0f;
+        return r->done = true;
+    }
+    if (draw(mask)) {
+        r->value = 0.0f;
+        return r->done = true;
+    }
+    return false;
+}
+
+typedef struct Search Search;
+struct Search {
+    LinearLSTM* net;
+    LSTMStatePool* pool;
+    CConnect4 env;
+    float history[MAX_HISTORY*42];
+    int history_len;
+    uint64_t player_pieces;
+    uint64_t env_pieces;
+    int rollouts;
+    int depth;
+    // Per continuation
+    LSTMState** states;
+    Rollout* boards;
+    int* columns;
+    PufferRNG* rngs;
+    float* values;
+    float* obs;
+    int* actions;
+};
+
+// Steps continuations [0, n) in batches of the net's size
+static void step_batch(Search* s, LSTMState** states, float* obs, int n) {
+    int max_batch = s->net->num_agents;
+    for (int start = 0; start < n; start += max_batch) {
+        int count = n - start < max_batch ? n - start : max_batch;
+        forward_linearlstm_states(s->net, states + start, count, obs + start*42,
+            s->actions + start);
+        memcpy(s->values + start, s->net->actor_value->values, count*sizeof(float));
+    }
+}
+
+// Runs the continuations from states already at the root and returns how many
+static int rollouts(Search* s) {
+    int n = 0;
+    uint64_t mask = s->player_pieces | s->env_pieces;
+    for (int c = 0; c < 7; c++) {
+        if (invalid_move(c, mask)) {
+            continue;
+        }
+        for (int r = 0; r < s->rollouts; r++) {
+            s->boards[n] = (Rollout){s->player_pieces, s->env_pieces, 0.0f, false};
+            s->columns[n] = c;
+            s->actions[n] = c;
+            n++;
+        }
+    }
+    for (int d = 0; d <= s->depth; d++) {
+        // Continuations that ended keep stepping on the last board, so the
+        // batch keeps its shape; their value is the result
+        for (int i = 0; i < n; i++) {
+            Rollout* r = &s->boards[i];
+            if (!r->done) {
+                play_round(r, s->actions[i], &s->rngs[i]);
+            }
+            board_observation(&s->env, r->player_pieces, r->env_pieces, s->obs + i*42);
+        }
+        step_batch(s, s->states, s->obs, n);
+    }
+    for (int i = 0; i < n; i++) {
+        if (!s->boards[i].done) {
+            s->boards[i].value = s->values[i];
+        }
+    }
+    return n;
+}
+
+static int lookahead_fork(Search* s, LSTMState* root) {
+    int n = 7*s->rollouts;
+    bool ok = lstm_state_fork(s->pool, root, s->states, n);
+    assert(ok);
+    for (int i = 0; i < n; i++) {
+        rng_seed(&s->rngs[i], 99, i);
+    }
+    n = rollouts(s);
+    lstm_state_release_all(s->pool, s->states, 7*s->rollouts);
+    return n;
+}
+
+static int lookahead_replay(Search* s, LSTMState* root) {
+    int n = 7*s->rollouts;
+    LSTMState* forks[7*64];
+    bool ok = lstm_state_fork(s->pool, root, forks, n);
+    assert(ok);
+    for (int i = 0; i < n; i++) {
+        s->states[i] = lstm_state_alloc(s->pool);
+        rng_seed(&s->rngs[i], 99, i);
+    }
+    float* obs = malloc(n*42*sizeof(float));
+    for (int t = 0; t < s->history_len; t++) {
+        for (int i = 0; i < n; i++) {
+            memcpy(obs + i*42, s->history + t*42, 42*sizeof(float));
+        }
+        step_batch(s, s->states, obs, n);
+    }
+    free(obs);
+    // Same sampling streams as the forks
+    for (int i = 0; i < n; i++) {
+        s->states[i]->rng = forks[i]->rng;
+    }
+    n = rollouts(s);
+    lstm_state_release_all(s->pool, s->states, 7*s->rollouts);
+    lstm_state_release_all(s->pool, forks, 7*s->rollouts);
+    return n;
+}
+
+static int best_column(Search* s, int n) {
+    float sums[7] = {0};
+    for (int i = 0; i < n; i++) {
+        sums[s->columns[i]] += s->boards[i].value;
+    }
+    int best = s->columns[0];
+    for (int c = 0; c < 7; c++) {
+        if (sums[c] > sums[best] && !invalid_move(c, s->player_pieces | s->env_pieces)) {
+            best = c;
+        }
+    }
+    return best;
+}
+
+static double time_lookahead(int (*fn)(Search*, LSTMState*), Search* s, LSTMState* root,
+        double seconds, long* continuations) {
+    long total = 0;
+    double start = now_sec();
+    double elapsed = 0.0;
+    while (elapsed < seconds || total == 0) {
+        total += fn(s, root);
+        elapsed = now_sec() - start;
+    }
+    *continuations = total;
+    return elapsed;
+}
+
+int main(int argc, char** argv) {
+    int history_moves = argc > 1 ? atoi(argv[1]) : 12;
+    int rollouts_per_move = argc > 2 ? atoi(argv[2]) : 32;
+    int depth = argc > 3 ? atoi(argv[3]) : 4;
+    double seconds = argc > 4 ? atof(argv[4]) : 0.5;
+    if (history_moves > MAX_HISTORY || rollouts_per_move > 64) {
+        fprintf(stderr, "At most %d history moves and 64 rollouts per move\n", MAX_HISTORY);
+        return 2;
+    }
+    int logit_sizes[1] = {7};
+    Weights* weights = make_synthetic_weights(linearlstm_num_weights(42, 7), 0.1f, 42);
+    LinearLSTM* net = make_linearlstm(weights, 64, 42, logit_sizes, 1, NULL);
+    int max_continuations = 7*rollouts_per_move;
+
+    Search s = {
+        .net = net,
+        // Root, the forks and one replay state per fork
+        .pool = make_lstm_state_pool(1 + 2*max_continuations, 128, NULL),
+        .rollouts = rollouts_per_move,
+        .depth = depth,
+        .states = calloc(max_continuations, sizeof(LSTMState*)),
+        .boards = calloc(max_continuations, sizeof(Rollout)),
+        .columns = calloc(max_continuations, sizeof(int)),
+        .rngs = calloc(max_continuations, sizeof(PufferRNG)),
+        .values = calloc(max_continuations, sizeof(float)),
+        .obs = calloc(max_continuations*42, sizeof(float)),
+        .actions = calloc(max_continuations, sizeof(int)),
+    };
+    allocate_cconnect4(&s.env);
+
+    // Random opening with the policy stepping on every player turn
+    LSTMState* root = lstm_state_alloc(s.pool);
+    PufferRNG rng;
+    rng_seed(&rng, 1, 0);
+    Rollout game = {0};
+    for (int t = 0; t < history_moves; t++) {
+        float* obs = s.history + t*42;
+        board_observation(&s.env, game.player_pieces, game.env_pieces, obs);
+        int action;
+        forward_linearlstm_states(net, &root, 1, obs, &action);
+        s.history_len = t + 1;
+        // Stop before a move that ends the game, the root is the player's turn
+        Rollout next = game;
+        if (play_round(&next, random_column(game.player_pieces | game.env_pieces, &rng), &rng)) {
+            break;
+        }
+        game = next;
+    }
+    s.player_pieces = game.player_pieces;
+    s.env_pieces = game.env_pieces;
+
+    // Both paths must agree continuation by continuation
+    int n = lookahead_fork(&s, root);
+    float* fork_values = malloc(n*sizeof(float));
+    for (int i = 0; i < n; i++) {
+        fork_values[i] = s.boards[i].value;
+    }
+    int fork_best = best_column(&s, n);
+    lookahead_replay(&s, root);
+    float diff = 0.0f;
+    for (int i = 0; i < n; i++) {
+        diff = fmaxf(diff, fabsf(fork_values[i] - s.boards[i].value));
+    }
+
+    long fork_count, replay_count;
+    double fork_time = time_lookahead(lookahead_fork, &s, root, seconds, &fork_count);
+    double replay_time = time_lookahead(lookahead_replay, &s, root, seconds, &replay_count);
+    double fork_rate = fork_count/fork_time;
+    double replay_rate = replay_count/replay_time;
+    printf("kernels %s, history %d steps, %d continuations of depth %d\n",
+        puffernet_kernels()->name, s.history_len, n, depth);
+    printf("best column       %d\n", fork_best);
+    printf("max value diff    %.2e (fork vs replay)\n", diff);
+    printf("fork              %10.0f continuations/sec  %8.1f us/move\n",
+        fork_rate, 1e6*n/fork_rate);
+    printf("replay            %10.0f continuations/sec  %8.1f us/move\n",
+        replay_rate, 1e6*n/replay_rate);
+    printf("speedup           %.2fx, state pool %zu bytes\n", fork_rate/replay_rate,
+        lstm_state_pool_size(1 + 2*max_continuations, 128));
+
+    free(fork_values);
+    free_allocated_cconnect4(&s.env);
+    free(s.pool);
+    free(s.states);
+    free(s.boards);
+    free(s.columns);
+    free(s.rngs);
+    free(s.values);
+    free(s.obs);
+    free(s.actions);
+    free_linearlstm(net);
+    free_weights(weights);
+    return diff == 0.0f ? 0 : 1;
+}
@@ -0,0 +1,363 @@
+// Alpha-beta search_best_move against the previous full-width negamax.
+//
+// Usage: bench_search [positions] [games] [max_depth] [match_depth]
+//
+// Both searches pick a move in the same random midgame positions (default
+// 200) at depths 1 to max_depth (default 10, 6 for the old search) and the
+// report compares nodes and microseconds per move and nodes/sec. The new
+// search runs without and with a transposition table, cleared for each
+// position, and the table rows add the share of probes that hit. Then the new
+// search at match_depth (default connect4_search.depth), with a table kept
+// across the games like compute_env_move's, plays games (default 100) against
+// the old one at the depth compute_env_move used (negamax(3) below the root,
+// 4 plies) from random two-ply openings, each opening once with either side
+// first.
+//
+// Last, search_move with the app's SEARCH_UI_BUDGET and with
+// SEARCH_ANALYSIS_BUDGET (on the first 20 positions) reports the depth it
+// reaches and its mean and worst time per move, and the UI budget plays the
+// games against the fixed match_depth search.
+//
+// Returns nonzero if compute_env_move picks a full column, checked first with
+// column 0 full, without a budget and with one that runs out at the first
+// clock check.
+#define CONNECT4_HEADLESS
+#include "connect4.h"
+#include "puffernet.h"
+#include "bench.h"
+
+#define LEGACY_DEPTH 4
+#define LEGACY_MAX_DEPTH 6
+
+// The search compute_env_move ran before: the sum of all outcomes below
+// each root move, full width with float pow(10, depth) scores
+static float legacy_negamax(uint64_t pieces, uint64_t other_pieces, int depth, uint64_t* nodes) {
+    (*nodes)++;
+    uint64_t piece_mask = pieces | other_pieces;
+    if (won(other_pieces)) {
+        return pow(10, depth);
+    }
+    if (won(pieces)) {
+        return 0;
+    }
+    if (depth == 0 || draw(piece_mask)) {
+        return 0;
+    }
+    float value = 0;
+    for (uint64_t column = 0; column < 7; column++) {
+        if (invalid_move(column, piece_mask)) {
+            continue;
+        }
+        uint64_t child_pieces = play(column, piece_mask, other_pieces);
+        value -= legacy_negamax(other_pieces, child_pieces, depth - 1, nodes);
+    }
+    return value;
+}
+
+static int legacy_move(uint64_t pieces, uint64_t other_pieces, int depth, uint64_t* nodes) {
+    (*nodes)++;
+    uint64_t piece_mask = pieces | other_pieces;
+    // The original started from 9999, which deeper sums can exceed
+    float best_value = INFINITY;
+    float values[7];
+    for (int i = 0; i < 7; i++) {
+        values[i] = INFINITY;
+    }
+    for (uint64_t column = 0; column < 7; column++) {
+        if (invalid_move(column, piece_mask)) {
+            continue;
+        }
+        uint64_t child_pieces = play(column, piece_mask, other_pieces);
+        if (won(child_pieces)) {
+            return column;
+        }
+        float val = -legacy_negamax(other_pieces, child_pieces, depth - 1, nodes);
+        values[column] = val;
+        if (val < best_value) {
+            best_value = val;
+        }
+    }
+    int num_ties = 0;
+    for (int column = 0; column < 7; column++) {
+        num_ties += values[column] == best_value;
+    }
+    int best_tie = rand() % num_ties;
+    for (int column = 0; column < 7; column++) {
+        if (values[column] == best_value && best_tie-- == 0) {
+            return column;
+        }
+    }
+    return 0;
+}
+
+typedef struct Position Position;
+struct Position {
+    uint64_t pieces;  // side to move
+    uint64_t mask;
+};
+
+// Random play that stops before a finished game or a win in one
+static Position random_position(int plies) {
+    Position p = {0, 0};
+    for (int ply = 0; ply < plies; ply++) {
+        uint64_t moves = non_losing_moves(p.pieces, p.mask);
+        if (moves == 0 || (possible_moves(p.mask) & winning_cells(p.pieces, p.mask))) {
+            break;
+        }
+        int column;
+        do {
+            column = rand() % COLUMNS;
+        } while ((moves & column_mask(column)) == 0);
+        uint64_t mask = p.mask | (moves & column_mask(column));
+        p.pieces ^= p.mask;
+        p.mask = mask;
+    }
+    return p;
+}
+
+typedef struct Result Result;
+struct Result {
+    uint64_t nodes;
+    double seconds;
+    int moves;
+    uint64_t probes;
+    uint64_t hits;
+};
+
+static void report(const char* name, int depth, Result r) {
+    printf("%-9s %5d %12.0f %12.1f %10.2f", name, depth, (double)r.nodes/r.moves,
+        1e6*r.seconds/r.moves, 1e-6*r.nodes/r.seconds);
+    if (r.probes) {
+        printf(" %7.1f%%", 100.0*r.hits/r.probes);
+    }
+    printf("\n");
+}
+
+// The new search plays first when new_first. Returns 1 for a new search win,
+// -1 for a loss and 0 for a draw
+static void add_stats(TableStats* total, TableStats stats) {
+    total->probes += stats.probes;
+    total->hits += stats.hits;
+    total->cutoffs += stats.cutoffs;
+    total->stores += stats.stores;
+    total->replaced += stats.replaced;
+}
+
+static int play_game(Position opening, bool new_first, TranspositionTable* table,
+        TableStats* stats, Result* new_result, Result* old_result) {
+    Position p = opening;
+    bool new_to_move = new_first;
+    while (true) {
+        uint64_t other = p.pieces ^ p.mask;
+        int column;
+        double start = now_sec();
+        if (new_to_move) {
+            Connect4Search search = {.depth = connect4_search.depth, .table = table};
+            column = search_best_move(&search, p.pieces, p.mask, search.depth, NULL);
+            new_result->nodes += search.nodes;
+            add_stats(stats, search.stats);
+            new_result->seconds += now_sec() - start;
+            new_result->moves++;
+        } else {
+            column = legacy_move(p.pieces, other, LEGACY_DEPTH, &old_result->nodes);
+            old_result->seconds += now_sec() - start;
+            old_result->moves++;
+        }
+        uint64_t pieces = play(column, p.mask, other);
+        if (won(pieces)) {
+            return new_to_move ? 1 : -1;
+        }
+        p.mask |= p.mask + bottom_mask(column);
+        if (draw(p.mask)) {
+            return 0;
+        }
+        p.pieces = other;
+        new_to_move = !new_to_move;
+    }
+}
+
+// Both play with search_move. Returns 1 for a first win, -1 for a loss and 0
+// for a draw
+static int play_searches(Position opening, Connect4Search* first, Connect4Search* second) {
+    Position p = opening;
+    for (int ply = 0; ; ply++) {
+        int column = search_move(ply % 2 == 0 ? first : second, p.pieces, p.mask, NULL);
+        uint64_t other = p.pieces ^ p.mask;
+        if (won(play(column, p.mask, other))) {
+            return ply % 2 == 0 ? 1 : -1;
+        }
+        p.mask |= p.mask + bottom_mask(column);
+        if (draw(p.mask)) {
+            return 0;
+        }
+        p.pieces = other;
+    }
+}
+
+static void report_budget(double budget, Position* positions, int num_positions,
+        TranspositionTable* table) {
+    Connect4Search search = {.depth = SEARCH_MAX_DEPTH, .table = table, .budget = budget};
+    double total = 0, worst = 0;
+    int depths = 0;
+    for (int i = 0; i < num_positions; i++) {
+        table_clear(table);
+        double start = now_sec();
+        search_move(&search, positions[i].pieces, positions[i].mask, NULL);
+        double seconds = now_sec() - start;
+        total += seconds;
+        worst = seconds > worst ? seconds : worst;
+        depths += search.completed;
+    }
+    printf("budget %6.1f ms: depth %5.1f, %7.3f ms/move, worst %7.3f ms, %.0f nodes/move\n",
+        1e3*budget, (double)depths/num_positions, 1e3*total/num_positions, 1e3*worst,
+        (double)search.nodes/num_positions);
+}
+
+// compute_env_move with column 0 full must play another column, also when the
+// deadline passes before the search finishes any move
+static bool check_full_column() {
+    CConnect4 env = {0};
+    for (int i = 0; i < ROWS; i++) {
+        uint64_t mask = env.player_pieces | env.env_pieces;
+        if (i % 2 == 0) {
+            env.player_pieces = play(0, mask, env.env_pieces);
+        } else {
+            env.env_pieces = play(0, mask, env.player_pieces);
+        }
+    }
+    Connect4Search saved = connect4_search;
+    bool ok = true;
+    double budgets[2] = {0, 1e-9};
+    for (int i = 0; i < 2; i++) {
+        connect4_search.budget = budgets[i];
+        connect4_search.depth = budgets[i] > 0 ? SEARCH_MAX_DEPTH : SEARCH_DEPTH;
+        // The root's first child is the first node to read the clock
+        connect4_search.nodes = SEARCH_CLOCK_NODES - 2;
+        int column = compute_env_move(&env);
+        if (column < 0 || invalid_move(column, env.player_pieces | env.env_pieces)) {
+            fprintf(stderr, "compute_env_move played full column %d with budget %g\n",
+                column, budgets[i]);
+            ok = false;
+        }
+    }
+    free_transposition_table(connect4_search.table);
+    saved.table = NULL;
+    connect4_search = saved;
+    return ok;
+}
+
+int main(int argc, char** argv) {
+    if (!check_full_column()) {
+        return 1;
+    }
+    int num_positions = argc > 1 ? atoi(argv[1]) : 200;
+    int num_games = argc > 2 ? atoi(argv[2]) : 100;
+    int max_depth = argc > 3 ? atoi(argv[3]) : 10;
+    if (argc > 4) {
+        connect4_search.depth = atoi(argv[4]);
+    }
+    srand(1);
+    Position* positions = malloc(num_positions*sizeof(Position));
+    for (int i = 0; i < num_positions; i++) {
+        positions[i] = random_position(4 + rand() % 16);
+    }
+
+    TranspositionTable* table = make_transposition_table(SEARCH_TABLE_BYTES);
+    if (table == NULL) {
+        perror("make_transposition_table");
+        return 1;
+    }
+    printf("%-9s %5s %12s %12s %10s %8s\n", "search", "depth", "nodes/move", "us/move",
+        "Mnodes/s", "hits");
+    for (int depth = 1; depth <= max_depth; depth++) {
+        Result r = {0};
+        double start = now_sec();
+        for (int i = 0; i < num_positions; i++) {
+            Connect4Search search = {.depth = depth};
+            search_best_move(&search, positions[i].pieces, positions[i].mask, depth, NULL);
+            r.nodes += search.nodes;
+        }
+        r.seconds = now_sec() - start;
+        r.moves = num_positions;
+        report("alphabeta", depth, r);
+        // Only the searches are timed, not the clears
+        r = (Result){0};
+        for (int i = 0; i < num_positions; i++) {
+            table_clear(table);
+            Connect4Search search = {.depth = depth, .table = table};
+            start = now_sec();
+            search_best_move(&search, positions[i].pieces, positions[i].mask, depth, NULL);
+            r.seconds += now_sec() - start;
+            r.nodes += search.nodes;
+            r.probes += search.stats.probes;
+            r.hits += search.stats.hits;
+        }
+        r.moves = num_positions;
+        report("table", depth, r);
+        if (depth > LEGACY_MAX_DEPTH) {
+            continue;
+        }
+        r = (Result){0};
+        start = now_sec();
+        for (int i = 0; i < num_positions; i++) {
+            Position p = positions[i];
+            legacy_move(p.pieces, p.pieces ^ p.mask, depth, &r.nodes);
+        }
+        r.seconds = now_sec() - start;
+        r.moves = num_positions;
+        report("negamax", depth, r);
+    }
+
+    int score[3] = {0};  // losses, draws, wins of the new search
+    Result new_result = {0}, old_result = {0};
+    Position opening = {0, 0};
+    TableStats stats = {0};
+    table_clear(table);
+    for (int g = 0; g < num_games; g++) {
+        if (g % 2 == 0) {
+            opening = random_position(2);
+        }
+        score[1 + play_game(opening, g % 2 == 0, table, &stats, &new_result, &old_result)]++;
+    }
+    printf("alpha-beta depth %d against negamax depth %d: %d won, %d drawn, %d lost\n",
+        connect4_search.depth, LEGACY_DEPTH, score[2], score[1], score[0]);
+    if (new_result.moves && old_result.moves) {
+        printf("per move: alpha-beta %.1f us (%.0f nodes), negamax %.1f us (%.0f nodes)\n",
+            1e6*new_result.seconds/new_result.moves, (double)new_result.nodes/new_result.moves,
+            1e6*old_result.seconds/old_result.moves, (double)old_result.nodes/old_result.moves);
+    }
+    printf("table: %.1f%% of %llu probes hit, %llu cutoffs, %llu stores, %llu replaced\n",
+        stats.probes ? 100.0*stats.hits/stats.probes : 0.0, (unsigned long long)stats.probes,
+        (unsigned long long)stats.cutoffs, (unsigned long long)stats.stores,
+        (unsigned long long)stats.replaced);
+
+    report_budget(SEARCH_UI_BUDGET, positions, num_positions, table);
+    report_budget(SEARCH_ANALYSIS_BUDGET, positions, num_positions < 20 ? num_positions : 20,
+        table);
+    TranspositionTable* fixed_table = make_transposition_table(SEARCH_TABLE_BYTES);
+    if (fixed_table == NULL) {
+        perror("make_transposition_table");
+        return 1;
+    }
+    Connect4Search timed = {.depth = SEARCH_MAX_DEPTH, .table = table,
+        .budget = SEARCH_UI_BUDGET};
+    Connect4Search fixed = {.depth = connect4_search.depth, .table = fixed_table};
+    table_clear(table);
+    int budget_score[3] = {0};
+    srand(2);
+    for (int g = 0; g < num_games; g++) {
+        if (g % 2 == 0) {
+            opening = random_position(2);
+            budget_score[1 + play_searches(opening, &timed, &fixed)]++;
+        } else {
+            budget_score[1 - play_searches(opening, &fixed, &timed)]++;
+        }
+    }
+    printf("budget %.1f ms against depth %d: %d won, %d drawn, %d lost\n",
+        1e3*SEARCH_UI_BUDGET, connect4_search.depth, budget_score[2], budget_score[1],
+        budget_score[0]);
+    free_transposition_table(fixed_table);
+    free_transposition_table(table);
+    free(positions);
+    return 0;
+}
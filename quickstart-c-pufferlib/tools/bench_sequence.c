@@ -0,0 +1,133 @@
+// Replay throughput of forward_linearlstm_sequence against stepping
+// forward_linearlstm (and the fixed-shape Connect4 pass at batch 1).
+//
+// Usage: bench_sequence [seconds_per_point]
+//
+// Feeds the same random observations through both paths from a zero state
+// for sequence lengths 8 to 256 at batch 1 and 16. Checks that every step's
+// logits and values and the final state match the step path, and reports
+// steps/sec per agent.
+#include "puffernet.h"
+#include "bench.h"
+
+PUFFERNET_FIXED_LINEARLSTM(connect4, 1, 42, 128, 7)
+
+static float max_diff(float* a, float* b, int n) {
+    float diff = 0.0f;
+    for (int i = 0; i < n; i++) {
+        diff = fmaxf(diff, fabsf(a[i] - b[i]));
+    }
+    return diff;
+}
+
+static void reset(LinearLSTM* net) {
+    int n = net->num_agents*128;
+    memset(net->lstm->state_h, 0, n*sizeof(float));
+    memset(net->lstm->state_c, 0, n*sizeof(float));
+    multidiscrete_seed(net->multidiscrete, 3);
+}
+
+static void run_steps(LinearLSTMForward forward, LinearLSTM* net, float* obs,
+        int* actions, int steps) {
+    int B = net->num_agents;
+    for (int t = 0; t < steps; t++) {
+        forward(net, obs + t*B*42, actions + t*B);
+    }
+}
+
+static double time_steps(LinearLSTMForward forward, LinearLSTM* net, float* obs,
+        int* actions, int steps, double seconds) {
+    long iters = 0;
+    double start = now_sec();
+    double elapsed = 0.0;
+    while (elapsed < seconds || iters == 0) {
+        reset(net);
+        run_steps(forward, net, obs, actions, steps);
+        iters++;
+        elapsed = now_sec() - start;
+    }
+    return iters*(double)steps*net->num_agents/elapsed;
+}
+
+static double time_sequence(LinearLSTMSequence* seq, float* obs, int* actions,
+        int steps, double seconds) {
+    long iters = 0;
+    double start = now_sec();
+    double elapsed = 0.0;
+    while (elapsed < seconds || iters == 0) {
+        reset(seq->net);
+        forward_linearlstm_sequence(seq, obs, actions, steps);
+        iters++;
+        elapsed = now_sec() - start;
+    }
+    return iters*(double)steps*seq->net->num_agents/elapsed;
+}
+
+int main(int argc, char** argv) {
+    double seconds = argc > 1 ? atof(argv[1]) : 0.3;
+    int logit_sizes[1] = {7};
+    int lengths[4] = {8, 21, 64, 256};
+    int batches[2] = {1, 16};
+    Weights* weights = make_synthetic_weights(linearlstm_num_weights(42, 7), 0.1f, 42);
+
+    printf("kernels %s\n", puffernet_kernels()->name);
+    printf("%5s %6s %12s %12s %12s %8s %10s %10s\n", "batch", "steps", "step/s",
+        "fixed/s", "sequence/s", "speedup", "max diff", "actions");
+    for (int bi = 0; bi < 2; bi++) {
+        int B = batches[bi];
+        weights->idx = 0;
+        LinearLSTM* net = make_linearlstm(weights, B, 42, logit_sizes, 1, NULL);
+        LinearLSTMSequence* seq = make_linearlstm_sequence(net, 256, NULL);
+        for (int li = 0; li < 4; li++) {
+            int T = lengths[li];
+            float* obs = malloc(T*B*42*sizeof(float));
+            for (int i = 0; i < T*B*42; i++) {
+                obs[i] = (float)(rand()%3 - 1);
+            }
+            int* step_actions = calloc(T*B, sizeof(int));
+            int* seq_actions = calloc(T*B, sizeof(int));
+            float* logits = malloc(T*B*7*sizeof(float));
+            float* values = malloc(T*B*sizeof(float));
+            float* state = malloc(2*B*128*sizeof(float));
+
+            reset(net);
+            for (int t = 0; t < T; t++) {
+                forward_linearlstm(net, obs + t*B*42, step_actions + t*B);
+                memcpy(logits + t*B*7, net->actor_value->logits, B*7*sizeof(float));
+                memcpy(values + t*B, net->actor_value->values, B*sizeof(float));
+            }
+            memcpy(state, net->lstm->state_h, B*128*sizeof(float));
+            memcpy(state + B*128, net->lstm->state_c, B*128*sizeof(float));
+            reset(net);
+            forward_linearlstm_sequence(seq, obs, seq_actions, T);
+            float diff = fmaxf(max_diff(logits, seq->logits, T*B*7),
+                max_diff(values, seq->values, T*B));
+            diff = fmaxf(diff, max_diff(state, net->lstm->state_h, B*128));
+            diff = fmaxf(diff, max_diff(state + B*128, net->lstm->state_c, B*128));
+            int agree = 0;
+            for (int i = 0; i < T*B; i++) {
+                agree += step_actions[i] == seq_actions[i];
+            }
+
+            double step_rate = time_steps(forward_linearlstm, net, obs, step_actions, T, seconds);
+            LinearLSTMForward fixed = linearlstm_connect4_kernel(net);
+            double fixed_rate = fixed != forward_linearlstm
+                ? time_steps(fixed, net, obs, step_actions, T, seconds) : step_rate;
+            double seq_rate = time_sequence(seq, obs, seq_actions, T, seconds);
+            double best = fixed_rate > step_rate ? fixed_rate : step_rate;
+            printf("%5d %6d %12.0f %12.0f %12.0f %7.2fx %10.2e %5d/%-5d\n", B, T,
+                step_rate, fixed_rate, seq_rate, seq_rate/best, diff, agree, T*B);
+
+            free(obs);
+            free(step_actions);
+            free(seq_actions);
+            free(logits);
+            free(values);
+            free(state);
+        }
+        free(seq);
+        free_linearlstm(net);
+    }
+    free_weights(weights);
+    return 0;
+}
@@ -0,0 +1,107 @@
+// Lazy-SMP speedup of search_move by thread count.
+//
+// Usage: bench_smp [positions] [depth] [max_threads] [table_mb]
+//
+// Searches the same random midgame positions (default 50) at a fixed depth
+// (default 14) with 1, 2, 4, ... up to max_threads threads (default all
+// cores), each position from an empty shared table of table_mb MB (default
+// 16). Reports the time to depth, the speedup over one thread, nodes/sec
+// over all threads and how many moves match the single-threaded search.
+// Searches one thread twice first and returns nonzero if the moves or node
+// counts differ, since one thread must be deterministic.
+#define CONNECT4_HEADLESS
+#include "connect4.h"
+#include "puffernet.h"
+#include "bench.h"
+#include <unistd.h>
+
+typedef struct Position Position;
+struct Position {
+    uint64_t pieces;  // side to move
+    uint64_t mask;
+};
+
+// Random play that stops before a finished game or a win in one
+static Position random_position(int plies) {
+    Position p = {0, 0};
+    for (int ply = 0; ply < plies; ply++) {
+        uint64_t moves = non_losing_moves(p.pieces, p.mask);
+        if (moves == 0 || (possible_moves(p.mask) & winning_cells(p.pieces, p.mask))) {
+            break;
+        }
+        int column;
+        do {
+            column = rand() % COLUMNS;
+        } while ((moves & column_mask(column)) == 0);
+        uint64_t mask = p.mask | (moves & column_mask(column));
+        p.pieces ^= p.mask;
+        p.mask = mask;
+    }
+    return p;
+}
+
+// Seconds to search every position, filling moves and nodes
+static double run(Position* positions, int num_positions, int depth, int threads,
+        TranspositionTable* table, int* moves, uint64_t* nodes) {
+    double seconds = 0;
+    *nodes = 0;
+    for (int i = 0; i < num_positions; i++) {
+        table_clear(table);
+        Connect4Search search = {.depth = depth, .table = table};
+        search.threads = threads;
+        double start = now_sec();
+        moves[i] = search_move(&search, positions[i].pieces, positions[i].mask, NULL);
+        seconds += now_sec() - start;
+        *nodes += search.nodes;
+    }
+    return seconds;
+}
+
+int main(int argc, char** argv) {
+    int num_positions = argc > 1 ? atoi(argv[1]) : 50;
+    int depth = argc > 2 ? atoi(argv[2]) : 14;
+    int max_threads = argc > 3 ? atoi(argv[3]) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    size_t table_mb = argc > 4 ? atoi(argv[4]) : 16;
+    max_threads = max_threads > SEARCH_MAX_THREADS ? SEARCH_MAX_THREADS : max_threads;
+    srand(1);
+    Position* positions = malloc(num_positions*sizeof(Position));
+    for (int i = 0; i < num_positions; i++) {
+        positions[i] = random_position(4 + rand() % 12);
+    }
+    TranspositionTable* table = make_transposition_table(table_mb << 20);
+    if (table == NULL) {
+        perror("make_transposition_table");
+        return 1;
+    }
+    int* base_moves = malloc(num_positions*sizeof(int));
+    int* moves = malloc(num_positions*sizeof(int));
+
+    uint64_t base_nodes, nodes;
+    double base = run(positions, num_positions, depth, 1, table, base_moves, &base_nodes);
+    run(positions, num_positions, depth, 1, table, moves, &nodes);
+    bool deterministic = nodes == base_nodes
+        && memcmp(moves, base_moves, num_positions*sizeof(int)) == 0;
+    printf("depth %d, %d positions, one thread %s\n", depth, num_positions,
+        deterministic ? "deterministic" : "NOT deterministic");
+
+    printf("%7s %12s %8s %12s %10s %8s\n", "threads", "ms/move", "speedup", "nodes/move",
+        "Mnodes/s", "same");
+    printf("%7d %12.3f %8.2f %12.0f %10.2f %7.0f%%\n", 1, 1e3*base/num_positions, 1.0,
+        (double)base_nodes/num_positions, 1e-6*base_nodes/base, 100.0);
+    for (int threads = 2; threads <= max_threads; threads = threads*2 > max_threads
+            && threads < max_threads ? max_threads : threads*2) {
+        double seconds = run(positions, num_positions, depth, threads, table, moves, &nodes);
+        int same = 0;
+        for (int i = 0; i < num_positions; i++) {
+            same += moves[i] == base_moves[i];
+        }
+        printf("%7d %12.3f %8.2f %12.0f %10.2f %7.0f%%\n", threads, 1e3*seconds/num_positions,
+            base/seconds, (double)nodes/num_positions, 1e-6*nodes/seconds,
+            100.0*same/num_positions);
+    }
+    free(moves);
+    free(base_moves);
+    free_transposition_table(table);
+    free(positions);
+    return !deterministic;
+}
@@ -0,0 +1,196 @@
+// Dense against block-sparse layers over a sweep of block densities, to find
+// where pruning starts to pay off.
+//
+// Usage: bench_sparse [seconds_per_point]
+//
+// Weights are pruned by whole 4x8 blocks (the structure SparseLinear skips)
+// to each density, then the same matrix runs through the dense and sparse
+// kernels at batch 1 and 64. Reports microseconds per call, the speedup, the
+// weight bytes of each and the crossover: the highest density at which the
+// sparse layer is faster.
+#include "puffernet.h"
+#include "bench.h"
+
+#define NUM_DENSITIES 8
+static const float densities[NUM_DENSITIES] = {1.0f, 0.75f, 0.5f, 0.375f, 0.25f, 0.125f, 0.0625f, 0.03125f};
+
+// Zeroes a random subset of blocks so that round(density*blocks) survive
+static void prune_blocks(float* w, int rows, int cols, float density, unsigned seed) {
+    int groups = block_sparse_groups(rows);
+    int col_blocks = (cols + PUFFERNET_SPARSE_COLS - 1)/PUFFERNET_SPARSE_COLS;
+    int total = groups*col_blocks;
+    int* order = malloc(total*sizeof(int));
+    for (int i = 0; i < total; i++) {
+        order[i] = i;
+    }
+    srand(seed);
+    for (int i = total - 1; i > 0; i--) {
+        int j = rand() % (i + 1);
+        int t = order[i];
+        order[i] = order[j];
+        order[j] = t;
+    }
+    int keep = (int)(density*total + 0.5f);
+    for (int i = keep; i < total; i++) {
+        int row = 4*(order[i]/col_blocks);
+        int col = PUFFERNET_SPARSE_COLS*(order[i] % col_blocks);
+        for (int r = row; r < row + 4 && r < rows; r++) {
+            for (int c = col; c < col + PUFFERNET_SPARSE_COLS && c < cols; c++) {
+                w[r*cols + c] = 0.0f;
+            }
+        }
+    }
+    free(order);
+}
+
+typedef void (*LayerFn)(void* layer, float* input);
+
+static void run_linear(void* layer, float* input) {
+    linear(layer, input);
+}
+
+static void run_lstm(void* layer, float* input) {
+    lstm(layer, input);
+}
+
+static double time_per_call(LayerFn fn, void* layer, float* input, double seconds) {
+    fn(layer, input);
+    long iters = 0;
+    double start = now_sec();
+    double elapsed = 0.0;
+    while (elapsed < seconds || iters < 3) {
+        fn(layer, input);
+        iters++;
+        elapsed = now_sec() - start;
+    }
+    return 1e6*elapsed/iters;
+}
+
+static size_t sparse_bytes(BlockSparse* w) {
+    int num_blocks = block_sparse_num_blocks(w);
+    return (block_sparse_groups(w->rows) + 1 + num_blocks)*sizeof(int32_t)
+        + (size_t)num_blocks*PUFFERNET_SPARSE_BLOCK*sizeof(float);
+}
+
+static float max_diff(float* a, float* b, int n) {
+    float diff = 0.0f;
+    for (int i = 0; i < n; i++) {
+        diff = fmaxf(diff, fabsf(a[i] - b[i]));
+    }
+    return diff;
+}
+
+static void report(const char* name, int batch, int rows, int cols, float density,
+        double dense_us, double sparse_us, size_t sparse_size, float diff) {
+    printf("%-10s %5d %5dx%-5d %7.2f%% %10.2f %10.2f %7.2fx %9zu %9zu %10.2e\n",
+        name, batch, rows, cols, 100.0f*density, dense_us, sparse_us, dense_us/sparse_us,
+        (size_t)rows*cols*sizeof(float), sparse_size, diff);
+}
+
+static float bench_linear(const char* name, int batch, int input_dim, int output_dim,
+        double seconds) {
+    float* input = malloc(batch*input_dim*sizeof(float));
+    for (int i = 0; i < batch*input_dim; i++) {
+        input[i] = 2.0f*rand()/(float)RAND_MAX - 1.0f;
+    }
+    float crossover = 0.0f;
+    for (int d = 0; d < NUM_DENSITIES; d++) {
+        Weights* weights = make_synthetic_weights(output_dim*input_dim + output_dim, 0.1f, d + 1);
+        prune_blocks(weights->data, output_dim, input_dim, densities[d], d + 1);
+        Linear* dense = make_linear(weights, batch, input_dim, output_dim, NULL);
+        weights->idx = 0;
+        Linear* sparse = make_sparse_linear(weights, batch, input_dim, output_dim, 0.0f, NULL);
+        linear(dense, input);
+        linear(sparse, input);
+        float diff = max_diff(dense->output, sparse->output, batch*output_dim);
+        double dense_us = time_per_call(run_linear, dense, input, seconds);
+        double sparse_us = time_per_call(run_linear, sparse, input, seconds);
+        report(name, batch, output_dim, input_dim, densities[d], dense_us, sparse_us,
+            sparse_bytes(&sparse->sparse), diff);
+        if (sparse_us < dense_us && densities[d] > crossover) {
+            crossover = densities[d];
+        }
+        free(dense);
+        free(sparse);
+        free_weights(weights);
+    }
+    free(input);
+    return crossover;
+}
+
+static float bench_lstm(const char* name, int batch, int hidden, double seconds) {
+    int rows = 4*hidden;
+    int cat_size = 2*hidden;
+    float* input = malloc(batch*hidden*sizeof(float));
+    for (int i = 0; i < batch*hidden; i++) {
+        input[i] = 2.0f*rand()/(float)RAND_MAX - 1.0f;
+    }
+    float crossover = 0.0f;
+    for (int d = 0; d < NUM_DENSITIES; d++) {
+        Weights* weights = make_synthetic_weights(rows*cat_size + 2*rows, 0.1f, d + 1);
+        // Blocks of the packed matrix map back to 4 gate rows that are
+        // hidden apart in PyTorch's layout, so prune a packed copy and unpack
+        float* packed = calloc(rows*cat_size, sizeof(float));
+        float* bias = calloc(rows, sizeof(float));
+        float* weights_input = weights->data;
+        float* weights_state = weights->data + rows*hidden;
+        _lstm_pack_weights(weights_input, weights_state, weights->data + rows*cat_size,
+            weights->data + rows*cat_size + rows, packed, bias, hidden, hidden);
+        prune_blocks(packed, rows, cat_size, densities[d], d + 1);
+        for (int j = 0; j < hidden; j++) {
+            for (int g = 0; g < 4; g++) {
+                float* src = packed + (4*j + g)*cat_size;
+                memcpy(weights_input + (g*hidden + j)*hidden, src, hidden*sizeof(float));
+                memcpy(weights_state + (g*hidden + j)*hidden, src + hidden, hidden*sizeof(float));
+            }
+        }
+        free(packed);
+        free(bias);
+
+        LSTM* dense = make_lstm(weights, batch, hidden, hidden, NULL);
+        weights->idx = 0;
+        LSTM* sparse = make_sparse_lstm(weights, batch, hidden, hidden, 0.0f, NULL);
+        lstm(dense, input);
+        lstm(sparse, input);
+        float diff = max_diff(dense->state_h, sparse->state_h, batch*hidden);
+        double dense_us = time_per_call(run_lstm, dense, input, seconds);
+        double sparse_us = time_per_call(run_lstm, sparse, input, seconds);
+        report(name, batch, rows, cat_size, densities[d], dense_us, sparse_us,
+            sparse_bytes(&sparse->sparse), diff);
+        if (sparse_us < dense_us && densities[d] > crossover) {
+            crossover = densities[d];
+        }
+        free(dense);
+        free(sparse);
+        free_weights(weights);
+    }
+    free(input);
+    return crossover;
+}
+
+int main(int argc, char** argv) {
+    double seconds = argc > 1 ? atof(argv[1]) : 0.2;
+    printf("kernels: %s, blocks of 4x%d\n", puffernet_kernels()->name, PUFFERNET_SPARSE_COLS);
+    printf("%-10s %5s %11s %8s %10s %10s %8s %9s %9s %10s\n", "layer", "batch", "shape",
+        "density", "dense us", "sparse us", "speedup", "dense B", "sparse B", "max diff");
+
+    const char* names[4] = {"encoder", "encoder", "lstm", "lstm"};
+    int batches[4] = {1, 64, 1, 64};
+    float crossovers[4];
+    for (int i = 0; i < 2; i++) {
+        crossovers[i] = bench_linear(names[i], batches[i], 42, 128, seconds);
+    }
+    for (int i = 2; i < 4; i++) {
+        crossovers[i] = bench_lstm(names[i], batches[i], 128, seconds);
+    }
+
+    printf("\ncrossover (highest block density where sparse is faster)\n");
+    for (int i = 0; i < 4; i++) {
+        if (crossovers[i] > 0.0f) {
+            printf("  %-8s batch %-3d %6.2f%%\n", names[i], batches[i], 100.0f*crossovers[i]);
+        } else {
+            printf("  %-8s batch %-3d   none\n", names[i], batches[i]);
+        }
+    }
+    return 0;
+}
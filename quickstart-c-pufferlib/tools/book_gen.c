@@ -0,0 +1,271 @@
+// Builds the Connect4 opening book read by connect4_book.h.
+//
+// Usage: book_gen [plies] [out] [depth] [threads] [table_mb]
+//
+// Collects every position with up to plies pieces (default 6) that is not
+// already won, one per mirror pair, and finds the best move of each on
+// threads worker threads (default all cores), each with a transposition table
+// of table_mb MB (default 64). Positions with no more empty cells than depth
+// (default 16) are solved exactly, the others take search_best_move at depth.
+// Depth 42 solves every position exactly, but a balanced position with few
+// pieces can take minutes to solve. Writes out (default connect4_book.bin), then loads it back,
+// checks every position and its mirror against the solver and times the
+// lookups. Returns nonzero if the check fails.
+//
+// resources/connect4_book.bin is made with the defaults.
+#define CONNECT4_HEADLESS
+#include "connect4.h"
+#include "puffernet.h"
+#include "bench.h"
+#include <pthread.h>
+#include <unistd.h>
+
+typedef struct Job Job;
+struct Job {
+    uint64_t pieces;  // side to move
+    uint64_t mask;
+    uint64_t key;
+    int move;
+    int score;
+};
+
+typedef struct Solver Solver;
+struct Solver {
+    Job* jobs;
+    int num_jobs;
+    int depth;
+    size_t table_bytes;
+    pthread_mutex_t lock;
+    int next;
+    int done;
+    uint64_t nodes;
+    double start;
+};
+
+static Job* jobs = NULL;
+static int num_jobs = 0;
+static int max_jobs = 0;
+
+// Every position from (pieces, mask) on with up to plies pieces
+static void collect(uint64_t pieces, uint64_t mask, int plies) {
+    if (num_jobs == max_jobs) {
+        max_jobs = max_jobs ? 2*max_jobs : 1024;
+        jobs = realloc(jobs, max_jobs*sizeof(Job));
+    }
+    bool mirrored;
+    jobs[num_jobs++] = (Job){pieces, mask, table_key(pieces, mask, &mirrored), -1, 0};
+    if (popcount(mask) >= plies) {
+        return;
+    }
+    uint64_t possible = possible_moves(mask);
+    for (int column = 0; column < COLUMNS; column++) {
+        uint64_t move = possible & column_mask(column);
+        if (move != 0 && !won(pieces | move)) {
+            collect(pieces ^ mask, mask | move, plies);
+        }
+    }
+}
+
+static int compare_keys(const void* a, const void* b) {
+    uint64_t ka = ((const Job*)a)->key;
+    uint64_t kb = ((const Job*)b)->key;
+    return ka < kb ? -1 : ka > kb;
+}
+
+// Fewest pieces (the slowest to solve) first, to balance the threads
+static int compare_pieces(const void* a, const void* b) {
+    int pa = popcount(((const Job*)a)->mask);
+    int pb = popcount(((const Job*)b)->mask);
+    return pa != pb ? pa - pb : compare_keys(a, b);
+}
+
+// Exact score of a position the side to move can not win at once: null
+// window searches that halve the range of possible scores, after
+// http://blog.gamesolver.org/solving-connect-four/
+static int solve(Connect4Search* search, uint64_t pieces, uint64_t mask) {
+    int stones = popcount(mask);
+    int min = -(SEARCH_WIN - (stones + 2));
+    int max = SEARCH_WIN - (stones + 1);
+    while (min < max) {
+        int med = min + (max - min)/2;
+        // Search closer to 0 first, where most scores are
+        if (med <= 0 && min/2 < med) {
+            med = min/2;
+        } else if (med >= 0 && max/2 > med) {
+            med = max/2;
+        }
+        int r = search_negamax(search, pieces, mask, SEARCH_MAX_DEPTH, med, med + 1);
+        if (r <= med) {
+            max = r;
+        } else {
+            min = r;
+        }
+    }
+    return min;
+}
+
+// Best move and its score, exact if depth reaches the end of the game
+static int solve_move(Connect4Search* search, uint64_t pieces, uint64_t mask, int depth,
+        int* score) {
+    uint64_t next = non_losing_moves(pieces, mask);
+    bool wins = possible_moves(mask) & winning_cells(pieces, mask);
+    if (wins || next == 0 || depth < ROWS*COLUMNS - popcount(mask)) {
+        return search_best_move(search, pieces, mask, depth, score);
+    }
+    *score = solve(search, pieces, mask);
+    int order[7];
+    int num_moves = search_order(-1, next, order);
+    for (int i = 0; i < num_moves; i++) {
+        uint64_t move = next & column_mask(order[i]);
+        if (-search_negamax(search, pieces ^ mask, mask | move, SEARCH_MAX_DEPTH,
+                -*score, -*score + 1) >= *score) {
+            return order[i];
+        }
+    }
+    fprintf(stderr, "No move reaches the solved score %d\n", *score);
+    exit(1);
+}
+
+static void* solve_jobs(void* arg) {
+    Solver* solver = (Solver*)arg;
+    TranspositionTable* table = make_transposition_table(solver->table_bytes);
+    if (table == NULL) {
+        perror("make_transposition_table");
+        exit(1);
+    }
+    Connect4Search search = {.depth = solver->depth, .table = table};
+    while (true) {
+        pthread_mutex_lock(&solver->lock);
+        int i = solver->next++;
+        pthread_mutex_unlock(&solver->lock);
+        if (i >= solver->num_jobs) {
+            break;
+        }
+        Job* job = &solver->jobs[i];
+        job->move = solve_move(&search, job->pieces, job->mask, solver->depth, &job->score);
+        pthread_mutex_lock(&solver->lock);
+        solver->done++;
+        if (solver->done % 100 == 0 || solver->done == solver->num_jobs) {
+            fprintf(stderr, "\r%d/%d positions, %.0f s", solver->done, solver->num_jobs,
+                now_sec() - solver->start);
+        }
+        pthread_mutex_unlock(&solver->lock);
+    }
+    pthread_mutex_lock(&solver->lock);
+    solver->nodes += search.nodes;
+    pthread_mutex_unlock(&solver->lock);
+    free_transposition_table(table);
+    return NULL;
+}
+
+static bool write_book(const char* path, Job* jobs, int count, int plies, int depth) {
+    uint64_t* entries = malloc(count*sizeof(uint64_t));
+    for (int i = 0; i < count; i++) {
+        // The move in the orientation of the key
+        bool mirrored;
+        table_key(jobs[i].pieces, jobs[i].mask, &mirrored);
+        int move = mirrored ? COLUMNS - 1 - jobs[i].move : jobs[i].move;
+        entries[i] = book_entry(jobs[i].key, jobs[i].score, move);
+    }
+    BookHeader header = {{0}};
+    memcpy(header.magic, BOOK_MAGIC, 4);
+    header.version = BOOK_VERSION;
+    header.plies = plies;
+    header.depth = depth;
+    header.count = count;
+    header.checksum = book_checksum(entries, count*sizeof(uint64_t));
+    FILE* file = fopen(path, "wb");
+    if (!file) {
+        perror("Error opening book");
+        free(entries);
+        return false;
+    }
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1
+        && fwrite(entries, sizeof(uint64_t), count, file) == (size_t)count;
+    ok = fclose(file) == 0 && ok;
+    free(entries);
+    if (!ok) {
+        perror("Error writing book");
+    }
+    return ok;
+}
+
+int main(int argc, char** argv) {
+    int plies = argc > 1 ? atoi(argv[1]) : 6;
+    const char* path = argc > 2 ? argv[2] : BOOK_FILE;
+    int depth = argc > 3 ? atoi(argv[3]) : 16;
+    int num_threads = argc > 4 ? atoi(argv[4]) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    size_t table_mb = argc > 5 ? atoi(argv[5]) : 64;
+    depth = depth > SEARCH_MAX_DEPTH ? SEARCH_MAX_DEPTH : depth;
+    num_threads = num_threads < 1 ? 1 : num_threads;
+
+    collect(0, 0, plies);
+    int num_positions = num_jobs;
+    qsort(jobs, num_jobs, sizeof(Job), compare_keys);
+    int unique = 0;
+    for (int i = 0; i < num_jobs; i++) {
+        if (unique == 0 || jobs[i].key != jobs[unique - 1].key) {
+            jobs[unique++] = jobs[i];
+        }
+    }
+    num_jobs = unique;
+    printf("%d move orders up to %d plies, %d positions without mirrors, depth %d%s, "
+        "%d threads\n", num_positions, plies, num_jobs, depth, depth == SEARCH_MAX_DEPTH ? " (exact)" : "",
+        num_threads);
+
+    qsort(jobs, num_jobs, sizeof(Job), compare_pieces);
+    Solver solver = {jobs, num_jobs, depth, table_mb << 20};
+    pthread_mutex_init(&solver.lock, NULL);
+    solver.start = now_sec();
+    pthread_t* threads = malloc(num_threads*sizeof(pthread_t));
+    for (int t = 0; t < num_threads; t++) {
+        if (pthread_create(&threads[t], NULL, solve_jobs, &solver) != 0) {
+            perror("pthread_create");
+            return 1;
+        }
+    }
+    for (int t = 0; t < num_threads; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    double seconds = now_sec() - solver.start;
+    pthread_mutex_destroy(&solver.lock);
+    free(threads);
+    printf("\nsolved in %.1f s, %.2f Mnodes/s\n", seconds, 1e-6*solver.nodes/seconds);
+
+    qsort(jobs, num_jobs, sizeof(Job), compare_keys);
+    if (!write_book(path, jobs, num_jobs, plies, depth)) {
+        return 1;
+    }
+    Book* book = load_book(path);
+    if (book == NULL) {
+        return 1;
+    }
+    printf("wrote %s: %llu entries, %zu bytes\n", path, (unsigned long long)book->count,
+        book->file_size);
+
+    int errors = 0;
+    double start = now_sec();
+    for (int i = 0; i < num_jobs; i++) {
+        Job* job = &jobs[i];
+        int move, score;
+        if (!book_probe(book, job->pieces, job->mask, &move, &score)
+                || move != job->move || score != job->score) {
+            errors++;
+            continue;
+        }
+        // A symmetric position is its own mirror
+        uint64_t pieces = mirror_columns(job->pieces);
+        uint64_t mask = mirror_columns(job->mask);
+        bool symmetric = pieces == job->pieces && mask == job->mask;
+        int mirror_move = symmetric ? job->move : COLUMNS - 1 - job->move;
+        if (!book_probe(book, pieces, mask, &move, &score)
+                || move != mirror_move || score != job->score) {
+            errors++;
+        }
+    }
+    double probe_ns = 1e9*(now_sec() - start)/(2*num_jobs);
+    printf("lookup: %.0f ns per probe, %d mismatches\n", probe_ns, errors);
+    free_book(book);
+    free(jobs);
+    return errors != 0;
+}
@@ -0,0 +1,544 @@
+// Gradient check of puffernet_train.h against central finite differences.
+//
+// Usage: gradcheck
+//
+// Every layer backward (Linear, ReLU, GELU, LayerNorm, the categorical policy
+// head, one LSTM step) and the LinearLSTMTrain window backward (BPTT with an
+// episode reset inside the window) is checked on small random shapes for the
+// loss sum(output * r) with a fixed random r. Also checks that the SIMD Adam
+// matches the scalar one, that every SIMD linear kernel stays within the
+// bound stated at _linear_scalar, that every fused and block-sparse LSTM
+// kernel matches the unfused _lstm and that the training forward matches
+// forward_linearlstm on the same parameters. Exits nonzero on a mismatch.
+#include "puffernet.h"
+#include "puffernet_train.h"
+#include "bench.h"
+
+#define EPS 1e-2f
+#define ATOL 1e-3f
+#define RTOL 1e-2f
+// Parameters checked per tensor of the full model
+#define MAX_SAMPLES 48
+
+typedef double (*LossFn)(void* ctx);
+
+static int failures = 0;
+
+static void fill(float* x, int n, float scale) {
+    for (int i = 0; i < n; i++) {
+        x[i] = scale*(2.0f*rand()/(float)RAND_MAX - 1.0f);
+    }
+}
+
+static float* random_buffer(int n, float scale) {
+    float* x = calloc(n, sizeof(float));
+    fill(x, n, scale);
+    return x;
+}
+
+static double dot(float* a, float* b, int n) {
+    double sum = 0.0;
+    for (int i = 0; i < n; i++) {
+        sum += (double)a[i]*b[i];
+    }
+    return sum;
+}
+
+// Compares grad against central differences of loss in every element of x
+// (or MAX_SAMPLES evenly spaced ones when sampled)
+static void check(const char* name, LossFn loss, void* ctx, float* x, float* grad,
+        int size, bool sampled) {
+    int stride = sampled && size > MAX_SAMPLES ? size/MAX_SAMPLES : 1;
+    float max_abs = 0.0f, max_rel = 0.0f;
+    bool ok = true;
+    for (int i = 0; i < size; i += stride) {
+        float saved = x[i];
+        x[i] = saved + EPS;
+        double plus = loss(ctx);
+        x[i] = saved - EPS;
+        double minus = loss(ctx);
+        x[i] = saved;
+        float numeric = (float)((plus - minus)/(2.0*EPS));
+        float diff = fabsf(numeric - grad[i]);
+        float scale = fmaxf(fabsf(numeric), fabsf(grad[i]));
+        max_abs = fmaxf(max_abs, diff);
+        max_rel = fmaxf(max_rel, diff/fmaxf(scale, 1e-6f));
+        ok &= diff <= ATOL + RTOL*scale;
+    }
+    printf("%-28s %6d  max abs %.2e  max rel %.2e  %s\n", name, (size + stride - 1)/stride,
+        max_abs, max_rel, ok ? "ok" : "FAIL");
+    failures += !ok;
+}
+
+typedef struct Layer Layer;
+struct Layer {
+    int batch_size;
+    int input_dim;
+    int output_dim;
+    float* input;
+    float* weights;
+    float* bias;
+    float* output;
+    float* r;
+    int* actions;
+    float* r2;  // entropy weights of the categorical head
+};
+
+static double linear_loss(void* ctx) {
+    Layer* l = ctx;
+    _linear(l->input, l->weights, l->bias, l->output, l->batch_size, l->input_dim, l->output_dim);
+    return dot(l->output, l->r, l->batch_size*l->output_dim);
+}
+
+static double relu_loss(void* ctx) {
+    Layer* l = ctx;
+    _relu(l->input, l->output, l->batch_size*l->input_dim);
+    return dot(l->output, l->r, l->batch_size*l->input_dim);
+}
+
+static double gelu_loss(void* ctx) {
+    Layer* l = ctx;
+    _gelu_train(l->input, l->output, l->batch_size*l->input_dim);
+    return dot(l->output, l->r, l->batch_size*l->input_dim);
+}
+
+static double layernorm_loss(void* ctx) {
+    Layer* l = ctx;
+    _layernorm(l->input, l->weights, l->bias, l->output, l->batch_size, l->input_dim);
+    return dot(l->output, l->r, l->batch_size*l->input_dim);
+}
+
+static double categorical_loss(void* ctx) {
+    Layer* l = ctx;
+    int B = l->batch_size;
+    float* logp = l->output;
+    float* action_logp = logp + B*l->input_dim;
+    float* entropy = action_logp + B;
+    _categorical_forward(l->input, l->actions, logp, action_logp, entropy, B, l->input_dim);
+    return dot(action_logp, l->r, B) + dot(entropy, l->r2, B);
+}
+
+static void check_layers() {
+    int B = 3, I = 7, O = 5;
+    Layer l = {
+        .batch_size = B, .input_dim = I, .output_dim = O,
+        .input = random_buffer(B*I, 1.0f),
+        .weights = random_buffer(O*I, 0.5f),
+        .bias = random_buffer(I, 0.5f),
+        .output = calloc(B*I + 2*B, sizeof(float)),
+        .r = random_buffer(B*I, 1.0f),
+        .actions = calloc(B, sizeof(int)),
+        .r2 = random_buffer(B, 1.0f),
+    };
+    float* grad_input = calloc(B*I, sizeof(float));
+    float* grad_weights = calloc(O*I, sizeof(float));
+    float* grad_bias = calloc(I, sizeof(float));
+
+    _linear_backward(l.input, l.weights, l.r, grad_input, grad_weights, grad_bias, B, I, O);
+    check("linear input", linear_loss, &l, l.input, grad_input, B*I, false);
+    check("linear weights", linear_loss, &l, l.weights, grad_weights, O*I, false);
+    check("linear bias", linear_loss, &l, l.bias, grad_bias, O, false);
+
+    // Keep inputs away from the ReLU kink
+    for (int i = 0; i < B*I; i++) {
+        l.input[i] += l.input[i] < 0.0f ? -0.1f : 0.1f;
+    }
+    relu_loss(&l);
+    _relu_backward(l.output, l.r, grad_input, B*I);
+    check("relu", relu_loss, &l, l.input, grad_input, B*I, false);
+
+    fill(l.input, B*I, 3.0f);
+    _gelu_backward(l.input, l.r, grad_input, B*I);
+    check("gelu", gelu_loss, &l, l.input, grad_input, B*I, false);
+
+    fill(l.input, B*I, 2.0f);
+    fill(l.weights, I, 1.0f);
+    fill(l.bias, I, 1.0f);
+    memset(grad_weights, 0, I*sizeof(float));
+    memset(grad_bias, 0, I*sizeof(float));
+    _layernorm_backward(l.input, l.weights, l.r, grad_input, grad_weights, grad_bias, B, I);
+    check("layernorm input", layernorm_loss, &l, l.input, grad_input, B*I, false);
+    check("layernorm weights", layernorm_loss, &l, l.weights, grad_weights, I, false);
+    check("layernorm bias", layernorm_loss, &l, l.bias, grad_bias, I, false);
+
+    fill(l.input, B*I, 3.0f);
+    for (int b = 0; b < B; b++) {
+        l.actions[b] = (2*b + 1) % I;
+    }
+    categorical_loss(&l);
+    _categorical_backward(l.output, l.actions, l.r, l.r2, grad_input, B, I);
+    check("categorical logits", categorical_loss, &l, l.input, grad_input, B*I, false);
+
+    free(l.input);
+    free(l.weights);
+    free(l.bias);
+    free(l.output);
+    free(l.r);
+    free(l.actions);
+    free(l.r2);
+    free(grad_input);
+    free(grad_weights);
+    free(grad_bias);
+}
+
+typedef struct Step Step;
+struct Step {
+    int batch_size;
+    int input_size;
+    int hidden_size;
+    float* input;
+    float* h_prev;
+    float* c_prev;
+    float* weights_input;
+    float* weights_state;
+    float* bias_input;
+    float* bias_state;
+    float* gates;
+    float* h;
+    float* c;
+    float* tanh_c;
+    float* r_h;
+    float* r_c;
+};
+
+static double lstm_loss(void* ctx) {
+    Step* s = ctx;
+    _lstm_train_step(s->input, s->h_prev, s->c_prev, s->weights_input, s->weights_state,
+        s->bias_input, s->bias_state, s->gates, s->h, s->c, s->tanh_c,
+        s->batch_size, s->input_size, s->hidden_size);
+    int n = s->batch_size*s->hidden_size;
+    return dot(s->h, s->r_h, n) + dot(s->c, s->r_c, n);
+}
+
+static void check_lstm() {
+    int B = 2, I = 5, H = 6;
+    Step s = {
+        .batch_size = B, .input_size = I, .hidden_size = H,
+        .input = random_buffer(B*I, 1.0f),
+        .h_prev = random_buffer(B*H, 1.0f),
+        .c_prev = random_buffer(B*H, 1.0f),
+        .weights_input = random_buffer(4*H*I, 0.5f),
+        .weights_state = random_buffer(4*H*H, 0.5f),
+        .bias_input = random_buffer(4*H, 0.5f),
+        .bias_state = random_buffer(4*H, 0.5f),
+        .gates = calloc(B*4*H, sizeof(float)),
+        .h = calloc(B*H, sizeof(float)),
+        .c = calloc(B*H, sizeof(float)),
+        .tanh_c = calloc(B*H, sizeof(float)),
+        .r_h = random_buffer(B*H, 1.0f),
+        .r_c = random_buffer(B*H, 1.0f),
+    };
+    float* grad_h = calloc(B*H, sizeof(float));
+    float* grad_c = calloc(B*H, sizeof(float));
+    float* grad_gates = calloc(B*4*H, sizeof(float));
+    float* grad_input = calloc(B*I, sizeof(float));
+    float* grad_weights_input = calloc(4*H*I, sizeof(float));
+    float* grad_weights_state = calloc(4*H*H, sizeof(float));
+    float* grad_bias_input = calloc(4*H, sizeof(float));
+    float* grad_bias_state = calloc(4*H, sizeof(float));
+
+    lstm_loss(&s);
+    memcpy(grad_h, s.r_h, B*H*sizeof(float));
+    memcpy(grad_c, s.r_c, B*H*sizeof(float));
+    // In place, as the BPTT loop runs it
+    _lstm_backward_step(s.input, s.h_prev, s.c_prev, s.weights_input, s.weights_state,
+        s.gates, s.tanh_c, grad_h, grad_c, grad_gates, grad_input, grad_h, grad_c,
+        grad_weights_input, grad_weights_state, grad_bias_input, grad_bias_state, B, I, H);
+    check("lstm input", lstm_loss, &s, s.input, grad_input, B*I, false);
+    check("lstm h_prev", lstm_loss, &s, s.h_prev, grad_h, B*H, false);
+    check("lstm c_prev", lstm_loss, &s, s.c_prev, grad_c, B*H, false);
+    check("lstm weights_input", lstm_loss, &s, s.weights_input, grad_weights_input, 4*H*I, false);
+    check("lstm weights_state", lstm_loss, &s, s.weights_state, grad_weights_state, 4*H*H, false);
+    check("lstm bias_input", lstm_loss, &s, s.bias_input, grad_bias_input, 4*H, false);
+    check("lstm bias_state", lstm_loss, &s, s.bias_state, grad_bias_state, 4*H, false);
+
+    float* buffers[] = {s.input, s.h_prev, s.c_prev, s.weights_input, s.weights_state,
+        s.bias_input, s.bias_state, s.gates, s.h, s.c, s.tanh_c, s.r_h, s.r_c, grad_h, grad_c,
+        grad_gates, grad_input, grad_weights_input, grad_weights_state, grad_bias_input,
+        grad_bias_state};
+    for (int i = 0; i < (int)(sizeof(buffers)/sizeof(float*)); i++) {
+        free(buffers[i]);
+    }
+}
+
+typedef struct Window Window;
+struct Window {
+    LinearLSTMTrain* model;
+    int steps;
+    float* obs;
+    float* starts;
+    float* h0;
+    float* c0;
+    float* r_logits;
+    float* r_values;
+};
+
+static double window_loss(void* ctx) {
+    Window* w = ctx;
+    LinearLSTMTrain* m = w->model;
+    linearlstm_train_forward(m, w->obs, w->starts, w->h0, w->c0, w->steps);
+    int rows = w->steps*m->batch_size;
+    return dot(m->logits, w->r_logits, rows*m->num_logits) + dot(m->values, w->r_values, rows);
+}
+
+static void check_window() {
+    int B = 3, T = 5, I = 6, H = 8, A = 4;
+    LinearLSTMTrain* model = make_linearlstm_train(B, T, I, H, A, NULL);
+    linearlstm_train_init(model, 7);
+    // Larger actor weights than the near-uniform init so every path matters
+    fill(model->actor_weights, A*H, 0.5f);
+    Window w = {
+        .model = model,
+        .steps = T,
+        .obs = random_buffer(T*B*I, 1.0f),
+        .starts = calloc(T*B, sizeof(float)),
+        .h0 = random_buffer(B*H, 0.5f),
+        .c0 = random_buffer(B*H, 0.5f),
+        .r_logits = random_buffer(T*B*A, 1.0f),
+        .r_values = random_buffer(T*B, 1.0f),
+    };
+    // Agent 1 starts a new episode at step 2
+    w.starts[2*B + 1] = 1.0f;
+
+    window_loss(&w);
+    linearlstm_train_zero_grad(model);
+    linearlstm_train_backward(model, w.r_logits, w.r_values);
+    static const char* names[10] = {
+        "window encoder weights", "window encoder bias", "window actor weights",
+        "window actor bias", "window value weights", "window value bias",
+        "window weights_input", "window weights_state", "window bias_input",
+        "window bias_state",
+    };
+    float* params[10];
+    float* grads[10];
+    size_t sizes[10];
+    _linearlstm_train_views(model, model->params, params, sizes);
+    _linearlstm_train_views(model, model->grads, grads, NULL);
+    for (int i = 0; i < 10; i++) {
+        check(names[i], window_loss, &w, params[i], grads[i], (int)sizes[i], true);
+    }
+    free(w.obs);
+    free(w.starts);
+    free(w.h0);
+    free(w.c0);
+    free(w.r_logits);
+    free(w.r_values);
+    free_linearlstm_train(model);
+}
+
+// Every available SIMD Adam against the scalar one over a few steps
+static void check_adam() {
+    int n = 1003;
+    float* start = random_buffer(n, 1.0f);
+    float* grads = random_buffer(n, 1.0f);
+    float* expected = malloc(n*sizeof(float));
+    float* params = malloc(n*sizeof(float));
+    const Kernels* active = puffernet_kernels();
+    for (int k = 0; k < PUFFERNET_NUM_KERNELS; k++) {
+        const char* name = PUFFERNET_KERNELS[k].name;
+        if (!puffernet_cpu_supports(name)) {
+            continue;
+        }
+        float max_diff = 0.0f;
+        for (int pass = 0; pass < 2; pass++) {
+            puffernet_select_kernels(pass == 0 ? "scalar" : name);
+            Adam* adam = make_adam(n, 1e-2f, NULL);
+            float* out = pass == 0 ? expected : params;
+            memcpy(out, start, n*sizeof(float));
+            for (int step = 0; step < 5; step++) {
+                adam_step(adam, out, grads);
+            }
+            free(adam);
+        }
+        for (int i = 0; i < n; i++) {
+            max_diff = fmaxf(max_diff, fabsf(params[i] - expected[i]));
+        }
+        bool ok = max_diff <= 1e-6f;
+        printf("adam %-23s %6d  max abs %.2e                   %s\n", name, n, max_diff,
+            ok ? "ok" : "FAIL");
+        failures += !ok;
+    }
+    puffernet_select_kernels(active->name);
+    free(start);
+    free(grads);
+    free(expected);
+    free(params);
+}
+
+// Every available SIMD linear against _linear_scalar, on shapes with and
+// without vector tails. The error is reported relative to the bound
+// 1e-6 * (|bias| + sum_i |input_i * weight_i|) of each output
+static void check_linear() {
+    int shapes[4][3] = {{1, 42, 128}, {4, 128, 128}, {3, 37, 13}, {8, 256, 7}};
+    for (int k = 0; k < PUFFERNET_NUM_KERNELS; k++) {
+        const char* name = PUFFERNET_KERNELS[k].name;
+        if (strcmp(name, "scalar") == 0 || !puffernet_cpu_supports(name)) {
+            continue;
+        }
+        float max_ratio = 0.0f;
+        int outputs = 0;
+        for (int s = 0; s < 4; s++) {
+            int B = shapes[s][0], I = shapes[s][1], O = shapes[s][2];
+            float* input = random_buffer(B*I, 1.0f);
+            float* weights = random_buffer(O*I, 0.5f);
+            float* bias = random_buffer(O, 0.5f);
+            float* expected = malloc(B*O*sizeof(float));
+            float* output = malloc(B*O*sizeof(float));
+            _linear_scalar(input, weights, bias, expected, B, I, O, PUFFERNET_EPILOGUE_NONE,
+                PUFFERNET_LINEAR_TILE);
+            PUFFERNET_KERNELS[k].linear(input, weights, bias, output, B, I, O,
+                PUFFERNET_EPILOGUE_NONE, PUFFERNET_LINEAR_TILE);
+            for (int b = 0; b < B; b++) {
+                for (int o = 0; o < O; o++) {
+                    double magnitude = fabsf(bias[o]);
+                    for (int i = 0; i < I; i++) {
+                        magnitude += fabs((double)input[b*I + i]*weights[o*I + i]);
+                    }
+                    float diff = fabsf(output[b*O + o] - expected[b*O + o]);
+                    max_ratio = fmaxf(max_ratio, diff/(1e-6*magnitude));
+                }
+            }
+            outputs += B*O;
+            free(input);
+            free(weights);
+            free(bias);
+            free(expected);
+            free(output);
+        }
+        bool ok = max_ratio <= 1.0f;
+        printf("linear %-21s %6d  max/bound %.2e                 %s\n", name, outputs,
+            max_ratio, ok ? "ok" : "FAIL");
+        failures += !ok;
+    }
+}
+
+// Every fused and block-sparse LSTM kernel against the unfused _lstm over a few
+// steps, with PyTorch-layout weights packed by _lstm_pack_weights. Hidden sizes
+// include a partial PUFFERNET_LSTM_BLOCK and cat sizes vector tails. _lstm uses
+// libm, so the kernels run in accurate mode whatever PUFFERNET_MATH says
+static void check_lstm_fused() {
+    int shapes[3][3] = {{1, 42, 128}, {4, 128, 128}, {3, 13, 21}};
+    int T = 3;
+    PufferMath math = puffernet_math();
+    puffernet_set_math(PUFFERNET_MATH_ACCURATE);
+    for (int k = 0; k < PUFFERNET_NUM_KERNELS; k++) {
+        const char* name = PUFFERNET_KERNELS[k].name;
+        if (!puffernet_cpu_supports(name)) {
+            continue;
+        }
+        float max_diff = 0.0f;
+        int outputs = 0;
+        for (int s = 0; s < 3; s++) {
+            int B = shapes[s][0], I = shapes[s][1], H = shapes[s][2];
+            int rows = 4*H, cat_size = I + H;
+            float* weights_input = random_buffer(rows*I, 0.3f);
+            float* weights_state = random_buffer(rows*H, 0.3f);
+            float* bias_input = random_buffer(rows, 0.3f);
+            float* bias_state = random_buffer(rows, 0.3f);
+            float* input = random_buffer(T*B*I, 1.0f);
+            float* fused = malloc(rows*cat_size*sizeof(float));
+            float* bias = malloc(rows*sizeof(float));
+            _lstm_pack_weights(weights_input, weights_state, bias_input, bias_state,
+                fused, bias, I, H);
+            int num_blocks = block_sparse_count(fused, rows, cat_size, 0.0f);
+            char* block = malloc(_block_sparse_size(rows, num_blocks));
+            char* cursor = block;
+            BlockSparse sparse;
+            _carve_block_sparse(&cursor, rows, num_blocks, &sparse);
+            block_sparse_pack(fused, rows, cat_size, 0.0f, &sparse);
+            // Reference, fused and sparse states, h then c
+            float* states[3][2];
+            for (int v = 0; v < 3; v++) {
+                states[v][0] = calloc(B*H, sizeof(float));
+                states[v][1] = calloc(B*H, sizeof(float));
+            }
+            float* gates = malloc(B*rows*sizeof(float));
+            float* buffer = malloc(B*cat_size*sizeof(float));
+            for (int t = 0; t < T; t++) {
+                float* x = input + t*B*I;
+                _lstm(x, states[0][0], states[0][1], weights_input, weights_state,
+                    bias_input, bias_state, gates, B, I, H);
+                _lstm_concat(x, states[1][0], buffer, B, I, H);
+                PUFFERNET_KERNELS[k].lstm(buffer, states[1][0], states[1][1], fused, bias,
+                    B, I, H, 0, H);
+                _lstm_concat(x, states[2][0], buffer, B, I, H);
+                PUFFERNET_KERNELS[k].sparse_lstm(buffer, states[2][0], states[2][1], &sparse,
+                    bias, B, I, H, 0, H);
+            }
+            for (int v = 1; v < 3; v++) {
+                for (int i = 0; i < B*H; i++) {
+                    max_diff = fmaxf(max_diff, fabsf(states[v][0][i] - states[0][0][i]));
+                    max_diff = fmaxf(max_diff, fabsf(states[v][1][i] - states[0][1][i]));
+                }
+            }
+            outputs += 2*2*B*H;
+            for (int v = 0; v < 3; v++) {
+                free(states[v][0]);
+                free(states[v][1]);
+            }
+            free(weights_input);
+            free(weights_state);
+            free(bias_input);
+            free(bias_state);
+            free(input);
+            free(fused);
+            free(bias);
+            free(block);
+            free(gates);
+            free(buffer);
+        }
+        bool ok = max_diff <= 1e-5f;
+        printf("lstm fused %-17s %6d  max abs %.2e                   %s\n", name, outputs,
+            max_diff, ok ? "ok" : "FAIL");
+        failures += !ok;
+    }
+    puffernet_set_math(math);
+}
+
+// Training forward against the inference net built from the same parameters
+static void check_inference() {
+    int B = 4, T = 6, I = 42, A = 7;
+    LinearLSTMTrain* model = make_linearlstm_train(B, T, I, 128, A, NULL);
+    linearlstm_train_init(model, 11);
+    fill(model->actor_weights, A*128, 0.2f);
+    float* obs = random_buffer(T*B*I, 1.0f);
+    float* starts = calloc(T*B, sizeof(float));
+    linearlstm_train_forward(model, obs, starts, NULL, NULL, T);
+
+    int logit_sizes[1] = {A};
+    LinearLSTM* net = make_linearlstm(linearlstm_train_weights(model), B, I, logit_sizes, 1, NULL);
+    int actions[4];
+    float max_diff = 0.0f;
+    for (int t = 0; t < T; t++) {
+        forward_linearlstm(net, obs + t*B*I, actions);
+        for (int i = 0; i < B*A; i++) {
+            max_diff = fmaxf(max_diff, fabsf(net->actor_value->logits[i] - model->logits[t*B*A + i]));
+        }
+        for (int b = 0; b < B; b++) {
+            max_diff = fmaxf(max_diff, fabsf(net->actor_value->values[b] - model->values[t*B + b]));
+        }
+    }
+    bool ok = max_diff <= 1e-3f;
+    printf("%-28s %6d  max abs %.2e                   %s\n", "inference forward", T*B*(A + 1),
+        max_diff, ok ? "ok" : "FAIL");
+    failures += !ok;
+    free_linearlstm(net);
+    free(obs);
+    free(starts);
+    free_linearlstm_train(model);
+}
+
+int main() {
+    srand(1);
+    printf("kernels %s\n", puffernet_kernels()->name);
+    printf("%-28s %6s\n", "gradient", "checked");
+    check_layers();
+    check_lstm();
+    check_window();
+    check_adam();
+    check_linear();
+    check_lstm_fused();
+    check_inference();
+    printf("%s\n", failures ? "FAILED" : "all gradients match");
+    return failures ? 1 : 0;
+}
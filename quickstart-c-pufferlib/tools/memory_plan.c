@@ -0,0 +1,35 @@
+// Activation memory of the puffernet models with and without the planner.
+//
+// Usage: memory_plan [-v]
+//
+// For every model and batch size, prints the activation bytes if every layer
+// kept its own buffer against the planned shared buffer, and the whole arena
+// each network needs. -v also prints where every layer output is placed.
+#include "puffernet.h"
+
+static void report(const char* model, int batch, PufferGraph* graph, size_t total, bool verbose) {
+    printf("%-10s %6d %14zu %14zu %7.2fx %14zu\n", model, batch, graph->unplanned_size,
+        graph->size, (double)graph->unplanned_size/graph->size, total);
+    if (verbose) {
+        graph_print(graph);
+    }
+}
+
+int main(int argc, char** argv) {
+    bool verbose = argc > 1 && strcmp(argv[1], "-v") == 0;
+    int batches[3] = {1, 1024, 8192};
+    int logit_sizes[1] = {7};
+    printf("%-10s %6s %14s %14s %8s %14s\n", "model", "batch",
+        "unplanned", "planned", "saving", "arena");
+    for (int i = 0; i < 3; i++) {
+        int b = batches[i];
+        PufferGraph graph;
+        default_graph(&graph, b, 128, 7);
+        report("default", b, &graph, default_size(b, 42, 128, 7), verbose);
+        linearlstm_graph(&graph, b, 42, 7);
+        report("linearlstm", b, &graph, linearlstm_size(b, 42, logit_sizes, 1), verbose);
+        convlstm_graph(&graph, b, 11, 3, 32, 128, 7);
+        report("convlstm", b, &graph, convlstm_size(b, 11, 3, 32, 128, 7), verbose);
+    }
+    return 0;
+}
@@ -0,0 +1,323 @@
+// Local inference server for the Connect4 LinearLSTM policy.
+//
+// Usage: puffernet_serve <weights> [socket] [max_batch] [flush_us] [max_clients]
+//
+// Loads the weights once and serves many game processes on the same host over
+// a Unix domain socket (default /tmp/puffernet.sock, protocol in serve.h).
+// Each connection owns an LSTMState from a pool, so clients keep their own
+// recurrent state and sampling stream. Requests are queued into a dynamic
+// batch that is run with forward_linearlstm_states as soon as max_batch
+// (default 64) are waiting, every connected client is waiting, or the oldest
+// has waited flush_us (default 200).
+//
+// Every few seconds, and on SIGINT/SIGTERM, prints requests/sec, the mean
+// batch size and p50/p99 latency from receiving a request to writing its
+// answer. Run tools/serve_client as a stand-in for the game processes.
+#include "puffernet.h"
+#include "bench.h"
+#include "serve.h"
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define NUM_WEIGHTS 138632
+#define INPUT_DIM 42
+#define REPORT_SECONDS 5.0
+
+typedef struct Client Client;
+struct Client {
+    int fd;  // -1 for a free slot
+    LSTMState* state;
+    char buffer[sizeof(ServeRequest) + SERVE_MAX_INPUT*sizeof(float)];
+    size_t fill;
+    bool waiting;  // queued; the socket is not read until the answer is out
+};
+
+typedef struct Server Server;
+struct Server {
+    LinearLSTM* net;
+    LSTMStatePool* pool;
+    Client* clients;
+    int max_clients;
+    int num_clients;
+    uint64_t seed;
+    uint64_t connections;
+    // Current batch
+    int max_batch;
+    int count;
+    int* slots;
+    uint32_t* ids;
+    double* arrivals;
+    LSTMState** states;
+    float* obs;
+    int* actions;
+    // Counters for the current report window and the whole run
+    uint64_t batches;
+    LatencyHistogram* window;
+    LatencyHistogram* total;
+    uint64_t total_batches;
+};
+
+static volatile sig_atomic_t stopping = 0;
+
+static void on_signal(int sig) {
+    (void)sig;
+    stopping = 1;
+}
+
+static Weights* load_any(const char* path) {
+    FILE* file = fopen(path, "rb");
+    char magic[4] = {0};
+    if (file) {
+        size_t read = fread(magic, 1, 4, file);
+        fclose(file);
+        (void)read;
+    }
+    bool container = memcmp(magic, PUFFERNET_WEIGHTS_MAGIC, 4) == 0;
+    return load_weights(path, container ? 0 : NUM_WEIGHTS);
+}
+
+static int listen_socket(const char* path) {
+    struct sockaddr_un addr = {0};
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        return -1;
+    }
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("Error creating socket");
+        return -1;
+    }
+    unlink(path);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 128) < 0) {
+        perror("Error binding socket");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void drop_client(Server* s, Client* c) {
+    close(c->fd);
+    lstm_state_release(s->pool, c->state);
+    c->fd = -1;
+    c->state = NULL;
+    c->fill = 0;
+    c->waiting = false;
+    s->num_clients--;
+}
+
+static void accept_client(Server* s, int listen_fd) {
+    int fd = accept(listen_fd, NULL, NULL);
+    if (fd < 0) {
+        return;
+    }
+    Client* c = NULL;
+    for (int i = 0; i < s->max_clients && c == NULL; i++) {
+        if (s->clients[i].fd < 0) {
+            c = &s->clients[i];
+        }
+    }
+    ServeHello hello = {SERVE_MAGIC, SERVE_VERSION, INPUT_DIM, s->net->multidiscrete->num_actions};
+    if (c == NULL || !serve_write(fd, &hello, sizeof(hello))) {
+        fprintf(stderr, "Refusing client, %d of %d slots in use\n", s->num_clients, s->max_clients);
+        close(fd);
+        return;
+    }
+    c->fd = fd;
+    c->state = lstm_state_alloc(s->pool);
+    lstm_state_reset(c->state);
+    lstm_state_seed(c->state, s->seed, s->connections++);
+    c->fill = 0;
+    c->waiting = false;
+    s->num_clients++;
+}
+
+static void flush_batch(Server* s) {
+    int n = s->count;
+    if (n == 0) {
+        return;
+    }
+    LinearLSTM* net = s->net;
+    int num_actions = net->multidiscrete->num_actions;
+    forward_linearlstm_states(net, s->states, n, s->obs, s->actions);
+    for (int b = 0; b < n; b++) {
+        Client* c = &s->clients[s->slots[b]];
+        ServeResponse response = {0};
+        response.id = s->ids[b];
+        response.value = net->actor_value->values[b];
+        memcpy(response.actions, s->actions + b*num_actions, num_actions*sizeof(int));
+        c->waiting = false;
+        if (!serve_write(c->fd, &response, sizeof(response))) {
+            drop_client(s, c);
+            continue;
+        }
+        double latency = now_sec() - s->arrivals[b];
+        histogram_add(s->window, latency);
+        histogram_add(s->total, latency);
+    }
+    s->count = 0;
+    s->batches++;
+    s->total_batches++;
+}
+
+// Reads what is available of the client's next request and queues it once
+// complete. Returns false if the client hung up
+static bool read_request(Server* s, Client* c) {
+    size_t size = sizeof(ServeRequest) + INPUT_DIM*sizeof(float);
+    ssize_t n = read(c->fd, c->buffer + c->fill, size - c->fill);
+    if (n < 0 && errno == EINTR) {
+        return true;
+    }
+    if (n <= 0) {
+        return false;
+    }
+    c->fill += n;
+    if (c->fill < size) {
+        return true;
+    }
+    ServeRequest* request = (ServeRequest*)c->buffer;
+    if (request->flags & SERVE_RESET) {
+        lstm_state_reset(c->state);
+    }
+    int b = s->count++;
+    s->slots[b] = (int)(c - s->clients);
+    s->ids[b] = request->id;
+    s->arrivals[b] = now_sec();
+    s->states[b] = c->state;
+    memcpy(s->obs + b*INPUT_DIM, request + 1, INPUT_DIM*sizeof(float));
+    c->fill = 0;
+    c->waiting = true;
+    // Once every client is waiting nothing else can join the batch
+    if (s->count == s->max_batch || s->count == s->num_clients) {
+        flush_batch(s);
+    }
+    return true;
+}
+
+static void report(const char* label, LatencyHistogram* hist, uint64_t batches,
+        double seconds, int clients) {
+    printf("%s %8.0f req/s  batch %5.1f  p50 %6.0f us  p99 %6.0f us  mean %6.0f us  %d clients\n",
+        label, hist->count/seconds, batches ? (double)hist->count/batches : 0.0,
+        histogram_percentile(hist, 0.5), histogram_percentile(hist, 0.99),
+        hist->count ? hist->sum_us/hist->count : 0.0, clients);
+    fflush(stdout);
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <weights> [socket] [max_batch] [flush_us] [max_clients]\n", argv[0]);
+        return 2;
+    }
+    const char* path = argc > 2 ? argv[2] : SERVE_DEFAULT_SOCKET;
+    int max_batch = argc > 3 ? atoi(argv[3]) : 64;
+    double flush_seconds = 1e-6*(argc > 4 ? atof(argv[4]) : 200.0);
+    int max_clients = argc > 5 ? atoi(argv[5]) : 256;
+    Weights* weights = load_any(argv[1]);
+    if (weights == NULL) {
+        return 1;
+    }
+    int logit_sizes[1] = {7};
+    int listen_fd = listen_socket(path);
+    if (listen_fd < 0) {
+        free_weights(weights);
+        return 1;
+    }
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    signal(SIGPIPE, SIG_IGN);
+
+    Server s = {
+        .net = make_linearlstm(weights, max_batch, INPUT_DIM, logit_sizes, 1, NULL),
+        .pool = make_lstm_state_pool(max_clients, 128, NULL),
+        .clients = calloc(max_clients, sizeof(Client)),
+        .max_clients = max_clients,
+        .seed = (uint64_t)time(NULL),
+        .max_batch = max_batch,
+        .slots = calloc(max_batch, sizeof(int)),
+        .ids = calloc(max_batch, sizeof(uint32_t)),
+        .arrivals = calloc(max_batch, sizeof(double)),
+        .states = calloc(max_batch, sizeof(LSTMState*)),
+        .obs = calloc(max_batch*INPUT_DIM, sizeof(float)),
+        .actions = calloc(max_batch, sizeof(int)),
+        .window = calloc(1, sizeof(LatencyHistogram)),
+        .total = calloc(1, sizeof(LatencyHistogram)),
+    };
+    for (int i = 0; i < max_clients; i++) {
+        s.clients[i].fd = -1;
+    }
+    struct pollfd* fds = calloc(1 + max_clients, sizeof(struct pollfd));
+    printf("puffernet_serve on %s, kernels %s, batches of <= %d, flush after %.0f us\n",
+        path, puffernet_kernels()->name, max_batch, 1e6*flush_seconds);
+    fflush(stdout);
+
+    double start = now_sec();
+    double window_start = start;
+    while (!stopping) {
+        // Poll resolution is 1 ms, so the last millisecond before a flush spins
+        int timeout = (int)(1000*REPORT_SECONDS);
+        if (s.count > 0) {
+            double remaining = s.arrivals[0] + flush_seconds - now_sec();
+            timeout = remaining >= 1e-3 ? (int)(1000*remaining) : 0;
+        }
+        fds[0] = (struct pollfd){listen_fd, POLLIN, 0};
+        for (int i = 0; i < max_clients; i++) {
+            Client* c = &s.clients[i];
+            // Negative fds are skipped by poll
+            fds[1 + i] = (struct pollfd){c->fd >= 0 && !c->waiting ? c->fd : -1, POLLIN, 0};
+        }
+        int ready = poll(fds, 1 + max_clients, timeout);
+        if (ready < 0 && errno != EINTR) {
+            perror("Error polling");
+            break;
+        }
+        for (int i = 0; ready > 0 && i < max_clients; i++) {
+            if (fds[1 + i].fd >= 0 && fds[1 + i].revents != 0) {
+                if (!read_request(&s, &s.clients[i])) {
+                    drop_client(&s, &s.clients[i]);
+                }
+            }
+        }
+        if (ready > 0 && (fds[0].revents & POLLIN)) {
+            accept_client(&s, listen_fd);
+        }
+        double now = now_sec();
+        if (s.count > 0 && now - s.arrivals[0] >= flush_seconds) {
+            flush_batch(&s);
+        }
+        if (now - window_start >= REPORT_SECONDS) {
+            if (s.window->count > 0) {
+                report("window", s.window, s.batches, now - window_start, s.num_clients);
+            }
+            memset(s.window, 0, sizeof(LatencyHistogram));
+            s.batches = 0;
+            window_start = now;
+        }
+    }
+
+    report("total ", s.total, s.total_batches, now_sec() - start, s.num_clients);
+    for (int i = 0; i < max_clients; i++) {
+        if (s.clients[i].fd >= 0) {
+            close(s.clients[i].fd);
+        }
+    }
+    close(listen_fd);
+    unlink(path);
+    free(fds);
+    free(s.clients);
+    free(s.pool);
+    free(s.slots);
+    free(s.ids);
+    free(s.arrivals);
+    free(s.states);
+    free(s.obs);
+    free(s.actions);
+    free(s.window);
+    free(s.total);
+    free_linearlstm(s.net);
+    free_weights(weights);
+    return 0;
+}
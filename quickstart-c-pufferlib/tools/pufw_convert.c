@@ -0,0 +1,178 @@
+// Converts a raw puffernet weight file (flattened float32 pytorch layers) into
+// the self-describing .pufw container read by load_weights.
+//
+// Usage:
+//   pufw_convert <in.bin> <out.pufw> linearlstm <input_dim> <num_logits>
+//   pufw_convert <in.bin> <out.pufw> default <input_dim> <hidden_dim> <action_dim>
+//   pufw_convert <in.bin> <out.pufw> custom <name:d0xd1...> [...]
+//
+// Tensors must be listed in the order the network constructor calls
+// get_weights. linearlstm stores the LSTM packed the way _make_lstm packs it
+// (lstm.weight_fused, lstm.bias_fused), so nets use it in place from the
+// mapped file instead of each packing a copy. The shipped Connect4 policy is:
+//   pufw_convert connect4_weights.bin connect4_weights.pufw linearlstm 42 7
+#include "puffernet.h"
+
+#define MAX_TENSORS 64
+
+static int num_tensors = 0;
+static Tensor tensors[MAX_TENSORS];
+static int fused_lstm = -1;  // tensor of the packed LSTM, read from PyTorch's four
+
+static void add_tensor(const char* name, int ndim, int d0, int d1) {
+    assert(num_tensors < MAX_TENSORS);
+    Tensor* t = &tensors[num_tensors++];
+    memset(t, 0, sizeof(Tensor));
+    snprintf(t->name, PUFFERNET_TENSOR_NAME, "%s", name);
+    t->dtype = DTYPE_F32;
+    t->ndim = ndim;
+    t->shape[0] = d0;
+    t->shape[1] = d1;
+}
+
+static void add_linear(const char* name, int input_dim, int output_dim) {
+    char buf[PUFFERNET_TENSOR_NAME];
+    snprintf(buf, sizeof(buf), "%s.weight", name);
+    add_tensor(buf, 2, output_dim, input_dim);
+    snprintf(buf, sizeof(buf), "%s.bias", name);
+    add_tensor(buf, 1, output_dim, 0);
+}
+
+static void add_fused_lstm(const char* name, int input_size, int hidden_size) {
+    char buf[PUFFERNET_TENSOR_NAME];
+    fused_lstm = num_tensors;
+    snprintf(buf, sizeof(buf), "%s.weight_fused", name);
+    add_tensor(buf, 2, 4*hidden_size, input_size + hidden_size);
+    snprintf(buf, sizeof(buf), "%s.bias_fused", name);
+    add_tensor(buf, 1, 4*hidden_size, 0);
+}
+
+static bool parse_custom(const char* spec) {
+    char name[PUFFERNET_TENSOR_NAME];
+    const char* colon = strchr(spec, ':');
+    if (colon == NULL || colon - spec >= PUFFERNET_TENSOR_NAME || num_tensors >= MAX_TENSORS) {
+        return false;
+    }
+    memcpy(name, spec, colon - spec);
+    name[colon - spec] = '\0';
+    Tensor* t = &tensors[num_tensors];
+    memset(t, 0, sizeof(Tensor));
+    snprintf(t->name, PUFFERNET_TENSOR_NAME, "%s", name);
+    t->dtype = DTYPE_F32;
+    const char* p = colon + 1;
+    while (*p != '\0') {
+        if (t->ndim == PUFFERNET_TENSOR_DIMS) {
+            return false;
+        }
+        char* end;
+        long dim = strtol(p, &end, 10);
+        if (end == p || dim <= 0) {
+            return false;
+        }
+        t->shape[t->ndim++] = dim;
+        p = (*end == 'x') ? end + 1 : end;
+        if (*end != 'x' && *end != '\0') {
+            return false;
+        }
+    }
+    num_tensors++;
+    return t->ndim > 0;
+}
+
+static int usage() {
+    fprintf(stderr,
+        "Usage: pufw_convert <in.bin> <out.pufw> linearlstm <input_dim> <num_logits>\n"
+        "       pufw_convert <in.bin> <out.pufw> default <input_dim> <hidden_dim> <action_dim>\n"
+        "       pufw_convert <in.bin> <out.pufw> custom <name:d0xd1...> [...]\n");
+    return 2;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 4) {
+        return usage();
+    }
+    const char* model = argv[3];
+    if (strcmp(model, "linearlstm") == 0 && argc == 6) {
+        // Matches the get_weights order of make_linearlstm
+        int input_dim = atoi(argv[4]);
+        int num_logits = atoi(argv[5]);
+        add_linear("encoder", input_dim, 128);
+        add_linear("actor", 128, num_logits);
+        add_linear("value_fn", 128, 1);
+        add_fused_lstm("lstm", 128, 128);
+    } else if (strcmp(model, "default") == 0 && argc == 7) {
+        int input_dim = atoi(argv[4]);
+        int hidden_dim = atoi(argv[5]);
+        int action_dim = atoi(argv[6]);
+        add_linear("encoder", input_dim, hidden_dim);
+        add_linear("actor", hidden_dim, action_dim);
+        add_linear("value_fn", hidden_dim, 1);
+    } else if (strcmp(model, "custom") == 0 && argc > 4) {
+        for (int i = 4; i < argc; i++) {
+            if (!parse_custom(argv[i])) {
+                fprintf(stderr, "Invalid tensor spec: %s\n", argv[i]);
+                return 2;
+            }
+        }
+    } else {
+        return usage();
+    }
+
+    // The raw file has the LSTM's two biases, summed in the packed one
+    size_t num_weights = 0;
+    for (int i = 0; i < num_tensors; i++) {
+        bool fused_bias = fused_lstm >= 0 && i == fused_lstm + 1;
+        num_weights += tensor_numel(&tensors[i])*(fused_bias ? 2 : 1);
+    }
+
+    // Raw files carry no size, so check the length before trusting the layout
+    FILE* file = fopen(argv[1], "rb");
+    if (!file) {
+        perror("Error opening file");
+        return 1;
+    }
+    fseek(file, 0, SEEK_END);
+    long file_size = ftell(file);
+    fclose(file);
+    if (file_size != (long)(num_weights*sizeof(float))) {
+        fprintf(stderr, "%s has %ld floats but the layout needs %zu\n",
+            argv[1], file_size/(long)sizeof(float), num_weights);
+        return 1;
+    }
+
+    Weights* weights = load_weights(argv[1], num_weights);
+    if (weights == NULL) {
+        return 1;
+    }
+    void* data[MAX_TENSORS];
+    float* packed = NULL;
+    float* bias = NULL;
+    for (int i = 0; i < num_tensors; i++) {
+        if (i == fused_lstm) {
+            int hidden_size = tensors[i].shape[0]/4;
+            int input_size = tensors[i].shape[1] - hidden_size;
+            packed = malloc(tensor_numel(&tensors[i])*sizeof(float));
+            bias = malloc(tensor_numel(&tensors[i + 1])*sizeof(float));
+            if (packed == NULL || bias == NULL) {
+                perror("Error allocating LSTM");
+                return 1;
+            }
+            float* weights_fused = packed;
+            float* bias_fused = bias;
+            _get_lstm_weights(weights, input_size, hidden_size, &weights_fused, &bias_fused);
+            data[i++] = weights_fused;
+            data[i] = bias_fused;
+            continue;
+        }
+        data[i] = get_weights(weights, tensor_numel(&tensors[i]));
+    }
+    bool ok = save_weights(argv[2], tensors, data, num_tensors);
+    free(packed);
+    free(bias);
+    free_weights(weights);
+    if (!ok) {
+        return 1;
+    }
+    printf("Wrote %s: %d tensors, %zu floats\n", argv[2], num_tensors, num_weights);
+    return 0;
+}
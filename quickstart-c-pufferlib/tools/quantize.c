@@ -0,0 +1,267 @@
+// INT8 calibration and accuracy report for the Connect4 LinearLSTM policy.
+//
+// Usage:
+//   quantize convert <weights> <out.pufw>
+//       Quantize float weights (raw .bin or .pufw) per output channel with
+//       MSE-calibrated clipping and write an int8 container.
+//   quantize record <weights> <obs.bin> <games> [seed]
+//       Play the float policy against the Connect4 AI and record every
+//       observation. Each record is 42 floats plus an episode-start flag.
+//   quantize report <float weights> <int8 weights> <obs.bin>
+//       Replay the recorded observations through forward_linearlstm and
+//       forward_qlinearlstm and report action agreement, logit error,
+//       weight memory and time per step.
+#define CONNECT4_HEADLESS
+#include "connect4.h"
+#include "puffernet.h"
+#include "puffernet_quant.h"
+#include "bench.h"
+
+#define OBS_SIZE 42
+#define RECORD_SIZE (OBS_SIZE + 1)
+#define NUM_WEIGHTS 138632
+
+static int logit_sizes[1] = {7};
+
+static Weights* load_any(const char* path) {
+    FILE* file = fopen(path, "rb");
+    char magic[4] = {0};
+    if (file) {
+        size_t read = fread(magic, 1, 4, file);
+        fclose(file);
+        (void)read;
+    }
+    bool container = memcmp(magic, PUFFERNET_WEIGHTS_MAGIC, 4) == 0;
+    return load_weights(path, container ? 0 : NUM_WEIGHTS);
+}
+
+static void set_tensor(Tensor* t, const char* name, uint32_t dtype, int d0, int d1) {
+    memset(t, 0, sizeof(Tensor));
+    snprintf(t->name, PUFFERNET_TENSOR_NAME, "%s", name);
+    t->dtype = dtype;
+    t->ndim = d1 > 0 ? 2 : 1;
+    t->shape[0] = d0;
+    t->shape[1] = d1 > 0 ? d1 : 0;
+}
+
+static int add_qlinear(Tensor* tensors, void** data, int n, const char* name, QLinear* layer) {
+    char buf[PUFFERNET_TENSOR_NAME];
+    int rows = _qpad(layer->output_dim, PUFFERNET_QROWS);
+    snprintf(buf, sizeof(buf), "%s.qweight", name);
+    set_tensor(&tensors[n], buf, DTYPE_I8, rows, layer->ld_weights);
+    data[n++] = layer->weights;
+    snprintf(buf, sizeof(buf), "%s.scale", name);
+    set_tensor(&tensors[n], buf, DTYPE_F32, rows, 0);
+    data[n++] = layer->scales;
+    snprintf(buf, sizeof(buf), "%s.bias", name);
+    set_tensor(&tensors[n], buf, DTYPE_F32, layer->output_dim, 0);
+    data[n++] = layer->bias;
+    return n;
+}
+
+static int convert(const char* in_path, const char* out_path) {
+    Weights* weights = load_any(in_path);
+    if (weights == NULL) {
+        return 1;
+    }
+    QLinearLSTM* net = make_qlinearlstm(weights, 1, OBS_SIZE, logit_sizes, 1, NULL);
+
+    // Same order make_qlinearlstm consumes them in
+    Tensor tensors[12];
+    void* data[12];
+    int n = 0;
+    n = add_qlinear(tensors, data, n, "encoder", net->encoder);
+    n = add_qlinear(tensors, data, n, "actor", net->actor);
+    n = add_qlinear(tensors, data, n, "value_fn", net->value_fn);
+    QLSTM* lstm = net->lstm;
+    set_tensor(&tensors[n], "lstm.qweight", DTYPE_I8, 4*lstm->hidden_size, lstm->ld_weights);
+    data[n++] = lstm->weights;
+    set_tensor(&tensors[n], "lstm.scale", DTYPE_F32, 4*lstm->hidden_size, 0);
+    data[n++] = lstm->scales;
+    set_tensor(&tensors[n], "lstm.bias", DTYPE_F32, 4*lstm->hidden_size, 0);
+    data[n++] = lstm->bias;
+
+    size_t bytes = 0;
+    for (int i = 0; i < n; i++) {
+        bytes += tensor_numel(&tensors[i])*dtype_size(tensors[i].dtype);
+    }
+    bool ok = save_weights(out_path, tensors, data, n);
+    if (ok) {
+        printf("Wrote %s: %zu bytes of tensors (float32: %zu bytes)\n",
+            out_path, bytes, (size_t)NUM_WEIGHTS*sizeof(float));
+    }
+    free_qlinearlstm(net);
+    free_weights(weights);
+    return ok ? 0 : 1;
+}
+
+static int record(const char* weights_path, const char* out_path, int games, int seed) {
+    Weights* weights = load_any(weights_path);
+    if (weights == NULL) {
+        return 1;
+    }
+    LinearLSTM* net = make_linearlstm(weights, 1, OBS_SIZE, logit_sizes, 1, NULL);
+    FILE* file = fopen(out_path, "wb");
+    if (!file) {
+        perror("Error opening file");
+        return 1;
+    }
+    srand(seed);
+    multidiscrete_seed(net->multidiscrete, seed);
+    CConnect4 env = {0};
+    allocate_cconnect4(&env);
+    long steps = 0;
+    for (int game = 0; game < games; game++) {
+        c_reset(&env);
+        memset(net->lstm->state_h, 0, 128*sizeof(float));
+        memset(net->lstm->state_c, 0, 128*sizeof(float));
+        float start = 1.0f;
+        while (env.terminals[0] != DONE) {
+            float rec[RECORD_SIZE];
+            memcpy(rec, env.observations, OBS_SIZE*sizeof(float));
+            rec[OBS_SIZE] = start;
+            fwrite(rec, sizeof(float), RECORD_SIZE, file);
+            start = 0.0f;
+            forward_linearlstm(net, env.observations, env.actions);
+            c_step(&env);
+            steps++;
+        }
+    }
+    fclose(file);
+    printf("Recorded %ld observations from %d games into %s\n", steps, games, out_path);
+    free_allocated_cconnect4(&env);
+    free_linearlstm(net);
+    free_weights(weights);
+    return 0;
+}
+
+static int argmax(float* x, int n) {
+    int best = 0;
+    for (int i = 1; i < n; i++) {
+        if (x[i] > x[best]) {
+            best = i;
+        }
+    }
+    return best;
+}
+
+static int report(const char* float_path, const char* quant_path, const char* obs_path) {
+    FILE* file = fopen(obs_path, "rb");
+    if (!file) {
+        perror("Error opening file");
+        return 1;
+    }
+    fseek(file, 0, SEEK_END);
+    long count = ftell(file)/(RECORD_SIZE*sizeof(float));
+    rewind(file);
+    float* records = malloc(count*RECORD_SIZE*sizeof(float));
+    if (fread(records, RECORD_SIZE*sizeof(float), count, file) != (size_t)count) {
+        fprintf(stderr, "Error reading %s\n", obs_path);
+        return 1;
+    }
+    fclose(file);
+
+    Weights* float_weights = load_any(float_path);
+    Weights* quant_weights = load_any(quant_path);
+    if (float_weights == NULL || quant_weights == NULL) {
+        return 1;
+    }
+    LinearLSTM* net = make_linearlstm(float_weights, 1, OBS_SIZE, logit_sizes, 1, NULL);
+    QLinearLSTM* qnet = make_qlinearlstm(quant_weights, 1, OBS_SIZE, logit_sizes, 1, NULL);
+
+    int actions[1];
+    float* float_logits = malloc(count*7*sizeof(float));
+    float* float_values = malloc(count*sizeof(float));
+    double t0 = now_sec();
+    for (long i = 0; i < count; i++) {
+        float* rec = records + i*RECORD_SIZE;
+        if (rec[OBS_SIZE] != 0.0f) {
+            memset(net->lstm->state_h, 0, 128*sizeof(float));
+            memset(net->lstm->state_c, 0, 128*sizeof(float));
+        }
+        forward_linearlstm(net, rec, actions);
+        memcpy(float_logits + i*7, net->actor_value->logits, 7*sizeof(float));
+        float_values[i] = net->actor_value->values[0];
+    }
+    double float_time = now_sec() - t0;
+
+    long agree = 0;
+    double max_logit_err = 0.0, sum_logit_err = 0.0, max_value_err = 0.0;
+    t0 = now_sec();
+    for (long i = 0; i < count; i++) {
+        float* rec = records + i*RECORD_SIZE;
+        if (rec[OBS_SIZE] != 0.0f) {
+            memset(qnet->lstm->state_h, 0, 128*sizeof(float));
+            memset(qnet->lstm->state_c, 0, 128*sizeof(float));
+        }
+        forward_qlinearlstm(qnet, rec, actions);
+    }
+    double quant_time = now_sec() - t0;
+
+    // Second pass for the comparison so it does not skew the timing
+    memset(qnet->lstm->state_h, 0, 128*sizeof(float));
+    memset(qnet->lstm->state_c, 0, 128*sizeof(float));
+    for (long i = 0; i < count; i++) {
+        float* rec = records + i*RECORD_SIZE;
+        if (rec[OBS_SIZE] != 0.0f) {
+            memset(qnet->lstm->state_h, 0, 128*sizeof(float));
+            memset(qnet->lstm->state_c, 0, 128*sizeof(float));
+        }
+        forward_qlinearlstm(qnet, rec, actions);
+        float* logits = float_logits + i*7;
+        agree += argmax(logits, 7) == argmax(qnet->actor->output, 7);
+        for (int a = 0; a < 7; a++) {
+            double err = fabs(logits[a] - qnet->actor->output[a]);
+            sum_logit_err += err;
+            max_logit_err = fmax(max_logit_err, err);
+        }
+        max_value_err = fmax(max_value_err, fabs(float_values[i] - qnet->value_fn->output[0]));
+    }
+
+    size_t quant_bytes = 0;
+    QLinear* linears[3] = {qnet->encoder, qnet->actor, qnet->value_fn};
+    for (int i = 0; i < 3; i++) {
+        int rows = _qpad(linears[i]->output_dim, PUFFERNET_QROWS);
+        quant_bytes += rows*linears[i]->ld_weights + rows*sizeof(float)
+            + linears[i]->output_dim*sizeof(float);
+    }
+    quant_bytes += 4*128*qnet->lstm->ld_weights + 2*4*128*sizeof(float);
+
+    printf("observations      %ld\n", count);
+    printf("kernels           float %s, int8 %s\n",
+        puffernet_kernels()->name, puffernet_qkernels()->name);
+    printf("action agreement  %.2f%% (%ld/%ld, argmax)\n", 100.0*agree/count, agree, count);
+    printf("logit abs error   mean %.5f, max %.5f\n", sum_logit_err/(7.0*count), max_logit_err);
+    printf("value abs error   max %.5f\n", max_value_err);
+    printf("weight memory     float %zu bytes, int8 %zu bytes (%.2fx)\n",
+        (size_t)NUM_WEIGHTS*sizeof(float), quant_bytes,
+        (double)NUM_WEIGHTS*sizeof(float)/quant_bytes);
+    printf("time per step     float %.2f us, int8 %.2f us (%.2fx)\n",
+        1e6*float_time/count, 1e6*quant_time/count, float_time/quant_time);
+
+    free(records);
+    free(float_logits);
+    free(float_values);
+    free_linearlstm(net);
+    free_qlinearlstm(qnet);
+    free_weights(float_weights);
+    free_weights(quant_weights);
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    if (argc == 4 && strcmp(argv[1], "convert") == 0) {
+        return convert(argv[2], argv[3]);
+    }
+    if ((argc == 5 || argc == 6) && strcmp(argv[1], "record") == 0) {
+        return record(argv[2], argv[3], atoi(argv[4]), argc == 6 ? atoi(argv[5]) : 1);
+    }
+    if (argc == 5 && strcmp(argv[1], "report") == 0) {
+        return report(argv[2], argv[3], argv[4]);
+    }
+    fprintf(stderr,
+        "Usage: quantize convert <weights> <out.pufw>\n"
+        "       quantize record <weights> <obs.bin> <games> [seed]\n"
+        "       quantize report <float weights> <int8 weights> <obs.bin>\n");
+    return 2;
+}
@@ -0,0 +1,116 @@
+// Wire format and latency histogram shared by puffernet_serve and
+// serve_client. Messages are fixed-size structs in host byte order over a
+// Unix domain stream socket, so both ends must run on the same host.
+// Include after puffernet.h.
+//
+// On connect the server sends a ServeHello. Each request is a ServeRequest
+// followed by input_dim floats, and the server answers each one with a
+// ServeResponse. A client has at most one request in flight: the server stops
+// reading its socket until the answer is written.
+#include <unistd.h>
+#include <errno.h>
+
+#define SERVE_MAGIC 0x56534650  // "PFSV"
+#define SERVE_VERSION 1
+#define SERVE_MAX_INPUT 1024
+#define SERVE_MAX_ACTIONS 16
+#define SERVE_DEFAULT_SOCKET "/tmp/puffernet.sock"
+
+// Request flags
+#define SERVE_RESET 1  // zero the client's recurrent state before this step
+
+typedef struct ServeHello ServeHello;
+struct ServeHello {
+    uint32_t magic;
+    uint32_t version;
+    int32_t input_dim;
+    int32_t num_actions;
+};
+
+typedef struct ServeRequest ServeRequest;
+struct ServeRequest {
+    uint32_t id;
+    uint32_t flags;
+};
+
+typedef struct ServeResponse ServeResponse;
+struct ServeResponse {
+    uint32_t id;
+    float value;
+    int32_t actions[SERVE_MAX_ACTIONS];
+};
+
+// Blocking full read/write. Return false on EOF or error
+static bool serve_read(int fd, void* data, size_t size) {
+    char* p = data;
+    while (size > 0) {
+        ssize_t n = read(fd, p, size);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+static bool serve_write(int fd, const void* data, size_t size) {
+    const char* p = data;
+    while (size > 0) {
+        ssize_t n = write(fd, p, size);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+// Latencies in 1 us buckets up to 100 ms, slower ones land in the last bucket
+#define SERVE_HIST_US 100000
+
+typedef struct LatencyHistogram LatencyHistogram;
+struct LatencyHistogram {
+    uint64_t count;
+    double sum_us;
+    uint32_t buckets[SERVE_HIST_US + 1];
+};
+
+static void histogram_add(LatencyHistogram* hist, double seconds) {
+    double us = 1e6*seconds;
+    int bucket = us < SERVE_HIST_US ? (int)us : SERVE_HIST_US;
+    hist->buckets[bucket]++;
+    hist->count++;
+    hist->sum_us += us;
+}
+
+static void histogram_merge(LatencyHistogram* dst, LatencyHistogram* src) {
+    for (int i = 0; i <= SERVE_HIST_US; i++) {
+        dst->buckets[i] += src->buckets[i];
+    }
+    dst->count += src->count;
+    dst->sum_us += src->sum_us;
+}
+
+// Upper edge in us of the bucket holding the p-th fraction of samples
+static double histogram_percentile(LatencyHistogram* hist, double p) {
+    if (hist->count == 0) {
+        return 0.0;
+    }
+    uint64_t target = (uint64_t)(p*(hist->count - 1)) + 1;
+    uint64_t seen = 0;
+    for (int i = 0; i <= SERVE_HIST_US; i++) {
+        seen += hist->buckets[i];
+        if (seen >= target) {
+            return i + 1;
+        }
+    }
+    return SERVE_HIST_US;
+}
@@ -0,0 +1,148 @@
+// Stand-in for Connect4 game processes talking to puffernet_serve.
+//
+// Usage: serve_client [socket] [clients] [games_per_client]
+//
+// Forks clients processes (default 16). Each one connects to the server and
+// plays games_per_client games (default 20) of the headless Connect4 env
+// against its built-in AI, asking the server for every policy move and
+// resetting its recurrent state at the start of each game. Reports total
+// moves/sec and p50/p99 round-trip latency over all clients.
+#define CONNECT4_HEADLESS
+#include "connect4.h"
+#include "puffernet.h"
+#include "bench.h"
+#include "serve.h"
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+typedef struct ClientResult ClientResult;
+struct ClientResult {
+    LatencyHistogram latency;
+    long moves;
+    long games;
+    long wins;
+    bool ok;
+};
+
+static int connect_socket(const char* path) {
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        perror("Error connecting to puffernet_serve");
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    return fd;
+}
+
+static void play_games(const char* path, int games, ClientResult* result) {
+    int fd = connect_socket(path);
+    if (fd < 0) {
+        return;
+    }
+    ServeHello hello;
+    if (!serve_read(fd, &hello, sizeof(hello)) || hello.magic != SERVE_MAGIC
+            || hello.version != SERVE_VERSION || hello.input_dim != 42 || hello.num_actions != 1) {
+        fprintf(stderr, "Unexpected puffernet_serve hello\n");
+        close(fd);
+        return;
+    }
+    CConnect4 env = {0};
+    allocate_cconnect4(&env);
+    struct {
+        ServeRequest header;
+        float obs[42];
+    } request;
+    uint32_t id = 0;
+    bool ok = true;
+    for (int game = 0; game < games && ok; game++) {
+        c_reset(&env);
+        request.header.flags = SERVE_RESET;
+        while (env.terminals[0] != DONE) {
+            request.header.id = id++;
+            memcpy(request.obs, env.observations, sizeof(request.obs));
+            ServeResponse response;
+            double start = now_sec();
+            ok = serve_write(fd, &request, sizeof(request))
+                && serve_read(fd, &response, sizeof(response))
+                && response.id == request.header.id;
+            if (!ok) {
+                fprintf(stderr, "Lost puffernet_serve connection\n");
+                break;
+            }
+            histogram_add(&result->latency, now_sec() - start);
+            request.header.flags = 0;
+            env.actions[0] = response.actions[0];
+            c_step(&env);
+            result->moves++;
+        }
+        result->games++;
+        result->wins += env.rewards[0] == PLAYER_WIN;
+    }
+    result->ok = ok;
+    free_allocated_cconnect4(&env);
+    close(fd);
+}
+
+int main(int argc, char** argv) {
+    const char* path = argc > 1 ? argv[1] : SERVE_DEFAULT_SOCKET;
+    int clients = argc > 2 ? atoi(argv[2]) : 16;
+    int games = argc > 3 ? atoi(argv[3]) : 20;
+    // Shared with the children, which fill in one result each
+    size_t size = clients*sizeof(ClientResult);
+    ClientResult* results = mmap(NULL, size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (results == MAP_FAILED) {
+        perror("Error mapping results");
+        return 1;
+    }
+    memset(results, 0, size);
+
+    double start = now_sec();
+    for (int i = 0; i < clients; i++) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("Error forking client");
+            clients = i;
+            break;
+        }
+        if (pid == 0) {
+            play_games(path, games, &results[i]);
+            _exit(results[i].ok ? 0 : 1);
+        }
+    }
+    int failed = 0;
+    for (int i = 0; i < clients; i++) {
+        int status;
+        wait(&status);
+        failed += !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+    }
+    double elapsed = now_sec() - start;
+
+    LatencyHistogram* latency = calloc(1, sizeof(LatencyHistogram));
+    long moves = 0, played = 0, wins = 0;
+    for (int i = 0; i < clients; i++) {
+        histogram_merge(latency, &results[i].latency);
+        moves += results[i].moves;
+        played += results[i].games;
+        wins += results[i].wins;
+    }
+    printf("%d clients, %ld games, policy won %ld (%.1f%%)\n", clients, played, wins,
+        played ? 100.0*wins/played : 0.0);
+    printf("moves/sec         %.0f (%ld moves in %.2f s)\n", moves/elapsed, moves, elapsed);
+    printf("round trip        p50 %.0f us  p99 %.0f us  mean %.0f us\n",
+        histogram_percentile(latency, 0.5), histogram_percentile(latency, 0.99),
+        latency->count ? latency->sum_us/latency->count : 0.0);
+    if (failed) {
+        printf("%d clients failed\n", failed);
+    }
+    free(latency);
+    munmap(results, size);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,152 @@
+// Prunes a policy to block-sparse weights and writes a .pufw container that
+// make_linearlstm and make_default load directly.
+//
+// Usage:
+//   sparsify <weights> <out.pufw> <threshold> linearlstm <input_dim> <num_logits>
+//   sparsify <weights> <out.pufw> <threshold> default <input_dim> <hidden_dim> <action_dim>
+//
+// <weights> is a raw float file or a float container. Weights with
+// |w| <= threshold are zeroed and every 4x8 block left all zero is dropped.
+// The encoder and the LSTM are stored block-sparse, the actor and value heads
+// (a few KB) stay dense. Use threshold 0 for a model that was pruned offline.
+#include "puffernet.h"
+
+#define MAX_TENSORS 16
+
+static int num_tensors = 0;
+static Tensor tensors[MAX_TENSORS];
+static void* data[MAX_TENSORS];
+static void* owned[MAX_TENSORS];
+static int num_owned = 0;
+
+static void add_tensor(const char* name, uint32_t dtype, int d0, int d1, void* ptr) {
+    assert(num_tensors < MAX_TENSORS);
+    Tensor* t = &tensors[num_tensors];
+    memset(t, 0, sizeof(Tensor));
+    snprintf(t->name, PUFFERNET_TENSOR_NAME, "%s", name);
+    t->dtype = dtype;
+    t->ndim = d1 > 0 ? 2 : 1;
+    t->shape[0] = d0;
+    t->shape[1] = d1 > 0 ? d1 : 0;
+    data[num_tensors++] = ptr;
+}
+
+static void* own(size_t size) {
+    assert(num_owned < MAX_TENSORS);
+    // Never zero bytes, so an empty tensor still has a valid pointer
+    return owned[num_owned++] = calloc(1, size > 0 ? size : 1);
+}
+
+static void add_dense(Weights* weights, const char* name, int rows, int cols) {
+    char buf[PUFFERNET_TENSOR_NAME];
+    snprintf(buf, sizeof(buf), "%s.weight", name);
+    add_tensor(buf, DTYPE_F32, rows, cols, get_weights(weights, rows*cols));
+    snprintf(buf, sizeof(buf), "%s.bias", name);
+    add_tensor(buf, DTYPE_F32, rows, 0, get_weights(weights, rows));
+}
+
+static void add_sparse(const char* name, float* dense, float* bias, int rows, int cols,
+        float threshold) {
+    int groups = block_sparse_groups(rows);
+    int num_blocks = block_sparse_count(dense, rows, cols, threshold);
+    BlockSparse sparse = {
+        .block_ptr = own((groups + 1)*sizeof(int32_t)),
+        .block_col = own(num_blocks*sizeof(int32_t)),
+        .values = own((size_t)num_blocks*PUFFERNET_SPARSE_BLOCK*sizeof(float)),
+    };
+    block_sparse_pack(dense, rows, cols, threshold, &sparse);
+
+    char buf[PUFFERNET_TENSOR_NAME];
+    snprintf(buf, sizeof(buf), "%s.block_ptr", name);
+    add_tensor(buf, DTYPE_I32, groups + 1, 0, sparse.block_ptr);
+    snprintf(buf, sizeof(buf), "%s.block_col", name);
+    add_tensor(buf, DTYPE_I32, num_blocks, 0, sparse.block_col);
+    snprintf(buf, sizeof(buf), "%s.block_val", name);
+    add_tensor(buf, DTYPE_F32, num_blocks, PUFFERNET_SPARSE_BLOCK, sparse.values);
+    snprintf(buf, sizeof(buf), "%s.bias", name);
+    add_tensor(buf, DTYPE_F32, rows, 0, bias);
+
+    int total = groups*((cols + PUFFERNET_SPARSE_COLS - 1)/PUFFERNET_SPARSE_COLS);
+    long nonzero = 0;
+    for (long i = 0; i < (long)rows*cols; i++) {
+        nonzero += fabsf(dense[i]) > threshold;
+    }
+    size_t sparse_bytes = (groups + 1 + num_blocks)*sizeof(int32_t)
+        + (size_t)num_blocks*PUFFERNET_SPARSE_BLOCK*sizeof(float);
+    printf("%-8s %4dx%-4d  weights %5.1f%%  blocks %5d/%-5d (%5.1f%%)  %8zu -> %8zu bytes\n",
+        name, rows, cols, 100.0*nonzero/((long)rows*cols), num_blocks, total,
+        100.0*num_blocks/total, (size_t)rows*cols*sizeof(float), sparse_bytes);
+}
+
+static void add_sparse_linear(Weights* weights, const char* name, int rows, int cols,
+        float threshold) {
+    float* dense = get_weights(weights, rows*cols);
+    add_sparse(name, dense, get_weights(weights, rows), rows, cols, threshold);
+}
+
+// Packed the way _make_lstm packs it, so each 4-row group is one unit's gates
+static void add_sparse_lstm(Weights* weights, int input_size, int hidden_size, float threshold) {
+    int rows = 4*hidden_size;
+    int cat_size = input_size + hidden_size;
+    float* packed_buffer = malloc((size_t)rows*cat_size*sizeof(float));
+    float* packed = packed_buffer;
+    float* bias = own(rows*sizeof(float));
+    _get_lstm_weights(weights, input_size, hidden_size, &packed, &bias);
+    add_sparse("lstm", packed, bias, rows, cat_size, threshold);
+    free(packed_buffer);
+}
+
+static int usage() {
+    fprintf(stderr,
+        "Usage: sparsify <weights> <out.pufw> <threshold> linearlstm <input_dim> <num_logits>\n"
+        "       sparsify <weights> <out.pufw> <threshold> default <input_dim> <hidden_dim> <action_dim>\n");
+    return 2;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 5) {
+        return usage();
+    }
+    float threshold = atof(argv[3]);
+    const char* model = argv[4];
+    bool lstm = strcmp(model, "linearlstm") == 0 && argc == 7;
+    bool dense = strcmp(model, "default") == 0 && argc == 8;
+    if (!lstm && !dense) {
+        return usage();
+    }
+    int input_dim = atoi(argv[5]);
+    int hidden_dim = lstm ? 128 : atoi(argv[6]);
+    int action_dim = lstm ? atoi(argv[6]) : atoi(argv[7]);
+    size_t num_weights = (size_t)hidden_dim*input_dim + hidden_dim
+        + action_dim*hidden_dim + action_dim + hidden_dim + 1;
+    if (lstm) {
+        num_weights += 4*hidden_dim*hidden_dim*2 + 4*hidden_dim*2;
+    }
+    Weights* weights = load_weights(argv[1], num_weights);
+    if (weights == NULL) {
+        return 1;
+    }
+
+    // Same order make_linearlstm and make_default consume them in
+    add_sparse_linear(weights, "encoder", hidden_dim, input_dim, threshold);
+    add_dense(weights, "actor", action_dim, hidden_dim);
+    add_dense(weights, "value_fn", 1, hidden_dim);
+    if (lstm) {
+        add_sparse_lstm(weights, hidden_dim, hidden_dim, threshold);
+    }
+
+    size_t bytes = 0;
+    for (int i = 0; i < num_tensors; i++) {
+        bytes += tensor_numel(&tensors[i])*dtype_size(tensors[i].dtype);
+    }
+    bool ok = save_weights(argv[2], tensors, data, num_tensors);
+    if (ok) {
+        printf("Wrote %s: %zu bytes of tensors (dense: %zu bytes)\n",
+            argv[2], bytes, num_weights*sizeof(float));
+    }
+    for (int i = 0; i < num_owned; i++) {
+        free(owned[i]);
+    }
+    free_weights(weights);
+    return ok ? 0 : 1;
+}
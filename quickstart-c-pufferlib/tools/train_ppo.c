@@ -0,0 +1,448 @@
+// Minimal PPO for the Connect4 LinearLSTM, trained in C against c_step.
+//
+// Usage: train_ppo [iterations] [weights_out] [weights_in|-] [selfplay_fraction]
+//
+// Runs NUM_ENVS headless envs for HORIZON steps per iteration with the
+// inference net (forward_linearlstm_states, one LSTMState per env), then
+// does EPOCHS of clipped PPO over the rollout with GAE advantages, BPTT over
+// the whole horizon and Adam. Envs play c_step against the built-in negamax
+// AI, except for the first selfplay_fraction of them (default 0.5) whose
+// opponent is a frozen copy of the policy, refreshed every SNAPSHOT_EVERY
+// iterations, that sees the board with the colors flipped.
+//
+// Starts from weights_in (raw make_linearlstm floats, e.g.
+// resources/connect4_weights.bin) or a fresh init, and saves the raw weights
+// to weights_out (default connect4_trained.bin), which the game loads as is.
+#define CONNECT4_HEADLESS
+#include "connect4.h"
+#include "puffernet.h"
+#include "puffernet_train.h"
+#include "bench.h"
+#include <limits.h>
+
+#define NUM_ENVS 64
+#define HORIZON 16
+#define EPOCHS 4
+#define MINIBATCHES 4
+#define INPUT_DIM 42
+#define HIDDEN 128
+#define NUM_LOGITS 7
+#define SNAPSHOT_EVERY 10
+
+#define LEARNING_RATE 1e-3f
+#define GAMMA 0.99f
+#define GAE_LAMBDA 0.95f
+#define CLIP_COEF 0.2f
+#define VF_COEF 0.5f
+#define ENT_COEF 0.01f
+#define MAX_GRAD_NORM 0.5f
+
+// Rollout of one iteration, [HORIZON x NUM_ENVS x ...]
+typedef struct Rollout Rollout;
+struct Rollout {
+    float obs[HORIZON][NUM_ENVS][INPUT_DIM];
+    float starts[HORIZON][NUM_ENVS];
+    int actions[HORIZON][NUM_ENVS];
+    float logp[HORIZON][NUM_ENVS];
+    float values[HORIZON][NUM_ENVS];
+    float rewards[HORIZON][NUM_ENVS];
+    float dones[HORIZON][NUM_ENVS];
+    float advantages[HORIZON][NUM_ENVS];
+    float returns[HORIZON][NUM_ENVS];
+    float h0[NUM_ENVS][HIDDEN];
+    float c0[NUM_ENVS][HIDDEN];
+};
+
+// One minibatch of whole env rows, laid out for LinearLSTMTrain
+typedef struct Minibatch Minibatch;
+struct Minibatch {
+    float obs[HORIZON*NUM_ENVS*INPUT_DIM];
+    float starts[HORIZON*NUM_ENVS];
+    int actions[HORIZON*NUM_ENVS];
+    float logp[HORIZON*NUM_ENVS];
+    float advantages[HORIZON*NUM_ENVS];
+    float returns[HORIZON*NUM_ENVS];
+    float h0[NUM_ENVS*HIDDEN];
+    float c0[NUM_ENVS*HIDDEN];
+    // Loss terms and gradients
+    float all_logp[HORIZON*NUM_ENVS*NUM_LOGITS];
+    float new_logp[HORIZON*NUM_ENVS];
+    float entropy[HORIZON*NUM_ENVS];
+    float grad_logp[HORIZON*NUM_ENVS];
+    float grad_entropy[HORIZON*NUM_ENVS];
+    float grad_logits[HORIZON*NUM_ENVS*NUM_LOGITS];
+    float grad_values[HORIZON*NUM_ENVS];
+};
+
+typedef struct Stats Stats;
+struct Stats {
+    int games[2];  // against negamax, against the snapshot
+    int wins[2];
+    int moves;
+    double pg_loss;
+    double v_loss;
+    double entropy;
+    double kl;
+    double clipped;
+    int updates;
+};
+
+// c_step_env with the opponent's column given
+static void opponent_move(CConnect4* env, int column) {
+    uint64_t piece_mask = env->player_pieces | env->env_pieces;
+    if (invalid_move(column, piece_mask)) {
+        finish_game(env, PLAYER_WIN);
+        return;
+    }
+    env->env_pieces = play(column, piece_mask, env->player_pieces);
+    if (won(env->env_pieces)) {
+        finish_game(env, ENV_WIN);
+        return;
+    }
+    compute_observation(env);
+}
+
+static LinearLSTM* make_policy(Weights* weights) {
+    int logit_sizes[1] = {NUM_LOGITS};
+    weights->idx = 0;
+    return make_linearlstm(weights, NUM_ENVS, INPUT_DIM, logit_sizes, 1, NULL);
+}
+
+typedef struct Trainer Trainer;
+struct Trainer {
+    CConnect4 envs[NUM_ENVS];
+    int selfplay;  // envs [0, selfplay) play the snapshot
+    LinearLSTMTrain* model;
+    Adam* adam;
+    LinearLSTM* policy;
+    LinearLSTM* opponent;
+    float* opponent_params;
+    Weights opponent_weights;
+    LSTMState* states[NUM_ENVS];
+    LSTMState* opponent_states[NUM_ENVS];
+    LSTMState* saved[NUM_ENVS];
+    bool starting[NUM_ENVS];
+    Rollout* rollout;
+    Minibatch* batch;
+    float obs[NUM_ENVS*INPUT_DIM];
+    int actions[NUM_ENVS];
+    float scratch[NUM_ENVS*NUM_LOGITS + 2*NUM_ENVS];
+};
+
+static void snapshot_opponent(Trainer* tr) {
+    memcpy(tr->opponent_params, tr->model->params, tr->model->num_params*sizeof(float));
+    if (tr->opponent) {
+        free_linearlstm(tr->opponent);
+    }
+    tr->opponent = make_policy(&tr->opponent_weights);
+}
+
+// Snapshot moves for the envs in which the player moved and the game goes on
+static void opponent_step(Trainer* tr) {
+    LSTMState* states[NUM_ENVS];
+    int index[NUM_ENVS];
+    int n = 0;
+    for (int e = 0; e < tr->selfplay; e++) {
+        if (tr->envs[e].terminals[0] == DONE) {
+            continue;
+        }
+        for (int i = 0; i < INPUT_DIM; i++) {
+            tr->obs[n*INPUT_DIM + i] = -tr->envs[e].observations[i];
+        }
+        states[n] = tr->opponent_states[e];
+        index[n++] = e;
+    }
+    if (n == 0) {
+        return;
+    }
+    forward_linearlstm_states(tr->opponent, states, n, tr->obs, tr->actions);
+    for (int b = 0; b < n; b++) {
+        opponent_move(&tr->envs[index[b]], tr->actions[b]);
+    }
+}
+
+static void collect(Trainer* tr, Stats* stats) {
+    Rollout* r = tr->rollout;
+    for (int e = 0; e < NUM_ENVS; e++) {
+        memcpy(r->h0[e], tr->states[e]->state_h, HIDDEN*sizeof(float));
+        memcpy(r->c0[e], tr->states[e]->state_c, HIDDEN*sizeof(float));
+    }
+    float* logp = tr->scratch;
+    float* action_logp = logp + NUM_ENVS*NUM_LOGITS;
+    float* entropy = action_logp + NUM_ENVS;
+    for (int t = 0; t < HORIZON; t++) {
+        for (int e = 0; e < NUM_ENVS; e++) {
+            memcpy(r->obs[t][e], tr->envs[e].observations, INPUT_DIM*sizeof(float));
+            r->starts[t][e] = tr->starting[e];
+            tr->starting[e] = false;
+        }
+        forward_linearlstm_states(tr->policy, tr->states, NUM_ENVS, &r->obs[t][0][0], tr->actions);
+        _categorical_forward(tr->policy->actor_value->logits, tr->actions, logp,
+            action_logp, entropy, NUM_ENVS, NUM_LOGITS);
+        for (int e = 0; e < NUM_ENVS; e++) {
+            r->actions[t][e] = tr->actions[e];
+            r->logp[t][e] = action_logp[e];
+            r->values[t][e] = tr->policy->actor_value->values[e];
+            tr->envs[e].actions[0] = tr->actions[e];
+            c_step_player(&tr->envs[e]);
+            if (e >= tr->selfplay && tr->envs[e].terminals[0] != DONE) {
+                c_step_env(&tr->envs[e]);
+            }
+        }
+        opponent_step(tr);
+        for (int e = 0; e < NUM_ENVS; e++) {
+            CConnect4* env = &tr->envs[e];
+            bool done = env->terminals[0] == DONE;
+            r->rewards[t][e] = env->rewards[0];
+            r->dones[t][e] = done;
+            stats->moves++;
+            if (done) {
+                int kind = e < tr->selfplay;
+                stats->games[kind]++;
+                stats->wins[kind] += env->rewards[0] == PLAYER_WIN;
+                c_reset(env);
+                lstm_state_reset(tr->states[e]);
+                lstm_state_reset(tr->opponent_states[e]);
+                tr->starting[e] = true;
+            }
+        }
+    }
+
+    // Bootstrap from the value of the next observation without advancing
+    for (int e = 0; e < NUM_ENVS; e++) {
+        lstm_state_save(tr->states[e], tr->saved[e]);
+        memcpy(tr->obs + e*INPUT_DIM, tr->envs[e].observations, INPUT_DIM*sizeof(float));
+    }
+    forward_linearlstm_states(tr->policy, tr->states, NUM_ENVS, tr->obs, tr->actions);
+    for (int e = 0; e < NUM_ENVS; e++) {
+        lstm_state_restore(tr->states[e], tr->saved[e]);
+        float last = 0.0f;
+        float next_value = tr->policy->actor_value->values[e];
+        for (int t = HORIZON - 1; t >= 0; t--) {
+            float live = 1.0f - r->dones[t][e];
+            float delta = r->rewards[t][e] + GAMMA*next_value*live - r->values[t][e];
+            last = delta + GAMMA*GAE_LAMBDA*live*last;
+            r->advantages[t][e] = last;
+            r->returns[t][e] = last + r->values[t][e];
+            next_value = r->values[t][e];
+        }
+    }
+}
+
+static void gather(Trainer* tr, int* envs, int count) {
+    Rollout* r = tr->rollout;
+    Minibatch* mb = tr->batch;
+    for (int t = 0; t < HORIZON; t++) {
+        for (int b = 0; b < count; b++) {
+            int e = envs[b], k = t*count + b;
+            memcpy(mb->obs + k*INPUT_DIM, r->obs[t][e], INPUT_DIM*sizeof(float));
+            mb->starts[k] = r->starts[t][e];
+            mb->actions[k] = r->actions[t][e];
+            mb->logp[k] = r->logp[t][e];
+            mb->advantages[k] = r->advantages[t][e];
+            mb->returns[k] = r->returns[t][e];
+        }
+    }
+    for (int b = 0; b < count; b++) {
+        memcpy(mb->h0 + b*HIDDEN, r->h0[envs[b]], HIDDEN*sizeof(float));
+        memcpy(mb->c0 + b*HIDDEN, r->c0[envs[b]], HIDDEN*sizeof(float));
+    }
+}
+
+// One PPO step on the gathered minibatch
+static void update(Trainer* tr, int count, Stats* stats) {
+    LinearLSTMTrain* model = tr->model;
+    Minibatch* mb = tr->batch;
+    int n = HORIZON*count;
+    linearlstm_train_forward(model, mb->obs, mb->starts, mb->h0, mb->c0, HORIZON);
+    _categorical_forward(model->logits, mb->actions, mb->all_logp, mb->new_logp,
+        mb->entropy, n, NUM_LOGITS);
+
+    double mean = 0.0, var = 0.0;
+    for (int k = 0; k < n; k++) {
+        mean += mb->advantages[k];
+    }
+    mean /= n;
+    for (int k = 0; k < n; k++) {
+        var += (mb->advantages[k] - mean)*(mb->advantages[k] - mean);
+    }
+    float inv_std = 1.0f/(float)(sqrt(var/n) + 1e-8);
+
+    for (int k = 0; k < n; k++) {
+        float adv = (mb->advantages[k] - mean)*inv_std;
+        float log_ratio = mb->new_logp[k] - mb->logp[k];
+        float ratio = expf(log_ratio);
+        float clipped = fminf(fmaxf(ratio, 1.0f - CLIP_COEF), 1.0f + CLIP_COEF);
+        float pg1 = -adv*ratio, pg2 = -adv*clipped;
+        // d ratio/d logp = ratio, zero where the clipped term is the max
+        mb->grad_logp[k] = pg1 >= pg2 ? -adv*ratio/n : 0.0f;
+        mb->grad_entropy[k] = -ENT_COEF/n;
+        float v_err = model->values[k] - mb->returns[k];
+        mb->grad_values[k] = VF_COEF*v_err/n;
+
+        stats->pg_loss += fmaxf(pg1, pg2)/n;
+        stats->v_loss += 0.5f*v_err*v_err/n;
+        stats->entropy += mb->entropy[k]/n;
+        stats->kl += ((ratio - 1.0f) - log_ratio)/n;
+        stats->clipped += (fabsf(ratio - 1.0f) > CLIP_COEF)/(double)n;
+    }
+    _categorical_backward(mb->all_logp, mb->actions, mb->grad_logp, mb->grad_entropy,
+        mb->grad_logits, n, NUM_LOGITS);
+    linearlstm_train_zero_grad(model);
+    linearlstm_train_backward(model, mb->grad_logits, mb->grad_values);
+    clip_grad_norm(model->grads, model->num_params, MAX_GRAD_NORM);
+    adam_step(tr->adam, model->params, model->grads);
+    stats->updates++;
+}
+
+static void train(Trainer* tr, Stats* stats) {
+    int count = NUM_ENVS/MINIBATCHES;
+    int order[NUM_ENVS];
+    for (int e = 0; e < NUM_ENVS; e++) {
+        order[e] = e;
+    }
+    for (int epoch = 0; epoch < EPOCHS; epoch++) {
+        for (int e = NUM_ENVS - 1; e > 0; e--) {
+            int j = rand() % (e + 1);
+            int swap = order[e];
+            order[e] = order[j];
+            order[j] = swap;
+        }
+        for (int m = 0; m < MINIBATCHES; m++) {
+            gather(tr, order + m*count, count);
+            update(tr, count, stats);
+        }
+    }
+    // The inference net copies the packed LSTM and head weights
+    free_linearlstm(tr->policy);
+    tr->policy = make_policy(linearlstm_train_weights(tr->model));
+}
+
+static int usage(int status) {
+    fprintf(status ? stderr : stdout, "Usage: train_ppo [iterations] [weights_out] "
+        "[weights_in|-] [selfplay_fraction]\n"
+        "  iterations         positive integer (default 50)\n"
+        "  weights_out        raw weights written after training (default connect4_trained.bin)\n"
+        "  weights_in         raw weights to start from, - for a fresh init (default)\n"
+        "  selfplay_fraction  share of envs playing a frozen copy, 0 to 1 (default 0.5)\n");
+    return status;
+}
+
+int main(int argc, char** argv) {
+    if (argc > 1 && (strcmp(argv[1], "-h") == 0 || strcmp(argv[1], "--help") == 0)) {
+        return usage(0);
+    }
+    if (argc > 5) {
+        return usage(2);
+    }
+    // Whole-string parses, a typo must not train with 0 and overwrite weights_out
+    int iterations = 50;
+    if (argc > 1) {
+        char* end;
+        long value = strtol(argv[1], &end, 10);
+        if (end == argv[1] || *end != '\0' || value < 1 || value > INT_MAX) {
+            fprintf(stderr, "Error: iterations must be a positive integer, got '%s'\n", argv[1]);
+            return usage(2);
+        }
+        iterations = (int)value;
+    }
+    const char* out_path = argc > 2 ? argv[2] : "connect4_trained.bin";
+    const char* in_path = argc > 3 && strcmp(argv[3], "-") != 0 ? argv[3] : NULL;
+    float selfplay = 0.5f;
+    if (argc > 4) {
+        char* end;
+        double value = strtod(argv[4], &end);
+        if (end == argv[4] || *end != '\0' || !(value >= 0.0 && value <= 1.0)) {
+            fprintf(stderr, "Error: selfplay_fraction must be in [0, 1], got '%s'\n", argv[4]);
+            return usage(2);
+        }
+        selfplay = (float)value;
+    }
+    srand(1);
+
+    Trainer* tr = calloc(1, sizeof(Trainer));
+    tr->selfplay = (int)(selfplay*NUM_ENVS);
+    tr->model = make_linearlstm_train(NUM_ENVS/MINIBATCHES, HORIZON, INPUT_DIM, HIDDEN,
+        NUM_LOGITS, NULL);
+    linearlstm_train_init(tr->model, 1);
+    if (in_path != NULL) {
+        Weights* weights = load_weights(in_path, tr->model->num_params);
+        if (weights == NULL || !linearlstm_train_load(tr->model, weights)) {
+            free_weights(weights);
+            return 1;
+        }
+        free_weights(weights);
+    }
+    tr->adam = make_adam(tr->model->num_params, LEARNING_RATE, NULL);
+    tr->policy = make_policy(linearlstm_train_weights(tr->model));
+    tr->opponent_params = malloc(tr->model->num_params*sizeof(float));
+    tr->opponent_weights = (Weights){.data = tr->opponent_params, .size = (int)tr->model->num_params};
+    snapshot_opponent(tr);
+    for (int e = 0; e < NUM_ENVS; e++) {
+        allocate_cconnect4(&tr->envs[e]);
+        c_reset(&tr->envs[e]);
+        tr->states[e] = make_lstm_state(HIDDEN, NULL);
+        tr->opponent_states[e] = make_lstm_state(HIDDEN, NULL);
+        tr->saved[e] = make_lstm_state(HIDDEN, NULL);
+        lstm_state_seed(tr->states[e], 1, e);
+        lstm_state_seed(tr->opponent_states[e], 2, e);
+        tr->starting[e] = true;
+    }
+    tr->rollout = calloc(1, sizeof(Rollout));
+    tr->batch = calloc(1, sizeof(Minibatch));
+
+    printf("kernels %s, %zu parameters, %d envs (%d self-play) x %d steps\n",
+        puffernet_kernels()->name, tr->model->num_params, NUM_ENVS, tr->selfplay, HORIZON);
+    printf("%5s %9s %9s %9s %8s %8s %8s %8s %8s %6s\n", "iter", "steps/s", "win ai",
+        "win self", "pg", "value", "entropy", "kl", "clipped", "train");
+    Stats total = {0};
+    double start = now_sec();
+    for (int it = 1; it <= iterations; it++) {
+        Stats stats = {0};
+        double t0 = now_sec();
+        collect(tr, &stats);
+        double t1 = now_sec();
+        train(tr, &stats);
+        double t2 = now_sec();
+        if (it % SNAPSHOT_EVERY == 0) {
+            snapshot_opponent(tr);
+        }
+        for (int k = 0; k < 2; k++) {
+            total.games[k] += stats.games[k];
+            total.wins[k] += stats.wins[k];
+        }
+        total.moves += stats.moves;
+        int u = stats.updates;
+        printf("%5d %9.0f %8.1f%% %8.1f%% %8.4f %8.4f %8.4f %8.5f %8.3f %5.0f%%\n", it,
+            stats.moves/(t2 - t0),
+            stats.games[0] ? 100.0*stats.wins[0]/stats.games[0] : 0.0,
+            stats.games[1] ? 100.0*stats.wins[1]/stats.games[1] : 0.0,
+            stats.pg_loss/u, stats.v_loss/u, stats.entropy/u, stats.kl/u, stats.clipped/u,
+            100.0*(t2 - t1)/(t2 - t0));
+        fflush(stdout);
+    }
+    double elapsed = now_sec() - start;
+    printf("%d moves in %.1f s (%.0f/s), won %d/%d against the AI and %d/%d in self-play\n",
+        total.moves, elapsed, total.moves/elapsed, total.wins[0], total.games[0],
+        total.wins[1], total.games[1]);
+    bool saved = linearlstm_train_save(tr->model, out_path);
+    if (saved) {
+        printf("saved %s\n", out_path);
+    }
+
+    for (int e = 0; e < NUM_ENVS; e++) {
+        free_allocated_cconnect4(&tr->envs[e]);
+        free(tr->states[e]);
+        free(tr->opponent_states[e]);
+        free(tr->saved[e]);
+    }
+    free_linearlstm(tr->policy);
+    free_linearlstm(tr->opponent);
+    free(tr->opponent_params);
+    free(tr->adam);
+    free_linearlstm_train(tr->model);
+    free(tr->rollout);
+    free(tr->batch);
+    free(tr);
+    return saved ? 0 : 1;
+}